@@ -4,10 +4,28 @@ in vec3 vPos;
 in vec3 vNormal;
 in vec2 vTextureCoord; 
 
+// The model and normal matrices of each copy of the model, when the model is drawn with instancing.
+in mat4 iModelMatrix;
+in mat3 iNormalMatrix;
+
 uniform mat4 mvpMatrix; // model_view_project matrix
 uniform mat4 modelMatrix;	// model view matrix
 uniform mat3 normalMatrix; // model matrix
 
+// With instancing, every vertex is transformed by the model matrix, then by the matrix of its copy, and then by
+// viewProjMatrix. mvpMatrix is not used.
+uniform bool useInstancing;
+uniform mat4 viewProjMatrix;
+
+// Quantized vertices store the position and texture coordinates relative to the bounding box of the mesh,
+// and the normal in the octahedral encoding. For 32-bit float vertices, the offsets are 0,
+// the scales are 1, and octahedralNormals is false.
+uniform vec3 positionOffset;
+uniform vec3 positionScale;
+uniform vec2 textureCoordOffset;
+uniform vec2 textureCoordScale;
+uniform bool octahedralNormals;
+
 out vec3 N; // The normal vector is passed over to the fragment shader
 out vec3 v; // Vertex position is passed over to the fragment shader
 out vec2 textureCoord; // The texture coordinates are passed over to the fragment shader
@@ -15,16 +33,39 @@ out vec2 textureCoord; // The texture coordinates are passed over to the fragmen
 // Note that there is no out color, because the pixel color is calculated
 // in the fragment shader. 
 
+// Unfold the octahedron back into the unit sphere.
+vec3 decodeOctahedralNormal(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+
+    if (n.z < 0.0) {
+        vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+        n.xy = (1.0 - abs(n.yx)) * signs;
+    }
+
+    return normalize(n);
+}
+
 void main() 
 {
-    vec4 position = vec4(vPos.xyz, 1.0);
-    gl_Position = mvpMatrix * position;
+    vec4 position = vec4(positionOffset + vPos.xyz * positionScale, 1.0);
+    vec3 normal = octahedralNormals ? decodeOctahedralNormal(vNormal.xy) : vNormal;
+
+    if (useInstancing) {
+        vec4 transformedPosition = iModelMatrix * (modelMatrix * position);
+        gl_Position = viewProjMatrix * transformedPosition;
+        v = transformedPosition.xyz;
+        N = normalize(iNormalMatrix * (normalMatrix * normal));
+    }
+    else {
+        gl_Position = mvpMatrix * position;
 
-    vec4 transformedPosition = modelMatrix * position;
-    v = transformedPosition.xyz;
+        vec4 transformedPosition = modelMatrix * position;
+        v = transformedPosition.xyz;
 
-    N = normalize(normalMatrix * vNormal);
+        N = normalize(normalMatrix * normal);
+    }
 	
-	textureCoord = vTextureCoord;
+	textureCoord = textureCoordOffset + vTextureCoord * textureCoordScale;
 }
 
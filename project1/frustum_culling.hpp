@@ -0,0 +1,171 @@
+/*
+View-frustum culling of axis-aligned bounding boxes.
+
+computeBoundingBox() computes the bounding box of a mesh in its own space once, at load time. transformBoundingBox()
+computes the axis-aligned box around the transformed box, so the world-space box of a mesh is only computed again
+when its model matrix changes.
+
+FrustumPlanes keeps the six planes of the view frustum by component: all the x components, then all the y components,
+and so on. isBoxOutsideFrustum() can then test a box against four planes at once with SSE, or one plane at a time
+where SSE isn't available. The planes come from extractFrustumPlanes() (see meshlet_builder.hpp) applied to the
+view-projection matrix, so the boxes are tested in world space.
+*/
+
+#ifndef FRUSTUM_CULLING_HPP
+#define FRUSTUM_CULLING_HPP
+
+#include <algorithm>
+#include <cstddef>
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define FRUSTUM_CULLING_SSE 1
+#include <xmmintrin.h>
+#endif
+
+struct BoundingBox {
+	float min[3];
+	float max[3];
+};
+
+// The six planes (a, b, c, d) of a frustum. A point is inside if a * x + b * y + c * z + d >= 0 for every plane.
+// The planes are padded to 8 with copies of the last plane, so they fill two groups of four.
+struct FrustumPlanes {
+	alignas(16) float a[8];
+	alignas(16) float b[8];
+	alignas(16) float c[8];
+	alignas(16) float d[8];
+};
+
+//-----------------------------------------------------------------
+// Compute the bounding box of the vertices. positions has positionStride floats per vertex.
+// A mesh without vertices gets an empty box at the origin.
+inline void computeBoundingBox(const float *positions, size_t positionStride, size_t vertexCount, BoundingBox& box) {
+	for (int k = 0; k < 3; k++) {
+		box.min[k] = (vertexCount > 0) ? positions[k] : 0.0f;
+		box.max[k] = box.min[k];
+	}
+
+	for (size_t i = 1; i < vertexCount; i++) {
+		const float *p = &positions[i * positionStride];
+
+		for (int k = 0; k < 3; k++) {
+			box.min[k] = std::min(box.min[k], p[k]);
+			box.max[k] = std::max(box.max[k], p[k]);
+		}
+	}
+}
+
+//-----------------------------------------------------------------
+// Compute the axis-aligned box around box transformed by matrix, a column-major 4 x 4 matrix (the layout of glm).
+// Every output coordinate is the translation plus the smallest and largest contributions of each input axis.
+inline void transformBoundingBox(const BoundingBox& box, const float *matrix, BoundingBox& result) {
+	for (int i = 0; i < 3; i++) {
+		result.min[i] = result.max[i] = matrix[12 + i];
+
+		for (int j = 0; j < 3; j++) {
+			float a = matrix[4 * j + i] * box.min[j];
+			float b = matrix[4 * j + i] * box.max[j];
+
+			result.min[i] += std::min(a, b);
+			result.max[i] += std::max(a, b);
+		}
+	}
+}
+
+//-----------------------------------------------------------------
+// Store the planes from extractFrustumPlanes() by component.
+inline void loadFrustumPlanes(const float planes[6][4], FrustumPlanes& frustum) {
+	for (int i = 0; i < 8; i++) {
+		const float *plane = planes[std::min(i, 5)];
+
+		frustum.a[i] = plane[0];
+		frustum.b[i] = plane[1];
+		frustum.c[i] = plane[2];
+		frustum.d[i] = plane[3];
+	}
+}
+
+//-----------------------------------------------------------------
+// True if the box is completely outside one of the planes. For every plane, only the corner of the box that is
+// furthest along the plane normal is tested: max(a * min.x, a * max.x) + ... picks it without branches.
+// The test is conservative: a box outside the frustum but not outside any single plane is kept.
+inline bool isBoxOutsideFrustum(const BoundingBox& box, const FrustumPlanes& frustum) {
+#ifdef FRUSTUM_CULLING_SSE
+	__m128 minX = _mm_set1_ps(box.min[0]), maxX = _mm_set1_ps(box.max[0]);
+	__m128 minY = _mm_set1_ps(box.min[1]), maxY = _mm_set1_ps(box.max[1]);
+	__m128 minZ = _mm_set1_ps(box.min[2]), maxZ = _mm_set1_ps(box.max[2]);
+
+	for (int i = 0; i < 8; i += 4) {
+		__m128 a = _mm_load_ps(&frustum.a[i]);
+		__m128 b = _mm_load_ps(&frustum.b[i]);
+		__m128 c = _mm_load_ps(&frustum.c[i]);
+		__m128 d = _mm_load_ps(&frustum.d[i]);
+
+		__m128 x = _mm_max_ps(_mm_mul_ps(a, minX), _mm_mul_ps(a, maxX));
+		__m128 y = _mm_max_ps(_mm_mul_ps(b, minY), _mm_mul_ps(b, maxY));
+		__m128 z = _mm_max_ps(_mm_mul_ps(c, minZ), _mm_mul_ps(c, maxZ));
+		__m128 distance = _mm_add_ps(_mm_add_ps(x, y), _mm_add_ps(z, d));
+
+		if (_mm_movemask_ps(_mm_cmplt_ps(distance, _mm_setzero_ps())) != 0) {
+			return true;
+		}
+	}
+
+	return false;
+#else
+	for (int i = 0; i < 6; i++) {
+		float distance = std::max(frustum.a[i] * box.min[0], frustum.a[i] * box.max[0]) +
+			std::max(frustum.b[i] * box.min[1], frustum.b[i] * box.max[1]) +
+			std::max(frustum.c[i] * box.min[2], frustum.c[i] * box.max[2]) + frustum.d[i];
+
+		if (distance < 0.0f) {
+			return true;
+		}
+	}
+
+	return false;
+#endif
+}
+
+//-----------------------------------------------------------------
+// True if the box is completely inside every plane, so everything in it is inside the frustum. For every plane, only
+// the corner of the box that is furthest against the plane normal is tested.
+inline bool isBoxInsideFrustum(const BoundingBox& box, const FrustumPlanes& frustum) {
+#ifdef FRUSTUM_CULLING_SSE
+	__m128 minX = _mm_set1_ps(box.min[0]), maxX = _mm_set1_ps(box.max[0]);
+	__m128 minY = _mm_set1_ps(box.min[1]), maxY = _mm_set1_ps(box.max[1]);
+	__m128 minZ = _mm_set1_ps(box.min[2]), maxZ = _mm_set1_ps(box.max[2]);
+
+	for (int i = 0; i < 8; i += 4) {
+		__m128 a = _mm_load_ps(&frustum.a[i]);
+		__m128 b = _mm_load_ps(&frustum.b[i]);
+		__m128 c = _mm_load_ps(&frustum.c[i]);
+		__m128 d = _mm_load_ps(&frustum.d[i]);
+
+		__m128 x = _mm_min_ps(_mm_mul_ps(a, minX), _mm_mul_ps(a, maxX));
+		__m128 y = _mm_min_ps(_mm_mul_ps(b, minY), _mm_mul_ps(b, maxY));
+		__m128 z = _mm_min_ps(_mm_mul_ps(c, minZ), _mm_mul_ps(c, maxZ));
+		__m128 distance = _mm_add_ps(_mm_add_ps(x, y), _mm_add_ps(z, d));
+
+		if (_mm_movemask_ps(_mm_cmplt_ps(distance, _mm_setzero_ps())) != 0) {
+			return false;
+		}
+	}
+
+	return true;
+#else
+	for (int i = 0; i < 6; i++) {
+		float distance = std::min(frustum.a[i] * box.min[0], frustum.a[i] * box.max[0]) +
+			std::min(frustum.b[i] * box.min[1], frustum.b[i] * box.max[1]) +
+			std::min(frustum.c[i] * box.min[2], frustum.c[i] * box.max[2]) + frustum.d[i];
+
+		if (distance < 0.0f) {
+			return false;
+		}
+	}
+
+	return true;
+#endif
+}
+
+#endif
@@ -0,0 +1,165 @@
+/*
+A linear (bump) allocator for the scratch memory of the loader.
+
+allocate() hands out memory from large blocks by moving an offset forward; nothing is freed one by one.
+reset() releases everything at once. If the arena needed more than one block, the blocks are replaced by one
+block of their combined size, so a load of the same size fits in a single block the next time and doesn't
+allocate at all. release() frees every block instead; call it when the arena won't be used again soon, so the
+peak scratch memory of a load isn't kept for the lifetime of the program.
+
+The arena counts the bytes in use, the peak of that count, and the total bytes handed out since it was
+created. It is not thread safe: only one thread may use it at a time.
+*/
+
+#ifndef LINEAR_ARENA_HPP
+#define LINEAR_ARENA_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+class LinearArena {
+public:
+	explicit LinearArena(size_t blockSize = 16 * 1024 * 1024)
+		: blockSize(blockSize), currentBlock(0), blockOffset(0), usedBytes(0), peakBytes(0), totalBytes(0), numAllocations(0) {}
+
+	~LinearArena() {
+		releaseBlocks();
+	}
+
+	// Return size bytes aligned to alignment, a power of two. The memory stays valid until reset() or release().
+	// Returns NULL only if the system is out of memory.
+	void *allocate(size_t size, size_t alignment = 16) {
+		if (size == 0) {
+			size = 1;
+		}
+
+		// Find a block with enough space left, starting with the current one. The rest of a block that is
+		// skipped stays unused until reset() or release().
+		for (; currentBlock < blocks.size(); currentBlock++, blockOffset = 0) {
+			Block& block = blocks[currentBlock];
+			size_t address = (size_t)block.data + blockOffset;
+			size_t padding = (alignment - (address & (alignment - 1))) & (alignment - 1);
+
+			if (blockOffset + padding + size <= block.size) {
+				blockOffset += padding + size;
+				usedBytes += padding + size;
+				return countAllocation(block.data + blockOffset - size, size);
+			}
+
+			usedBytes += block.size - blockOffset;
+		}
+
+		// Allocate a new block. malloc() aligns to at least 16 bytes, so only larger alignments need padding.
+		Block block;
+		block.size = (size + alignment > blockSize) ? size + alignment : blockSize;
+		block.data = (unsigned char*)malloc(block.size);
+		if (!block.data) {
+			return NULL;
+		}
+
+		blocks.push_back(block);
+		currentBlock = blocks.size() - 1;
+		blockOffset = 0;
+
+		return allocate(size, alignment);
+	}
+
+	template <typename T>
+	T *allocateArray(size_t count) {
+		return (T*)allocate(sizeof(T) * count, alignof(T) > 16 ? alignof(T) : 16);
+	}
+
+	// Release all the allocations. The memory is kept for the next use.
+	void reset() {
+		if (blocks.size() > 1) {
+			size_t capacity = getCapacity();
+			releaseBlocks();
+
+			Block block;
+			block.size = capacity;
+			block.data = (unsigned char*)malloc(capacity);
+			if (block.data) {
+				blocks.push_back(block);
+			}
+		}
+
+		currentBlock = 0;
+		blockOffset = 0;
+		usedBytes = 0;
+	}
+
+	// Release all the allocations and free the memory. The next allocate() starts with a new block.
+	void release() {
+		releaseBlocks();
+
+		currentBlock = 0;
+		blockOffset = 0;
+		usedBytes = 0;
+	}
+
+	size_t getUsedBytes() const {
+		return usedBytes;
+	}
+
+	size_t getPeakBytes() const {
+		return peakBytes;
+	}
+
+	size_t getTotalBytes() const {
+		return totalBytes;
+	}
+
+	size_t getCapacity() const {
+		size_t capacity = 0;
+
+		for (const Block& block : blocks) {
+			capacity += block.size;
+		}
+
+		return capacity;
+	}
+
+	void printStatistics(std::ostream& out) const {
+		out << "Loader scratch memory: " << usedBytes << " bytes in use, " << peakBytes << " bytes peak, "
+			<< totalBytes << " bytes in " << numAllocations << " allocations in total, "
+			<< blocks.size() << " blocks (" << getCapacity() << " bytes)." << std::endl;
+	}
+
+private:
+	struct Block {
+		unsigned char *data;
+		size_t size;
+	};
+
+	void *countAllocation(void *memory, size_t size) {
+		totalBytes += size;
+		numAllocations++;
+		peakBytes = (usedBytes > peakBytes) ? usedBytes : peakBytes;
+
+		return memory;
+	}
+
+	void releaseBlocks() {
+		for (const Block& block : blocks) {
+			free(block.data);
+		}
+		blocks.clear();
+	}
+
+	// Not copyable: the blocks are owned by one arena.
+	LinearArena(const LinearArena&);
+	LinearArena& operator=(const LinearArena&);
+
+	std::vector<Block> blocks;
+	size_t blockSize;
+	size_t currentBlock;
+	size_t blockOffset; // the first free byte of the current block
+	size_t usedBytes; // including the alignment padding and the unused ends of the filled blocks
+	size_t peakBytes;
+	size_t totalBytes;
+	size_t numAllocations;
+};
+
+#endif
@@ -0,0 +1,223 @@
+/*
+A profiler for the phases of loading: reading and importing the 3D file, flattening the meshes, transferring
+the VBOs, decoding and transferring the textures, and building the shaders.
+
+A LoadPhase object measures the time from its construction to its destruction and records it in a
+LoadProfiler, with the number of bytes the phase processed and an optional detail, e.g. the file name.
+Phases can be recorded on any thread.
+
+writeJson() writes a summary per phase name (count, total and longest time, bytes) followed by every
+recorded phase. writeChromeTrace() writes the phases in the Chrome trace event format, one row per thread,
+so the file can be opened in chrome://tracing or https://ui.perfetto.dev.
+*/
+
+#ifndef LOAD_PROFILER_HPP
+#define LOAD_PROFILER_HPP
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+struct LoadPhaseRecord {
+	std::string name; // e.g. "mesh.flatten"
+	std::string detail; // e.g. the file name, or empty
+	double start; // microseconds since the profiler was created
+	double duration; // microseconds
+	uint64_t bytes;
+	unsigned int thread; // 0 for the first thread that recorded a phase, 1 for the next, ...
+};
+
+class LoadProfiler {
+public:
+	LoadProfiler() : enabled(true), startTime(std::chrono::high_resolution_clock::now()) {}
+
+	void setEnabled(bool value) {
+		enabled = value;
+	}
+
+	bool isEnabled() const {
+		return enabled;
+	}
+
+	// Microseconds since the profiler was created.
+	double getTime() const {
+		return std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - startTime).count();
+	}
+
+	void record(const char *name, const std::string& detail, double start, double end, uint64_t bytes) {
+		if (!enabled) {
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		auto thread = threadNumbers.insert(std::make_pair(std::this_thread::get_id(), (unsigned int)threadNumbers.size())).first;
+
+		LoadPhaseRecord phase;
+		phase.name = name;
+		phase.detail = detail;
+		phase.start = start;
+		phase.duration = end - start;
+		phase.bytes = bytes;
+		phase.thread = thread->second;
+		phases.push_back(phase);
+	}
+
+	void printSummary(std::ostream& out) {
+		std::vector<PhaseSummary> summaries = summarize();
+
+		out << "Load phases:" << std::endl;
+		for (const PhaseSummary& summary : summaries) {
+			out << "  " << summary.name << ": " << summary.count << " x, " << summary.total / 1000.0 << " ms, "
+				<< summary.bytes << " bytes" << std::endl;
+		}
+	}
+
+	bool writeJson(const char *filename) {
+		std::ofstream out(filename, std::ios::binary);
+		if (!out) {
+			return false;
+		}
+
+		std::vector<PhaseSummary> summaries = summarize();
+		std::lock_guard<std::mutex> lock(mutex);
+
+		out << "{\n\t\"phases\": [\n";
+		for (size_t i = 0; i < summaries.size(); i++) {
+			const PhaseSummary& summary = summaries[i];
+			out << "\t\t{ \"name\": " << quote(summary.name) << ", \"count\": " << summary.count
+				<< ", \"totalMs\": " << summary.total / 1000.0 << ", \"maxMs\": " << summary.longest / 1000.0
+				<< ", \"bytes\": " << summary.bytes << " }" << (i + 1 < summaries.size() ? "," : "") << "\n";
+		}
+
+		out << "\t],\n\t\"events\": [\n";
+		for (size_t i = 0; i < phases.size(); i++) {
+			const LoadPhaseRecord& phase = phases[i];
+			out << "\t\t{ \"name\": " << quote(phase.name) << ", \"detail\": " << quote(phase.detail)
+				<< ", \"startMs\": " << phase.start / 1000.0 << ", \"durationMs\": " << phase.duration / 1000.0
+				<< ", \"bytes\": " << phase.bytes << ", \"thread\": " << phase.thread << " }"
+				<< (i + 1 < phases.size() ? "," : "") << "\n";
+		}
+		out << "\t]\n}\n";
+
+		return out.good();
+	}
+
+	bool writeChromeTrace(const char *filename) {
+		std::ofstream out(filename, std::ios::binary);
+		if (!out) {
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		// Complete events ("ph": "X") with the start and duration in microseconds.
+		out << "{\n\"displayTimeUnit\": \"ms\",\n\"traceEvents\": [\n";
+		for (size_t i = 0; i < phases.size(); i++) {
+			const LoadPhaseRecord& phase = phases[i];
+			out << "{ \"name\": " << quote(phase.detail.empty() ? phase.name : phase.name + " " + phase.detail)
+				<< ", \"cat\": " << quote(phase.name.substr(0, phase.name.find('.')))
+				<< ", \"ph\": \"X\", \"ts\": " << (uint64_t)phase.start << ", \"dur\": " << (uint64_t)phase.duration
+				<< ", \"pid\": 1, \"tid\": " << phase.thread + 1
+				<< ", \"args\": { \"bytes\": " << phase.bytes << " } }" << (i + 1 < phases.size() ? "," : "") << "\n";
+		}
+		out << "]\n}\n";
+
+		return out.good();
+	}
+
+private:
+	struct PhaseSummary {
+		std::string name;
+		unsigned int count;
+		double total;
+		double longest;
+		uint64_t bytes;
+	};
+
+	// The phases with the same name added up, in the order of their first record.
+	std::vector<PhaseSummary> summarize() {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<PhaseSummary> summaries;
+		std::map<std::string, size_t> indices;
+
+		for (const LoadPhaseRecord& phase : phases) {
+			auto found = indices.insert(std::make_pair(phase.name, summaries.size())).first;
+
+			if (found->second == summaries.size()) {
+				PhaseSummary summary = { phase.name, 0, 0.0, 0.0, 0 };
+				summaries.push_back(summary);
+			}
+
+			PhaseSummary& summary = summaries[found->second];
+			summary.count++;
+			summary.total += phase.duration;
+			summary.longest = (phase.duration > summary.longest) ? phase.duration : summary.longest;
+			summary.bytes += phase.bytes;
+		}
+
+		return summaries;
+	}
+
+	static std::string quote(const std::string& text) {
+		std::string quoted = "\"";
+
+		for (char c : text) {
+			if (c == '"' || c == '\\') {
+				quoted += '\\';
+				quoted += c;
+			}
+			else if ((unsigned char)c < 0x20) {
+				char escaped[8];
+				snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned int)(unsigned char)c);
+				quoted += escaped;
+			}
+			else {
+				quoted += c;
+			}
+		}
+
+		return quoted + "\"";
+	}
+
+	bool enabled;
+	std::chrono::high_resolution_clock::time_point startTime;
+	std::mutex mutex;
+	std::map<std::thread::id, unsigned int> threadNumbers;
+	std::vector<LoadPhaseRecord> phases;
+};
+
+// Records the time from its construction to its destruction as one phase.
+class LoadPhase {
+public:
+	LoadPhase(LoadProfiler& profiler, const char *name, const std::string& detail = std::string())
+		: profiler(profiler), name(name), detail(detail), bytes(0), start(profiler.getTime()) {}
+
+	~LoadPhase() {
+		profiler.record(name, detail, start, profiler.getTime(), bytes);
+	}
+
+	void addBytes(uint64_t count) {
+		bytes += count;
+	}
+
+private:
+	LoadPhase(const LoadPhase&);
+	LoadPhase& operator=(const LoadPhase&);
+
+	LoadProfiler& profiler;
+	const char *name;
+	std::string detail;
+	uint64_t bytes;
+	double start;
+};
+
+#endif
@@ -0,0 +1,319 @@
+/*
+Helper classes for the binary mesh cache used by load3DData().
+
+After a 3D file is imported with Assimp, the flattened vertex, index, material, light,
+camera, and node data are written into a cache file next to the 3D file. On the next run
+the cache file is memory-mapped and the vertex data is transferred to the VBOs directly
+from the mapped memory, so Assimp doesn't need to import the file again.
+
+The cache file starts with a MeshCacheHeader. The cache is only used if the magic number,
+the version, the Assimp post-processing flags, and the size and hash of the 3D file all match.
+Everything after the header is a sequence of 4-byte aligned records written by MeshCacheWriter
+and read back by MeshCacheReader.
+*/
+
+#ifndef MESH_CACHE_HPP
+#define MESH_CACHE_HPP
+
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// "HUMC" in a little-endian file
+const uint32_t meshCacheMagic = 0x434D5548;
+
+// Increase this number whenever the layout of the cache file changes.
+const uint32_t meshCacheVersion = 3;
+
+struct MeshCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t postProcessFlags; // Assimp post-processing flags used to import the 3D file
+	uint32_t reserved;
+	uint64_t sourceSize; // size of the 3D file in bytes
+	uint64_t sourceHash; // FNV-1a hash of the content of the 3D file
+	uint32_t numMeshes;
+	uint32_t numMaterials;
+	uint32_t numLights;
+	uint32_t numCameras;
+	uint32_t numNodes;
+	uint32_t padding;
+};
+
+//------------------------------------------------
+// A read-only memory mapping of a whole file.
+class MappedFile {
+public:
+	MappedFile() : data(NULL), size(0) {
+#ifdef _WIN32
+		fileHandle = INVALID_HANDLE_VALUE;
+		mappingHandle = NULL;
+#endif
+	}
+
+	~MappedFile() {
+		close();
+	}
+
+	bool open(const char *filename) {
+		close();
+
+#ifdef _WIN32
+		fileHandle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (fileHandle == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0) {
+			close();
+			return false;
+		}
+		size = (size_t)fileSize.QuadPart;
+
+		mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mappingHandle == NULL) {
+			close();
+			return false;
+		}
+
+		data = (const unsigned char *)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+#else
+		int fd = ::open(filename, O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+
+		struct stat fileStat;
+		if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+			::close(fd);
+			return false;
+		}
+		size = (size_t)fileStat.st_size;
+
+		void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd); // The mapping stays valid after the file descriptor is closed.
+		data = (mapping == MAP_FAILED) ? NULL : (const unsigned char *)mapping;
+#endif
+
+		if (data == NULL) {
+			close();
+			return false;
+		}
+
+		return true;
+	}
+
+	void close() {
+#ifdef _WIN32
+		if (data) {
+			UnmapViewOfFile(data);
+		}
+		if (mappingHandle) {
+			CloseHandle(mappingHandle);
+			mappingHandle = NULL;
+		}
+		if (fileHandle != INVALID_HANDLE_VALUE) {
+			CloseHandle(fileHandle);
+			fileHandle = INVALID_HANDLE_VALUE;
+		}
+#else
+		if (data) {
+			munmap((void *)data, size);
+		}
+#endif
+		data = NULL;
+		size = 0;
+	}
+
+	bool isOpen() const { return data != NULL; }
+	const unsigned char *getData() const { return data; }
+	size_t getSize() const { return size; }
+
+private:
+	// A mapping can't be copied.
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const unsigned char *data;
+	size_t size;
+
+#ifdef _WIN32
+	HANDLE fileHandle;
+	HANDLE mappingHandle;
+#endif
+};
+
+//------------------------------------------
+// 64-bit FNV-1a hash of a block of memory.
+inline uint64_t hashBytesFNV1a(const unsigned char *bytes, size_t size) {
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+//-----------------------------------------------------------------
+// Hash the content of a file. Returns false if the file can't be read.
+inline bool hashFile(const char *filename, uint64_t &hash, uint64_t &fileSize) {
+	MappedFile file;
+
+	if (!file.open(filename)) {
+		return false;
+	}
+
+	hash = hashBytesFNV1a(file.getData(), file.getSize());
+	fileSize = file.getSize();
+
+	return true;
+}
+
+//----------------------------------------------------------------
+// Builds the content of a cache file in memory and saves it to disk.
+// Every record is padded to 4 bytes so that the float and index arrays
+// can be used directly from the memory-mapped file.
+class MeshCacheWriter {
+public:
+	void writeBytes(const void *bytes, size_t numBytes) {
+		const unsigned char *source = (const unsigned char *)bytes;
+		buffer.insert(buffer.end(), source, source + numBytes);
+
+		// Pad the record to 4 bytes.
+		while (buffer.size() % 4 != 0) {
+			buffer.push_back(0);
+		}
+	}
+
+	template <typename T>
+	void write(const T &value) {
+		writeBytes(&value, sizeof(T));
+	}
+
+	template <typename T>
+	void writeArray(const T *values, size_t count) {
+		if (count > 0) {
+			writeBytes(values, sizeof(T) * count);
+		}
+	}
+
+	void writeString(const std::string &s) {
+		write((uint32_t)s.length());
+		writeBytes(s.data(), s.length());
+	}
+
+	bool saveToFile(const char *filename) const {
+		std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+
+		if (!file.is_open()) {
+			return false;
+		}
+
+		file.write((const char *)buffer.data(), buffer.size());
+
+		return file.good();
+	}
+
+	size_t getSize() const { return buffer.size(); }
+
+private:
+	std::vector<unsigned char> buffer;
+};
+
+//------------------------------------------------------------------
+// Reads records back from a memory-mapped cache file.
+// If the file is truncated, every following read fails and failed() returns true.
+class MeshCacheReader {
+public:
+	MeshCacheReader(const unsigned char *data, size_t size)
+		: data(data), size(size), position(0), readFailed(false) {
+	}
+
+	const void *readBytes(size_t numBytes) {
+		size_t paddedSize = (numBytes + 3) & ~(size_t)3;
+
+		if (readFailed || paddedSize > size - position) {
+			readFailed = true;
+			return NULL;
+		}
+
+		const void *bytes = data + position;
+		position += paddedSize;
+
+		return bytes;
+	}
+
+	template <typename T>
+	bool read(T &value) {
+		const void *bytes = readBytes(sizeof(T));
+
+		if (!bytes) {
+			return false;
+		}
+
+		memcpy(&value, bytes, sizeof(T));
+
+		return true;
+	}
+
+	// Returns a pointer into the mapped file. No data is copied.
+	template <typename T>
+	const T *readArray(size_t count) {
+		if (count == 0) {
+			return NULL;
+		}
+
+		if (count > size / sizeof(T)) {
+			readFailed = true;
+			return NULL;
+		}
+
+		return (const T *)readBytes(sizeof(T) * count);
+	}
+
+	bool readString(std::string &s) {
+		uint32_t length = 0;
+
+		if (!read(length)) {
+			return false;
+		}
+
+		const char *chars = (const char *)readBytes(length);
+		if (!chars && length > 0) {
+			return false;
+		}
+
+		s.assign(chars ? chars : "", length);
+
+		return true;
+	}
+
+	bool failed() const { return readFailed; }
+
+private:
+	const unsigned char *data;
+	size_t size;
+	size_t position;
+	bool readFailed;
+};
+
+#endif
@@ -0,0 +1,284 @@
+/*
+Meshlet (cluster) builder and cluster culling tests.
+
+buildMeshlets() splits a range of a triangle list into meshlets of at most maxMeshletVertices unique vertices and
+maxMeshletTriangles triangles. The triangles are reordered in place so that the triangles of every meshlet are
+stored next to each other, and a meshlet is simply a range of the index buffer that can be drawn on its own.
+Meshlets are grown from a seed triangle by adding the neighboring triangle that adds the fewest new vertices,
+so they stay compact.
+
+Every meshlet stores a bounding sphere and a normal cone. The sphere is used for frustum culling. The cone
+contains the normals of all the triangles of the meshlet, so when the camera sees every one of those normals
+from behind, the whole meshlet is back-facing (see isMeshletBackFacing()).
+
+The tests work in the model space of the mesh: the frustum planes are extracted from the model-view-projection
+matrix and the camera position is transformed into model space, so the meshlet data never has to be transformed.
+*/
+
+#ifndef MESHLET_BUILDER_HPP
+#define MESHLET_BUILDER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+// The size limits of a meshlet, the common limits of mesh shader hardware.
+const unsigned int maxMeshletVertices = 64;
+const unsigned int maxMeshletTriangles = 124;
+
+// Meshes with fewer triangles than this are not split into meshlets.
+const unsigned int minMeshletTriangles = 4096;
+
+struct Meshlet {
+	unsigned int firstIndex; // the first index of the meshlet in the index array
+	unsigned int indexCount;
+	float center[3]; // bounding sphere
+	float radius;
+	float coneAxis[3]; // normal cone; coneCutoff is the sine of the half angle of the cone, or 1 if the cone is too wide
+	float coneCutoff;
+};
+
+//-----------------------------------------------------------------
+// Compute the bounding sphere and the normal cone of the triangles of a meshlet.
+inline void computeMeshletBounds(Meshlet& meshlet, const unsigned int *indices, const float *positions, size_t positionStride) {
+	const unsigned int *triangles = indices + meshlet.firstIndex;
+
+	// The bounding sphere is centered at the center of the bounding box of the vertices.
+	float minValue[3], maxValue[3];
+	for (unsigned int i = 0; i < meshlet.indexCount; i++) {
+		const float *p = &positions[triangles[i] * positionStride];
+		for (int k = 0; k < 3; k++) {
+			minValue[k] = (i == 0 || p[k] < minValue[k]) ? p[k] : minValue[k];
+			maxValue[k] = (i == 0 || p[k] > maxValue[k]) ? p[k] : maxValue[k];
+		}
+	}
+
+	float maxDistance2 = 0.0f;
+	for (int k = 0; k < 3; k++) {
+		meshlet.center[k] = 0.5f * (minValue[k] + maxValue[k]);
+	}
+	for (unsigned int i = 0; i < meshlet.indexCount; i++) {
+		const float *p = &positions[triangles[i] * positionStride];
+		float dx = p[0] - meshlet.center[0], dy = p[1] - meshlet.center[1], dz = p[2] - meshlet.center[2];
+		maxDistance2 = std::max(maxDistance2, dx * dx + dy * dy + dz * dz);
+	}
+	meshlet.radius = std::sqrt(maxDistance2);
+
+	// The cone axis is the average of the unit normals of the triangles. The cone must contain every normal.
+	std::vector<float> normals;
+	normals.reserve(meshlet.indexCount);
+	float axis[3] = { 0.0f, 0.0f, 0.0f };
+
+	for (unsigned int i = 0; i + 2 < meshlet.indexCount; i += 3) {
+		const float *p0 = &positions[triangles[i] * positionStride];
+		const float *p1 = &positions[triangles[i + 1] * positionStride];
+		const float *p2 = &positions[triangles[i + 2] * positionStride];
+
+		float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+		float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+		float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+		float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+		// Degenerate triangles are never visible, so they don't widen the cone.
+		if (length <= 0.0f) {
+			continue;
+		}
+
+		for (int k = 0; k < 3; k++) {
+			normals.push_back(n[k] / length);
+			axis[k] += n[k] / length;
+		}
+	}
+
+	float axisLength = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+	meshlet.coneAxis[0] = meshlet.coneAxis[1] = meshlet.coneAxis[2] = 0.0f;
+	meshlet.coneCutoff = 1.0f;
+
+	if (axisLength <= 0.0f) {
+		return;
+	}
+
+	float minDot = 1.0f;
+	for (size_t i = 0; i < normals.size(); i += 3) {
+		float dot = (normals[i] * axis[0] + normals[i + 1] * axis[1] + normals[i + 2] * axis[2]) / axisLength;
+		minDot = std::min(minDot, dot);
+	}
+
+	for (int k = 0; k < 3; k++) {
+		meshlet.coneAxis[k] = axis[k] / axisLength;
+	}
+
+	// A cone that is 90 degrees wide or wider is never completely back-facing.
+	if (minDot > 0.0f) {
+		meshlet.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+	}
+}
+
+//-----------------------------------------------------------------
+// Split the triangles indices[firstIndex] to indices[firstIndex + indexCount - 1] into meshlets and append them
+// to meshlets. The triangles in the range are reordered so that every meshlet is a contiguous range.
+// positions has positionStride floats per vertex.
+inline void buildMeshlets(unsigned int *indices, unsigned int firstIndex, unsigned int indexCount,
+	const float *positions, size_t positionStride, size_t vertexCount, std::vector<Meshlet>& meshlets) {
+	unsigned int *triangles = indices + firstIndex;
+	unsigned int numTriangles = indexCount / 3;
+
+	if (numTriangles == 0) {
+		return;
+	}
+
+	// The triangles of every vertex, in compressed rows.
+	std::vector<unsigned int> offsets(vertexCount + 1, 0), adjacentTriangles(3 * numTriangles);
+	for (unsigned int i = 0; i < 3 * numTriangles; i++) {
+		offsets[triangles[i] + 1]++;
+	}
+	for (size_t v = 0; v < vertexCount; v++) {
+		offsets[v + 1] += offsets[v];
+	}
+	{
+		std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+		for (unsigned int i = 0; i < 3 * numTriangles; i++) {
+			adjacentTriangles[fill[triangles[i]]++] = i / 3;
+		}
+	}
+
+	std::vector<unsigned char> emitted(numTriangles, 0);
+	std::vector<unsigned int> order;
+	order.reserve(numTriangles);
+
+	// The vertices of the current meshlet, and a marker of the meshlet that last used each vertex.
+	std::vector<unsigned int> meshletVertices;
+	std::vector<unsigned int> vertexMeshlet(vertexCount, ~0u);
+	unsigned int meshletId = 0;
+	unsigned int meshletTriangles = 0;
+	unsigned int meshletStart = 0;
+	unsigned int nextSeed = 0;
+
+	for (;;) {
+		// Pick the next triangle: the neighbor of the meshlet that adds the fewest new vertices.
+		unsigned int best = ~0u, bestNewVertices = 4;
+
+		for (size_t i = 0; i < meshletVertices.size() && bestNewVertices > 0; i++) {
+			unsigned int v = meshletVertices[i];
+
+			for (unsigned int j = offsets[v]; j < offsets[v + 1]; j++) {
+				unsigned int t = adjacentTriangles[j];
+				if (emitted[t]) {
+					continue;
+				}
+
+				unsigned int newVertices = 0;
+				for (int k = 0; k < 3; k++) {
+					newVertices += (vertexMeshlet[triangles[3 * t + k]] != meshletId) ? 1 : 0;
+				}
+
+				if (newVertices < bestNewVertices || (newVertices == bestNewVertices && t < best)) {
+					best = t;
+					bestNewVertices = newVertices;
+				}
+			}
+		}
+
+		bool full = best != ~0u && (meshletVertices.size() + bestNewVertices > maxMeshletVertices ||
+			meshletTriangles + 1 > maxMeshletTriangles);
+
+		// Start a new meshlet when the current one is full or has no unused neighbors left.
+		if (best == ~0u || full) {
+			if (meshletTriangles > 0) {
+				Meshlet meshlet;
+				meshlet.firstIndex = firstIndex + 3 * meshletStart;
+				meshlet.indexCount = 3 * meshletTriangles;
+				meshlets.push_back(meshlet);
+
+				meshletStart += meshletTriangles;
+				meshletTriangles = 0;
+				meshletVertices.clear();
+				meshletId++;
+			}
+
+			while (nextSeed < numTriangles && emitted[nextSeed]) {
+				nextSeed++;
+			}
+			if (nextSeed == numTriangles) {
+				break;
+			}
+
+			best = nextSeed;
+		}
+
+		emitted[best] = 1;
+		order.push_back(best);
+		meshletTriangles++;
+
+		for (int k = 0; k < 3; k++) {
+			unsigned int v = triangles[3 * best + k];
+			if (vertexMeshlet[v] != meshletId) {
+				vertexMeshlet[v] = meshletId;
+				meshletVertices.push_back(v);
+			}
+		}
+	}
+
+	// Store the triangles in meshlet order.
+	std::vector<unsigned int> reordered(3 * numTriangles);
+	for (unsigned int i = 0; i < numTriangles; i++) {
+		for (int k = 0; k < 3; k++) {
+			reordered[3 * i + k] = triangles[3 * order[i] + k];
+		}
+	}
+	std::copy(reordered.begin(), reordered.end(), triangles);
+
+	for (size_t i = meshlets.size() - meshletId; i < meshlets.size(); i++) {
+		computeMeshletBounds(meshlets[i], indices, positions, positionStride);
+	}
+}
+
+//-----------------------------------------------------------------
+// Extract the six frustum planes (a, b, c, d) from a column-major model-view-projection matrix. A point p is inside
+// the frustum when a * p.x + b * p.y + c * p.z + d >= 0 for every plane. The planes are normalized, so the
+// result is the distance in model space.
+inline void extractFrustumPlanes(const float *mvp, float planes[6][4]) {
+	for (int i = 0; i < 3; i++) {
+		for (int side = 0; side < 2; side++) {
+			float *plane = planes[2 * i + side];
+			float sign = side ? -1.0f : 1.0f;
+
+			for (int k = 0; k < 4; k++) {
+				plane[k] = mvp[4 * k + 3] + sign * mvp[4 * k + i];
+			}
+
+			float length = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+			if (length > 0.0f) {
+				for (int k = 0; k < 4; k++) {
+					plane[k] /= length;
+				}
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------
+// True if the bounding sphere of a meshlet is completely outside one of the frustum planes.
+inline bool isMeshletOutsideFrustum(const Meshlet& meshlet, const float planes[6][4]) {
+	for (int i = 0; i < 6; i++) {
+		const float *plane = planes[i];
+		if (plane[0] * meshlet.center[0] + plane[1] * meshlet.center[1] + plane[2] * meshlet.center[2] + plane[3] < -meshlet.radius) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------
+// True if every triangle of a meshlet faces away from the camera. cameraPosition is in model space.
+inline bool isMeshletBackFacing(const Meshlet& meshlet, const float *cameraPosition) {
+	float d[3] = { meshlet.center[0] - cameraPosition[0], meshlet.center[1] - cameraPosition[1], meshlet.center[2] - cameraPosition[2] };
+	float distance = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+
+	return d[0] * meshlet.coneAxis[0] + d[1] * meshlet.coneAxis[1] + d[2] * meshlet.coneAxis[2] >=
+		meshlet.coneCutoff * distance + meshlet.radius;
+}
+
+#endif
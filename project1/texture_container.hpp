@@ -0,0 +1,427 @@
+/*
+A texture container file that holds a block-compressed texture with all its mipmaps, ready to be
+transferred to the GPU.
+
+The container starts with a TextureContainerHeader, followed by one TextureContainerLevel per mipmap level
+(level 0 first) and the compressed data of every level, 16-byte aligned. The data is stored in the block
+layout of BC1 (8 bytes per 4 x 4 block, opaque images), BC3 (16 bytes per block, images with alpha), or
+BC7 (16 bytes per block), so each level can be copied from the memory-mapped file into a texture directly.
+
+buildTextureContainer() creates a container from an RGBA image: it builds the mipmaps with a 2x2 box filter
+and compresses every level with a simple BC1 or BC3 encoder. BC7 containers can be read but are not created
+here; they have to come from an offline tool.
+
+A container is only used if the size and hash of the image file it was created from match, so an edited image
+is compressed again. None of these functions calls a graphics API function, so they can run on any thread.
+*/
+
+#ifndef TEXTURE_CONTAINER_HPP
+#define TEXTURE_CONTAINER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <stdint.h>
+
+// "HUTX" in a little-endian file
+const uint32_t textureContainerMagic = 0x58545548;
+
+// Increase this number whenever the layout of the container file changes.
+const uint32_t textureContainerVersion = 1;
+
+// The container is stored next to the image file, with this extension appended.
+const char * const textureContainerExtension = ".hutex";
+
+// Enough levels for a 32768 x 32768 image.
+const unsigned int maxTextureLevels = 16;
+
+enum TextureContainerFormat {
+	textureFormatBC1 = 1,
+	textureFormatBC3 = 3,
+	textureFormatBC7 = 7
+};
+
+struct TextureContainerHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t format; // TextureContainerFormat
+	uint32_t width;
+	uint32_t height;
+	uint32_t numLevels;
+	uint64_t sourceSize; // size of the image file in bytes
+	uint64_t sourceHash; // FNV-1a hash of the content of the image file
+};
+
+struct TextureContainerLevel {
+	uint32_t width;
+	uint32_t height;
+	uint64_t offset; // from the start of the file
+	uint64_t size;
+};
+
+// A decoded RGBA image and its mipmaps. All the levels are stored one after another in pixels,
+// level 0 first, so they can be copied into one buffer.
+struct DecodedTexture {
+	unsigned int numLevels;
+	unsigned int width[maxTextureLevels];
+	unsigned int height[maxTextureLevels];
+	size_t offset[maxTextureLevels]; // the byte offset of each level in pixels
+	std::vector<unsigned char> pixels;
+};
+
+//-----------------------------------------------------------------
+// The number of bytes of one 4 x 4 block.
+inline size_t getTextureBlockSize(uint32_t format) {
+	return (format == textureFormatBC1) ? 8 : 16;
+}
+
+//-----------------------------------------------------------------
+// 64-bit FNV-1a hash of the image file, stored in the container.
+inline uint64_t hashTextureSource(const unsigned char *bytes, size_t size) {
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+//-----------------------------------------------------------------
+// Halve an RGBA image with a 2x2 box filter. For odd sizes, the last row or column is repeated.
+inline void downsampleImage(const unsigned char *source, unsigned int width, unsigned int height,
+	unsigned char *destination, unsigned int destinationWidth, unsigned int destinationHeight) {
+	for (unsigned int y = 0; y < destinationHeight; y++) {
+		unsigned int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+
+		for (unsigned int x = 0; x < destinationWidth; x++) {
+			unsigned int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+
+			for (unsigned int c = 0; c < 4; c++) {
+				unsigned int sum = source[4 * (y0 * width + x0) + c] + source[4 * (y0 * width + x1) + c] +
+					source[4 * (y1 * width + x0) + c] + source[4 * (y1 * width + x1) + c];
+				destination[4 * (y * destinationWidth + x) + c] = (unsigned char)((sum + 2) / 4);
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------
+// Copy an RGBA image into texture and build its mipmaps, down to 1 x 1.
+inline void buildMipChain(const unsigned char *rgba, unsigned int width, unsigned int height, DecodedTexture& texture) {
+	// Compute the size and offset of every level.
+	size_t size = 0;
+	unsigned int levelWidth = width, levelHeight = height;
+	texture.numLevels = 0;
+
+	while (texture.numLevels < maxTextureLevels) {
+		unsigned int k = texture.numLevels++;
+		texture.width[k] = levelWidth;
+		texture.height[k] = levelHeight;
+		texture.offset[k] = size;
+		size += 4 * (size_t)levelWidth * levelHeight;
+
+		if (levelWidth == 1 && levelHeight == 1) {
+			break;
+		}
+		levelWidth = std::max(levelWidth / 2, 1u);
+		levelHeight = std::max(levelHeight / 2, 1u);
+	}
+
+	texture.pixels.resize(size);
+	memcpy(texture.pixels.data(), rgba, 4 * (size_t)width * height);
+
+	for (unsigned int k = 1; k < texture.numLevels; k++) {
+		downsampleImage(&texture.pixels[texture.offset[k - 1]], texture.width[k - 1], texture.height[k - 1],
+			&texture.pixels[texture.offset[k]], texture.width[k], texture.height[k]);
+	}
+}
+
+//-----------------------------------------------------------------
+// Convert an 8-bit RGB color to RGB565 and back.
+inline uint16_t packColor565(const float *color) {
+	int r = std::min(31, std::max(0, (int)(color[0] * 31.0f / 255.0f + 0.5f)));
+	int g = std::min(63, std::max(0, (int)(color[1] * 63.0f / 255.0f + 0.5f)));
+	int b = std::min(31, std::max(0, (int)(color[2] * 31.0f / 255.0f + 0.5f)));
+
+	return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+inline void unpackColor565(uint16_t packed, float *color) {
+	int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+
+	color[0] = (float)((r << 3) | (r >> 2));
+	color[1] = (float)((g << 2) | (g >> 4));
+	color[2] = (float)((b << 3) | (b >> 2));
+}
+
+//-----------------------------------------------------------------
+// Compress the colors of a 4 x 4 block of RGBA pixels into an 8-byte BC1 block, in the four color mode.
+// The endpoints are the extremes of the colors along their principal axis.
+inline void compressColorBlock(const unsigned char *block, unsigned char *output) {
+	float mean[3] = { 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; i++) {
+		for (int c = 0; c < 3; c++) {
+			mean[c] += block[4 * i + c] / 16.0f;
+		}
+	}
+
+	// Find the principal axis of the covariance matrix with a few power iterations.
+	float covariance[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; i++) {
+		float d[3] = { block[4 * i] - mean[0], block[4 * i + 1] - mean[1], block[4 * i + 2] - mean[2] };
+		covariance[0] += d[0] * d[0];
+		covariance[1] += d[0] * d[1];
+		covariance[2] += d[0] * d[2];
+		covariance[3] += d[1] * d[1];
+		covariance[4] += d[1] * d[2];
+		covariance[5] += d[2] * d[2];
+	}
+
+	float axis[3] = { 1.0f, 1.0f, 1.0f };
+	for (int iteration = 0; iteration < 8; iteration++) {
+		float next[3] = {
+			covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+			covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+			covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2]
+		};
+		float length = std::max(std::fabs(next[0]), std::max(std::fabs(next[1]), std::fabs(next[2])));
+
+		if (length <= 0.0f) {
+			break;
+		}
+		for (int c = 0; c < 3; c++) {
+			axis[c] = next[c] / length;
+		}
+	}
+
+	float minProjection = 0.0f, maxProjection = 0.0f;
+	for (int i = 0; i < 16; i++) {
+		float projection = (block[4 * i] - mean[0]) * axis[0] + (block[4 * i + 1] - mean[1]) * axis[1] +
+			(block[4 * i + 2] - mean[2]) * axis[2];
+		minProjection = (i == 0) ? projection : std::min(minProjection, projection);
+		maxProjection = (i == 0) ? projection : std::max(maxProjection, projection);
+	}
+
+	float axisLength2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+	float endpoints[2][3];
+	for (int c = 0; c < 3; c++) {
+		endpoints[0][c] = mean[c] + axis[c] * maxProjection / std::max(axisLength2, 1e-6f);
+		endpoints[1][c] = mean[c] + axis[c] * minProjection / std::max(axisLength2, 1e-6f);
+	}
+
+	uint16_t color0 = packColor565(endpoints[0]), color1 = packColor565(endpoints[1]);
+
+	// color0 > color1 selects the four color mode.
+	if (color0 < color1) {
+		std::swap(color0, color1);
+	}
+
+	float palette[4][3];
+	unpackColor565(color0, palette[0]);
+	unpackColor565(color1, palette[1]);
+	for (int c = 0; c < 3; c++) {
+		palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+		palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+	}
+
+	uint32_t indices = 0;
+	if (color0 != color1) {
+		for (int i = 0; i < 16; i++) {
+			int best = 0;
+			float bestDistance = 0.0f;
+
+			for (int k = 0; k < 4; k++) {
+				float distance = 0.0f;
+				for (int c = 0; c < 3; c++) {
+					float d = block[4 * i + c] - palette[k][c];
+					distance += d * d;
+				}
+
+				if (k == 0 || distance < bestDistance) {
+					best = k;
+					bestDistance = distance;
+				}
+			}
+
+			indices |= (uint32_t)best << (2 * i);
+		}
+	}
+
+	output[0] = (unsigned char)(color0 & 0xFF);
+	output[1] = (unsigned char)(color0 >> 8);
+	output[2] = (unsigned char)(color1 & 0xFF);
+	output[3] = (unsigned char)(color1 >> 8);
+	for (int i = 0; i < 4; i++) {
+		output[4 + i] = (unsigned char)(indices >> (8 * i));
+	}
+}
+
+//-----------------------------------------------------------------
+// Compress the alpha values of a 4 x 4 block of RGBA pixels into the 8-byte alpha block of BC3,
+// in the eight value mode.
+inline void compressAlphaBlock(const unsigned char *block, unsigned char *output) {
+	unsigned char alpha0 = 0, alpha1 = 255;
+	for (int i = 0; i < 16; i++) {
+		alpha0 = std::max(alpha0, block[4 * i + 3]);
+		alpha1 = std::min(alpha1, block[4 * i + 3]);
+	}
+
+	float palette[8] = { (float)alpha0, (float)alpha1 };
+	for (int k = 1; k <= 6; k++) {
+		palette[k + 1] = ((7 - k) * alpha0 + k * alpha1) / 7.0f;
+	}
+
+	uint64_t indices = 0;
+	if (alpha0 != alpha1) {
+		for (int i = 0; i < 16; i++) {
+			int best = 0;
+			float bestDistance = 0.0f;
+
+			for (int k = 0; k < 8; k++) {
+				float distance = std::fabs(block[4 * i + 3] - palette[k]);
+				if (k == 0 || distance < bestDistance) {
+					best = k;
+					bestDistance = distance;
+				}
+			}
+
+			indices |= (uint64_t)best << (3 * i);
+		}
+	}
+
+	output[0] = alpha0;
+	output[1] = alpha1;
+	for (int i = 0; i < 6; i++) {
+		output[2 + i] = (unsigned char)(indices >> (8 * i));
+	}
+}
+
+//-----------------------------------------------------------------
+// Compress an RGBA image into BC1 or BC3 blocks. Blocks that cross the right or bottom edge repeat
+// the last column or row.
+inline void compressTextureLevel(const unsigned char *rgba, unsigned int width, unsigned int height, uint32_t format,
+	unsigned char *output) {
+	unsigned char block[64];
+
+	for (unsigned int blockY = 0; blockY < height; blockY += 4) {
+		for (unsigned int blockX = 0; blockX < width; blockX += 4) {
+			for (unsigned int y = 0; y < 4; y++) {
+				for (unsigned int x = 0; x < 4; x++) {
+					unsigned int sourceX = std::min(blockX + x, width - 1), sourceY = std::min(blockY + y, height - 1);
+					memcpy(&block[4 * (4 * y + x)], &rgba[4 * ((size_t)sourceY * width + sourceX)], 4);
+				}
+			}
+
+			if (format == textureFormatBC3) {
+				compressAlphaBlock(block, output);
+				output += 8;
+			}
+
+			compressColorBlock(block, output);
+			output += 8;
+		}
+	}
+}
+
+//-----------------------------------------------------------------
+// Build a container from an RGBA image and its mipmaps. Opaque images are compressed into BC1, and images
+// with alpha into BC3.
+inline void buildTextureContainer(const DecodedTexture& texture, const unsigned char *source, size_t sourceSize,
+	std::vector<unsigned char>& container) {
+	bool hasAlpha = false;
+	for (size_t i = 3; i < 4 * (size_t)texture.width[0] * texture.height[0] && !hasAlpha; i += 4) {
+		hasAlpha = texture.pixels[i] < 255;
+	}
+
+	TextureContainerHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = textureContainerMagic;
+	header.version = textureContainerVersion;
+	header.format = hasAlpha ? textureFormatBC3 : textureFormatBC1;
+	header.width = texture.width[0];
+	header.height = texture.height[0];
+	header.numLevels = texture.numLevels;
+	header.sourceSize = sourceSize;
+	header.sourceHash = hashTextureSource(source, sourceSize);
+
+	// Lay out the levels.
+	std::vector<TextureContainerLevel> levels(texture.numLevels);
+	size_t size = (sizeof(header) + sizeof(TextureContainerLevel) * levels.size() + 15) & ~(size_t)15;
+
+	for (unsigned int k = 0; k < texture.numLevels; k++) {
+		levels[k].width = texture.width[k];
+		levels[k].height = texture.height[k];
+		levels[k].offset = size;
+		levels[k].size = getTextureBlockSize(header.format) * ((texture.width[k] + 3) / 4) * ((texture.height[k] + 3) / 4);
+		size += ((size_t)levels[k].size + 15) & ~(size_t)15;
+	}
+
+	container.assign(size, 0);
+	memcpy(container.data(), &header, sizeof(header));
+	memcpy(container.data() + sizeof(header), levels.data(), sizeof(TextureContainerLevel) * levels.size());
+
+	for (unsigned int k = 0; k < texture.numLevels; k++) {
+		compressTextureLevel(&texture.pixels[texture.offset[k]], texture.width[k], texture.height[k], header.format,
+			container.data() + levels[k].offset);
+	}
+}
+
+//-----------------------------------------------------------------
+// Check a container in memory. Returns its header, or NULL if the container is damaged, has an old version,
+// or was created from a different image file. The levels follow the header.
+inline const TextureContainerHeader *readTextureContainer(const unsigned char *container, size_t containerSize,
+	const unsigned char *source, size_t sourceSize) {
+	if (!container || containerSize < sizeof(TextureContainerHeader)) {
+		return NULL;
+	}
+
+	const TextureContainerHeader *header = (const TextureContainerHeader *)container;
+
+	if (header->magic != textureContainerMagic ||
+		header->version != textureContainerVersion ||
+		(header->format != textureFormatBC1 && header->format != textureFormatBC3 && header->format != textureFormatBC7) ||
+		header->numLevels < 1 || header->numLevels > maxTextureLevels ||
+		header->sourceSize != sourceSize ||
+		header->sourceHash != hashTextureSource(source, sourceSize) ||
+		containerSize < sizeof(TextureContainerHeader) + sizeof(TextureContainerLevel) * header->numLevels) {
+		return NULL;
+	}
+
+	// Every level must be inside the file, and big enough for its blocks.
+	const TextureContainerLevel *levels = (const TextureContainerLevel *)(header + 1);
+	for (unsigned int k = 0; k < header->numLevels; k++) {
+		uint64_t blocksSize = getTextureBlockSize(header->format) * (uint64_t)((levels[k].width + 3) / 4) * ((levels[k].height + 3) / 4);
+
+		if (levels[k].offset > containerSize || levels[k].size > containerSize - levels[k].offset || levels[k].size < blocksSize) {
+			return NULL;
+		}
+	}
+
+	return header;
+}
+
+inline const TextureContainerLevel *getTextureContainerLevels(const TextureContainerHeader *header) {
+	return (const TextureContainerLevel *)(header + 1);
+}
+
+//-----------------------------------------------------------------
+// Save a container built by buildTextureContainer(). Returns false if the file can't be written.
+inline bool saveTextureContainer(const char *filename, const std::vector<unsigned char>& container) {
+	std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+
+	if (!file) {
+		return false;
+	}
+
+	file.write((const char *)container.data(), container.size());
+
+	return file.good();
+}
+
+#endif
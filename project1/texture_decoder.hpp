@@ -0,0 +1,34 @@
+/*
+Image decoding for the asynchronous texture loader.
+
+decodeTextureImage() decodes an image file with SOIL into 8-bit RGBA pixels and builds the whole mipmap chain
+with a 2x2 box filter (see texture_container.hpp), so the GL thread only has to copy the levels into a pixel
+buffer object and create the texture object. It doesn't call any OpenGL function, so it can run on any thread.
+*/
+
+#ifndef TEXTURE_DECODER_HPP
+#define TEXTURE_DECODER_HPP
+
+#include <SOIL.h>
+
+#include "texture_container.hpp"
+
+//-----------------------------------------------------------------
+// Decode an image file into RGBA pixels and build its mipmaps, down to 1 x 1.
+// Returns false if the file can't be decoded.
+inline bool decodeTextureImage(const char *filename, DecodedTexture& texture) {
+	int width = 0, height = 0, channels = 0;
+	unsigned char *image = SOIL_load_image(filename, &width, &height, &channels, SOIL_LOAD_RGBA);
+
+	if (!image || width <= 0 || height <= 0) {
+		SOIL_free_image_data(image);
+		return false;
+	}
+
+	buildMipChain(image, (unsigned int)width, (unsigned int)height, texture);
+	SOIL_free_image_data(image);
+
+	return true;
+}
+
+#endif
@@ -27,11 +27,24 @@ uniform int lightType[maxNumLights];
 
 uniform int numLights;
 
-uniform vec4 Kambient;
-uniform vec4 Kdiffuse;
-uniform vec4 Kspecular;
-uniform vec4 emission;
-uniform float shininess;
+// The materials of all the meshes, in the std140 layout. A group of at most maxNumMaterials materials is bound 
+// at a time, and materialIndex is the index of the material of the mesh in that group. 
+// This number must be coordinated with maxNumMaterialsPerBlock in the program. 
+const int maxNumMaterials = 200;
+
+struct Material {
+	vec4 ambient;
+	vec4 diffuse;
+	vec4 specular;
+	vec4 emission;
+	float shininess;
+};
+
+layout(std140) uniform Materials {
+	Material materials[maxNumMaterials];
+};
+
+uniform int materialIndex;
 
 uniform vec3 eyePosition;
 
@@ -43,6 +56,13 @@ out vec4 color;
 // This fragment shader is an example of per-pixel lighting.
 void main() {
 
+	// The surface material properties of the mesh. 
+	vec4 Kambient = materials[materialIndex].ambient;
+	vec4 Kdiffuse = materials[materialIndex].diffuse;
+	vec4 Kspecular = materials[materialIndex].specular;
+	vec4 emission = materials[materialIndex].emission;
+	float shininess = materials[materialIndex].shininess;
+
 	// Now calculate the parameters for the lighting equation:
 	// color = Ka * Lag + (Ka * La) + attenuation * ((Kd * (N dot L) * Ld) + (Ks * ((N dot HV) ^ shininess) * Ls))
 	// Ka, Kd, Ks: surface material properties
@@ -101,6 +101,15 @@ Click the left mouse button again to stop the rotation.
 The rotations are only around X and Y axes.
 3D translations: press keys a, w, s, and d.
 Scale: press + and - keys.
+LOD: press l to turn the LOD selection on and off, [ and ] to change the LOD bias, and , and . to change
+the LOD hysteresis.
+Cluster culling: press c to turn the culling of off-screen and back-facing meshlets on and off.
+
+Command line options:
+--model <file>: the 3D file to load from the default model folder, instead of objectFileName.
+--instances <count>: draw count copies of the model with instanced draw calls.
+--layout grid|random: place the copies in a square grid, or scatter them randomly with random rotations.
+--spacing <distance>: the distance between the copies. By default, 2.5 times the radius of the model.
 
 User controlled transformations are applied only to the 3D meshes, not to the lights or camera.
 
@@ -110,8 +119,17 @@ file folder and copy the shader files there.
 
 */
 
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cstddef>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <GL/glew.h>
 #include <GL/freeglut.h>
@@ -126,6 +144,7 @@ file folder and copy the shader files there.
 
 #include <glm/gtx/projection.hpp>
 #include <glm/gtc/matrix_transform.hpp> 
+#include <glm/gtc/constants.hpp>
 #include <glm/gtx/transform2.hpp>
 #include <glm/gtc/type_ptr.hpp> 
 #include <glm/gtc/matrix_access.hpp>
@@ -141,6 +160,40 @@ file folder and copy the shader files there.
 // aiScene data structure. 
 #include "assimp_utilities.hpp"
 
+// This header file contains the memory mapping and binary reading/writing helpers
+// of the mesh cache. 
+#include "mesh_cache.hpp"
+
+// Helper functions for the quantized vertex format.
+#include "vertex_quantization.hpp"
+
+// Quadric error mesh simplification, used to build the LOD levels of each mesh.
+#include "mesh_simplifier.hpp"
+
+// Meshlets with bounding spheres and normal cones, used to cull parts of dense meshes.
+#include "meshlet_builder.hpp"
+
+// Bounding boxes of the meshes and the view-frustum test that culls whole meshes.
+#include "frustum_culling.hpp"
+
+// The bounding volume hierarchy over the mesh instances, used to cull whole groups of meshes at once.
+#include "scene_bvh.hpp"
+
+// The software depth buffer of a few large occluders, used to cull the meshes hidden behind them.
+#include "occlusion_culling.hpp"
+
+// The queue that sorts the draws of a frame by their state, so fewer textures, materials, and VAOs are bound.
+#include "render_queue.hpp"
+
+// The worker threads that decode the texture images, and the image decoding itself.
+#include "thread_pool.hpp"
+#include "texture_decoder.hpp"
+
+// The texture objects shared by the materials that use the same image.
+#include "texture_cache.hpp"
+#include "linear_arena.hpp"
+#include "load_profiler.hpp"
+
 using namespace std;
 using namespace glm;
 
@@ -175,12 +228,343 @@ Assimp::Importer importer;
 // Global Assimp scene object
 const aiScene* scene = NULL;
 
+// Assimp post-processing flags used to import the 3D file. 
+// They are also stored in the mesh cache. Changing them invalidates the existing cache files. 
+const unsigned int importPostProcessFlags = aiProcessPreset_TargetRealtime_Quality;
+
 // This array stores the VAO indices for each corresponding mesh in the aiScene object. 
 // For example, vaoArray[0] stores the VAO index for the mesh scene->mMeshes[0], and so on. 
 unsigned int *vaoArray = NULL;
 
-// This is the 1D array that stores the face indices of a mesh. 
-unsigned int *faceArray = NULL;
+// This array stores the number of face indices (elements) of each mesh. 
+// It is in sync with the vaoArray[] array. 
+unsigned int *indexCountArray = NULL;
+
+//-----------------------------
+// Shared mesh buffer related variables
+
+// Set this to false to give every mesh its own VAO and VBOs. 
+// When it's true, all the meshes are packed into one shared VBO and one shared index VBO with the
+// interleaved vertex format, and they are all drawn with one VAO that is bound once per frame. 
+bool useSharedMeshBuffers = true;
+
+// The VAO and VBOs shared by all the meshes.
+GLuint sharedVao = 0;
+GLuint sharedVertexBuffer = 0;
+GLuint sharedIndexBuffer = 0;
+
+// The offset of the first vertex and the byte offset of the first index of each mesh in the shared buffers.
+// They are in sync with the mMeshes[] array. 
+GLint *baseVertexArray = NULL;
+size_t *indexOffsetArray = NULL;
+
+// The type of the indices of each mesh: GL_UNSIGNED_SHORT if the mesh has fewer than 65536 vertices, 
+// GL_UNSIGNED_INT otherwise. It is in sync with the mMeshes[] array. 
+GLenum *indexTypeArray = NULL;
+
+// The vertex data of one mesh, flattened into continuous 1D arrays that can be 
+// transferred to VBOs directly. 
+// The arrays either point into Assimp's aiMesh, into arrays created by flattenMesh(), 
+// or into the memory-mapped mesh cache file. 
+struct FlatMesh {
+	unsigned int numVertices;
+	unsigned int numIndices;
+	unsigned int materialIndex;
+	const float *positions; // 3 floats per vertex
+	const float *normals; // 3 floats per vertex. NULL if the mesh has no normals. 
+	const float *textureCoords; // 2 floats per vertex. NULL if the mesh has no texture coordinates. 
+	unsigned int textureCoordStride; // number of floats from one texture coordinate to the next: 2, or 3 for Assimp's aiVector3D array
+	const unsigned int *indices; // the indices of all the LOD levels, coarsest level first
+	bool ownsArrays; // true if indices and meshlets were allocated in loaderArena, false if they point into the cache file
+	MeshLodChain lods; // the index range and error of each LOD level
+	const Meshlet *meshlets; // the meshlets of all the LOD levels, sorted by their first index. NULL if the mesh has none. 
+	unsigned int numMeshlets;
+};
+
+// One vertex of the interleaved vertex format. The position, normal, and texture coordinates of a vertex
+// are stored next to each other, so all the attributes of a vertex are fetched from one VBO. 
+struct InterleavedVertex {
+	float position[3];
+	float normal[3];
+	float textureCoord[2];
+};
+
+// Set this to false to store the positions, normals, and texture coordinates of each mesh in 
+// separate VBOs (the old layout), e.g. to compare the vertex fetch cost of both layouts. 
+bool useInterleavedVertices = true;
+
+// One vertex of the quantized vertex format, 16 bytes instead of the 32 bytes of InterleavedVertex. 
+// The position and texture coordinates are 16-bit values relative to the bounding box of the mesh, and the normal 
+// is octahedral-encoded into two 16-bit values. See vertex_quantization.hpp. 
+struct QuantizedVertex {
+	uint16_t position[4]; // The 4th value is padding, so that the normal is 4-byte aligned. 
+	int16_t normal[2];
+	uint16_t textureCoord[2];
+};
+
+// Set this to false to use 32-bit floats for the vertex attributes. 
+// The quantized format is an interleaved format, so it's only used with useSharedMeshBuffers or useInterleavedVertices. 
+bool useQuantizedVertices = true;
+
+// The vertex shader converts the vertex attributes back with these parameters: 
+// position = positionOffset + vPos * positionScale, and the same for the texture coordinates. 
+// For the float formats, the offset is 0 and the scale is 1. 
+struct VertexDecodeParameters {
+	float positionOffset[3];
+	float positionScale[3];
+	float textureCoordOffset[2];
+	float textureCoordScale[2];
+};
+
+// The decode parameters of each mesh. It is in sync with the mMeshes[] array. 
+VertexDecodeParameters *vertexDecodeArray = NULL;
+
+// This array stores the flattened vertex data of each mesh. It is in sync with the mMeshes[] array. 
+// It's only used while loading. 
+FlatMesh *flatMeshArray = NULL;
+
+// The scratch memory of the loader: flatMeshArray, the index, texture coordinate, and meshlet arrays of the 
+// flattened meshes, and the staging arrays of the VBO transfers are all allocated from this arena, instead of 
+// one malloc() per array. It is reset once, after all the vertex data is in the VBOs. See linear_arena.hpp. 
+LinearArena loaderArena;
+
+// The staging array of the chunked VBO transfers, big enough for the largest chunk. Allocated from loaderArena. 
+void *meshStagingArray = NULL;
+
+//-----------------------------
+// LOD related variables
+
+// Every mesh with at least minLodTriangles triangles gets up to maxLodLevels LOD levels when the 3D file is imported,
+// and the levels are stored in the mesh cache. See mesh_simplifier.hpp. 
+// For every draw, the coarsest level whose error is at most lodPixelThreshold pixels on the screen is used. 
+// These settings can be changed at run time with the keyboard: 
+// useMeshLods (l), lodBias ([ and ]), and lodHysteresis (, and .). 
+bool useMeshLods = true;
+const float lodPixelThreshold = 1.0f;
+
+// A positive bias selects coarser levels: every step of 1 doubles the allowed error. 
+float lodBias = 0.0f;
+
+// A mesh switches to a coarser level only when the error is hysteresis below the threshold, and back to a finer level 
+// only when the error is hysteresis above it, so that it doesn't switch back and forth at the threshold. 
+float lodHysteresis = 0.1f;
+
+// The LOD levels of each mesh. It is in sync with the mMeshes[] array. The level drawn last is kept by every 
+// MeshInstance, since the instances of one mesh can be at very different distances. 
+MeshLodChain *meshLodArray = NULL;
+
+//-----------------------------
+// Cluster culling related variables
+
+// Every LOD level of a mesh with at least minMeshletTriangles triangles is split into meshlets when the 3D file 
+// is imported, and the meshlets are stored in the mesh cache. See meshlet_builder.hpp. 
+// Before a mesh is drawn, the meshlets outside the view frustum and the meshlets that face away from the camera 
+// are culled, and only the index ranges of the remaining meshlets are drawn. 
+// useClusterCulling can be changed at run time with the c key. 
+bool useClusterCulling = true;
+
+// Set this to false for models with one-sided surfaces that must be visible from behind. 
+// Back-face culling (GL_CULL_FACE) is not enabled in this program, so these surfaces are otherwise drawn. 
+bool useClusterConeCulling = true;
+
+// The meshlets of all the meshes, and the first meshlet and the number of meshlets of each mesh. 
+// firstMeshletArray and meshletCountArray are in sync with the mMeshes[] array. 
+Meshlet *meshletArray = NULL;
+unsigned int *firstMeshletArray = NULL;
+unsigned int *meshletCountArray = NULL;
+
+// The index ranges of the visible meshlets of the mesh being drawn, passed to glMultiDrawElementsBaseVertex(). 
+vector<GLsizei> clusterDrawCounts;
+vector<const GLvoid*> clusterDrawOffsets;
+vector<GLint> clusterDrawBaseVertices;
+
+// The number of meshlets tested and culled in the last frame. 
+unsigned int numClustersTested = 0;
+unsigned int numClustersCulled = 0;
+
+//-----------------------------
+// Frustum culling related variables
+
+// Every mesh gets a bounding box when it's loaded. Before a mesh is drawn, the box transformed by the model matrix of 
+// its node is tested against the view frustum, and the mesh is skipped if the box is outside. See frustum_culling.hpp.
+// This can be switched on and off at run time with the f key. 
+// When the model is drawn many times with instancing, the boxes of the copies aren't tested, so nothing is culled. 
+bool useFrustumCulling = true;
+
+// The bounding box of each mesh in its own space. It is in sync with the mMeshes[] array. 
+BoundingBox *meshBoundsArray = NULL;
+
+// The planes of the view frustum in world space, extracted from projMatrix * viewMatrix when the camera changes. 
+FrustumPlanes viewFrustum;
+
+// The number of meshes tested and culled in the last frame. 
+unsigned int numMeshesTested = 0;
+unsigned int numMeshesCulled = 0;
+
+// With useSceneBvh, the mesh instances are culled by walking sceneBvh instead of testing every instance, so a group of 
+// meshes outside the frustum is skipped with one test. The tree is built with the SAH after the scene is loaded, and 
+// refitted when the node transformations change. See scene_bvh.hpp. 
+// The boxes of the tree don't include the user transformation, so moving the model with the mouse or the keyboard 
+// doesn't refit anything; sceneFrustum is the view frustum transformed back by the user transformation instead. 
+// The tree can be switched on and off with the v key, and the b key times it against testing every instance. 
+bool useSceneBvh = true;
+SceneBvh sceneBvh;
+bool sceneBvhBuilt = false;
+
+FrustumPlanes sceneFrustum;
+unsigned int sceneFrustumCameraVersion = 0;
+unsigned int sceneFrustumUserVersion = 0;
+
+// The mesh instances that passed the culling, in drawing order. 
+vector<unsigned int> visibleMeshInstances;
+
+// The number of tree nodes visited in the last frame. 
+unsigned int numBvhNodesVisited = 0;
+
+//-----------------------------
+// Occlusion culling related variables
+
+// After the frustum culling, the largest visible meshes on the screen are rasterized as occluders into occlusionBuffer, 
+// a small depth buffer in memory, and the meshes whose boxes are behind the occluders aren't drawn. 
+// The occluders are rasterized on occlusionThreadPool. See occlusion_culling.hpp. 
+// This can be switched on and off at run time with the o key. It only runs when the frustum culling runs. 
+bool useOcclusionCulling = true;
+
+// The number of occluders rasterized per frame, and the largest number of triangles of one occluder. 
+unsigned int maxOccluders = 8;
+unsigned int maxOccluderTriangles = 4096;
+
+// The triangles a mesh is rasterized with when it's an occluder: its full-detail LOD level 0, with its own compact copy 
+// of the vertex positions. Empty if level 0 has more than maxOccluderTriangles triangles. The simplified levels aren't 
+// used: they can cover pixels the mesh itself doesn't, and then hide meshes that are visible. 
+struct OccluderMesh {
+	vector<float> positions; // 3 floats per vertex
+	vector<unsigned int> indices;
+};
+
+// The occluder of each mesh. It is in sync with the mMeshes[] array. 
+vector<OccluderMesh> occluderMeshArray;
+
+OcclusionBuffer occlusionBuffer;
+ThreadPool *occlusionThreadPool = NULL;
+
+// The number of meshes culled by the occluders, and the number of occluder triangles rasterized, in the last frame. 
+unsigned int numMeshesOccluded = 0;
+unsigned int numOccluderTriangles = 0;
+
+//-----------------------------
+// Render queue related variables
+
+// The meshes are not drawn while the scene graph is traversed. Every mesh that passes the culling is recorded in 
+// meshDrawArray, and a packet with a sort key made of its shader, texture, material, mesh, and depth is pushed to 
+// renderQueue. The queue is sorted, and the draws are submitted in that order. The texture, the material index, 
+// and the VAO or vertex decode uniforms are only sent when they differ from the previous draw. See render_queue.hpp. 
+// With useRenderQueue false, the draws are submitted in traversal order, and all their state is sent every time. 
+// This can be switched at run time with the r key. 
+bool useRenderQueue = true;
+
+// A mesh instance that will be drawn in this frame. 
+struct MeshDraw {
+	unsigned int instanceIndex; // the index in meshInstanceArray
+	unsigned int firstIndex; // the index range of the selected LOD level
+	unsigned int indexCount;
+	unsigned int firstCluster; // the visible meshlet ranges in queuedClusterCounts, ..., if clusterCount > 0
+	unsigned int clusterCount;
+};
+
+vector<MeshDraw> meshDrawArray;
+RenderQueue renderQueue;
+
+// The index ranges of the visible meshlets of all the draws in meshDrawArray. 
+vector<GLsizei> queuedClusterCounts;
+vector<const GLvoid*> queuedClusterOffsets;
+vector<GLint> queuedClusterBaseVertices;
+
+// The state changes sent in the last frame, and the ones skipped because the state was already bound. 
+// A draw needs four: its texture, the group of materialUniformBuffer its material is in, its material index, and its 
+// VAO or vertex decode uniforms. 
+unsigned int numStateChanges = 0;
+unsigned int numStateChangesSaved = 0;
+
+//-----------------------------
+// Background loading related variables
+
+// Set this to false to load all the 3D data before the first frame. 
+// When it's true, the 3D file (or the mesh cache) is loaded by the scene loader thread while the window already
+// draws frames. Then the vertex data is transferred to the VBOs in chunks, at most about meshUploadBudgetPerFrame
+// bytes per frame, and every mesh is drawn as soon as some of its indices are transferred. 
+bool useBackgroundLoading = true;
+
+const size_t meshUploadBudgetPerFrame = 4 * 1024 * 1024;
+
+// The largest vertex and index ranges transferred as one chunk. 
+// maxChunkIndices is a multiple of 3, so a chunk never ends in the middle of a triangle. 
+const unsigned int maxChunkVertices = 65536;
+const unsigned int maxChunkIndices = 3 * 65536;
+
+// A range of vertices or indices of one mesh, transferred to the VBOs in one glBufferSubData() call. 
+// The separate VBOs of the old vertex layout are created and filled by uploadFlatMesh() as one whole-mesh chunk. 
+enum MeshUploadChunkType { meshUploadVertices, meshUploadIndices, meshUploadWholeMesh };
+
+struct MeshUploadChunk {
+	unsigned int meshIndex;
+	MeshUploadChunkType type;
+	unsigned int first;
+	unsigned int count;
+};
+
+// The chunks of all the meshes, in transfer order, and the next chunk to transfer. 
+vector<MeshUploadChunk> meshUploadQueue;
+size_t nextMeshUploadChunk = 0;
+
+// The VBO and index VBO of each mesh. With shared mesh buffers, they are the shared VBOs. 
+// They are in sync with the mMeshes[] array. 
+GLuint *vertexBufferArray = NULL;
+GLuint *indexBufferArray = NULL;
+
+// The scene loader thread only writes the variables filled by loadSceneData(). 
+// The render thread reads them after sceneLoaderDone becomes true. 
+thread *sceneLoaderThread = NULL;
+atomic<bool> sceneLoaderDone(false);
+bool sceneLoaderSucceeded = false;
+
+// Set by stopSceneLoading() when the program ends before the scene loader thread is done. 
+// loadSceneData() checks it between meshes and gives up. 
+atomic<bool> sceneLoaderCancelled(false);
+
+// True when the VAOs, VBOs, and texture objects are created. 
+bool sceneReady = false;
+
+// Used to report how long it takes until the first frame and until all the meshes are in the VBOs. 
+chrono::high_resolution_clock::time_point programStartTime = chrono::high_resolution_clock::now();
+bool firstSceneFrameDrawn = false;
+
+// Every phase of loading is timed with a LoadPhase object, with the number of bytes it processed. When the 
+// meshes and textures are all loaded, the phases are written next to the 3D file, as a JSON summary (3D file 
+// name plus loadProfileExtension) and as a Chrome trace (plus loadTraceExtension). See load_profiler.hpp. 
+// Set this to false to skip the files. 
+bool useLoadProfiler = true;
+const char * loadProfileExtension = ".load_profile.json";
+const char * loadTraceExtension = ".load_trace.json";
+LoadProfiler loadProfiler;
+bool loadProfileWritten = false;
+
+//-----------------------------
+// Mesh cache related variables
+
+// Set this to false to always import the 3D file with Assimp. 
+bool useMeshCache = true;
+
+// The cache file is stored in the model folder. Its name is the 3D file name plus this extension. 
+const char * meshCacheExtension = ".hucache";
+
+// The memory-mapped cache file. It's kept open until the vertex data is transferred to the VBOs. 
+MappedFile meshCacheFile;
+
+// When the 3D data is loaded from the cache, Assimp is not used. Instead, an aiScene object 
+// containing only the nodes, cameras, lights, and the material index of each mesh is rebuilt 
+// from the cache. This program owns that object, so it must be deleted at the end. 
+aiScene *cachedScene = NULL;
 
 //---------------------------------
 // Vertex related variables
@@ -189,10 +573,22 @@ struct VertexAttributeLocations {
 	GLint vPos; // Index of the in variable vPos in the vertex shader
 	GLint vNormal; // Index of the in variable vNormal in the vertex shader
 	GLint vTextureCoord; // Index of the in variable vTextureCoord in the vertex shader
+	GLint iModelMatrix; // Index of the per-instance mat4 iModelMatrix, which takes 4 indices, one per column
+	GLint iNormalMatrix; // Index of the per-instance mat3 iNormalMatrix, which takes 3 indices
 };
 
 VertexAttributeLocations vertexAttributeLocations;
 
+struct VertexDecodeLocations {
+	GLint positionOffset; // uniform variable: offset of the quantized positions
+	GLint positionScale; // uniform variable: scale of the quantized positions
+	GLint textureCoordOffset; // uniform variable: offset of the quantized texture coordinates
+	GLint textureCoordScale; // uniform variable: scale of the quantized texture coordinates
+	GLint octahedralNormals; // uniform variable: true if the normals are octahedral-encoded
+};
+
+VertexDecodeLocations vertexDecodeLocations;
+
 //---------------------------------
 // Transformation related variables
 
@@ -204,6 +600,110 @@ struct MatrixLocations {
 
 MatrixLocations matrixLocations;
 
+//-----------------------------
+// Instancing related variables
+
+// The model is drawn instanceCount times with one instanced draw call per mesh. Every copy gets its own model and 
+// normal matrix from instanceBuffer, through per-instance vertex attributes (glVertexAttribDivisor()). The instance 
+// matrix is applied on top of the node and user transformations, so every copy is rotated and scaled in place. 
+// The copies are placed by buildInstanceTransforms() in a square grid, or scattered randomly, instanceSpacing apart. 
+// These settings are set on the command line; see main(). 
+enum InstanceLayout { instanceLayoutGrid, instanceLayoutRandom };
+
+unsigned int instanceCount = 1;
+InstanceLayout instanceLayout = instanceLayoutGrid;
+float instanceSpacing = 0.0f; // 0 means 2.5 times the radius of the model
+
+struct InstanceTransform {
+	mat4 modelMatrix;
+	mat3 normalMatrix;
+};
+
+vector<InstanceTransform> instanceTransforms;
+GLuint instanceBuffer = 0;
+
+// The matrix of the copy closest to the camera. The LOD level of every mesh is selected for this copy. 
+// It's found again, and the view-projection matrix is passed to the shader again, only when the camera has a new 
+// version (see cameraVersion). 
+mat4 nearestInstanceMatrix = mat4(1.0f);
+unsigned int viewProjCameraVersion = 0;
+
+struct InstancingLocations {
+	GLint useInstancing; // uniform variable: true if the per-instance matrices are used
+	GLint viewProjMatrix; // uniform variable: view-projection matrix, used with the per-instance matrices
+};
+
+InstancingLocations instancingLocations;
+
+//-----------------------------
+// Scene graph related variables
+
+// The node tree is flattened by flattenNodeTree() into flatNodeArray, in depth-first order, so every node comes after
+// its parent. The matrices of the nodes are then computed in one pass over the array instead of a recursive traversal 
+// every frame, and only the matrices that are out of date are computed. 
+// Every computed matrix has a version number, which is incremented when the matrix is computed again. A node remembers
+// the version of its parent's matrix that its own matrix was computed from, so a node is only computed again when it 
+// is marked dirty or its parent's matrix has a new version. sceneTransform is used for the camera and the lights, 
+// without the user transformation; modelMatrix and normalMatrix are used for the meshes, with it. 
+struct FlatNode {
+	const aiNode* node;
+	int parentIndex; // -1 for the root node
+	bool dirty; // localTransform changed since the matrices were computed
+	aiMatrix4x4 localTransform; // the transformation relative to the parent node; starts as node->mTransformation
+	mat4 localMatrix; // localTransform as a glm matrix
+
+	aiMatrix4x4 sceneTransform; // the node transformations from the root node down to this node
+	unsigned int sceneVersion;
+	unsigned int parentSceneVersion;
+
+	mat4 modelMatrix; // the user transformation times the node transformations
+	mat3 normalMatrix;
+	unsigned int worldVersion; // the version of modelMatrix and normalMatrix
+	unsigned int parentWorldVersion; // for the root node, the version of userMatrix
+
+	mat4 mvpMatrix; // computed by getNodeMvpMatrix() from the versions below
+	unsigned int mvpWorldVersion;
+	unsigned int mvpCameraVersion;
+};
+
+vector<FlatNode> flatNodeArray;
+
+// One mesh of one node. A mesh that is used by several nodes has one instance for each. 
+struct MeshInstance {
+	unsigned int nodeIndex;
+	unsigned int meshIndex;
+	BoundingBox worldBounds; // the bounding box of the mesh transformed by the model matrix of the node
+	unsigned int boundsWorldVersion; // the worldVersion of the node that worldBounds was computed from
+	BoundingBox sceneBounds; // the same without the user transformation, for sceneBvh
+	unsigned int boundsSceneVersion; // the sceneVersion of the node that sceneBounds was computed from
+	unsigned int lodLevel; // the LOD level drawn last, for the hysteresis of selectMeshLod()
+};
+
+// The meshes of all the nodes, in drawing order. 
+vector<MeshInstance> meshInstanceArray;
+
+// The user transformation of the mouse and the keyboard, applied at the root node. The input callbacks set 
+// userTransformDirty, and display() then computes userMatrix and increments its version. 
+mat4 userMatrix = mat4(1.0f);
+unsigned int userMatrixVersion = 0;
+bool userTransformDirty = true;
+
+// projMatrix and viewMatrix are computed again only when cameraDirty is set (at load time and when the window is 
+// resized) or when the camera node has moved; cameraVersion is then incremented. 
+bool cameraDirty = true;
+unsigned int cameraVersion = 0;
+unsigned int cameraNodeVersion = 0; // the sceneVersion of the camera node that the matrices were computed from
+
+// The light parameters are passed to the shader again only when a light has moved or lightsDirty is set. 
+bool lightsDirty = true;
+
+// The camera and the lights reference their nodes by name. bindCameraAndLights() finds the nodes once after loading, 
+// so every frame only reads sceneTransform of the bound node. -1 means there is no node. 
+int boundCameraIndex = -1; // the camera in scene->mCameras that has a node
+int cameraNodeIndex = -1;
+vector<int> lightNodeIndices; // one for each of the numLights lights
+vector<unsigned int> lightNodeVersions; // the sceneVersion of the light node that the light was transformed with
+
 mat4 projMatrix; // projection matrix
 mat4 viewMatrix; // view matrix
 
@@ -238,12 +738,32 @@ struct SurfaceMaterialProperties {
 
 SurfaceMaterialProperties *surfaceMaterials = NULL;
 
+// The materials are transferred once to materialUniformBuffer, in the std140 layout of the Materials uniform block 
+// of the fragment shader, and a draw only passes the index of its material. A uniform block is only guaranteed to 
+// hold 16 KB, so the buffer is split into groups of maxNumMaterialsPerBlock materials. The group of a material is 
+// bound to the block with glBindBufferRange(), and the index passed to the shader is relative to the group. 
+// This number must be coordinated with maxNumMaterials in the fragment shader. 
+const unsigned int maxNumMaterialsPerBlock = 200;
+const GLuint materialBlockBinding = 0;
+
+// One material of the Materials block. In the std140 layout, the size of a struct is a multiple of 16 bytes. 
+struct MaterialBlockEntry {
+	float ambient[4];
+	float diffuse[4];
+	float specular[4];
+	float emission[4];
+	float shininess;
+	float padding[3];
+};
+
+GLuint materialUniformBuffer = 0;
+
+// The bytes from one group of materials to the next, a multiple of GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT. 
+GLintptr materialGroupStride = 0;
+
 struct SurfaceMaterialLocations {
-	unsigned int ambient;
-	unsigned int diffuse;
-	unsigned int specular;
-	unsigned int emission;
-	unsigned int shininess;
+	unsigned int materialIndex;
+	unsigned int materialBlock; // the index of the Materials uniform block
 };
 
 SurfaceMaterialLocations surfaceMaterialLocations;
@@ -331,10 +851,59 @@ LightSourceLocations lightSourceLocations;
 
 // ------------------------------------
 // Texture mapping related variables. 
-float* textureCoordArray = 0;
 unsigned int* textureObjectIDArray = 0;
+
+// Number of materials, and the texture file of each material. 
+// The texture file name is empty if the material has no texture. 
+unsigned int numMaterials = 0;
+vector<string> materialTextureFiles;
 unsigned int textureUnit;
 
+// Set this to false to load the texture images one after another with SOIL_load_OGL_texture() on the GL thread. 
+// When it's true, the images are decoded and their mipmaps are built on textureThreadPool, one worker thread per 
+// core, and every finished image is transferred to its texture object through a pixel buffer object in display(), 
+// at most about textureUploadBudgetPerFrame bytes per frame. Until then, the material uses placeholderTexture. 
+bool useAsyncTextureLoading = true;
+const size_t textureUploadBudgetPerFrame = 16 * 1024 * 1024;
+
+// Set this to false to keep the asynchronously loaded textures uncompressed (8-bit RGBA). 
+// When it's true, every image is stored in a texture container next to the image file, compressed into BC1 or BC3 
+// with all its mipmaps, and the container is memory-mapped and its levels are transferred without any decoding. 
+// A missing or out-of-date container is created from the image the first time. See texture_container.hpp. 
+bool useCompressedTextures = true;
+
+// Materials that use the same image file share one texture object, so every image is decoded and transferred once. 
+// All the material textures are loaded with the same flags, SOIL_FLAG_MIPMAPS: 8-bit RGBA with mipmaps. 
+TextureCache textureCache;
+const unsigned int materialTextureFlags = SOIL_FLAG_MIPMAPS;
+
+// The cache entry of the texture of each material, or NULL if the material has no texture. Each material holds one 
+// reference to its entry, which is released at exit. 
+vector<TextureCacheEntry*> materialTextureEntries;
+
+// The decoding of one texture image, used by the materials in materialIndices. image and succeeded are written by 
+// the worker thread, and read by the GL thread only after done is ready. 
+struct TextureLoadJob {
+	vector<unsigned int> materialIndices;
+	TextureCacheEntry *cacheEntry;
+	string filename;
+	DecodedTexture image; // the RGBA image, if it isn't compressed
+	MappedFile *containerFile; // the memory-mapped texture container, or NULL
+	vector<unsigned char> containerBytes; // the container created from the image, if there was no up-to-date container file
+	const TextureContainerHeader *container; // points into containerFile or containerBytes. NULL if the image isn't compressed. 
+	bool succeeded;
+	bool uploaded;
+	future<void> done;
+};
+
+ThreadPool *textureThreadPool = NULL;
+vector<TextureLoadJob> textureLoadJobs;
+unsigned int numPendingTextures = 0;
+
+// A 1 x 1 gray texture, and the pixel buffer object that the texture images are transferred through. 
+GLuint placeholderTexture = 0;
+GLuint textureUploadBuffer = 0;
+
 // User interactions related parameters
 float rotateX = 0;
 float rotateY = 0;
@@ -355,23 +924,43 @@ float transformationStep = 1.0f;
 //---------------
 // Load a 3D file
 const aiScene* load3DFile(const char *filename) {
+	uint64_t fileSize = 0;
 
-	ifstream fileIn(filename);
+	{
+		LoadPhase phase(loadProfiler, "file.check", filename);
+		ifstream fileIn(filename, ios::binary | ios::ate);
 
-	// Check if the file exists. 
-	if (fileIn.good()) {
-		fileIn.close();  // The file exists. 
-	}
-	else {
-		fileIn.close();
-		cout << "Unable to open the 3D file." << endl;
-		return false;
+		// Check if the file exists. 
+		if (fileIn.good()) {
+			fileSize = (uint64_t)fileIn.tellg();
+			fileIn.close();  // The file exists. 
+		}
+		else {
+			fileIn.close();
+			cout << "Unable to open the 3D file." << endl;
+			return false;
+		}
 	}
 
 	cout << "Loading 3D file " << filename << endl;
 
 	// Load the 3D file using Assimp. The content of the 3D file is stored in an aiScene object. 
-	const aiScene* sceneObj = importer.ReadFile(filename, aiProcessPreset_TargetRealtime_Quality);
+	// The post-processing steps are applied separately, so they are timed separately. 
+	const aiScene* sceneObj = NULL;
+	{
+		LoadPhase phase(loadProfiler, "assimp.import", filename);
+		phase.addBytes(fileSize);
+		sceneObj = importer.ReadFile(filename, 0);
+	}
+
+	if (sceneObj) {
+		LoadPhase phase(loadProfiler, "assimp.postprocess", filename);
+		sceneObj = importer.ApplyPostProcessing(importPostProcessFlags);
+
+		for (unsigned int i = 0; sceneObj && i < sceneObj->mNumMeshes; i++) {
+			phase.addBytes(sizeof(aiVector3D) * sceneObj->mMeshes[i]->mNumVertices + sizeof(aiFace) * sceneObj->mMeshes[i]->mNumFaces);
+		}
+	}
 
 	// Check if the file is loaded successfully. 
 	if (!sceneObj)
@@ -394,6 +983,7 @@ const aiScene* load3DFile(const char *filename) {
 //-------------------
 // Read a shader file
 const char *readShaderFile(const char * filename) {
+	LoadPhase phase(loadProfiler, "shader.read", filename);
 	ifstream shaderFile(filename);
 
 	if (!shaderFile.is_open()) {
@@ -411,6 +1001,7 @@ const char *readShaderFile(const char * filename) {
 	}
 
 	const char *shaderSource = shaderSourceStr->c_str();
+	phase.addBytes(shaderSourceStr->size());
 
 	shaderFile.close();
 
@@ -493,11 +1084,19 @@ bool prepareShaders() {
 	glShaderSource(fShaderID, 1, &fShader, NULL);
 
 	// Compile the vertex shader object
-	glCompileShader(vShaderID);
+	{
+		LoadPhase phase(loadProfiler, "shader.compile", vShaderFilename);
+		phase.addBytes(strlen(vShader));
+		glCompileShader(vShaderID);
+	}
 	printShaderInfoLog(vShaderID); // Print error messages, if any. 
 
 								   // Compile the fragment shader object
-	glCompileShader(fShaderID);
+	{
+		LoadPhase phase(loadProfiler, "shader.compile", fShaderFilename);
+		phase.addBytes(strlen(fShader));
+		glCompileShader(fShaderID);
+	}
 	printShaderInfoLog(fShaderID); // Print error messages, if any. 
 
 								   // Create an empty shader program object
@@ -512,9 +1111,13 @@ bool prepareShaders() {
 	glAttachShader(program, fShaderID);
 
 	// Link the shader program
-	glLinkProgram(program);
-	// Check if the shader program can run in the current OpenGL state, just for testing purposes. 
-	glValidateProgram(program);
+	{
+		LoadPhase phase(loadProfiler, "shader.link");
+		phase.addBytes(strlen(vShader) + strlen(fShader));
+		glLinkProgram(program);
+		// Check if the shader program can run in the current OpenGL state, just for testing purposes. 
+		glValidateProgram(program);
+	}
 	printShaderProgramInfoLog(program); // Print error messages, if any. 
 
 	return true;
@@ -534,6 +1137,15 @@ void getShaderVariableLocations() {
 	vertexAttributeLocations.vTextureCoord = glGetAttribLocation(program, "vTextureCoord");
 	checkGlGetXLocationError(vertexAttributeLocations.vTextureCoord, "vTextureCoord");
 
+	vertexAttributeLocations.iModelMatrix = glGetAttribLocation(program, "iModelMatrix");
+	checkGlGetXLocationError(vertexAttributeLocations.iModelMatrix, "iModelMatrix");
+
+	vertexAttributeLocations.iNormalMatrix = glGetAttribLocation(program, "iNormalMatrix");
+	checkGlGetXLocationError(vertexAttributeLocations.iNormalMatrix, "iNormalMatrix");
+
+	instancingLocations.useInstancing = glGetUniformLocation(program, "useInstancing");
+	instancingLocations.viewProjMatrix = glGetUniformLocation(program, "viewProjMatrix");
+
 	// Get the ID of the uniform matrix variable in the vertex shader. 
 	matrixLocations.mvpMatrixID = glGetUniformLocation(program, "mvpMatrix");
 	if (matrixLocations.mvpMatrixID == -1) {
@@ -550,11 +1162,20 @@ void getShaderVariableLocations() {
 		cout << "There is an error getting the handle of GLSL uniform variable normalMatrix." << endl;
 	}
 
-	surfaceMaterialLocations.ambient = glGetUniformLocation(program, "Kambient");
-	surfaceMaterialLocations.diffuse = glGetUniformLocation(program, "Kdiffuse");
-	surfaceMaterialLocations.specular = glGetUniformLocation(program, "Kspecular");
-	surfaceMaterialLocations.emission = glGetUniformLocation(program, "emission");
-	surfaceMaterialLocations.shininess = glGetUniformLocation(program, "shininess");
+	vertexDecodeLocations.positionOffset = glGetUniformLocation(program, "positionOffset");
+	vertexDecodeLocations.positionScale = glGetUniformLocation(program, "positionScale");
+	vertexDecodeLocations.textureCoordOffset = glGetUniformLocation(program, "textureCoordOffset");
+	vertexDecodeLocations.textureCoordScale = glGetUniformLocation(program, "textureCoordScale");
+	vertexDecodeLocations.octahedralNormals = glGetUniformLocation(program, "octahedralNormals");
+
+	surfaceMaterialLocations.materialIndex = glGetUniformLocation(program, "materialIndex");
+	surfaceMaterialLocations.materialBlock = glGetUniformBlockIndex(program, "Materials");
+	if (surfaceMaterialLocations.materialBlock == GL_INVALID_INDEX) {
+		cout << "There is an error getting the index of GLSL uniform block Materials." << endl;
+	}
+	else {
+		glUniformBlockBinding(program, surfaceMaterialLocations.materialBlock, materialBlockBinding);
+	}
 
 	lightSourceLocations.position = glGetUniformLocation(program, "lightSourcePosition");
 	lightSourceLocations.direction = glGetUniformLocation(program, "lightDirection");
@@ -575,171 +1196,141 @@ void getShaderVariableLocations() {
 	checkGlGetXLocationError(textureUnit, "textureUnit");
 }
 
-//--------------------------------------
-// Load 3D data from 3D file with Assimp
-// The Assimp data structure consists of a scene graph and multiple arrays: meshes, materials, 
-// lights, cameras, embedded textures, and animations. 
-// In this program, we don't process embedded texture and animation. 
-// Each mesh contains multiple arrays: vertices, normals, texture coordinates, and faces.
-// - This function associates each array with a VBO and create a VAO for each mesh. 
-// - This function also copies the data from Assimp's materials array to the surfaceMaterials 
-// array so it can be transferred to the shader. 
-// - This function creates an array of texture objects, one for each material. 
-// - This function copies the data from Assimp's light array to the arrays of light parameters so 
-// they can be transferred to the shader. 
-bool load3DData() {
-	// ****************
-	// Load the 3D file
+//--------------------------------------------------------------
+// Copy the vertex data of an aiMesh into a FlatMesh.
+// Vertex positions and normals are already stored in continuous 1D arrays (mVertices and mNormals)
+// in the aiScene object, so they are used directly.
+// Face indices and texture coordinates are not, so they are copied into new 1D arrays in loaderArena.
+void flattenMesh(const aiMesh* currentMesh, FlatMesh& flatMesh) {
+	flatMesh.numVertices = currentMesh->mNumVertices;
+	flatMesh.numIndices = 0;
+	flatMesh.materialIndex = currentMesh->mMaterialIndex;
+	flatMesh.positions = currentMesh->HasPositions() ? (const float*)currentMesh->mVertices : NULL;
+	flatMesh.normals = currentMesh->HasNormals() ? (const float*)currentMesh->mNormals : NULL;
+	flatMesh.textureCoords = NULL;
+	flatMesh.textureCoordStride = 2;
+	flatMesh.indices = NULL;
+	flatMesh.ownsArrays = true;
+	flatMesh.meshlets = NULL;
+	flatMesh.numMeshlets = 0;
+
+	if (currentMesh->HasFaces()) {
+		// Face indices are NOT stored in a continuous 1D array inside aiScene.
+		// Instead, there is an array of aiFace objects. Each aiFace object stores a number of (usually 3) face indices.
+		// We need to copy the face indices into a continuous 1D array.
+		for (unsigned int j = 0; j < currentMesh->mNumFaces; j++) {
+			flatMesh.numIndices += currentMesh->mFaces[j].mNumIndices;
+		}
 
-	// This variable temporarily stores the VBO index. 
-	GLuint buffer;
+		unsigned int *faceArray = loaderArena.allocateArray<unsigned int>(flatMesh.numIndices);
 
-	// Load the 3D file using Assimp.
-	// Assume that the 3D file is stored in the default model folder. 
-	// use ASSIMP to load the OBJ file
-	scene = load3DFile(
-		(string(defaultModelFolder) + string(getFileName(objectFileName))).c_str());
+		// copy the face indices from aiScene into a 1D array faceArray.
+		int faceArrayIndex = 0;
+		for (unsigned int j = 0; j < currentMesh->mNumFaces; j++) {
+			for (unsigned int k = 0; k < currentMesh->mFaces[j].mNumIndices; k++) {
+				faceArray[faceArrayIndex] = currentMesh->mFaces[j].mIndices[k];
+				faceArrayIndex++;
+			}
+		}
 
-	if (!scene) {
-		return false;
+		flatMesh.indices = faceArray;
 	}
 
-	//********************************************************************************
-	// Retrieve vertex arrays from the aiScene object and bind them with VBOs and VAOs.
+	// Each mesh may have multiple UV(texture) channels (multi-texture). Here we only use
+	// the first channel.
+	if (currentMesh->HasTextureCoords(0) && useInterleavedVertices) {
+		// The interleaved vertices are built in one pass over the mesh, so the texture coordinates
+		// are read directly from Assimp's array of aiVector3D (3 floats per texture coordinate). 
+		flatMesh.textureCoords = (const float *)currentMesh->mTextureCoords[0];
+		flatMesh.textureCoordStride = 3;
+	}
+	else if (currentMesh->HasTextureCoords(0)) {
+		// mTextureCoords is different from mVertices or mNormals. It is a 2D array, not a 1D array.
+		// So we need to copy it to a 1D texture coordinate array.
+		// The first dimension of this array is the texture channel for this mesh.
+		// The second dimension is the vertex index number.
+		// The number of texture coordinates is always the same as the number of vertices.
+		float *textureCoordArray = loaderArena.allocateArray<float>(2 * currentMesh->mNumVertices);
+		unsigned int k = 0;
+		for (unsigned int j = 0; j < currentMesh->mNumVertices; j++) {
+			textureCoordArray[k] = currentMesh->mTextureCoords[0][j].x;
+			k++;
+			textureCoordArray[k] = currentMesh->mTextureCoords[0][j].y;
+			k++;
+		}
 
-	// Create an array to store the VAO indices for each mesh. 
-	vaoArray = (unsigned int*)malloc(sizeof(unsigned int) * scene->mNumMeshes);
+		flatMesh.textureCoords = textureCoordArray;
+	}
 
-	// Go through each mesh stored in the aiScene object, bind it with a VAO, 
-	// and save the VAO index in the vaoArray. 
-	for (unsigned int i = 0; i < scene->mNumMeshes; i++) {
-		const aiMesh* currentMesh = scene->mMeshes[i];
-
-		// Create an empty Vertex Array Object (VAO). VAO is only available from OpenGL 3.0 or higher. 
-		// Note that the vaoArray[] index is in sync with the mMeshes[] array index. 
-		// That is, for mesh #0, the corresponding VAO index is stored in vaoArray[0], and so on. 
-		glGenVertexArrays(1, &vaoArray[i]);
-		glBindVertexArray(vaoArray[i]);
-
-		if (currentMesh->HasPositions()) {
-			// Create an empty Vertex Buffer Object (VBO)
-			glGenBuffers(1, &buffer);
-			glBindBuffer(GL_ARRAY_BUFFER, buffer);
-
-			// Bind (transfer) the vertex position array (stored in aiMesh's member variable mVertices) 
-			// to the VBO.
-			// Note that the vertex positions are stored in a continuous 1D array (i.e. mVertices) in the aiScene object. 
-			glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 3 * currentMesh->mNumVertices,
-				currentMesh->mVertices, GL_STATIC_DRAW);
-
-			// Associate this VBO with an the vPos variable in the vertex shader. 
-			// The vertex data and the vertex shader must be connected. 
-			glEnableVertexAttribArray(vertexAttributeLocations.vPos);
-			glVertexAttribPointer(vertexAttributeLocations.vPos, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-		}
-
-		if (currentMesh->HasFaces()) {
-			// Create an array to store the face indices (elements) of this mesh. 
-			// This is necessary becaue face indices are NOT stored in a continuous 1D array inside aiScene. 
-			// Instead, there is an array of aiFace objects. Each aiFace object stores a number of (usually 3) face indices.
-			// We need to copy the face indices into a continuous 1D array. 
-			faceArray = (unsigned int*)malloc(sizeof(unsigned int) * currentMesh->mNumFaces * currentMesh->mFaces[0].mNumIndices);
-
-			// copy the face indices from aiScene into a 1D array faceArray.  
-			int faceArrayIndex = 0;
-			for (unsigned int j = 0; j < currentMesh->mNumFaces; j++) {
-				for (unsigned int k = 0; k < currentMesh->mFaces[j].mNumIndices; k++) {
-					faceArray[faceArrayIndex] = currentMesh->mFaces[j].mIndices[k];
-					faceArrayIndex++;
-				}
-			}
+	// Until buildMeshLods() is called, the mesh has only level 0.
+	MeshLodChain& lods = flatMesh.lods;
+	lods.numLevels = 1;
+	lods.firstIndex[0] = 0;
+	lods.indexCount[0] = flatMesh.numIndices;
+	lods.error[0] = 0.0f;
+	lods.boundingCenter[0] = lods.boundingCenter[1] = lods.boundingCenter[2] = 0.0f;
+	lods.boundingRadius = 0.0f;
+
+	if (flatMesh.positions) {
+		computeBoundingSphere(flatMesh.positions, 3, flatMesh.numVertices, lods.boundingCenter, &lods.boundingRadius);
+	}
+}
 
-			// Create an empty VBO
-			glGenBuffers(1, &buffer);
-
-			// This VBO is an GL_ELEMENT_ARRAY_BUFFER, not a GL_ARRAY_BUFFER. 
-			// GL_ELEMENT_ARRAY_BUFFER stores the face indices (elements), while 
-			// GL_ARRAY_BUFFER stores vertex positions. 
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
-			glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-				sizeof(unsigned int) * currentMesh->mNumFaces * currentMesh->mFaces[0].mNumIndices,
-				faceArray, GL_STATIC_DRAW);
-		}
-
-		if (currentMesh->HasNormals()) {
-			// Create an empty Vertex Buffer Object (VBO)
-			glGenBuffers(1, &buffer);
-			glBindBuffer(GL_ARRAY_BUFFER, buffer);
-
-			// Bind (transfer) the vertex normal array (stored in aiMesh's member variable mNormals) 
-			// to the VBO.
-			// Note that the vertex normals are stored in a 1D array (i.e. mVertices) 
-			// in the aiScene object. 
-			glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 3 * currentMesh->mNumVertices,
-				currentMesh->mNormals, GL_STATIC_DRAW);
-
-			// Associate this VBO with an the vPos variable in the vertex shader. 
-			// The vertex data and the vertex shader must be connected. 
-			glEnableVertexAttribArray(vertexAttributeLocations.vNormal);
-			glVertexAttribPointer(vertexAttributeLocations.vNormal, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-		}
-
-		//**************************************
-		// Set up texture mapping data
-
-		// Each mesh may have multiple UV(texture) channels (multi-texture). Here we only use 
-		// the first channel. Call currentMesh->GetNumUVChannels() to get the number of UV channels
-		// for this mesh. 
-		if (currentMesh->HasTextureCoords(0)) {
-			// Create an empty Vertex Buffer Object (VBO)
-			glGenBuffers(1, &buffer);
-			glBindBuffer(GL_ARRAY_BUFFER, buffer);
-
-			// mTextureCoords is different from mVertices or mNormals. It is a 2D array, not a 1D array. 
-			// So we need to copy it to a 1D texture coordinate array.
-			// The first dimension of this array is the texture channel for this mesh.
-			// The second dimension is the vertex index number. 
-			// The number of texture coordinates is always the same as the number of vertices.
-			textureCoordArray = (float *)malloc(sizeof(float) * 2 * currentMesh->mNumVertices);
-			unsigned int k = 0;
-			for (unsigned int j = 0; j < currentMesh->mNumVertices; j++) {
-				textureCoordArray[k] = currentMesh->mTextureCoords[0][j].x;
-				k++;
-				textureCoordArray[k] = currentMesh->mTextureCoords[0][j].y;
-				k++;
-			}
+//-------------------------------------------------------------
+// Build the LOD levels of a flattened triangle mesh. The indices of all the levels replace the indices of the mesh. 
+void buildMeshLods(FlatMesh& flatMesh) {
+	if (!flatMesh.positions || !flatMesh.indices || flatMesh.numIndices / 3 < minLodTriangles) {
+		return;
+	}
 
-			// Bind (transfer) the texture coordinate array to the VBO.
-			glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 2 * currentMesh->mNumVertices,
-				textureCoordArray, GL_STATIC_DRAW);
+	vector<unsigned int> lodIndices;
+	buildLodChain(flatMesh.indices, flatMesh.numIndices, flatMesh.positions, 3, flatMesh.numVertices, flatMesh.lods, lodIndices);
 
-			// Associate this VBO with the vTextureCoord variable in the vertex shader. 
-			// The vertex data and the vertex shader must be connected. 
-			glVertexAttribPointer(vertexAttributeLocations.vTextureCoord, 2, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-			glEnableVertexAttribArray(vertexAttributeLocations.vTextureCoord);
-		}
+	// The level 0 indices stay in loaderArena until it's reset. 
+	unsigned int *indexArray = loaderArena.allocateArray<unsigned int>(lodIndices.size());
+	memcpy(indexArray, lodIndices.data(), sizeof(unsigned int) * lodIndices.size());
 
-		//Close the VAOs and VBOs for later use. 
-		glBindVertexArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-	} // end for
+	flatMesh.indices = indexArray;
+	flatMesh.numIndices = (unsigned int)lodIndices.size();
+	flatMesh.ownsArrays = true;
+}
 
-	  //-----------------------------------------------
-	  // Create an array to store surface material data.
-	  // The surface material data in the Assimp data structure cannot be directly transferred to the shader, so 
-	  // we need to copy them to our own data structure first. 
-	surfaceMaterials = (SurfaceMaterialProperties *)malloc(sizeof(SurfaceMaterialProperties) * scene->mNumMaterials);
+//-------------------------------------------------------------
+// Split every LOD level of a flattened triangle mesh into meshlets. The triangles of each level are reordered 
+// so that every meshlet is a continuous range of indices. 
+void buildMeshMeshlets(FlatMesh& flatMesh) {
+	if (!flatMesh.positions || !flatMesh.indices || !flatMesh.ownsArrays || flatMesh.lods.indexCount[0] / 3 < minMeshletTriangles) {
+		return;
+	}
 
-	// Create an array to store texture object IDs, one texture object per material. Not all materials will have
-	// texture objects. 
-	// Note that we only have one texture object per material. This means we only load one texture per material.
-	textureObjectIDArray = (unsigned int*)malloc(sizeof(unsigned int) * scene->mNumMaterials);
+	// The coarsest level is stored first, so the meshlets end up sorted by their first index. 
+	vector<Meshlet> meshlets;
+	for (unsigned int k = flatMesh.lods.numLevels; k-- > 0; ) {
+		buildMeshlets((unsigned int*)flatMesh.indices, flatMesh.lods.firstIndex[k], flatMesh.lods.indexCount[k],
+			flatMesh.positions, 3, flatMesh.numVertices, meshlets);
+	}
 
-	// Copy all the Assimp material data to our own C data structure. 
-	for (unsigned int i = 0; i < scene->mNumMaterials; i++) 
+	Meshlet *meshletArray = loaderArena.allocateArray<Meshlet>(meshlets.size());
+	memcpy(meshletArray, meshlets.data(), sizeof(Meshlet) * meshlets.size());
+
+	flatMesh.meshlets = meshletArray;
+	flatMesh.numMeshlets = (unsigned int)meshlets.size();
+}
+
+//-------------------------------------------------------------
+// Copy the Assimp material data to our own C data structure.
+// The surface material data in the Assimp data structure cannot be directly transferred to the shader, so
+// we need to copy them to our own data structure first.
+// The texture file name of each material is saved in materialTextureFiles.
+void copyMaterials(const aiScene* sceneObj) {
+	numMaterials = sceneObj->mNumMaterials;
+
+	surfaceMaterials = (SurfaceMaterialProperties *)malloc(sizeof(SurfaceMaterialProperties) * numMaterials);
+	materialTextureFiles.assign(numMaterials, string());
+
+	for (unsigned int i = 0; i < numMaterials; i++)
 	{
-		aiMaterial* currentMaterial = scene->mMaterials[i];
+		aiMaterial* currentMaterial = sceneObj->mMaterials[i];
 
 		aiColor3D color(0.0f, 0.0f, 0.0f);
 		//aiColor3D color(0.98f, 0.68f, 0.25f);
@@ -760,325 +1351,2318 @@ bool load3DData() {
 		surfaceMaterials[i].shininess = shininess;
 
 		// To keep it simple, we only retrieve the diffuse type texture.
-		if (currentMaterial->GetTextureCount(aiTextureType_DIFFUSE) > 0) 
+		if (currentMaterial->GetTextureCount(aiTextureType_DIFFUSE) > 0)
 		{
 			int texIndex = 0; // To keep it simple, we only retrieve the first texture for each material.
 			aiString path;	// filename
 
-							// Get the diffuse texture file path for this material. 
+							// Get the diffuse texture file path for this material.
 			aiReturn texFound = currentMaterial->GetTexture(aiTextureType_DIFFUSE, texIndex, &path);
 
-			if (texFound == AI_SUCCESS) 
+			if (texFound == AI_SUCCESS)
 			{
-				string filename = getFileName(path.data);  // get only the filename	
+				string filename = getFileName(path.data);  // get only the filename
 				filename = "cedarstone.jpg";
-														   // Use SOIL to load texture image. SOIL will create a texture object for this texture
-														   // image and return the texture object ID. 
-														   // We assume that the image is stored in the default texture image folder, not necessarily the
-														   // texture file path stored in the 3D file. 
-				textureObjectIDArray[i] = SOIL_load_OGL_texture((string(defaultImageFolder) + filename).c_str(),
-					SOIL_LOAD_AUTO, SOIL_CREATE_NEW_ID, SOIL_FLAG_MIPMAPS);
-
-				// If the returned texture ID > 0, it means the imaged is loaded successfully. 
-				if (textureObjectIDArray[i] <= 0) 
-				{
-					cout << "Couldn't create a texture object for the texture image: " << filename.c_str() << endl;
-				} // end if
-
+				materialTextureFiles[i] = filename;
 			}
-			else 
+			else
 			{
-				textureObjectIDArray[i] = 0;
 				cout << "Couldn't find the texture file for mesh #" << i << endl;
 			} // end if (texture is found)
 		}
-		else 
+		else
 		{
-			textureObjectIDArray[i] = 0;
 			cout << "There is no texture for mesh #" << i << endl;
 		}
-	} // end for 
+	} // end for
+}
 
-	  // Copy data from Assimp's light parameters to our own C data struction, which makes it easier to transfer
-	  // it to the shader. 
-	if (scene->HasLights()) {
+//------------------------------------------------------------
+// Count the nodes of the node tree, including the given node.
+unsigned int countNodes(const aiNode* node) {
+	unsigned int numNodes = 1;
 
-		// Because the lighting parameters need to passed to the shader and GLSL doesn't support
-		// dynamic memory allocation, we have to use a static array to store lighting parameters. 
-		// We also need to set a maximum number of lights. 
-		// If the actual number of lights are smaller than the maximum number of lights, use the 
-		// actual number. Otherwise, use the maximum number of lights. 
-		numLights = std::min(scene->mNumLights, maxNumLightSources);
+	for (unsigned int j = 0; j < node->mNumChildren; j++) {
+		numNodes += countNodes(node->mChildren[j]);
+	}
 
-		for (unsigned int i = 0; i < numLights; i++) {
-			aiLight* currentLight = scene->mLights[i];
+	return numNodes;
+}
 
-			copyAiColor3DToFloat4(lightAmbient[i], currentLight->mColorAmbient);
-			copyAiColor3DToFloat4(lightDiffuse[i], currentLight->mColorDiffuse);
-			copyAiColor3DToFloat4(lightSpecular[i], currentLight->mColorSpecular);
-			copyAiVector3DToFloat4(lightPosition[i], currentLight->mPosition);
-			copyAiVector3DToFloat4(lightDirection[i], currentLight->mDirection);
-			lightConstantAttenuation[i] = currentLight->mAttenuationConstant;
-			lightLinearAttenuation[i] = currentLight->mAttenuationLinear;
-			lightQuadraticAttenuation[i] = currentLight->mAttenuationQuadratic;
-			spotlightInnerCone[i] = currentLight->mAngleInnerCone;
-			spotlightOuterCone[i] = currentLight->mAngleOuterCone;
+//------------------------------------------------------------
+// Convert a row-major aiMatrix4x4 to a column-major glm matrix. 
+mat4 aiMatrix4x4ToMat4(const aiMatrix4x4& matrix) {
+	return mat4(vec4(matrix.a1, matrix.b1, matrix.c1, matrix.d1),
+		vec4(matrix.a2, matrix.b2, matrix.c2, matrix.d2),
+		vec4(matrix.a3, matrix.b3, matrix.c3, matrix.d3),
+		vec4(matrix.a4, matrix.b4, matrix.c4, matrix.d4));
+}
 
-			switch (currentLight->mType) {
-			case aiLightSource_POINT:
-				lightType[i] = 1;
-				break;
-			case aiLightSource_DIRECTIONAL:
-				lightType[i] = 2;
-				break;
-			case aiLightSource_SPOT:
-				lightType[i] = 3;
-				break;
-			default:
-				lightType[i] = 0;
-				break;
-			}
-		}
-	}
+//------------------------------------------------------------
+// Flatten the node tree of the scene into flatNodeArray in depth-first order, and list the meshes of the nodes. 
+// The order of the nodes is the order of the recursive traversal, so the meshes are drawn in the same order. 
+void flattenNodeTree() {
+	flatNodeArray.clear();
+	meshInstanceArray.clear();
+	flatNodeArray.reserve(countNodes(scene->mRootNode));
+
+	// The stack holds the nodes to visit and the indices of their parents. The children are pushed in reverse
+	// order, so the first child is visited first. 
+	vector<pair<const aiNode*, int> > stack;
+	stack.push_back(make_pair(scene->mRootNode, -1));
+
+	while (!stack.empty()) {
+		const aiNode* node = stack.back().first;
+		int parentIndex = stack.back().second;
+		stack.pop_back();
+
+		FlatNode flatNode;
+		flatNode.node = node;
+		flatNode.parentIndex = parentIndex;
+		flatNode.dirty = true;
+		flatNode.localTransform = node->mTransformation;
+		flatNode.localMatrix = aiMatrix4x4ToMat4(node->mTransformation);
+		flatNode.sceneVersion = 0;
+		flatNode.parentSceneVersion = 0;
+		flatNode.modelMatrix = mat4(1.0f);
+		flatNode.normalMatrix = mat3(1.0f);
+		flatNode.worldVersion = 0;
+		flatNode.parentWorldVersion = 0;
+		flatNode.mvpWorldVersion = 0;
+		flatNode.mvpCameraVersion = 0;
+
+		int nodeIndex = (int)flatNodeArray.size();
+		flatNodeArray.push_back(flatNode);
 
-	return true;
-}
+		for (unsigned int i = 0; i < node->mNumMeshes; i++) {
+			MeshInstance instance;
+			instance.nodeIndex = (unsigned int)nodeIndex;
+			instance.meshIndex = node->mMeshes[i];
+			instance.boundsWorldVersion = 0;
+			instance.boundsSceneVersion = 0;
+			instance.lodLevel = 0;
+			meshInstanceArray.push_back(instance);
+		}
 
-//-------------------------------
-//Prepare the shaders and 3D data
-bool init()
-{
-	// Load shaders
-	if (prepareShaders() == false) {
-		return false;
+		for (unsigned int j = node->mNumChildren; j > 0; j--) {
+			stack.push_back(make_pair((const aiNode*)node->mChildren[j - 1], nodeIndex));
+		}
 	}
+}
 
-	getShaderVariableLocations();
+//------------------------------------------------------------
+// Find the nodes of the camera and the lights by name. If several nodes have the same name, the last one in 
+// flatNodeArray is used, and if several cameras have a node, the camera of the last node is used. 
+// This must be called after flattenNodeTree() and loadMaterialsAndLights(). 
+void bindCameraAndLights() {
+	unordered_map<string, int> nodeIndices;
 
-	if (load3DData() == false) {
-		return false;
+	for (size_t n = 0; n < flatNodeArray.size(); n++) {
+		nodeIndices[flatNodeArray[n].node->mName.C_Str()] = (int)n;
 	}
 
-	//****************************
-	// Set up other OpenGL states. 
+	boundCameraIndex = -1;
+	cameraNodeIndex = -1;
 
-	// Turn on visibility test. 
-	glEnable(GL_DEPTH_TEST);
+	for (unsigned int i = 0; i < scene->mNumCameras; i++) {
+		auto found = nodeIndices.find(scene->mCameras[i]->mName.C_Str());
 
-	// Draw the object in wire frame mode. 
-	// You can comment out this line to draw the object in 
-	// shaded mode. But without lighting, the object will look very dark. 
-	// displayed in wired frame mode 
-	//glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-	//const GLfloat Yellow[4] = { 1.0, 1.0, 0.0, 1.0 }; // Yellow
-	const GLfloat Yellow[4] = { 0.95, 0.68, 0.25, 1.0 }; // Yellow
-	glColor4fv(Yellow);
-	//glColor3f(1.0f, 1.0f, 0.0f);
-	// This is the background color. 
-	//glClearColor(57.0, 57.0, 57.0, 57.0);
-	//glClearColor(254.0, 0.0, 0.0, 0.0);
-	glClearColor(255.0, 255.0, 255.0, 255.0);
-	// Uncomment this line for debugging purposes.
-	// Check error
-	checkOpenGLError("init()");
+		if (found != nodeIndices.end() && found->second >= cameraNodeIndex) {
+			boundCameraIndex = (int)i;
+			cameraNodeIndex = found->second;
+		}
+	}
 
-	return true;
-}
+	lightNodeIndices.assign(numLights, -1);
+	lightNodeVersions.assign(numLights, 0);
+	cameraDirty = true;
+	lightsDirty = true;
 
-//------------------------------------------------
-// Traverse the scene graph to find a camera, update its location and direction, 
-// and then create the view and projection matrices.
-void nodeTreeTraversalCamera(const aiNode* node, aiMatrix4x4 matrix) {
+	// numLights keeps its default when the scene has no lights (mLights is then NULL, or empty when loaded from the 
+	// mesh cache), so only the lights the scene really has are bound. The others keep the node index -1. 
+	unsigned int numSceneLights = std::min(numLights, scene->mNumLights);
+	for (unsigned int i = 0; i < numSceneLights; i++) {
+		auto found = nodeIndices.find(scene->mLights[i]->mName.C_Str());
 
-	if (!node) {
-		cout << "nodeTreeTraversalCamera(): Null node" << endl;
-		return;
+		if (found != nodeIndices.end()) {
+			lightNodeIndices[i] = found->second;
+		}
 	}
+}
 
-	// Camera and lights reference a specific node by name, if any. 
-	string name = node->mName.C_Str();
-
-	// Calculate this (camera) node's transformation matrix. 
-	aiMatrix4x4 currentTransformMatrix = matrix * node->mTransformation;
+//--------------------------------------------------------------------
+// Write a node and all its child nodes to the cache in depth-first order.
+// Each node record stores the index of its parent node, so the tree can be rebuilt.
+void writeCachedNode(MeshCacheWriter& writer, const aiNode* node, int parentIndex, int& nodeIndex) {
+	int currentIndex = nodeIndex;
+	nodeIndex++;
 
-	// Check every camera on the camera list
-	for (unsigned int i = 0; i < scene->mNumCameras; i++) {
-		aiCamera* currentCamera = scene->mCameras[i];
-
-		string currentCameraName = currentCamera->mName.C_Str();
-
-		// If the current camera is the same as the camera node ...
-		if (currentCameraName.compare(name) == 0) {
-
-			// It's not clear whether we also need to multiply the camera's local matrix. 
-			// Maybe it's necessary for some 3D file format. 
-			aiMatrix4x4 cameraMatrix;
-			currentCamera->GetCameraMatrix(cameraMatrix);
-			//currentTransformMatrix = currentTransformMatrix *cameraMatrix;
-
-			// Get the camera position, look-at, and up vector. 
-			// Don't modify aiCamera's member variables mPosition, mLookAt, mUp directly. 
-			aiVector3D cameraPosition = currentCamera->mPosition;
-			aiVector3D cameraLookAtPosition = currentCamera->mLookAt;
-			aiVector3D cameraUpVector = currentCamera->mUp;
-
-			// Transform the camera position, lookAt, and up vector
-			cameraPosition = currentTransformMatrix * cameraPosition;
-			cameraLookAtPosition = currentTransformMatrix * cameraLookAtPosition;
-			cameraUpVector = currentTransformMatrix * cameraUpVector;
-			cameraUpVector.Normalize(); // Remember to normalize the UP vector.
-
-										// Pass the eye position to the shader. We'll need it for calculating
-										// the specular color. 
-			float eyePosition[3] = { cameraPosition.x, cameraPosition.y, cameraPosition.z };
-			glUniform3fv(lightSourceLocations.eyePosition, 1, eyePosition);
-
-			// Build the projection and view matrices
-			// It's better to use the window's aspect than using the aspect ratio from the 3D file.
-			projMatrix = perspective(currentCamera->mHorizontalFOV,
-				(float)windowWidth / (float)windowHeight,
-				currentCamera->mClipPlaneNear,
-				currentCamera->mClipPlaneFar);
-
-			// Create a view matrix
-			// You specify where the camera location and orientation and GLM will create a view matrix. 
-			viewMatrix = lookAt(vec3(cameraPosition.x, cameraPosition.y, cameraPosition.z),
-				vec3(cameraLookAtPosition.x, cameraLookAtPosition.y, cameraLookAtPosition.z),
-				vec3(cameraUpVector.x, cameraUpVector.y, cameraUpVector.z));
-		} // end if camera name is the same
-	} // end for
+	writer.writeString(node->mName.C_Str());
+	writer.write(node->mTransformation);
+	writer.write((int32_t)parentIndex);
+	writer.write((uint32_t)node->mNumMeshes);
+	writer.writeArray(node->mMeshes, node->mNumMeshes);
 
-	  // Recursively visit and find a camera in child nodes. This is a depth-first traversal. 
 	for (unsigned int j = 0; j < node->mNumChildren; j++) {
-		nodeTreeTraversalCamera(node->mChildren[j], currentTransformMatrix);
+		writeCachedNode(writer, node->mChildren[j], currentIndex, nodeIndex);
 	}
 }
 
-//----------------------------------------------
-// Traverse the scene graph to update the locations and directions of light sources. 
-void nodeTreeTraversalLight(const aiNode* node, aiMatrix4x4 matrix) {
-
-	if (!node) {
-		cout << "nodeTreeTraversal(): Null node" << endl;
-		return;
-	}
-
-	string nodeName = node->mName.C_Str();
+//----------------------------------------------------------------------------
+// Save the flattened 3D data to the mesh cache file.
+// This is called after the 3D file is imported by Assimp and flattened by flattenMesh()
+// and copyMaterials().
+bool saveMeshCache(const string& cacheFilename, uint64_t sourceHash, uint64_t sourceSize) {
+	MeshCacheWriter writer;
+
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = meshCacheMagic;
+	header.version = meshCacheVersion;
+	header.postProcessFlags = importPostProcessFlags;
+	header.sourceSize = sourceSize;
+	header.sourceHash = sourceHash;
+	header.numMeshes = scene->mNumMeshes;
+	header.numMaterials = numMaterials;
+	header.numLights = scene->mNumLights;
+	header.numCameras = scene->mNumCameras;
+	header.numNodes = scene->mRootNode ? countNodes(scene->mRootNode) : 0;
+	writer.write(header);
+
+	// Meshes
+	for (unsigned int i = 0; i < scene->mNumMeshes; i++) {
+		const FlatMesh& mesh = flatMeshArray[i];
 
-	// Calculate this (light) node's transformation matrix. 
-	aiMatrix4x4 currentTransformMatrix = matrix * node->mTransformation;
+		uint32_t flags = (mesh.positions ? 1 : 0) | (mesh.normals ? 2 : 0) | (mesh.textureCoords ? 4 : 0);
+		writer.write((uint32_t)mesh.numVertices);
+		writer.write((uint32_t)mesh.numIndices);
+		writer.write((uint32_t)mesh.materialIndex);
+		writer.write(flags);
+		writer.write(mesh.lods);
 
-	// Check every light in the light array to see if there is a match. 
-	for (unsigned int i = 0; i < numLights; i++) {
-		aiLight* currentLight = scene->mLights[i];
+		if (mesh.positions) {
+			writer.writeArray(mesh.positions, 3 * mesh.numVertices);
+		}
+		if (mesh.normals) {
+			writer.writeArray(mesh.normals, 3 * mesh.numVertices);
+		}
+		if (mesh.textureCoords && mesh.textureCoordStride == 2) {
+			writer.writeArray(mesh.textureCoords, 2 * mesh.numVertices);
+		}
+		else if (mesh.textureCoords) {
+			// The cache always stores 2 floats per texture coordinate.
+			vector<float> textureCoords(2 * mesh.numVertices);
+			for (unsigned int j = 0; j < mesh.numVertices; j++) {
+				textureCoords[2 * j] = mesh.textureCoords[mesh.textureCoordStride * j];
+				textureCoords[2 * j + 1] = mesh.textureCoords[mesh.textureCoordStride * j + 1];
+			}
+			writer.writeArray(textureCoords.data(), textureCoords.size());
+		}
+		writer.writeArray(mesh.indices, mesh.numIndices);
+		writer.write((uint32_t)mesh.numMeshlets);
+		writer.writeArray(mesh.meshlets, mesh.numMeshlets);
+	}
 
-		string currentLightName = currentLight->mName.C_Str();
+	// Materials
+	for (unsigned int i = 0; i < numMaterials; i++) {
+		writer.write(surfaceMaterials[i]);
+		writer.writeString(materialTextureFiles[i]);
+	}
 
-		// If the current light is the same as the light node ...
-		if (currentLightName.compare(nodeName) == 0) {
-			aiVector3D transformedLightPosition =
-				currentTransformMatrix * currentLight->mPosition;
-			aiVector3D transformedLightDirection =
-				currentTransformMatrix * currentLight->mDirection;
+	// Lights
+	for (unsigned int i = 0; i < scene->mNumLights; i++) {
+		const aiLight* currentLight = scene->mLights[i];
+
+		writer.writeString(currentLight->mName.C_Str());
+		writer.write((int32_t)currentLight->mType);
+		writer.write(currentLight->mPosition);
+		writer.write(currentLight->mDirection);
+		writer.write(currentLight->mAttenuationConstant);
+		writer.write(currentLight->mAttenuationLinear);
+		writer.write(currentLight->mAttenuationQuadratic);
+		writer.write(currentLight->mColorDiffuse);
+		writer.write(currentLight->mColorSpecular);
+		writer.write(currentLight->mColorAmbient);
+		writer.write(currentLight->mAngleInnerCone);
+		writer.write(currentLight->mAngleOuterCone);
+	}
 
-			// Update the light position and direction in the lightSources Array. 
-			copyAiVector3DToFloat4(lightPosition[i], transformedLightPosition);
-			copyAiVector3DToFloat4(lightDirection[i], transformedLightDirection);
-		} // end if
-	} // end for
+	// Cameras
+	for (unsigned int i = 0; i < scene->mNumCameras; i++) {
+		const aiCamera* currentCamera = scene->mCameras[i];
+
+		writer.writeString(currentCamera->mName.C_Str());
+		writer.write(currentCamera->mPosition);
+		writer.write(currentCamera->mUp);
+		writer.write(currentCamera->mLookAt);
+		writer.write(currentCamera->mHorizontalFOV);
+		writer.write(currentCamera->mClipPlaneNear);
+		writer.write(currentCamera->mClipPlaneFar);
+		writer.write(currentCamera->mAspect);
+	}
 
-	  // Recursively visit and find a light in child nodes. This is a depth-first traversal. 
-	for (unsigned int j = 0; j < node->mNumChildren; j++) {
-		nodeTreeTraversalLight(node->mChildren[j], currentTransformMatrix);
+	// Node tree
+	if (scene->mRootNode) {
+		int nodeIndex = 0;
+		writeCachedNode(writer, scene->mRootNode, -1, nodeIndex);
 	}
-}
 
+	LoadPhase phase(loadProfiler, "mesh.cache.save", cacheFilename);
+	phase.addBytes(writer.getSize());
 
-//--------------------------------------------------------------------------------------------
-// Traverse the node tree in the aiScene object and draw the meshes associated with each node. 
-// This function is called recursively to perform a depth-first tree traversal.
-// The second argument is the parent node's accumulated transformation matrix. 
-void nodeTreeTraversalMesh(const aiNode* node, aiMatrix4x4 matrix) {
-	if (!node) {
-		cout << "nodeTreeTraversal(): Null node" << endl;
-		return;
+	if (!writer.saveToFile(cacheFilename.c_str())) {
+		cout << "Unable to write the mesh cache file " << cacheFilename << endl;
+		return false;
 	}
 
-	// Multiply the parent's node's transformation matrix with this node's transformation matrix. 
-	aiMatrix4x4 currentTransformMatrix = matrix * node->mTransformation;
+	cout << "Mesh cache " << cacheFilename << " saved (" << writer.getSize() << " bytes)." << endl;
 
-	if (node->mNumMeshes > 0) {
-		// If this node contains meshes, we'll caculate the model-view-projection matrix for it. 
+	return true;
+}
 
-		// Conver the transformation matrix from aiMatrix4x4 to glm:mat4 format.
-		// aiMatrix4x4 is row major. 
-		mat4 modelMatrix = mat4(1.0);
-		modelMatrix = row(modelMatrix, 0, vec4(currentTransformMatrix.a1,
-			currentTransformMatrix.a2, currentTransformMatrix.a3, currentTransformMatrix.a4));
-		modelMatrix = row(modelMatrix, 1, vec4(currentTransformMatrix.b1,
-			currentTransformMatrix.b2, currentTransformMatrix.b3, currentTransformMatrix.b4));
-		modelMatrix = row(modelMatrix, 2, vec4(currentTransformMatrix.c1,
-			currentTransformMatrix.c2, currentTransformMatrix.c3, currentTransformMatrix.c4));
-		modelMatrix = row(modelMatrix, 3, vec4(currentTransformMatrix.d1,
-			currentTransformMatrix.d2, currentTransformMatrix.d3, currentTransformMatrix.d4));
+//------------------------------------------------------------------------------
+// Load the 3D data from the mesh cache file, if the cache file matches the 3D file.
+// The vertex data is not copied. flatMeshArray points into the memory-mapped cache file.
+// The nodes, cameras, lights, and the material index of each mesh are used to rebuild
+// an aiScene object, so the scene graph traversal works the same as with an imported 3D file.
+bool loadMeshCache(const string& cacheFilename, uint64_t sourceHash, uint64_t sourceSize) {
+	LoadPhase phase(loadProfiler, "mesh.cache.load", cacheFilename);
 
-		//**********************************************************************************
-		// Combine the model, view, and project matrix into one model-view-projection matrix.
+	if (!meshCacheFile.open(cacheFilename.c_str())) {
+		return false;
+	}
+	phase.addBytes(meshCacheFile.getSize());
+
+	MeshCacheReader reader(meshCacheFile.getData(), meshCacheFile.getSize());
+
+	// Check if the cache file is created from the same 3D file with the same post-processing flags.
+	MeshCacheHeader header;
+	if (!reader.read(header) ||
+		header.magic != meshCacheMagic ||
+		header.version != meshCacheVersion ||
+		header.postProcessFlags != importPostProcessFlags ||
+		header.sourceSize != sourceSize ||
+		header.sourceHash != sourceHash) {
+		cout << "The mesh cache " << cacheFilename << " is out of date." << endl;
+		meshCacheFile.close();
+		return false;
+	}
 
-		// Model matrix is then multiplied with view matrix and projection matrix to create a combined
-		// model_view_projection matrix. 
-		// The view and projection matrices are created in the previous traversal of the scene that processes 
-		// the camera data.
+	aiScene* sceneObj = new aiScene();
+
+	// Meshes
+	bool meshesCorrupted = false;
+	flatMeshArray = loaderArena.allocateArray<FlatMesh>(header.numMeshes);
+	sceneObj->mMeshes = new aiMesh*[header.numMeshes];
+	sceneObj->mNumMeshes = header.numMeshes;
+
+	for (unsigned int i = 0; i < header.numMeshes; i++) {
+		FlatMesh& mesh = flatMeshArray[i];
+		uint32_t numVertices = 0, numIndices = 0, materialIndex = 0, flags = 0, numMeshlets = 0;
+
+		reader.read(numVertices);
+		reader.read(numIndices);
+		reader.read(materialIndex);
+		reader.read(flags);
+		reader.read(mesh.lods);
+
+		mesh.numVertices = numVertices;
+		mesh.numIndices = numIndices;
+		mesh.materialIndex = materialIndex;
+		mesh.positions = (flags & 1) ? reader.readArray<float>(3 * numVertices) : NULL;
+		mesh.normals = (flags & 2) ? reader.readArray<float>(3 * numVertices) : NULL;
+		mesh.textureCoords = (flags & 4) ? reader.readArray<float>(2 * numVertices) : NULL;
+		mesh.textureCoordStride = 2;
+		mesh.indices = reader.readArray<unsigned int>(numIndices);
+		reader.read(numMeshlets);
+		mesh.meshlets = reader.readArray<Meshlet>(numMeshlets);
+		mesh.numMeshlets = mesh.meshlets ? numMeshlets : 0;
+		mesh.ownsArrays = false;
+
+		// Every LOD level must be inside the index array.
+		if (mesh.lods.numLevels < 1 || mesh.lods.numLevels > maxLodLevels) {
+			meshesCorrupted = true;
+			mesh.lods.numLevels = 1;
+		}
+		for (unsigned int k = 0; k < mesh.lods.numLevels; k++) {
+			if (mesh.lods.firstIndex[k] > numIndices || mesh.lods.indexCount[k] > numIndices - mesh.lods.firstIndex[k]) {
+				meshesCorrupted = true;
+			}
+		}
 
-		// The sequence of multiplication is important here. Model matrix, view matrix, and projection matrix 
-		// must be multiplied from right to left, because the vertex position is on the right hand side. 
-		mat4 mvpMatrix = projMatrix * viewMatrix * modelMatrix;
+		// Every meshlet must be inside the index array too.
+		for (unsigned int k = 0; k < mesh.numMeshlets; k++) {
+			if (mesh.meshlets[k].firstIndex > numIndices || mesh.meshlets[k].indexCount > numIndices - mesh.meshlets[k].firstIndex) {
+				meshesCorrupted = true;
+			}
+		}
+
+		// And every index must name a vertex of the mesh: the LOD, meshlet, and occluder code read the vertex arrays 
+		// through the indices without checking them. 
+		if (mesh.indices) {
+			for (unsigned int k = 0; k < numIndices; k++) {
+				if (mesh.indices[k] >= numVertices) {
+					meshesCorrupted = true;
+					break;
+				}
+			}
+		}
+
+		sceneObj->mMeshes[i] = new aiMesh();
+		sceneObj->mMeshes[i]->mMaterialIndex = (materialIndex < header.numMaterials) ? materialIndex : 0;
+	}
+
+	// Materials
+	numMaterials = header.numMaterials;
+	surfaceMaterials = (SurfaceMaterialProperties *)malloc(sizeof(SurfaceMaterialProperties) * numMaterials);
+	materialTextureFiles.assign(numMaterials, string());
+
+	for (unsigned int i = 0; i < numMaterials; i++) {
+		reader.read(surfaceMaterials[i]);
+		reader.readString(materialTextureFiles[i]);
+	}
+
+	// Lights
+	sceneObj->mLights = new aiLight*[header.numLights];
+	sceneObj->mNumLights = header.numLights;
+
+	for (unsigned int i = 0; i < header.numLights; i++) {
+		aiLight* currentLight = new aiLight();
+		sceneObj->mLights[i] = currentLight;
+
+		string name;
+		int32_t type = 0;
+		reader.readString(name);
+		reader.read(type);
+		currentLight->mName.Set(name);
+		currentLight->mType = (aiLightSourceType)type;
+		reader.read(currentLight->mPosition);
+		reader.read(currentLight->mDirection);
+		reader.read(currentLight->mAttenuationConstant);
+		reader.read(currentLight->mAttenuationLinear);
+		reader.read(currentLight->mAttenuationQuadratic);
+		reader.read(currentLight->mColorDiffuse);
+		reader.read(currentLight->mColorSpecular);
+		reader.read(currentLight->mColorAmbient);
+		reader.read(currentLight->mAngleInnerCone);
+		reader.read(currentLight->mAngleOuterCone);
+	}
+
+	// Cameras
+	sceneObj->mCameras = new aiCamera*[header.numCameras];
+	sceneObj->mNumCameras = header.numCameras;
+
+	for (unsigned int i = 0; i < header.numCameras; i++) {
+		aiCamera* currentCamera = new aiCamera();
+		sceneObj->mCameras[i] = currentCamera;
+
+		string name;
+		reader.readString(name);
+		currentCamera->mName.Set(name);
+		reader.read(currentCamera->mPosition);
+		reader.read(currentCamera->mUp);
+		reader.read(currentCamera->mLookAt);
+		reader.read(currentCamera->mHorizontalFOV);
+		reader.read(currentCamera->mClipPlaneNear);
+		reader.read(currentCamera->mClipPlaneFar);
+		reader.read(currentCamera->mAspect);
+	}
+
+	// Node tree. The nodes are stored in depth-first order, so a parent node always
+	// comes before its child nodes.
+	vector<aiNode*> nodes(header.numNodes, (aiNode*)NULL);
+	vector<int32_t> parentIndices(header.numNodes, -1);
+	vector<unsigned int> numChildren(header.numNodes, 0);
+	bool nodeTreeCorrupted = false;
+
+	for (unsigned int i = 0; i < header.numNodes && !reader.failed(); i++) {
+		aiNode* node = new aiNode();
+		nodes[i] = node;
+
+		string name;
+		uint32_t numMeshes = 0;
+		reader.readString(name);
+		reader.read(node->mTransformation);
+		reader.read(parentIndices[i]);
+		reader.read(numMeshes);
+		const unsigned int *meshes = reader.readArray<unsigned int>(numMeshes);
+
+		node->mName.Set(name);
+
+		if (meshes) {
+			node->mNumMeshes = numMeshes;
+			node->mMeshes = new unsigned int[numMeshes];
+			for (unsigned int j = 0; j < numMeshes; j++) {
+				node->mMeshes[j] = (meshes[j] < header.numMeshes) ? meshes[j] : 0;
+			}
+		}
+
+		if (i == 0 ? parentIndices[i] != -1 : (parentIndices[i] < 0 || parentIndices[i] >= (int32_t)i)) {
+			parentIndices[i] = -1;
+			nodeTreeCorrupted = true;
+			break;
+		}
+
+		if (i > 0) {
+			numChildren[parentIndices[i]]++;
+		}
+	}
+
+	// Connect the nodes.
+	for (unsigned int i = 0; i < header.numNodes; i++) {
+		if (nodes[i] && numChildren[i] > 0) {
+			nodes[i]->mChildren = new aiNode*[numChildren[i]];
+		}
+	}
+	for (unsigned int i = 1; i < header.numNodes; i++) {
+		if (nodes[i] && parentIndices[i] >= 0) {
+			aiNode* parent = nodes[parentIndices[i]];
+			nodes[i]->mParent = parent;
+			parent->mChildren[parent->mNumChildren] = nodes[i];
+			parent->mNumChildren++;
+		}
+	}
+	sceneObj->mRootNode = header.numNodes > 0 ? nodes[0] : NULL;
+
+	if (reader.failed() || meshesCorrupted || nodeTreeCorrupted || !sceneObj->mRootNode) {
+		cout << "The mesh cache " << cacheFilename << " is corrupted." << endl;
+
+		// Nodes that couldn't be connected to the tree must be deleted separately.
+		for (unsigned int i = 1; i < header.numNodes; i++) {
+			if (nodes[i] && !nodes[i]->mParent) {
+				delete nodes[i];
+			}
+		}
+		delete sceneObj;
+		loaderArena.reset();
+		flatMeshArray = NULL;
+		free(surfaceMaterials);
+		surfaceMaterials = NULL;
+		meshCacheFile.close();
+		return false;
+	}
+
+	cachedScene = sceneObj;
+	scene = sceneObj;
+
+	return true;
+}
+
+//---------------------------------------------------------------
+// The number of bytes per index for GL_UNSIGNED_SHORT or GL_UNSIGNED_INT.
+size_t getIndexSize(GLenum indexType) {
+	return (indexType == GL_UNSIGNED_SHORT) ? sizeof(unsigned short) : sizeof(unsigned int);
+}
+
+//---------------------------------------------------------------
+// Copy count indices of a mesh, starting at firstIndex, to indexArray, converting them to indexType.
+void fillIndices(const FlatMesh& mesh, GLenum indexType, unsigned int firstIndex, unsigned int count, void *indexArray) {
+	if (indexType == GL_UNSIGNED_SHORT) {
+		unsigned short *shortIndices = (unsigned short *)indexArray;
+		for (unsigned int j = 0; j < count; j++) {
+			shortIndices[j] = (unsigned short)mesh.indices[firstIndex + j];
+		}
+	}
+	else {
+		memcpy(indexArray, mesh.indices + firstIndex, sizeof(unsigned int) * count);
+	}
+}
+
+//---------------------------------------------------------------
+// Transfer the indices of a mesh to the VBO bound to GL_ELEMENT_ARRAY_BUFFER.
+void uploadIndices(const FlatMesh& mesh, GLenum indexType) {
+	if (indexType == GL_UNSIGNED_INT) {
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * mesh.numIndices,
+			mesh.indices, GL_STATIC_DRAW);
+		return;
+	}
+
+	void *indexArray = loaderArena.allocate(getIndexSize(indexType) * mesh.numIndices);
+	fillIndices(mesh, indexType, 0, mesh.numIndices, indexArray);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, getIndexSize(indexType) * mesh.numIndices, indexArray, GL_STATIC_DRAW);
+}
+
+//---------------------------------------------------------------
+// Set the per-instance attributes of the VAO that is bound, from instanceBuffer. 
+// Every column of the matrices is a separate attribute that advances once per instance. 
+void setInstanceAttributes() {
+	glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+
+	for (GLint k = 0; k < 4 && vertexAttributeLocations.iModelMatrix >= 0; k++) {
+		GLuint location = vertexAttributeLocations.iModelMatrix + k;
+		glEnableVertexAttribArray(location);
+		glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceTransform),
+			BUFFER_OFFSET((offsetof(InstanceTransform, modelMatrix) + sizeof(vec4) * k)));
+		glVertexAttribDivisor(location, 1);
+	}
+
+	for (GLint k = 0; k < 3 && vertexAttributeLocations.iNormalMatrix >= 0; k++) {
+		GLuint location = vertexAttributeLocations.iNormalMatrix + k;
+		glEnableVertexAttribArray(location);
+		glVertexAttribPointer(location, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceTransform),
+			BUFFER_OFFSET((offsetof(InstanceTransform, normalMatrix) + sizeof(vec3) * k)));
+		glVertexAttribDivisor(location, 1);
+	}
+}
+
+//---------------------------------------------------------------
+// Place the copies of the model and create instanceBuffer. radius is the radius of the model. 
+// The random layout uses a fixed seed, so the copies are in the same places in every run. 
+void buildInstanceTransforms(float radius) {
+	float spacing = (instanceSpacing > 0.0f) ? instanceSpacing : 2.5f * std::max(radius, 0.001f);
+	unsigned int columns = (unsigned int)ceil(sqrt((double)instanceCount));
+	float extent = spacing * columns;
+	unsigned int seed = 1;
+
+	// A small linear congruential generator, in [0, 1). 
+	auto random = [&seed]() {
+		seed = seed * 1664525u + 1013904223u;
+		return (float)(seed >> 8) / 16777216.0f;
+	};
+
+	instanceTransforms.resize(instanceCount);
+	for (unsigned int i = 0; i < instanceCount; i++) {
+		mat4 modelMatrix = mat4(1.0f);
+
+		if (instanceLayout == instanceLayoutRandom) {
+			vec3 position = vec3((random() - 0.5f) * extent, 0.0f, (random() - 0.5f) * extent);
+			modelMatrix = rotate(translate(mat4(1.0f), position), random() * 2.0f * pi<float>(), vec3(0.0f, 1.0f, 0.0f));
+		}
+		else {
+			// The grid is centered at the origin, in the xz plane. 
+			vec3 position = vec3(((float)(i % columns) - 0.5f * (columns - 1)) * spacing, 0.0f,
+				((float)(i / columns) - 0.5f * (columns - 1)) * spacing);
+			modelMatrix = translate(mat4(1.0f), position);
+		}
+
+		instanceTransforms[i].modelMatrix = modelMatrix;
+		instanceTransforms[i].normalMatrix = inverseTranspose(mat3(modelMatrix));
+	}
+
+	glGenBuffers(1, &instanceBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(InstanceTransform) * instanceTransforms.size(), instanceTransforms.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	if (instanceCount > 1) {
+		cout << instanceCount << " instances in a " << (instanceLayout == instanceLayoutRandom ? "random" : "grid")
+			<< " layout, " << spacing << " apart." << endl;
+	}
+}
+
+//---------------------------------------------------------------
+// Bind the flattened vertex data of a mesh with VBOs and a VAO.
+void uploadFlatMesh(unsigned int meshIndex, const FlatMesh& mesh) {
+	// This variable temporarily stores the VBO index.
+	GLuint buffer;
+
+	// Create an empty Vertex Array Object (VAO). VAO is only available from OpenGL 3.0 or higher.
+	// Note that the vaoArray[] index is in sync with the mMeshes[] array index.
+	// That is, for mesh #0, the corresponding VAO index is stored in vaoArray[0], and so on.
+	glGenVertexArrays(1, &vaoArray[meshIndex]);
+	glBindVertexArray(vaoArray[meshIndex]);
+
+	if (mesh.positions) {
+		// Create an empty Vertex Buffer Object (VBO)
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+		// Bind (transfer) the vertex position array to the VBO.
+		glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 3 * mesh.numVertices,
+			mesh.positions, GL_STATIC_DRAW);
+
+		// Associate this VBO with an the vPos variable in the vertex shader.
+		// The vertex data and the vertex shader must be connected.
+		glEnableVertexAttribArray(vertexAttributeLocations.vPos);
+		glVertexAttribPointer(vertexAttributeLocations.vPos, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+	}
+
+	if (mesh.indices) {
+		// Create an empty VBO
+		glGenBuffers(1, &buffer);
+
+		// This VBO is an GL_ELEMENT_ARRAY_BUFFER, not a GL_ARRAY_BUFFER.
+		// GL_ELEMENT_ARRAY_BUFFER stores the face indices (elements), while
+		// GL_ARRAY_BUFFER stores vertex positions.
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+		uploadIndices(mesh, indexTypeArray[meshIndex]);
+	}
+
+	if (mesh.normals) {
+		// Create an empty Vertex Buffer Object (VBO)
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+		// Bind (transfer) the vertex normal array to the VBO.
+		glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 3 * mesh.numVertices,
+			mesh.normals, GL_STATIC_DRAW);
+
+		// Associate this VBO with an the vNormal variable in the vertex shader.
+		// The vertex data and the vertex shader must be connected.
+		glEnableVertexAttribArray(vertexAttributeLocations.vNormal);
+		glVertexAttribPointer(vertexAttributeLocations.vNormal, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+	}
+
+	//**************************************
+	// Set up texture mapping data
+	if (mesh.textureCoords) {
+		// Create an empty Vertex Buffer Object (VBO)
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+		// Bind (transfer) the texture coordinate array to the VBO.
+		glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 2 * mesh.numVertices,
+			mesh.textureCoords, GL_STATIC_DRAW);
+
+		// Associate this VBO with the vTextureCoord variable in the vertex shader.
+		// The vertex data and the vertex shader must be connected.
+		glVertexAttribPointer(vertexAttributeLocations.vTextureCoord, 2, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+		glEnableVertexAttribArray(vertexAttributeLocations.vTextureCoord);
+	}
+
+	setInstanceAttributes();
+
+	//Close the VAOs and VBOs for later use.
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+//---------------------------------------------------------------
+// Convert count vertices of a mesh, starting at firstVertex, into interleaved vertices in a single pass.
+// Missing normals and texture coordinates are set to 0. 
+void fillInterleavedVertices(const FlatMesh& mesh, unsigned int firstVertex, unsigned int count, InterleavedVertex *vertexArray) {
+	for (unsigned int i = 0; i < count; i++) {
+		InterleavedVertex& vertex = vertexArray[i];
+		unsigned int j = firstVertex + i;
+
+		vertex.position[0] = mesh.positions[3 * j];
+		vertex.position[1] = mesh.positions[3 * j + 1];
+		vertex.position[2] = mesh.positions[3 * j + 2];
+
+		if (mesh.normals) {
+			vertex.normal[0] = mesh.normals[3 * j];
+			vertex.normal[1] = mesh.normals[3 * j + 1];
+			vertex.normal[2] = mesh.normals[3 * j + 2];
+		}
+		else {
+			vertex.normal[0] = vertex.normal[1] = vertex.normal[2] = 0.0f;
+		}
+
+		if (mesh.textureCoords) {
+			vertex.textureCoord[0] = mesh.textureCoords[mesh.textureCoordStride * j];
+			vertex.textureCoord[1] = mesh.textureCoords[mesh.textureCoordStride * j + 1];
+		}
+		else {
+			vertex.textureCoord[0] = vertex.textureCoord[1] = 0.0f;
+		}
+	}
+}
+
+//---------------------------------------------------------------
+// Compute the parameters the vertex shader needs to convert the quantized vertices of a mesh back. 
+// The float formats don't need decoding, so their offsets are 0 and their scales are 1. 
+void computeVertexDecode(const FlatMesh& mesh, VertexDecodeParameters& decode) {
+	for (unsigned int k = 0; k < 3; k++) {
+		decode.positionOffset[k] = 0.0f;
+		decode.positionScale[k] = 1.0f;
+	}
+	for (unsigned int k = 0; k < 2; k++) {
+		decode.textureCoordOffset[k] = 0.0f;
+		decode.textureCoordScale[k] = 1.0f;
+	}
+
+	if (!useQuantizedVertices || !mesh.positions) {
+		return;
+	}
+
+	computeQuantizationRange(mesh.positions, mesh.numVertices, 3, 3, decode.positionOffset, decode.positionScale);
+
+	if (mesh.textureCoords) {
+		computeQuantizationRange(mesh.textureCoords, mesh.numVertices, mesh.textureCoordStride, 2,
+			decode.textureCoordOffset, decode.textureCoordScale);
+	}
+}
+
+//---------------------------------------------------------------
+// Convert count vertices of a mesh, starting at firstVertex, into quantized vertices in a single pass. 
+void fillQuantizedVertices(const FlatMesh& mesh, const VertexDecodeParameters& decode, unsigned int firstVertex, unsigned int count,
+	QuantizedVertex *vertexArray) {
+	for (unsigned int i = 0; i < count; i++) {
+		QuantizedVertex& vertex = vertexArray[i];
+		unsigned int j = firstVertex + i;
+
+		for (unsigned int k = 0; k < 3; k++) {
+			vertex.position[k] = quantizeUnorm16(mesh.positions[3 * j + k], decode.positionOffset[k], decode.positionScale[k]);
+		}
+		vertex.position[3] = 0;
+
+		if (mesh.normals) {
+			encodeOctahedralNormal(&mesh.normals[3 * j], vertex.normal);
+		}
+		else {
+			vertex.normal[0] = vertex.normal[1] = 0;
+		}
+
+		for (unsigned int k = 0; k < 2; k++) {
+			vertex.textureCoord[k] = mesh.textureCoords ? quantizeUnorm16(mesh.textureCoords[mesh.textureCoordStride * j + k],
+				decode.textureCoordOffset[k], decode.textureCoordScale[k]) : 0;
+		}
+	}
+}
+
+//---------------------------------------------------------------
+// The number of bytes per vertex in the VBOs.
+size_t getVertexSize() {
+	return useQuantizedVertices ? sizeof(QuantizedVertex) : sizeof(InterleavedVertex);
+}
+
+//---------------------------------------------------------------
+// Fill vertexArray with count vertices of a mesh, starting at firstVertex, in the interleaved or quantized format.
+void fillVertices(unsigned int meshIndex, const FlatMesh& mesh, unsigned int firstVertex, unsigned int count, void *vertexArray) {
+	if (useQuantizedVertices) {
+		fillQuantizedVertices(mesh, vertexDecodeArray[meshIndex], firstVertex, count, (QuantizedVertex *)vertexArray);
+	}
+	else {
+		fillInterleavedVertices(mesh, firstVertex, count, (InterleavedVertex *)vertexArray);
+	}
+}
+
+//---------------------------------------------------------------
+// Associate the interleaved VBO bound to GL_ARRAY_BUFFER with the vertex shader variables.
+// Every attribute uses the size of a whole vertex as its stride and starts at its offset inside the vertex. 
+// The quantized attributes are normalized integers, so the shader reads them as floats in [0, 1] or [-1, 1]. 
+void setVertexAttributes(bool hasNormals, bool hasTextureCoords) {
+	glEnableVertexAttribArray(vertexAttributeLocations.vPos);
+	if (useQuantizedVertices) {
+		glVertexAttribPointer(vertexAttributeLocations.vPos, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(QuantizedVertex),
+			BUFFER_OFFSET(offsetof(QuantizedVertex, position)));
+	}
+	else {
+		glVertexAttribPointer(vertexAttributeLocations.vPos, 3, GL_FLOAT, GL_FALSE, sizeof(InterleavedVertex),
+			BUFFER_OFFSET(offsetof(InterleavedVertex, position)));
+	}
+
+	if (hasNormals) {
+		glEnableVertexAttribArray(vertexAttributeLocations.vNormal);
+		if (useQuantizedVertices) {
+			glVertexAttribPointer(vertexAttributeLocations.vNormal, 2, GL_SHORT, GL_TRUE, sizeof(QuantizedVertex),
+				BUFFER_OFFSET(offsetof(QuantizedVertex, normal)));
+		}
+		else {
+			glVertexAttribPointer(vertexAttributeLocations.vNormal, 3, GL_FLOAT, GL_FALSE, sizeof(InterleavedVertex),
+				BUFFER_OFFSET(offsetof(InterleavedVertex, normal)));
+		}
+	}
+
+	if (hasTextureCoords) {
+		glEnableVertexAttribArray(vertexAttributeLocations.vTextureCoord);
+		if (useQuantizedVertices) {
+			glVertexAttribPointer(vertexAttributeLocations.vTextureCoord, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(QuantizedVertex),
+				BUFFER_OFFSET(offsetof(QuantizedVertex, textureCoord)));
+		}
+		else {
+			glVertexAttribPointer(vertexAttributeLocations.vTextureCoord, 2, GL_FLOAT, GL_FALSE, sizeof(InterleavedVertex),
+				BUFFER_OFFSET(offsetof(InterleavedVertex, textureCoord)));
+		}
+	}
+}
+
+//---------------------------------------------------------------
+// The number of milliseconds since the program started.
+double getTimeSinceStart() {
+	return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - programStartTime).count();
+}
+
+//---------------------------------------------------------------------------------
+// Load the 3D data into flatMeshArray, surfaceMaterials, and scene, without any OpenGL calls.
+// If there is an up-to-date mesh cache file for the 3D file, the flattened data is loaded from
+// the cache and Assimp is not used. Otherwise the cache file is created after the 3D file is imported.
+// With useBackgroundLoading, this runs on the scene loader thread. 
+bool loadSceneData() {
+	// ****************
+	// Load the 3D file
+
+	// Assume that the 3D file is stored in the default model folder.
+	string modelFilename = string(defaultModelFolder) + string(getFileName(objectFileName));
+	string cacheFilename = modelFilename + meshCacheExtension;
+
+	chrono::high_resolution_clock::time_point loadStartTime = chrono::high_resolution_clock::now();
+
+	// The size and hash of the 3D file are used to check if the cache file is up to date.
+	uint64_t sourceHash = 0, sourceSize = 0;
+	bool canUseCache = false;
+	if (useMeshCache) {
+		LoadPhase phase(loadProfiler, "file.hash", modelFilename);
+		canUseCache = hashFile(modelFilename.c_str(), sourceHash, sourceSize);
+		phase.addBytes(sourceSize);
+	}
+
+	bool cacheHit = canUseCache && loadMeshCache(cacheFilename, sourceHash, sourceSize);
+
+	if (!cacheHit) {
+		// Load the 3D file using Assimp.
+		// use ASSIMP to load the OBJ file
+		const aiScene* importedScene = load3DFile(modelFilename.c_str());
+
+		if (!importedScene) {
+			return false;
+		}
+
+		// Flatten the vertex data of each mesh, and build the LOD levels and meshlets of the triangle meshes.
+		flatMeshArray = loaderArena.allocateArray<FlatMesh>(importedScene->mNumMeshes);
+		for (unsigned int i = 0; i < importedScene->mNumMeshes; i++) {
+			if (sceneLoaderCancelled) {
+				return false;
+			}
+
+			const aiMesh *mesh = importedScene->mMeshes[i];
+			string meshName = mesh->mName.length > 0 ? string(mesh->mName.C_Str()) : "mesh " + to_string(i);
+			uint64_t meshBytes = sizeof(float) * 8 * mesh->mNumVertices + sizeof(unsigned int) * 3 * mesh->mNumFaces;
+
+			{
+				LoadPhase phase(loadProfiler, "mesh.flatten", meshName);
+				phase.addBytes(meshBytes);
+				flattenMesh(mesh, flatMeshArray[i]);
+			}
+
+			if (mesh->mPrimitiveTypes == aiPrimitiveType_TRIANGLE) {
+				{
+					LoadPhase phase(loadProfiler, "mesh.lod", meshName);
+					phase.addBytes(sizeof(unsigned int) * flatMeshArray[i].numIndices);
+					buildMeshLods(flatMeshArray[i]);
+				}
+				{
+					LoadPhase phase(loadProfiler, "mesh.meshlets", meshName);
+					phase.addBytes(sizeof(unsigned int) * flatMeshArray[i].numIndices);
+					buildMeshMeshlets(flatMeshArray[i]);
+				}
+			}
+		}
+
+		copyMaterials(importedScene);
+
+		scene = importedScene;
+	}
+
+	double loadTime = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - loadStartTime).count();
+	if (cacheHit) {
+		cout << "3D data loaded from the mesh cache in " << loadTime << " ms." << endl;
+	}
+	else {
+		cout << "3D file imported and flattened in " << loadTime << " ms." << endl;
+
+		if (canUseCache && !sceneLoaderCancelled) {
+			saveMeshCache(cacheFilename, sourceHash, sourceSize);
+		}
+	}
+
+	return true;
+}
+
+//---------------------------------------------------------------
+// Copy LOD level 0 of a mesh with at most maxOccluderTriangles triangles, for occlusion culling. 
+// Only the vertices used by the level are copied, and the indices are renumbered to them. 
+void buildOccluderMesh(const FlatMesh& mesh, OccluderMesh& occluder) {
+	occluder.positions.clear();
+	occluder.indices.clear();
+
+	if (!mesh.positions || !mesh.indices) {
+		return;
+	}
+
+	unsigned int level = 0;
+	if (mesh.lods.numLevels == 0 || mesh.lods.indexCount[level] == 0 || mesh.lods.indexCount[level] / 3 > maxOccluderTriangles) {
+		return;
+	}
+
+	const unsigned int *indices = &mesh.indices[mesh.lods.firstIndex[level]];
+	unordered_map<unsigned int, unsigned int> vertexIndices;
+
+	occluder.indices.reserve(mesh.lods.indexCount[level]);
+	for (unsigned int i = 0; i < mesh.lods.indexCount[level]; i++) {
+		auto found = vertexIndices.insert(make_pair(indices[i], (unsigned int)vertexIndices.size())).first;
+
+		if (found->second == occluder.positions.size() / 3) {
+			occluder.positions.insert(occluder.positions.end(), &mesh.positions[3 * indices[i]], &mesh.positions[3 * indices[i] + 3]);
+		}
+
+		occluder.indices.push_back(found->second);
+	}
+}
+
+//---------------------------------------------------------------
+// Create the VAOs and the empty VBOs of all the meshes, and split the vertex data into upload chunks.
+// The chunks are transferred to the VBOs by uploadMeshChunks(). 
+void createMeshBuffers() {
+	unsigned int numMeshes = scene->mNumMeshes;
+
+	// Create an array to store the VAO indices for each mesh.
+	vaoArray = (unsigned int*)malloc(sizeof(unsigned int) * numMeshes);
+	indexCountArray = (unsigned int*)malloc(sizeof(unsigned int) * numMeshes);
+
+	vertexDecodeArray = (VertexDecodeParameters*)malloc(sizeof(VertexDecodeParameters) * numMeshes);
+	indexTypeArray = (GLenum*)malloc(sizeof(GLenum) * numMeshes);
+	baseVertexArray = (GLint*)malloc(sizeof(GLint) * numMeshes);
+	indexOffsetArray = (size_t*)malloc(sizeof(size_t) * numMeshes);
+	vertexBufferArray = (GLuint*)malloc(sizeof(GLuint) * numMeshes);
+	indexBufferArray = (GLuint*)malloc(sizeof(GLuint) * numMeshes);
+	meshLodArray = (MeshLodChain*)malloc(sizeof(MeshLodChain) * numMeshes);
+	firstMeshletArray = (unsigned int*)malloc(sizeof(unsigned int) * numMeshes);
+	meshletCountArray = (unsigned int*)malloc(sizeof(unsigned int) * numMeshes);
+	meshBoundsArray = (BoundingBox*)malloc(sizeof(BoundingBox) * numMeshes);
+	occluderMeshArray.assign(numMeshes, OccluderMesh());
+
+	// The meshlets are copied, because the flattened arrays are released after the upload. 
+	unsigned int numMeshlets = 0;
+	for (unsigned int i = 0; i < numMeshes; i++) {
+		numMeshlets += flatMeshArray[i].numMeshlets;
+	}
+	meshletArray = (Meshlet*)malloc(sizeof(Meshlet) * std::max(numMeshlets, 1u));
+
+	// The quantized format is an interleaved format. 
+	if (!useSharedMeshBuffers && !useInterleavedVertices) {
+		useQuantizedVertices = false;
+	}
+
+	// Compute the offsets of every mesh in the shared buffers, or in its own buffers. 
+	size_t numVertices = 0, vertexBufferSize = 0, indexBufferSize = 0;
+	for (unsigned int i = 0; i < numMeshes; i++) {
+		const FlatMesh& mesh = flatMeshArray[i];
+
+		computeVertexDecode(mesh, vertexDecodeArray[i]);
+		computeBoundingBox(mesh.positions, 3, mesh.positions ? mesh.numVertices : 0, meshBoundsArray[i]);
+		buildOccluderMesh(mesh, occluderMeshArray[i]);
+
+		meshLodArray[i] = mesh.lods;
+
+		firstMeshletArray[i] = (i > 0) ? firstMeshletArray[i - 1] + meshletCountArray[i - 1] : 0;
+		meshletCountArray[i] = mesh.numMeshlets;
+		if (mesh.numMeshlets > 0) {
+			memcpy(&meshletArray[firstMeshletArray[i]], mesh.meshlets, sizeof(Meshlet) * mesh.numMeshlets);
+		}
+
+		// The indices of a mesh with fewer than 65536 vertices fit in 16 bits.
+		indexTypeArray[i] = (mesh.numVertices < 65536) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+
+		// Nothing is drawn until the indices are transferred to the VBOs.
+		indexCountArray[i] = 0;
+		vaoArray[i] = 0;
+		vertexBufferArray[i] = 0;
+		indexBufferArray[i] = 0;
+
+		baseVertexArray[i] = useSharedMeshBuffers ? (GLint)numVertices : 0;
+		indexOffsetArray[i] = useSharedMeshBuffers ? indexBufferSize : 0;
+
+		if (mesh.positions) {
+			numVertices += mesh.numVertices;
+			vertexBufferSize += getVertexSize() * mesh.numVertices;
+		}
+		if (mesh.indices) {
+			// Keep every mesh's indices 4-byte aligned.
+			indexBufferSize += (getIndexSize(indexTypeArray[i]) * mesh.numIndices + 3) & ~(size_t)3;
+		}
+	}
+
+	cout << "Vertex data: " << vertexBufferSize << " bytes (" << (useQuantizedVertices ? "quantized" : "32-bit floats")
+		<< "), index data: " << indexBufferSize << " bytes, " << numMeshlets << " meshlets." << endl;
+
+	// The copies of the model are placed by the radius of the bounding spheres of the meshes, around the origin. 
+	float modelRadius = 0.0f;
+	for (unsigned int i = 0; i < numMeshes; i++) {
+		const MeshLodChain& lods = meshLodArray[i];
+		modelRadius = std::max(modelRadius, length(vec3(lods.boundingCenter[0], lods.boundingCenter[1], lods.boundingCenter[2])) + lods.boundingRadius);
+	}
+	buildInstanceTransforms(modelRadius);
+
+	if (useSharedMeshBuffers) {
+		// All the meshes are packed into one shared VBO and one shared index VBO, bound to a single VAO. 
+		// The indices of each mesh are not changed. They are relative to the first vertex of the mesh, which is
+		// stored in baseVertexArray[] and passed to glDrawElementsBaseVertex(). 
+		// The indices of each mesh keep their own type, so the byte offset of each mesh is stored in indexOffsetArray[]. 
+		glGenVertexArrays(1, &sharedVao);
+		glBindVertexArray(sharedVao);
+
+		glGenBuffers(1, &sharedVertexBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, sharedVertexBuffer);
+		glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, NULL, GL_STATIC_DRAW);
+
+		glGenBuffers(1, &sharedIndexBuffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sharedIndexBuffer);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, NULL, GL_STATIC_DRAW);
+
+		// All the attributes are enabled because the meshes share one vertex format. 
+		// Meshes without normals or texture coordinates get 0 for them. 
+		setVertexAttributes(true, true);
+		setInstanceAttributes();
+
+		for (unsigned int i = 0; i < numMeshes; i++) {
+			// Every mesh is drawn with the same VAO.
+			vaoArray[i] = sharedVao;
+			vertexBufferArray[i] = sharedVertexBuffer;
+			indexBufferArray[i] = sharedIndexBuffer;
+		}
+
+		cout << numMeshes << " meshes packed into shared buffers: " << numVertices << " vertices, "
+			<< indexBufferSize << " bytes of indices." << endl;
+	}
+	else if (useInterleavedVertices) {
+		// Every mesh gets one interleaved VBO, one index VBO, and a VAO.
+		for (unsigned int i = 0; i < numMeshes; i++) {
+			const FlatMesh& mesh = flatMeshArray[i];
+
+			glGenVertexArrays(1, &vaoArray[i]);
+			glBindVertexArray(vaoArray[i]);
+
+			if (mesh.positions) {
+				glGenBuffers(1, &vertexBufferArray[i]);
+				glBindBuffer(GL_ARRAY_BUFFER, vertexBufferArray[i]);
+				glBufferData(GL_ARRAY_BUFFER, getVertexSize() * mesh.numVertices, NULL, GL_STATIC_DRAW);
+
+				// Attributes that the mesh doesn't have are left disabled, the same as with the separate VBOs. 
+				setVertexAttributes(mesh.normals != NULL, mesh.textureCoords != NULL);
+			}
+
+			setInstanceAttributes();
+
+			if (mesh.indices) {
+				glGenBuffers(1, &indexBufferArray[i]);
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBufferArray[i]);
+				glBufferData(GL_ELEMENT_ARRAY_BUFFER, getIndexSize(indexTypeArray[i]) * mesh.numIndices, NULL, GL_STATIC_DRAW);
+			}
+		}
+	}
+
+	//Close the VAOs and VBOs for later use.
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	// Split every mesh into chunks: first its vertices, then its indices. Since the index chunks of a mesh
+	// are transferred in order after all of its vertices, a mesh can be drawn with the indices transferred so far. 
+	// Huge meshes are split into several vertex and index ranges. 
+	// The separate VBOs of the old vertex layout are transferred as one chunk per mesh. 
+	meshUploadQueue.clear();
+	nextMeshUploadChunk = 0;
+
+	for (unsigned int i = 0; i < numMeshes; i++) {
+		const FlatMesh& mesh = flatMeshArray[i];
+
+		if (!useSharedMeshBuffers && !useInterleavedVertices) {
+			MeshUploadChunk chunk = { i, meshUploadWholeMesh, 0, mesh.numIndices };
+			meshUploadQueue.push_back(chunk);
+			continue;
+		}
+
+		if (mesh.positions) {
+			for (unsigned int first = 0; first < mesh.numVertices; first += maxChunkVertices) {
+				MeshUploadChunk chunk = { i, meshUploadVertices, first, std::min(maxChunkVertices, mesh.numVertices - first) };
+				meshUploadQueue.push_back(chunk);
+			}
+		}
+
+		if (mesh.indices) {
+			for (unsigned int first = 0; first < mesh.numIndices; first += maxChunkIndices) {
+				MeshUploadChunk chunk = { i, meshUploadIndices, first, std::min(maxChunkIndices, mesh.numIndices - first) };
+				meshUploadQueue.push_back(chunk);
+			}
+		}
+	}
+}
+
+//---------------------------------------------------------------
+// Transfer the next chunks in meshUploadQueue to the VBOs, until about byteBudget bytes are transferred. 
+// At least one chunk is transferred per call. 
+// When the last chunk is transferred, the flattened arrays and the cache file are released.
+// Returns true when all the chunks are transferred. 
+bool uploadMeshChunks(size_t byteBudget) {
+	LoadPhase phase(loadProfiler, "vbo.upload");
+	size_t numBytes = 0;
+
+	while (nextMeshUploadChunk < meshUploadQueue.size() && (numBytes == 0 || numBytes < byteBudget)) {
+		const MeshUploadChunk& chunk = meshUploadQueue[nextMeshUploadChunk];
+		const FlatMesh& mesh = flatMeshArray[chunk.meshIndex];
+		unsigned int i = chunk.meshIndex;
+
+		// The staging array is reused for every chunk, until the arena is reset. 
+		if (!meshStagingArray && chunk.type != meshUploadWholeMesh) {
+			meshStagingArray = loaderArena.allocate(std::max(getVertexSize() * maxChunkVertices, sizeof(unsigned int) * maxChunkIndices));
+		}
+
+		if (chunk.type == meshUploadWholeMesh) {
+			uploadFlatMesh(i, mesh);
+			indexCountArray[i] = mesh.numIndices;
+			numBytes += sizeof(float) * 8 * mesh.numVertices + sizeof(unsigned int) * mesh.numIndices;
+		}
+		else if (chunk.type == meshUploadVertices) {
+			size_t chunkSize = getVertexSize() * chunk.count;
+			fillVertices(i, mesh, chunk.first, chunk.count, meshStagingArray);
+
+			// GL_COPY_WRITE_BUFFER doesn't change the state of any VAO. 
+			glBindBuffer(GL_COPY_WRITE_BUFFER, vertexBufferArray[i]);
+			glBufferSubData(GL_COPY_WRITE_BUFFER, getVertexSize() * (baseVertexArray[i] + chunk.first), chunkSize, meshStagingArray);
+			numBytes += chunkSize;
+		}
+		else {
+			size_t chunkSize = getIndexSize(indexTypeArray[i]) * chunk.count;
+			fillIndices(mesh, indexTypeArray[i], chunk.first, chunk.count, meshStagingArray);
+
+			glBindBuffer(GL_COPY_WRITE_BUFFER, indexBufferArray[i]);
+			glBufferSubData(GL_COPY_WRITE_BUFFER, indexOffsetArray[i] + getIndexSize(indexTypeArray[i]) * chunk.first,
+				chunkSize, meshStagingArray);
+			numBytes += chunkSize;
+
+			// The triangles of this chunk can be drawn now.
+			indexCountArray[i] = chunk.first + chunk.count;
+		}
+
+		nextMeshUploadChunk++;
+	}
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	phase.addBytes(numBytes);
+
+	if (nextMeshUploadChunk < meshUploadQueue.size()) {
+		return false;
+	}
+
+	// The vertex data is in the VBOs now. Release the flattened arrays, which are all in loaderArena, and the cache file.
+	if (flatMeshArray) {
+		loaderArena.printStatistics(cout);
+		loaderArena.release();
+		flatMeshArray = NULL;
+		meshStagingArray = NULL;
+		meshCacheFile.close();
+
+		cout << "All meshes transferred to the VBOs " << getTimeSinceStart() << " ms after the program started." << endl;
+	}
+
+	return true;
+}
+
+//---------------------------------------------------------------
+// Load the texture image of a job. This runs on a worker thread. 
+// With useCompressedTextures, the texture container of the image is memory-mapped. If it is missing or out of date, 
+// the image is decoded and compressed, and the container is saved for the next run. 
+// Returns false if the image can't be loaded. 
+bool loadTextureImage(TextureLoadJob& job) {
+	LoadPhase phase(loadProfiler, "texture.decode", job.filename);
+
+	if (!useCompressedTextures) {
+		bool decoded = decodeTextureImage(job.filename.c_str(), job.image);
+		phase.addBytes(job.image.pixels.size());
+		return decoded;
+	}
+
+	// The container stores the size and hash of the image file it was created from.
+	MappedFile source;
+	if (!source.open(job.filename.c_str())) {
+		return false;
+	}
+
+	string containerFilename = job.filename + textureContainerExtension;
+	job.containerFile = new MappedFile();
+
+	if (job.containerFile->open(containerFilename.c_str())) {
+		job.container = readTextureContainer(job.containerFile->getData(), job.containerFile->getSize(),
+			source.getData(), source.getSize());
+
+		if (job.container) {
+			phase.addBytes(job.containerFile->getSize());
+			return true;
+		}
+	}
+
+	delete job.containerFile;
+	job.containerFile = NULL;
+
+	if (!decodeTextureImage(job.filename.c_str(), job.image)) {
+		return false;
+	}
+
+	phase.addBytes(job.image.pixels.size());
+	buildTextureContainer(job.image, source.getData(), source.getSize(), job.containerBytes);
+	vector<unsigned char>().swap(job.image.pixels);
+	job.container = (const TextureContainerHeader *)job.containerBytes.data();
+
+	// If the container can't be saved, the image is compressed again on the next run. 
+	saveTextureContainer(containerFilename.c_str(), job.containerBytes);
+
+	return true;
+}
+
+//---------------------------------------------------------------
+// Create the placeholder texture, and start decoding the texture images of the materials on textureThreadPool. 
+// textureLoadJobs must not change after this, because the worker threads write into its elements. 
+void startTextureLoading() {
+	const unsigned char gray[4] = { 128, 128, 128, 255 };
+
+	glGenTextures(1, &placeholderTexture);
+	glBindTexture(GL_TEXTURE_2D, placeholderTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, gray);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenBuffers(1, &textureUploadBuffer);
+
+	// BC1 and BC3 are the S3TC formats DXT1 and DXT5. 
+	if (useCompressedTextures && !GLEW_EXT_texture_compression_s3tc) {
+		cout << "S3TC texture compression isn't supported. The textures are not compressed." << endl;
+		useCompressedTextures = false;
+	}
+
+	if (!textureThreadPool) {
+		textureThreadPool = new ThreadPool();
+	}
+
+	for (size_t j = 0; j < textureLoadJobs.size(); j++) {
+		TextureLoadJob *job = &textureLoadJobs[j];
+		for (unsigned int materialIndex : job->materialIndices) {
+			textureObjectIDArray[materialIndex] = placeholderTexture;
+		}
+
+		job->done = textureThreadPool->enqueue([job] {
+			job->succeeded = loadTextureImage(*job);
+		});
+	}
+
+	numPendingTextures = (unsigned int)textureLoadJobs.size();
+
+	cout << "Loading " << numPendingTextures << (useCompressedTextures ? " compressed" : "") << " texture images on " << textureThreadPool->size() << " threads." << endl;
+}
+
+//---------------------------------------------------------------
+// Copy the levels of a texture into the pixel buffer object, and create a texture object for them. 
+// The pixel buffer object and the texture object are left bound, so the levels can be specified with offsets into 
+// the buffer; glTexImage2D() then reads them from there, and the GL thread doesn't wait for the transfer. 
+// Returns 0 if the buffer can't be mapped. 
+GLuint beginTextureUpload(const void *levels, size_t size, unsigned int numLevels) {
+	// Give the buffer new storage, so that the previous transfer from it doesn't have to finish first. 
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, textureUploadBuffer);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+
+	void *pixels = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (!pixels) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return 0;
+	}
+	memcpy(pixels, levels, size);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	GLuint texture = 0;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	// The same sampling as the textures created by SOIL with SOIL_FLAG_MIPMAPS. Without SOIL_FLAG_TEXTURE_REPEATS, 
+	// SOIL clamps the texture coordinates to the edge. 
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, numLevels - 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	return texture;
+}
+
+void endTextureUpload() {
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+//---------------------------------------------------------------
+// Create a texture object from a decoded image and its mipmaps. 
+GLuint uploadDecodedTexture(const DecodedTexture& image) {
+	GLuint texture = beginTextureUpload(image.pixels.data(), image.pixels.size(), image.numLevels);
+
+	// With a pixel buffer object bound, the last argument is an offset into the buffer. 
+	for (unsigned int k = 0; texture && k < image.numLevels; k++) {
+		glTexImage2D(GL_TEXTURE_2D, k, GL_RGBA8, image.width[k], image.height[k], 0, GL_RGBA, GL_UNSIGNED_BYTE,
+			BUFFER_OFFSET(image.offset[k]));
+	}
+
+	endTextureUpload();
+
+	return texture;
+}
+
+//---------------------------------------------------------------
+// Create a texture object from the compressed levels of a texture container. The levels are stored one after 
+// another in the container, so they are copied into the pixel buffer object in one piece. 
+GLuint uploadCompressedTexture(const TextureContainerHeader *container) {
+	const TextureContainerLevel *levels = getTextureContainerLevels(container);
+	GLenum internalFormat = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+
+	if (container->format == textureFormatBC3) {
+		internalFormat = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	}
+	else if (container->format == textureFormatBC7) {
+		// BC7 is BPTC in OpenGL 4.2. 
+		if (!GLEW_ARB_texture_compression_bptc) {
+			return 0;
+		}
+		internalFormat = GL_COMPRESSED_RGBA_BPTC_UNORM;
+	}
+
+	const unsigned char *data = (const unsigned char *)container + levels[0].offset;
+	size_t size = (size_t)(levels[container->numLevels - 1].offset + levels[container->numLevels - 1].size - levels[0].offset);
+	GLuint texture = beginTextureUpload(data, size, container->numLevels);
+
+	for (unsigned int k = 0; texture && k < container->numLevels; k++) {
+		glCompressedTexImage2D(GL_TEXTURE_2D, k, internalFormat, levels[k].width, levels[k].height, 0, (GLsizei)levels[k].size,
+			BUFFER_OFFSET((size_t)(levels[k].offset - levels[0].offset)));
+	}
+
+	endTextureUpload();
+
+	return texture;
+}
+
+//---------------------------------------------------------------
+// Create the texture objects of the images that are decoded, until about byteBudget bytes are transferred. 
+// At least one texture is transferred per call if one is ready. Returns true when all the textures are loaded. 
+bool uploadDecodedTextures(size_t byteBudget) {
+	size_t numBytes = 0;
+
+	for (size_t j = 0; j < textureLoadJobs.size() && numBytes < byteBudget; j++) {
+		TextureLoadJob& job = textureLoadJobs[j];
+
+		if (job.uploaded || job.done.wait_for(chrono::seconds(0)) != future_status::ready) {
+			continue;
+		}
+
+		job.done.get();
+		job.uploaded = true;
+		numPendingTextures--;
+
+		// The size of the texture object, with all its mipmaps. 
+		size_t size = job.image.pixels.size();
+		if (job.container) {
+			const TextureContainerLevel *levels = getTextureContainerLevels(job.container);
+			size = (size_t)(levels[job.container->numLevels - 1].offset + levels[job.container->numLevels - 1].size - levels[0].offset);
+		}
+
+		GLuint texture = 0;
+		if (job.succeeded) {
+			LoadPhase phase(loadProfiler, "texture.upload", job.filename);
+			phase.addBytes(size);
+			texture = job.container ? uploadCompressedTexture(job.container) : uploadDecodedTexture(job.image);
+		}
+
+		job.cacheEntry->texture = texture;
+		job.cacheEntry->size = texture ? size : 0;
+		for (unsigned int materialIndex : job.materialIndices) {
+			textureObjectIDArray[materialIndex] = texture;
+		}
+		numBytes += size;
+
+		if (texture == 0) {
+			cout << "Couldn't create a texture object for the texture image: " << job.filename << endl;
+		}
+
+		// The pixels are in the texture object now. 
+		vector<unsigned char>().swap(job.image.pixels);
+		vector<unsigned char>().swap(job.containerBytes);
+		delete job.containerFile;
+		job.containerFile = NULL;
+		job.container = NULL;
+	}
+
+	if (numPendingTextures > 0) {
+		return false;
+	}
+
+	if (!textureLoadJobs.empty()) {
+		textureLoadJobs.clear();
+		cout << "All textures loaded " << getTimeSinceStart() << " ms after the program started." << endl;
+		textureCache.printStatistics(cout);
+	}
+
+	return true;
+}
+
+//---------------------------------------------------------------
+// Copy surfaceMaterials to materialUniformBuffer in the std140 layout of the Materials block, one group of 
+// maxNumMaterialsPerBlock materials every materialGroupStride bytes. 
+void createMaterialBuffer() {
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+
+	GLintptr groupSize = sizeof(MaterialBlockEntry) * maxNumMaterialsPerBlock;
+	materialGroupStride = (groupSize + alignment - 1) / alignment * alignment;
+
+	unsigned int numGroups = std::max((numMaterials + maxNumMaterialsPerBlock - 1) / maxNumMaterialsPerBlock, 1u);
+	vector<unsigned char> data(materialGroupStride * numGroups, 0);
+
+	for (unsigned int i = 0; i < numMaterials; i++) {
+		MaterialBlockEntry *entry = (MaterialBlockEntry*)&data[materialGroupStride * (i / maxNumMaterialsPerBlock)] + i % maxNumMaterialsPerBlock;
+
+		memcpy(entry->ambient, surfaceMaterials[i].ambient, sizeof(entry->ambient));
+		memcpy(entry->diffuse, surfaceMaterials[i].diffuse, sizeof(entry->diffuse));
+		memcpy(entry->specular, surfaceMaterials[i].specular, sizeof(entry->specular));
+		memcpy(entry->emission, surfaceMaterials[i].emission, sizeof(entry->emission));
+		entry->shininess = surfaceMaterials[i].shininess;
+	}
+
+	glGenBuffers(1, &materialUniformBuffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, materialUniformBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, data.size(), data.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+//---------------------------------------------------------------
+// Create the texture objects of the materials and copy the lights. 
+void loadMaterialsAndLights() {
+	createMaterialBuffer();
+
+	// Create an array to store texture object IDs, one texture object per material. Not all materials will have
+	// texture objects.
+	// Note that we only have one texture object per material. This means we only load one texture per material.
+	textureObjectIDArray = (unsigned int*)malloc(sizeof(unsigned int) * numMaterials);
+	materialTextureEntries.assign(numMaterials, NULL);
+
+	for (unsigned int i = 0; i < numMaterials; i++)
+	{
+		textureObjectIDArray[i] = 0;
+
+		if (materialTextureFiles[i].empty()) {
+			continue;
+		}
+
+		// We assume that the image is stored in the default texture image folder, not necessarily the
+		// texture file path stored in the 3D file.
+		string path = string(defaultImageFolder) + materialTextureFiles[i];
+
+		// If another material uses the same image, share its texture object. 
+		bool hit = false;
+		TextureCacheEntry& cacheEntry = textureCache.acquire(path, materialTextureFlags, hit);
+		materialTextureEntries[i] = &cacheEntry;
+
+		if (hit) {
+			textureObjectIDArray[i] = cacheEntry.texture;
+
+			// The image may still be decoded. Then this material gets the texture object when the image is transferred. 
+			for (size_t j = 0; j < textureLoadJobs.size(); j++) {
+				if (textureLoadJobs[j].cacheEntry == &cacheEntry) {
+					textureLoadJobs[j].materialIndices.push_back(i);
+				}
+			}
+		}
+		else if (useAsyncTextureLoading)
+		{
+			// The image is decoded by startTextureLoading().
+			TextureLoadJob job;
+			job.materialIndices.push_back(i);
+			job.cacheEntry = &cacheEntry;
+			job.filename = path;
+			job.containerFile = NULL;
+			job.container = NULL;
+			job.succeeded = false;
+			job.uploaded = false;
+			textureLoadJobs.push_back(std::move(job));
+		}
+		else
+		{
+			const string& filename = materialTextureFiles[i];
+
+			// Use SOIL to load texture image. SOIL will create a texture object for this texture
+			// image and return the texture object ID. It decodes and transfers the image in one call. 
+			LoadPhase phase(loadProfiler, "texture.load", path);
+			textureObjectIDArray[i] = SOIL_load_OGL_texture(path.c_str(), SOIL_LOAD_AUTO, SOIL_CREATE_NEW_ID, materialTextureFlags);
+
+			// If the returned texture ID > 0, it means the imaged is loaded successfully.
+			if (textureObjectIDArray[i] <= 0)
+			{
+				cout << "Couldn't create a texture object for the texture image: " << filename.c_str() << endl;
+			} // end if
+			else
+			{
+				// The size of level 0, and a third more for the mipmaps. 
+				GLint width = 0, height = 0;
+				glBindTexture(GL_TEXTURE_2D, textureObjectIDArray[i]);
+				glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+				glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+				glBindTexture(GL_TEXTURE_2D, 0);
+
+				cacheEntry.size = 4 * (size_t)width * height * 4 / 3;
+				phase.addBytes(cacheEntry.size);
+			}
+
+			cacheEntry.texture = textureObjectIDArray[i];
+		}
+	} // end for
+
+	if (textureLoadJobs.empty()) {
+		textureCache.printStatistics(cout);
+	}
+
+	if (!textureLoadJobs.empty()) {
+		startTextureLoading();
+	}
+
+	  // Copy data from Assimp's light parameters to our own C data struction, which makes it easier to transfer
+	  // it to the shader.
+	if (scene->HasLights()) {
+
+		// Because the lighting parameters need to passed to the shader and GLSL doesn't support
+		// dynamic memory allocation, we have to use a static array to store lighting parameters.
+		// We also need to set a maximum number of lights.
+		// If the actual number of lights are smaller than the maximum number of lights, use the
+		// actual number. Otherwise, use the maximum number of lights.
+		numLights = std::min(scene->mNumLights, maxNumLightSources);
+
+		for (unsigned int i = 0; i < numLights; i++) {
+			aiLight* currentLight = scene->mLights[i];
+
+			copyAiColor3DToFloat4(lightAmbient[i], currentLight->mColorAmbient);
+			copyAiColor3DToFloat4(lightDiffuse[i], currentLight->mColorDiffuse);
+			copyAiColor3DToFloat4(lightSpecular[i], currentLight->mColorSpecular);
+			copyAiVector3DToFloat4(lightPosition[i], currentLight->mPosition);
+			copyAiVector3DToFloat4(lightDirection[i], currentLight->mDirection);
+			lightConstantAttenuation[i] = currentLight->mAttenuationConstant;
+			lightLinearAttenuation[i] = currentLight->mAttenuationLinear;
+			lightQuadraticAttenuation[i] = currentLight->mAttenuationQuadratic;
+			spotlightInnerCone[i] = currentLight->mAngleInnerCone;
+			spotlightOuterCone[i] = currentLight->mAngleOuterCone;
+
+			switch (currentLight->mType) {
+			case aiLightSource_POINT:
+				lightType[i] = 1;
+				break;
+			case aiLightSource_DIRECTIONAL:
+				lightType[i] = 2;
+				break;
+			case aiLightSource_SPOT:
+				lightType[i] = 3;
+				break;
+			default:
+				lightType[i] = 0;
+				break;
+			}
+		}
+	}
+
+}
+
+//---------------------------------------------------------------
+// Create the VAOs, VBOs, and texture objects of the loaded 3D data and copy the lights. 
+// This must be called by the thread that owns the OpenGL context, after loadSceneData() is done. 
+void prepareSceneForRendering() {
+	flattenNodeTree();
+	createMeshBuffers();
+	loadMaterialsAndLights();
+	bindCameraAndLights();
+	sceneReady = true;
+}
+
+//--------------------------------------
+// Load 3D data from 3D file with Assimp
+// The Assimp data structure consists of a scene graph and multiple arrays: meshes, materials,
+// lights, cameras, embedded textures, and animations.
+// In this program, we don't process embedded texture and animation.
+// Each mesh contains multiple arrays: vertices, normals, texture coordinates, and faces.
+// - This function flattens each mesh and associates each array with a VBO and create a VAO for each mesh.
+// - This function also copies the data from Assimp's materials array to the surfaceMaterials
+// array so it can be transferred to the shader.
+// - This function creates an array of texture objects, one for each material.
+// - This function copies the data from Assimp's light array to the arrays of light parameters so
+// they can be transferred to the shader.
+// This function loads everything before returning. With useBackgroundLoading, startSceneLoading() is used instead. 
+bool load3DData() {
+	if (!loadSceneData()) {
+		return false;
+	}
+
+	prepareSceneForRendering();
+
+	// Transfer all the chunks at once.
+	uploadMeshChunks(~(size_t)0);
+
+	return true;
+}
+
+//---------------------------------------------------------------
+// The scene loader thread runs loadSceneData() and reports the result to the render thread. 
+void sceneLoaderThreadFunction() {
+	sceneLoaderSucceeded = loadSceneData();
+	sceneLoaderDone = true;
+}
+
+//---------------------------------------------------------------
+// Wait for the scene loader thread if it's still running, and ask it to stop early. 
+// The program can end at any time, from the Escape key or when the window is closed, both of which call exit(); 
+// the thread must be joined before the global variables it uses are destroyed. 
+void stopSceneLoading() {
+	if (sceneLoaderThread) {
+		sceneLoaderCancelled = true;
+		sceneLoaderThread->join();
+		delete sceneLoaderThread;
+		sceneLoaderThread = NULL;
+	}
+}
+
+//---------------------------------------------------------------
+// Start loading the 3D data in the background. The window keeps drawing frames while the 3D file is loaded. 
+void startSceneLoading() {
+	sceneLoaderDone = false;
+	sceneLoaderCancelled = false;
+	sceneLoaderThread = new thread(sceneLoaderThreadFunction);
+
+	// Functions registered with atexit() run before the global variables are destroyed. 
+	atexit(stopSceneLoading);
+}
+
+//---------------------------------------------------------------
+// Called at the start of every frame while the 3D data is streamed. 
+// When the scene loader thread is done, the VBOs are created, and then the vertex data is transferred to them, 
+// meshUploadBudgetPerFrame bytes per frame. 
+// Returns false if the scene can't be drawn yet. 
+bool streamSceneData() {
+	if (!sceneReady) {
+		if (!sceneLoaderDone) {
+			return false;
+		}
+
+		sceneLoaderThread->join();
+		delete sceneLoaderThread;
+		sceneLoaderThread = NULL;
+
+		if (!sceneLoaderSucceeded) {
+			cout << "Couldn't load the 3D data." << endl;
+			glutLeaveMainLoop();
+			return false;
+		}
+
+		prepareSceneForRendering();
+	}
+
+	if (nextMeshUploadChunk < meshUploadQueue.size()) {
+		uploadMeshChunks(meshUploadBudgetPerFrame);
+	}
+
+	return true;
+}
+
+//-------------------------------
+//Prepare the shaders and 3D data
+bool init()
+{
+	// Load shaders
+	if (prepareShaders() == false) {
+		return false;
+	}
+
+	getShaderVariableLocations();
+
+	if (useBackgroundLoading) {
+		// The 3D data is loaded while display() draws empty frames. 
+		startSceneLoading();
+	}
+	else if (load3DData() == false) {
+		return false;
+	}
+
+	//****************************
+	// Set up other OpenGL states. 
+
+	// Turn on visibility test. 
+	glEnable(GL_DEPTH_TEST);
+
+	// Draw the object in wire frame mode. 
+	// You can comment out this line to draw the object in 
+	// shaded mode. But without lighting, the object will look very dark. 
+	// displayed in wired frame mode 
+	//glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	//const GLfloat Yellow[4] = { 1.0, 1.0, 0.0, 1.0 }; // Yellow
+	const GLfloat Yellow[4] = { 0.95, 0.68, 0.25, 1.0 }; // Yellow
+	glColor4fv(Yellow);
+	//glColor3f(1.0f, 1.0f, 0.0f);
+	// This is the background color. 
+	//glClearColor(57.0, 57.0, 57.0, 57.0);
+	//glClearColor(254.0, 0.0, 0.0, 0.0);
+	glClearColor(255.0, 255.0, 255.0, 255.0);
+	// Uncomment this line for debugging purposes.
+	// Check error
+	checkOpenGLError("init()");
+
+	return true;
+}
+
+//------------------------------------------------
+// Update the camera location and direction from the node bound to the camera, 
+// and then create the view and projection matrices.
+void updateCameraFromNode() {
+	aiCamera* currentCamera = scene->mCameras[boundCameraIndex];
+
+	// This (camera) node's transformation matrix. 
+	const aiMatrix4x4& currentTransformMatrix = flatNodeArray[cameraNodeIndex].sceneTransform;
+
+	// It's not clear whether we also need to multiply the camera's local matrix. 
+	// Maybe it's necessary for some 3D file format. 
+	aiMatrix4x4 cameraMatrix;
+	currentCamera->GetCameraMatrix(cameraMatrix);
+	//currentTransformMatrix = currentTransformMatrix *cameraMatrix;
+
+	// Get the camera position, look-at, and up vector. 
+	// Don't modify aiCamera's member variables mPosition, mLookAt, mUp directly. 
+	aiVector3D cameraPosition = currentCamera->mPosition;
+	aiVector3D cameraLookAtPosition = currentCamera->mLookAt;
+	aiVector3D cameraUpVector = currentCamera->mUp;
+
+	// Transform the camera position, lookAt, and up vector
+	cameraPosition = currentTransformMatrix * cameraPosition;
+	cameraLookAtPosition = currentTransformMatrix * cameraLookAtPosition;
+	cameraUpVector = currentTransformMatrix * cameraUpVector;
+	cameraUpVector.Normalize(); // Remember to normalize the UP vector.
+
+	// Pass the eye position to the shader. We'll need it for calculating
+	// the specular color. 
+	float eyePosition[3] = { cameraPosition.x, cameraPosition.y, cameraPosition.z };
+	glUniform3fv(lightSourceLocations.eyePosition, 1, eyePosition);
+
+	// Build the projection and view matrices
+	// It's better to use the window's aspect than using the aspect ratio from the 3D file.
+	projMatrix = perspective(currentCamera->mHorizontalFOV,
+		(float)windowWidth / (float)windowHeight,
+		currentCamera->mClipPlaneNear,
+		currentCamera->mClipPlaneFar);
+
+	// Create a view matrix
+	// You specify where the camera location and orientation and GLM will create a view matrix. 
+	viewMatrix = lookAt(vec3(cameraPosition.x, cameraPosition.y, cameraPosition.z),
+		vec3(cameraLookAtPosition.x, cameraLookAtPosition.y, cameraLookAtPosition.z),
+		vec3(cameraUpVector.x, cameraUpVector.y, cameraUpVector.z));
+}
+
+//------------------------------------------------
+// Compute the view and projection matrices again if the window has been resized or the camera node has moved. 
+// Every time they are computed, cameraVersion is incremented. 
+void updateCamera() {
+	bool cameraMoved = (cameraNodeIndex >= 0 && flatNodeArray[cameraNodeIndex].sceneVersion != cameraNodeVersion);
+
+	if (!cameraDirty && !cameraMoved) {
+		return;
+	}
+
+	// Update the location and direction of the camera from its node.
+	if (cameraNodeIndex >= 0) {
+		updateCameraFromNode();
+		cameraNodeVersion = flatNodeArray[cameraNodeIndex].sceneVersion;
+	}
+	else {
+		// If there is no camera data in the file, create the default projection and view matrices.
+		projMatrix = perspective(radians(defaultFOV), (float)windowWidth / (float)windowHeight, defaultNearPlane, defaultFarPlane);
+
+		// Create a view matrix
+		// You specify where the camera location and orientation and GLM will create a view matrix. 
+		// The first parameter is the location of the camera; 
+		// the second is where the camera is pointing at; the third is the up vector for camera.
+		// If you need to move or animate your camera during run time, then you need to construct the 
+		// view matrix in display() function. 
+		viewMatrix = lookAt(defaultCameraPosition, defaultCameraLookAt, defaultCameraUp);
+	}
+
+	// The planes of the frustum in world space. 
+	mat4 viewProjMatrix = projMatrix * viewMatrix;
+	float frustumPlanes[6][4];
+	extractFrustumPlanes(value_ptr(viewProjMatrix), frustumPlanes);
+	loadFrustumPlanes(frustumPlanes, viewFrustum);
+
+	cameraDirty = false;
+	cameraVersion++;
+}
+
+//----------------------------------------------
+// Update the locations and directions of light sources from the nodes bound to them. 
+// Only the lights whose nodes have moved since the last call are updated. Returns true if any light was updated. 
+bool updateLightsFromNodes() {
+	bool updated = false;
+
+	for (unsigned int i = 0; i < numLights; i++) {
+		if (lightNodeIndices[i] < 0 || flatNodeArray[lightNodeIndices[i]].sceneVersion == lightNodeVersions[i]) {
+			continue;
+		}
+
+		aiLight* currentLight = scene->mLights[i];
 
-		// Create a normal matrix to transform normals. 
-		// We don't need to include the view matrix here because the lighting is done
-		// in world space. 
-		mat3 normalMatrix = mat3(1.0);
-		normalMatrix = column(normalMatrix, 0, vec3(modelMatrix[0][0], modelMatrix[0][1], modelMatrix[0][2]));
-		normalMatrix = column(normalMatrix, 1, vec3(modelMatrix[1][0], modelMatrix[1][1], modelMatrix[1][2]));
-		normalMatrix = column(normalMatrix, 2, vec3(modelMatrix[2][0], modelMatrix[2][1], modelMatrix[2][2]));
+		// This (light) node's transformation matrix. 
+		const FlatNode& lightNode = flatNodeArray[lightNodeIndices[i]];
+		const aiMatrix4x4& currentTransformMatrix = lightNode.sceneTransform;
+		lightNodeVersions[i] = lightNode.sceneVersion;
+		updated = true;
 
-		normalMatrix = inverseTranspose(normalMatrix);
+		aiVector3D transformedLightPosition =
+			currentTransformMatrix * currentLight->mPosition;
+		aiVector3D transformedLightDirection =
+			currentTransformMatrix * currentLight->mDirection;
 
-		// Draw all the meshes associated with the current node.
-		// Certain node may have multiple meshes associated with it. 
-		for (unsigned int i = 0; i < node->mNumMeshes; i++) {
-			// This is the index of the mesh associated with this node.
-			int meshIndex = node->mMeshes[i];
+		// Update the light position and direction in the lightSources Array. 
+		copyAiVector3DToFloat4(lightPosition[i], transformedLightPosition);
+		copyAiVector3DToFloat4(lightDirection[i], transformedLightDirection);
+	}
+
+	return updated;
+}
+
+
+//--------------------------------------------------------------------------------------------
+// Select the LOD level of a mesh from the size of its bounding sphere on the screen. previousLevel is the level the 
+// same instance of the mesh was drawn with last. 
+unsigned int selectMeshLod(unsigned int meshIndex, unsigned int previousLevel, const mat4& modelMatrix) {
+	const MeshLodChain& lods = meshLodArray[meshIndex];
+
+	if (!useMeshLods || lods.numLevels <= 1) {
+		return 0;
+	}
+
+	// The radius is scaled by the largest scaling factor of the model matrix.
+	float scale = std::max(length(vec3(modelMatrix[0])), std::max(length(vec3(modelMatrix[1])), length(vec3(modelMatrix[2]))));
+	float radius = lods.boundingRadius * scale;
+
+	vec4 center = viewMatrix * modelMatrix * vec4(lods.boundingCenter[0], lods.boundingCenter[1], lods.boundingCenter[2], 1.0f);
+	float distance = length(vec3(center));
+
+	// Use the full detail when the camera is inside the bounding sphere.
+	if (distance <= radius) {
+		return 0;
+	}
+
+	// projMatrix[1][1] is 1 / tan(fovy / 2).
+	float screenRadius = radius / distance * projMatrix[1][1] * 0.5f * (float)windowHeight;
+
+	return selectLodLevel(lods, screenRadius, previousLevel, lodPixelThreshold, lodBias, lodHysteresis);
+}
+
+//--------------------------------------------------------------------------------------------
+// Find the range of indices to draw for LOD level lodLevel of a mesh, relative to the first index of the mesh. 
+// While the mesh is streamed, a level whose indices aren't all in the index VBO yet is replaced by the closest
+// coarser level that is. The coarsest level is stored first, so it's always the first to arrive; until it's complete,
+// the part of it that is in the index VBO is drawn. 
+void getMeshDrawRange(unsigned int meshIndex, unsigned int lodLevel, unsigned int& firstIndex, unsigned int& count) {
+	const MeshLodChain& lods = meshLodArray[meshIndex];
+	unsigned int residentCount = indexCountArray[meshIndex];
+
+	for (unsigned int k = lodLevel; k < lods.numLevels; k++) {
+		if (lods.firstIndex[k] + lods.indexCount[k] <= residentCount) {
+			firstIndex = lods.firstIndex[k];
+			count = lods.indexCount[k];
+			return;
+		}
+	}
+
+	unsigned int coarsest = lods.numLevels - 1;
+	firstIndex = lods.firstIndex[coarsest];
+	count = (residentCount > firstIndex) ? std::min(residentCount - firstIndex, lods.indexCount[coarsest]) : 0;
+}
+
+//--------------------------------------------------------------------------------------------
+// Cull the meshlets of the index range [firstIndex, firstIndex + count) of a mesh against the view frustum and the
+// camera direction. The index ranges of the visible meshlets are stored in clusterDrawCounts and clusterDrawOffsets,
+// and adjacent visible meshlets are merged into one range. 
+// Returns false if the range isn't covered by meshlets, e.g. a level that is still being transferred to the index VBO. 
+// Then the whole range is drawn. 
+bool cullMeshClusters(unsigned int meshIndex, unsigned int firstIndex, unsigned int count, 
+	const mat4& modelMatrix, const mat4& mvpMatrix) {
+	const Meshlet *meshlets = &meshletArray[firstMeshletArray[meshIndex]];
+	const Meshlet *meshletsEnd = meshlets + meshletCountArray[meshIndex];
+
+	// Find the meshlets of the range. The meshlets of a mesh are sorted by their first index. 
+	const Meshlet *first = lower_bound(meshlets, meshletsEnd, firstIndex,
+		[](const Meshlet& meshlet, unsigned int index) { return meshlet.firstIndex < index; });
+	const Meshlet *last = first;
+	unsigned int coveredCount = 0;
+	while (last != meshletsEnd && last->firstIndex + last->indexCount <= firstIndex + count) {
+		coveredCount += last->indexCount;
+		last++;
+	}
+
+	if (first == meshletsEnd || first->firstIndex != firstIndex || coveredCount != count) {
+		return false;
+	}
+
+	// The tests are done in the model space of the mesh. 
+	float frustumPlanes[6][4];
+	extractFrustumPlanes(value_ptr(mvpMatrix), frustumPlanes);
+	vec4 cameraPosition = inverse(viewMatrix * modelMatrix) * vec4(0.0f, 0.0f, 0.0f, 1.0f);
+
+	clusterDrawCounts.clear();
+	clusterDrawOffsets.clear();
+
+	size_t indexSize = getIndexSize(indexTypeArray[meshIndex]);
+	unsigned int rangeEnd = 0;
+
+	for (const Meshlet *meshlet = first; meshlet != last; meshlet++) {
+		numClustersTested++;
+
+		if (isMeshletOutsideFrustum(*meshlet, frustumPlanes) ||
+			(useClusterConeCulling && isMeshletBackFacing(*meshlet, value_ptr(cameraPosition)))) {
+			numClustersCulled++;
+			continue;
+		}
+
+		if (!clusterDrawCounts.empty() && meshlet->firstIndex == rangeEnd) {
+			clusterDrawCounts.back() += meshlet->indexCount;
+		}
+		else {
+			clusterDrawCounts.push_back(meshlet->indexCount);
+			clusterDrawOffsets.push_back(BUFFER_OFFSET((indexOffsetArray[meshIndex] + indexSize * meshlet->firstIndex)));
+		}
+		rangeEnd = meshlet->firstIndex + meshlet->indexCount;
+	}
+
+	clusterDrawBaseVertices.assign(clusterDrawCounts.size(), baseVertexArray[meshIndex]);
+
+	return true;
+}
+
+//--------------------------------------------------------------------------------------------
+// Change the transformation of a node relative to its parent. The matrices of the node and all the nodes below it 
+// are computed again by the next updateNodeMatrices(). 
+void setNodeTransformation(unsigned int nodeIndex, const aiMatrix4x4& transformation) {
+	FlatNode& flatNode = flatNodeArray[nodeIndex];
+
+	flatNode.localTransform = transformation;
+	flatNode.localMatrix = aiMatrix4x4ToMat4(transformation);
+	flatNode.dirty = true;
+}
+
+//--------------------------------------------------------------------------------------------
+// Compute the matrices of the nodes of the flattened scene graph that are out of date, in one pass. The parent of a 
+// node comes before it in flatNodeArray, so its matrices are already up to date. 
+void updateNodeMatrices() {
+	for (FlatNode& flatNode : flatNodeArray) {
+		const FlatNode* parent = (flatNode.parentIndex >= 0) ? &flatNodeArray[flatNode.parentIndex] : NULL;
+
+		// The scene transformation changes only when this node or one above it has a new transformation. 
+		bool sceneChanged = flatNode.dirty || (parent && parent->sceneVersion != flatNode.parentSceneVersion);
+
+		if (sceneChanged) {
+			flatNode.sceneTransform = parent ? parent->sceneTransform * flatNode.localTransform : flatNode.localTransform;
+			flatNode.parentSceneVersion = parent ? parent->sceneVersion : 0;
+			flatNode.sceneVersion++;
+		}
+
+		// The user transformation is applied at the root, so it's passed down to every node. 
+		unsigned int parentWorldVersion = parent ? parent->worldVersion : userMatrixVersion;
+
+		if (sceneChanged || parentWorldVersion != flatNode.parentWorldVersion) {
+			flatNode.modelMatrix = (parent ? parent->modelMatrix : userMatrix) * flatNode.localMatrix;
+
+			// Create a normal matrix to transform normals. 
+			// We don't need to include the view matrix here because the lighting is done
+			// in world space. Only the nodes with meshes need one. 
+			if (flatNode.node->mNumMeshes > 0) {
+				flatNode.normalMatrix = inverseTranspose(mat3(flatNode.modelMatrix));
+			}
+
+			flatNode.parentWorldVersion = parentWorldVersion;
+			flatNode.worldVersion++;
+		}
+
+		flatNode.dirty = false;
+	}
+}
+
+//--------------------------------------------------------------------------------------------
+// The model-view-projection matrix of a node. It's only computed again when the model matrix or the camera has 
+// a new version. 
+const mat4& getNodeMvpMatrix(FlatNode& flatNode) {
+	if (flatNode.mvpWorldVersion != flatNode.worldVersion || flatNode.mvpCameraVersion != cameraVersion) {
+		// The sequence of multiplication is important here. Model matrix, view matrix, and projection matrix 
+		// must be multiplied from right to left, because the vertex position is on the right hand side. 
+		flatNode.mvpMatrix = projMatrix * viewMatrix * flatNode.modelMatrix;
+		flatNode.mvpWorldVersion = flatNode.worldVersion;
+		flatNode.mvpCameraVersion = cameraVersion;
+	}
+
+	return flatNode.mvpMatrix;
+}
+
+//--------------------------------------------------------------------------------------------
+// Transform the bounding boxes of the mesh instances whose nodes have a new model matrix or scene transformation. 
+// The instances with a new scene box are updated in sceneBvh, which is refitted afterwards. 
+// This must be called after updateNodeMatrices(). 
+void updateMeshInstanceBounds() {
+	for (unsigned int i = 0; i < meshInstanceArray.size(); i++) {
+		MeshInstance& instance = meshInstanceArray[i];
+		const FlatNode& flatNode = flatNodeArray[instance.nodeIndex];
+
+		if (instance.boundsWorldVersion != flatNode.worldVersion) {
+			transformBoundingBox(meshBoundsArray[instance.meshIndex], value_ptr(flatNode.modelMatrix), instance.worldBounds);
+			instance.boundsWorldVersion = flatNode.worldVersion;
+		}
+
+		if (instance.boundsSceneVersion != flatNode.sceneVersion) {
+			mat4 sceneMatrix = aiMatrix4x4ToMat4(flatNode.sceneTransform);
+			transformBoundingBox(meshBoundsArray[instance.meshIndex], value_ptr(sceneMatrix), instance.sceneBounds);
+			instance.boundsSceneVersion = flatNode.sceneVersion;
+
+			if (sceneBvhBuilt) {
+				sceneBvh.setItemBounds(i, instance.sceneBounds);
+			}
+		}
+	}
+
+	sceneBvh.refit();
+}
+
+//--------------------------------------------------------------------------------------------
+// Build sceneBvh over the scene boxes of the mesh instances. 
+// This must be called after updateMeshInstanceBounds(), once the scene is loaded. 
+void buildSceneBvh() {
+	LoadPhase phase(loadProfiler, "scene.bvh");
+	vector<BoundingBox> bounds(meshInstanceArray.size());
+
+	for (size_t i = 0; i < meshInstanceArray.size(); i++) {
+		bounds[i] = meshInstanceArray[i].sceneBounds;
+	}
+
+	sceneBvh.build(bounds);
+	sceneBvhBuilt = true;
+	phase.addBytes(sizeof(BoundingBox) * bounds.size());
+
+	cout << "Scene BVH: " << sceneBvh.getNumNodes() << " nodes over " << meshInstanceArray.size() << " mesh instances." << endl;
+}
+
+//--------------------------------------------------------------------------------------------
+// Update sceneFrustum, the view frustum in the space of the scene boxes, when the camera or the user transformation
+// has a new version. 
+void updateSceneFrustum() {
+	if (sceneFrustumCameraVersion == cameraVersion && sceneFrustumUserVersion == userMatrixVersion) {
+		return;
+	}
+
+	mat4 viewProjUserMatrix = projMatrix * viewMatrix * userMatrix;
+	float frustumPlanes[6][4];
+	extractFrustumPlanes(value_ptr(viewProjUserMatrix), frustumPlanes);
+	loadFrustumPlanes(frustumPlanes, sceneFrustum);
+
+	sceneFrustumCameraVersion = cameraVersion;
+	sceneFrustumUserVersion = userMatrixVersion;
+}
+
+//--------------------------------------------------------------------------------------------
+// Fill visibleMeshInstances with the mesh instances whose boxes aren't outside the view frustum, by walking sceneBvh
+// or by testing every instance. 
+void cullMeshInstances() {
+	visibleMeshInstances.clear();
+	numMeshesTested = 0;
+	numBvhNodesVisited = 0;
+
+	if (useSceneBvh) {
+		updateSceneFrustum();
+
+		SceneBvhCullStats stats = sceneBvh.cull(sceneFrustum, [](unsigned int i) { visibleMeshInstances.push_back(i); });
+		numBvhNodesVisited = stats.nodesVisited;
+		numMeshesTested = stats.itemsTested;
+
+		// The tree reports the instances in its own order. They are drawn in the order of the node tree. 
+		sort(visibleMeshInstances.begin(), visibleMeshInstances.end());
+	}
+	else {
+		for (unsigned int i = 0; i < meshInstanceArray.size(); i++) {
+			numMeshesTested++;
+
+			if (!isBoxOutsideFrustum(meshInstanceArray[i].worldBounds, viewFrustum)) {
+				visibleMeshInstances.push_back(i);
+			}
+		}
+	}
+
+	numMeshesCulled = (unsigned int)(meshInstanceArray.size() - visibleMeshInstances.size());
+}
+
+//--------------------------------------------------------------------------------------------
+// Remove the mesh instances hidden behind the occluders from visibleMeshInstances. The occluders are the visible 
+// instances with the largest boxes relative to their distance from the camera. 
+void cullOccludedMeshInstances() {
+	numMeshesOccluded = 0;
+	numOccluderTriangles = 0;
+
+	vec3 eye = vec3(inverse(viewMatrix)[3]);
+	vector<pair<float, unsigned int> > candidates;
+
+	for (unsigned int i : visibleMeshInstances) {
+		const MeshInstance& instance = meshInstanceArray[i];
+
+		if (occluderMeshArray[instance.meshIndex].indices.empty()) {
+			continue;
+		}
+
+		vec3 boxMin = make_vec3(instance.worldBounds.min), boxMax = make_vec3(instance.worldBounds.max);
+		vec3 toBox = 0.5f * (boxMin + boxMax) - eye;
+		float score = dot(boxMax - boxMin, boxMax - boxMin) / std::max(dot(toBox, toBox), 1e-6f);
+		candidates.push_back(make_pair(-score, i));
+	}
+
+	if (candidates.empty()) {
+		return;
+	}
+
+	// Sorting by the instance index too keeps the choice of the occluders the same for the same view. 
+	size_t numOccluders = std::min((size_t)maxOccluders, candidates.size());
+	partial_sort(candidates.begin(), candidates.begin() + numOccluders, candidates.end());
+
+	occlusionBuffer.clear();
+	for (size_t k = 0; k < numOccluders; k++) {
+		FlatNode& flatNode = flatNodeArray[meshInstanceArray[candidates[k].second].nodeIndex];
+		const OccluderMesh& occluder = occluderMeshArray[meshInstanceArray[candidates[k].second].meshIndex];
+
+		occlusionBuffer.addOccluder(occluder.positions.data(), occluder.indices.data(), occluder.indices.size(),
+			value_ptr(getNodeMvpMatrix(flatNode)));
+	}
+
+	if (!occlusionThreadPool) {
+		occlusionThreadPool = new ThreadPool();
+	}
+	occlusionBuffer.rasterize(occlusionThreadPool);
+	numOccluderTriangles = (unsigned int)occlusionBuffer.getNumTriangles();
+
+	// The world boxes include the user transformation, so they are seen with the view-projection matrix. 
+	mat4 viewProj = projMatrix * viewMatrix;
+	size_t numVisible = 0;
+
+	for (unsigned int i : visibleMeshInstances) {
+		if (!occlusionBuffer.isBoxOccluded(meshInstanceArray[i].worldBounds, value_ptr(viewProj))) {
+			visibleMeshInstances[numVisible++] = i;
+		}
+	}
+
+	numMeshesOccluded = (unsigned int)(visibleMeshInstances.size() - numVisible);
+	visibleMeshInstances.resize(numVisible);
+}
+
+//--------------------------------------------------------------------------------------------
+// Time the culling of the mesh instances with sceneBvh and by testing every instance, for the current view. 
+void benchmarkCulling() {
+	const int numRuns = 1000;
+	bool savedUseSceneBvh = useSceneBvh;
+	double times[2];
+	size_t visible[2];
+
+	for (int method = 0; method < 2; method++) {
+		useSceneBvh = (method == 1);
+
+		auto start = chrono::high_resolution_clock::now();
+		for (int run = 0; run < numRuns; run++) {
+			cullMeshInstances();
+		}
+		times[method] = chrono::duration<double, micro>(chrono::high_resolution_clock::now() - start).count() / numRuns;
+		visible[method] = visibleMeshInstances.size();
+	}
+
+	useSceneBvh = savedUseSceneBvh;
+
+	cout << "Culling " << meshInstanceArray.size() << " mesh instances: every instance " << times[0] << " us (" << visible[0]
+		<< " visible), BVH " << times[1] << " us (" << visible[1] << " visible, " << numBvhNodesVisited << " of "
+		<< sceneBvh.getNumNodes() << " nodes visited)" << endl;
+}
 
-			const aiMesh* currentMesh = scene->mMeshes[meshIndex];
+//--------------------------------------------------------------------------------------------
+// Record the draw of one mesh of a node of the flattened scene graph in meshDrawArray, and push its packet to 
+// renderQueue. The mesh is only drawn by submitMeshDraws(). 
+void queueMeshInstance(unsigned int instanceIndex) {
+	MeshInstance& instance = meshInstanceArray[instanceIndex];
+
+	// This is the index of the mesh.
+	unsigned int meshIndex = instance.meshIndex;
+
+	FlatNode& flatNode = flatNodeArray[instance.nodeIndex];
+	const mat4& modelMatrix = flatNode.modelMatrix;
+
+	//**********************************************************************************
+	// Combine the model, view, and project matrix into one model-view-projection matrix.
+
+	// Model matrix is then multiplied with view matrix and projection matrix to create a combined
+	// model_view_projection matrix. 
+	// The view and projection matrices are created in updateCamera(). 
+	const mat4& mvpMatrix = getNodeMvpMatrix(flatNode);
+
+	// Pick the LOD level of the mesh. Skip the meshes that have no indices in the index VBO yet. 
+	// With instancing, the level is picked for the closest copy, so no copy gets too coarse a level. 
+	instance.lodLevel = selectMeshLod(meshIndex, instance.lodLevel, nearestInstanceMatrix * modelMatrix);
+
+	MeshDraw draw;
+	draw.instanceIndex = instanceIndex;
+	getMeshDrawRange(meshIndex, instance.lodLevel, draw.firstIndex, draw.indexCount);
+
+	if (draw.indexCount == 0) {
+		return;
+	}
+
+	// Cull the meshlets of the mesh. Skip the mesh if all of them are culled. 
+	// The meshlets are culled for one model matrix, so not when the mesh is drawn many times. 
+	bool drawClusters = useClusterCulling && instanceCount == 1 && meshletCountArray[meshIndex] > 0 &&
+		cullMeshClusters(meshIndex, draw.firstIndex, draw.indexCount, modelMatrix, mvpMatrix);
+
+	if (drawClusters && clusterDrawCounts.empty()) {
+		return;
+	}
 
-			// The model_view_projection matrix is transferred to the shader to be used in the vertex shader. 
-			// Here we send the combined model_view_projection matrix to the shader so that we don't have to do the same 
-			// multiplication in the vertex shader repeatedly. Note that the vertex shader is executed for each vertex. 
-			glUniformMatrix4fv(matrixLocations.mvpMatrixID, 1, GL_FALSE, glm::value_ptr(mvpMatrix));
+	// The ranges of the visible meshlets are kept until the draw is submitted. 
+	draw.firstCluster = (unsigned int)queuedClusterCounts.size();
+	draw.clusterCount = drawClusters ? (unsigned int)clusterDrawCounts.size() : 0;
+	if (drawClusters) {
+		queuedClusterCounts.insert(queuedClusterCounts.end(), clusterDrawCounts.begin(), clusterDrawCounts.end());
+		queuedClusterOffsets.insert(queuedClusterOffsets.end(), clusterDrawOffsets.begin(), clusterDrawOffsets.end());
+		queuedClusterBaseVertices.insert(queuedClusterBaseVertices.end(), clusterDrawBaseVertices.begin(), clusterDrawBaseVertices.end());
+	}
 
-			glUniformMatrix4fv(matrixLocations.modelMatrixID, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-			glUniformMatrix3fv(matrixLocations.normalMatrixID, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+	// The depth of the center of the mesh box sorts the draws with the same state front to back. 
+	const BoundingBox& bounds = meshBoundsArray[meshIndex];
+	vec4 center = mvpMatrix * vec4(0.5f * (bounds.min[0] + bounds.max[0]), 0.5f * (bounds.min[1] + bounds.max[1]),
+		0.5f * (bounds.min[2] + bounds.max[2]), 1.0f);
+	float depth = (center.w > 0.0f) ? center.z / center.w * 0.5f + 0.5f : 0.0f;
 
-			// This is the material for this mesh
-			unsigned int materialIndex = currentMesh->mMaterialIndex;
+	// There is only one shader program. 
+	unsigned int materialIndex = scene->mMeshes[meshIndex]->mMaterialIndex;
+	uint64_t key = RenderQueue::makeKey(0, textureObjectIDArray[materialIndex], materialIndex, meshIndex, depth);
 
-			// Pass the material data to the shader. The material data is copied from Assimp's data structure 
-			// to our own data structure in load3DData().
-			glUniform4fv(surfaceMaterialLocations.ambient, 1, surfaceMaterials[currentMesh->mMaterialIndex].ambient);
-			glUniform4fv(surfaceMaterialLocations.diffuse, 1, surfaceMaterials[currentMesh->mMaterialIndex].diffuse);
-			glUniform4fv(surfaceMaterialLocations.specular, 1, surfaceMaterials[currentMesh->mMaterialIndex].specular);
-			glUniform4fv(surfaceMaterialLocations.emission, 1, surfaceMaterials[currentMesh->mMaterialIndex].emission);
-			glUniform1f(surfaceMaterialLocations.shininess, surfaceMaterials[currentMesh->mMaterialIndex].shininess);
+	renderQueue.push(key, (unsigned int)meshDrawArray.size());
+	meshDrawArray.push_back(draw);
+}
 
-			// Transfer texture image to the shader. 
-			if (textureObjectIDArray[currentMesh->mMaterialIndex] > 0) {
+//--------------------------------------------------------------------------------------------
+// Draw the meshes in meshDrawArray in the order of renderQueue. The state of a draw is only sent when it differs 
+// from the state of the previous draw, unless useRenderQueue is false. 
+void submitMeshDraws() {
+	GLuint boundTexture = 0;
+	int boundMaterial = -1, boundMaterialGroup = -1, boundMesh = -1;
+	bool textureUnitSet = false;
+
+	numStateChanges = 0;
+	numStateChangesSaved = 0;
+
+	for (const RenderPacket& packet : renderQueue.getPackets()) {
+		const MeshDraw& draw = meshDrawArray[packet.item];
+		const MeshInstance& instance = meshInstanceArray[draw.instanceIndex];
+		unsigned int meshIndex = instance.meshIndex;
+		FlatNode& flatNode = flatNodeArray[instance.nodeIndex];
+
+		// The model_view_projection matrix is transferred to the shader to be used in the vertex shader. 
+		// Here we send the combined model_view_projection matrix to the shader so that we don't have to do the same 
+		// multiplication in the vertex shader repeatedly. Note that the vertex shader is executed for each vertex. 
+		glUniformMatrix4fv(matrixLocations.mvpMatrixID, 1, GL_FALSE, glm::value_ptr(getNodeMvpMatrix(flatNode)));
+
+		glUniformMatrix4fv(matrixLocations.modelMatrixID, 1, GL_FALSE, glm::value_ptr(flatNode.modelMatrix));
+		glUniformMatrix3fv(matrixLocations.normalMatrixID, 1, GL_FALSE, glm::value_ptr(flatNode.normalMatrix));
+
+		// This is the material for this mesh
+		unsigned int materialIndex = scene->mMeshes[meshIndex]->mMaterialIndex;
+		GLuint texture = textureObjectIDArray[materialIndex];
+
+		// Transfer texture image to the shader. 
+		if (!useRenderQueue || boundMaterial < 0 || texture != boundTexture) {
+			if (texture > 0) {
 				glActiveTexture(GL_TEXTURE1);
-				glBindTexture(GL_TEXTURE_2D, textureObjectIDArray[currentMesh->mMaterialIndex]);
+				glBindTexture(GL_TEXTURE_2D, texture);
 
 				// We only use texture unit 1. Here 1 means Texture Unit 1. 
 				// This tells fragment shader to retrieve texture from Texture Unit 1. 
-				glUniform1i(textureUnit, 1);
+				if (!useRenderQueue || !textureUnitSet) {
+					glUniform1i(textureUnit, 1);
+					textureUnitSet = true;
+				}
 
 				// Tell the shader there is no texture so don't do texture mapping. 
 				glUniform1i(lightSourceLocations.hasTexture, 1);
@@ -1087,37 +3671,136 @@ void nodeTreeTraversalMesh(const aiNode* node, aiMatrix4x4 matrix) {
 				glUniform1i(lightSourceLocations.hasTexture, 0); // No texture
 			}
 
-			// This mesh should have already been associated with a VAO in a previous function. 
-			// Note that mMeshes[] array and the vaoArray[] array are in sync. 
-			// That is, for mesh #0, the corresponding VAO index is stored in vaoArray[0], and so on. 
-			// Bind the corresponding VAO for this mesh. 
-			glBindVertexArray(vaoArray[meshIndex]);
+			boundTexture = texture;
+			numStateChanges++;
+		}
+
+		// Pass the index of the material to the shader, which reads the material data from materialUniformBuffer. 
+		// Bind the group of materials it belongs to, if the previous material was in another group. 
+		if (!useRenderQueue || boundMaterial != (int)materialIndex) {
+			int materialGroup = (int)(materialIndex / maxNumMaterialsPerBlock);
+			if (!useRenderQueue || boundMaterialGroup != materialGroup) {
+				glBindBufferRange(GL_UNIFORM_BUFFER, materialBlockBinding, materialUniformBuffer,
+					materialGroupStride * materialGroup, sizeof(MaterialBlockEntry) * maxNumMaterialsPerBlock);
+				boundMaterialGroup = materialGroup;
+				numStateChanges++;
+			}
+
+			glUniform1i(surfaceMaterialLocations.materialIndex, materialIndex % maxNumMaterialsPerBlock);
+
+			boundMaterial = (int)materialIndex;
+			numStateChanges++;
+		}
+
+		// Pass the parameters that convert the quantized vertex attributes back to the shader, and bind the VAO 
+		// of the mesh. The shared VAO is already bound in display(). 
+		// Note that mMeshes[] array and the vaoArray[] array are in sync. 
+		if (!useRenderQueue || boundMesh != (int)meshIndex) {
+			const VertexDecodeParameters& decode = vertexDecodeArray[meshIndex];
+			glUniform3fv(vertexDecodeLocations.positionOffset, 1, decode.positionOffset);
+			glUniform3fv(vertexDecodeLocations.positionScale, 1, decode.positionScale);
+			glUniform2fv(vertexDecodeLocations.textureCoordOffset, 1, decode.textureCoordOffset);
+			glUniform2fv(vertexDecodeLocations.textureCoordScale, 1, decode.textureCoordScale);
+
+			if (!useSharedMeshBuffers) {
+				glBindVertexArray(vaoArray[meshIndex]);
+			}
 
-			// How many faces are in this mesh?
-			unsigned int numFaces = currentMesh->mNumFaces;
-			// How many indices are for each face?
-			unsigned int numIndicesPerFace = currentMesh->mFaces[0].mNumIndices;
+			boundMesh = (int)meshIndex;
+			numStateChanges++;
+		}
 
+		if (useSharedMeshBuffers && draw.clusterCount > 0) {
+			// Draw the index ranges of the visible meshlets with one call. 
+			glMultiDrawElementsBaseVertex(GL_TRIANGLES, &queuedClusterCounts[draw.firstCluster], indexTypeArray[meshIndex],
+				&queuedClusterOffsets[draw.firstCluster], (GLsizei)draw.clusterCount, &queuedClusterBaseVertices[draw.firstCluster]);
+		}
+		else if (useSharedMeshBuffers) {
+			// The indices of this mesh start at byte indexOffsetArray[meshIndex] in the shared index buffer, and 
+			// they are relative to the first vertex of the mesh, baseVertexArray[meshIndex]. 
+			// All the copies of the mesh are drawn with one call. 
+			glDrawElementsInstancedBaseVertex(GL_TRIANGLES, draw.indexCount, indexTypeArray[meshIndex],
+				BUFFER_OFFSET((indexOffsetArray[meshIndex] + getIndexSize(indexTypeArray[meshIndex]) * draw.firstIndex)),
+				instanceCount, baseVertexArray[meshIndex]);
+		}
+		else if (draw.clusterCount > 0) {
 			// The second parameter is crucial. This is the number of face indices, not the number of faces.
-			// (numFaces * numIndicesPerFace) is the total number of elements(face indices) of this mesh.
+			// indexCount is the number of elements(face indices) of the selected LOD level of this mesh. 
 			// Now draw all the faces. We know these faces are triangle because in 
 			// importer.ReadFile(filename, aiProcessPreset_TargetRealtime_Quality);
 			// "aiProcessPreset_TargetRealtime_Quality" indicates that the 3D object will be triangulated. 
-			glDrawElements(GL_TRIANGLES, (numFaces * numIndicesPerFace), GL_UNSIGNED_INT, 0);
+			glMultiDrawElements(GL_TRIANGLES, &queuedClusterCounts[draw.firstCluster], indexTypeArray[meshIndex],
+				&queuedClusterOffsets[draw.firstCluster], (GLsizei)draw.clusterCount);
+		}
+		else {
+			glDrawElementsInstanced(GL_TRIANGLES, draw.indexCount, indexTypeArray[meshIndex],
+				BUFFER_OFFSET((getIndexSize(indexTypeArray[meshIndex]) * draw.firstIndex)), instanceCount);
+		}
 
-			// We are done with the current VAO. Move on to the next VAO, if any. 
-			glBindVertexArray(0);
+		// Uncomment this line for debugging purposes. 
+		// checkOpenGLError();
+	}
+
+	// We are done with the VAOs of the meshes. 
+	if (!useSharedMeshBuffers) {
+		glBindVertexArray(0);
+	}
+
+	numStateChangesSaved = 4 * (unsigned int)renderQueue.size() - numStateChanges;
+}
+
+//--------------------------------------------------------------------------------------------
+// Queue the mesh instances in the order of a depth-first traversal of the node tree, and draw them in the order 
+// of renderQueue. The instances whose bounding boxes are outside the view frustum are skipped. 
+void drawMeshInstances() {
+	renderQueue.clear();
+	meshDrawArray.clear();
+	queuedClusterCounts.clear();
+	queuedClusterOffsets.clear();
+	queuedClusterBaseVertices.clear();
+
+	if (!useFrustumCulling || instanceCount > 1) {
+		for (unsigned int i = 0; i < meshInstanceArray.size(); i++) {
+			queueMeshInstance(i);
 		}
+	}
+	else {
+		cullMeshInstances();
 
-	} // end if (node->mNumMeshes > 0)
+		if (useOcclusionCulling) {
+			cullOccludedMeshInstances();
+		}
+		else {
+			numMeshesOccluded = 0;
+		}
 
-	  // Uncomment this line for debugging purposes. 
-	  // checkOpenGLError();
+		for (unsigned int i : visibleMeshInstances) {
+			queueMeshInstance(i);
+		}
+	}
 
-	  // Recursively visit and draw all the child nodes. This is a depth-first traversal. 
-	  // Even if this node does not contain mesh, we still need to pass down the transformation matrix. 
-	for (unsigned int j = 0; j < node->mNumChildren; j++) {
-		nodeTreeTraversalMesh(node->mChildren[j], currentTransformMatrix);
+	if (useRenderQueue) {
+		renderQueue.sort();
+	}
+
+	submitMeshDraws();
+}
+
+//---------------------------------------------------------------
+// Write the load phases next to the 3D file, once all the meshes and textures are loaded. 
+void writeLoadProfile() {
+	loadProfileWritten = true;
+	loadProfiler.printSummary(cout);
+
+	string modelFilename = string(defaultModelFolder) + string(getFileName(objectFileName));
+	string profileFilename = modelFilename + loadProfileExtension;
+	string traceFilename = modelFilename + loadTraceExtension;
+
+	if (loadProfiler.writeJson(profileFilename.c_str()) && loadProfiler.writeChromeTrace(traceFilename.c_str())) {
+		cout << "Load profile saved to " << profileFilename << " and " << traceFilename << endl;
+	}
+	else {
+		cout << "Unable to write the load profile " << profileFilename << endl;
 	}
 }
 
@@ -1127,77 +3810,134 @@ void display() {
 	// Clear the background color and the depth buffer. 
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+	// While the 3D data is loaded in the background, only the background is drawn. 
+	if (useBackgroundLoading && !streamSceneData()) {
+		glutSwapBuffers();
+		glutPostRedisplay();
+		return;
+	}
+
+	// Replace the placeholder textures with the texture images that have been decoded since the last frame. 
+	if (numPendingTextures > 0) {
+		uploadDecodedTextures(textureUploadBudgetPerFrame);
+	}
+
 	// Activate the shader program. 
 	glUseProgram(program);
 
-	// Traverse the scene graph to update the location and direction of the camera.
-	if (scene->HasCameras()) {
-		nodeTreeTraversalCamera(scene->mRootNode, aiMatrix4x4());
+	// First create the transformation matrix that will transform the 3D objects. 
+	// Note that this transformation only applies to the meshes, not the lights and camera. 
+	// Because the transformation matrix is pass down the scene graph through the root, all the meshes are
+	// transformed. If you want to transform a specific mesh, then you need to attach the transformation matrix to 
+	// that mesh's node on the scene graph. 
+	// These rotation, translation, and scaling parameters are controlled by the mouse and keyboard, which set 
+	// userTransformDirty when they change. 
+	if (userTransformDirty) {
+		userMatrix = translate(mat4(1.0f), vec3(xTranslation, yTranslation, zTranslation));
+		userMatrix = rotate(userMatrix, radians(rotateX), vec3(1.0f, 0.0f, 0.0f));
+		userMatrix = rotate(userMatrix, radians(rotateY), vec3(0.0f, 1.0f, 0.0f));
+		userMatrix = scale(userMatrix, vec3(scaleFactor, scaleFactor, scaleFactor));
+
+		userMatrixVersion++;
+		userTransformDirty = false;
 	}
-	else {
-		// If there is no camera data in the file, create the default projection and view matrices.
-		projMatrix = perspective(radians(defaultFOV), (float)windowWidth / (float)windowHeight, defaultNearPlane, defaultFarPlane);
 
-		// Create a view matrix
-		// You specify where the camera location and orientation and GLM will create a view matrix. 
-		// The first parameter is the location of the camera; 
-		// the second is where the camera is pointing at; the third is the up vector for camera.
-		// If you need to move or animate your camera during run time, then you need to construct the 
-		// view matrix in display() function. 
-		viewMatrix = lookAt(defaultCameraPosition, defaultCameraLookAt, defaultCameraUp);
+	// The userMatrix is passed down the scene through the root node. Only the matrices that are out of date are 
+	// computed, so nothing is computed when neither the user transformation nor a node has changed. 
+	updateNodeMatrices();
+	updateMeshInstanceBounds();
 
+	// The tree is built once, when the boxes of all the instances are known. 
+	if (!sceneBvhBuilt) {
+		buildSceneBvh();
 	}
 
-	// Traverse the scene graph to upate the location and direction of the light sources. 
-	if (scene->HasLights()) 
-	{
-		nodeTreeTraversalLight(scene->mRootNode, aiMatrix4x4());
-	}
-
-	// After the lighting parameters are updated, pass them to the shader program. 
-	glUniform4fv(lightSourceLocations.position, numLights, (const float*)lightPosition);
-	glUniform4fv(lightSourceLocations.direction, numLights, (const float*)lightDirection);
-	glUniform4fv(lightSourceLocations.ambient, numLights, (const float*)lightAmbient);
-	glUniform4fv(lightSourceLocations.diffuse, numLights, (const float*)lightDiffuse);
-	glUniform4fv(lightSourceLocations.specular, numLights, (const float*)lightSpecular);
-	glUniform1fv(lightSourceLocations.constantAttenuation, numLights, lightConstantAttenuation);
-	glUniform1fv(lightSourceLocations.linearAttenuation, numLights, lightLinearAttenuation);
-	glUniform1fv(lightSourceLocations.quadraticAttenuation, numLights, lightQuadraticAttenuation);
-	glUniform1fv(lightSourceLocations.spotlightInnerCone, numLights, spotlightInnerCone);
-	glUniform1fv(lightSourceLocations.spotlightOuterCone, numLights, spotlightOuterCone);
-	glUniform1iv(lightSourceLocations.type, numLights, lightType);
-	glUniform1i(lightSourceLocations.numLights, numLights);
+	// The camera and the lights are only updated when they have moved. 
+	updateCamera();
+
+	bool lightsMoved = scene->HasLights() && updateLightsFromNodes();
+
+	// After the lighting parameters are updated, pass them to the shader program. The shader program keeps them, 
+	// so this is only done when they have changed. 
+	if (lightsDirty || lightsMoved) {
+		glUniform4fv(lightSourceLocations.position, numLights, (const float*)lightPosition);
+		glUniform4fv(lightSourceLocations.direction, numLights, (const float*)lightDirection);
+		glUniform4fv(lightSourceLocations.ambient, numLights, (const float*)lightAmbient);
+		glUniform4fv(lightSourceLocations.diffuse, numLights, (const float*)lightDiffuse);
+		glUniform4fv(lightSourceLocations.specular, numLights, (const float*)lightSpecular);
+		glUniform1fv(lightSourceLocations.constantAttenuation, numLights, lightConstantAttenuation);
+		glUniform1fv(lightSourceLocations.linearAttenuation, numLights, lightLinearAttenuation);
+		glUniform1fv(lightSourceLocations.quadraticAttenuation, numLights, lightQuadraticAttenuation);
+		glUniform1fv(lightSourceLocations.spotlightInnerCone, numLights, spotlightInnerCone);
+		glUniform1fv(lightSourceLocations.spotlightOuterCone, numLights, spotlightOuterCone);
+		glUniform1iv(lightSourceLocations.type, numLights, lightType);
+		glUniform1i(lightSourceLocations.numLights, numLights);
+		lightsDirty = false;
+	}
 
 	//*************
 	// Render scene
 
-	// First create the transformation matrix that will transform the 3D objects. 
-	// Note that this transformation only applies to the meshes, not the lights and camera. 
-	// Because the transformation matrix is pass down the scene graph through the root, all the meshes are
-	// transformed. If you want to transform a specific mesh, then you need to attach the transformation matrix to 
-	// that mesh's node on the scene graph. 
-	// These rotation, translation, and scaling parameters are controlled by the mouse and keyboard. 
-	aiMatrix4x4 rotationXMatrix = aiMatrix4x4::RotationX(radians(rotateX), rotationXMatrix);
-	aiMatrix4x4 rotationYMatrix = aiMatrix4x4::RotationY(radians(rotateY), rotationYMatrix);
-	aiMatrix4x4 scaleMatrix = aiMatrix4x4::Scaling(aiVector3D(scaleFactor, scaleFactor, scaleFactor), scaleMatrix);
-	aiMatrix4x4 translationXMatrix = aiMatrix4x4::Translation(aiVector3D(xTranslation, 0.0f, 0.0f),
-		translationXMatrix);
-	aiMatrix4x4 translationYMatrix = aiMatrix4x4::Translation(aiVector3D(0.0f, yTranslation, 0.0f),
-		translationYMatrix);
-	aiMatrix4x4 translationZMatrix = aiMatrix4x4::Translation(aiVector3D(0.0f, 0.0f, zTranslation),
-		translationZMatrix);
-	aiMatrix4x4 overallTransformationMatrix =
-		translationZMatrix * translationXMatrix * translationYMatrix * rotationXMatrix * rotationYMatrix * scaleMatrix;
-
-	// Start the node tree traversal and process each node. The overallTransformationMatrix is passed down
-	// the scene through the root node. 
-
 	if (scene->HasMeshes()) {
-		nodeTreeTraversalMesh(scene->mRootNode, overallTransformationMatrix);
+		glUniform1i(vertexDecodeLocations.octahedralNormals, useQuantizedVertices);
+
+		// With instancing, the shader applies the per-instance matrix and then the view-projection matrix. 
+		// Both only change when the camera does. 
+		glUniform1i(instancingLocations.useInstancing, instanceCount > 1);
+
+		if (viewProjCameraVersion != cameraVersion) {
+			mat4 viewProjMatrix = projMatrix * viewMatrix;
+			glUniformMatrix4fv(instancingLocations.viewProjMatrix, 1, GL_FALSE, value_ptr(viewProjMatrix));
+			viewProjCameraVersion = cameraVersion;
+
+			nearestInstanceMatrix = mat4(1.0f);
+			if (instanceCount > 1) {
+				vec3 cameraPosition = vec3(inverse(viewMatrix)[3]);
+				float nearestDistance = FLT_MAX;
+
+				for (const InstanceTransform& instance : instanceTransforms) {
+					float distance = length(vec3(instance.modelMatrix[3]) - cameraPosition);
+					if (distance < nearestDistance) {
+						nearestDistance = distance;
+						nearestInstanceMatrix = instance.modelMatrix;
+					}
+				}
+			}
+		}
+
+		// With shared mesh buffers, one VAO is bound for the whole frame.
+		if (useSharedMeshBuffers) {
+			glBindVertexArray(sharedVao);
+		}
+
+		numClustersTested = 0;
+		numClustersCulled = 0;
+
+		numMeshesTested = 0;
+		numMeshesCulled = 0;
+
+		drawMeshInstances();
+
+		if (useSharedMeshBuffers) {
+			glBindVertexArray(0);
+		}
 	}
 
 	// Swap front and back buffers. The rendered image is now displayed. 
 	glutSwapBuffers();
+
+	if (!firstSceneFrameDrawn) {
+		firstSceneFrameDrawn = true;
+		cout << "First frame with 3D data drawn " << getTimeSinceStart() << " ms after the program started." << endl;
+	}
+
+	// Keep drawing frames until all the chunks and textures are transferred. 
+	if (nextMeshUploadChunk < meshUploadQueue.size() || numPendingTextures > 0) {
+		glutPostRedisplay();
+	}
+	else if (useLoadProfiler && !loadProfileWritten) {
+		writeLoadProfile();
+	}
 }
 
 //----------------------------------------------------------------
@@ -1211,6 +3951,9 @@ void reshape(int width, int height)
 
 	windowWidth = width;
 	windowHeight = height;
+
+	// The projection matrix depends on the aspect ratio of the window. 
+	cameraDirty = true;
 }
 
 // -------------------------------------------
@@ -1221,25 +3964,88 @@ void keyboard(unsigned char key, int x, int y)
 	switch (key) {
 	case '+':
 		scaleFactor += 0.1f;
+		userTransformDirty = true;
 		break;
 	case'-':
 		scaleFactor -= 0.1f;
+		userTransformDirty = true;
 		break;
 	case 'w':
 	case 'W':
 		zTranslation -= transformationStep;
+		userTransformDirty = true;
 		break;
 	case 's':
 	case 'S':
 		zTranslation += transformationStep;
+		userTransformDirty = true;
 		break;
 	case 'a':
 	case 'A':
 		xTranslation -= transformationStep;
+		userTransformDirty = true;
 		break;
 	case 'd':
 	case 'D':
 		xTranslation += transformationStep;
+		userTransformDirty = true;
+		break;
+	case 'l':
+	case 'L':
+		useMeshLods = !useMeshLods;
+		cout << "LOD selection " << (useMeshLods ? "on" : "off") << endl;
+		break;
+	case '[':
+		lodBias -= 0.5f;
+		cout << "LOD bias " << lodBias << endl;
+		break;
+	case ']':
+		lodBias += 0.5f;
+		cout << "LOD bias " << lodBias << endl;
+		break;
+	case ',':
+		lodHysteresis = std::max(lodHysteresis - 0.05f, 0.0f);
+		cout << "LOD hysteresis " << lodHysteresis << endl;
+		break;
+	case '.':
+		lodHysteresis = std::min(lodHysteresis + 0.05f, 0.9f);
+		cout << "LOD hysteresis " << lodHysteresis << endl;
+		break;
+	case 'c':
+	case 'C':
+		useClusterCulling = !useClusterCulling;
+		cout << "Cluster culling " << (useClusterCulling ? "on" : "off") << " (" << numClustersCulled << " of "
+			<< numClustersTested << " meshlets culled in the last frame)" << endl;
+		break;
+	case 'f':
+	case 'F':
+		useFrustumCulling = !useFrustumCulling;
+		cout << "Frustum culling " << (useFrustumCulling ? "on" : "off") << " (" << numMeshesCulled << " of "
+			<< meshInstanceArray.size() << " meshes culled and " << numMeshesTested << " tested in the last frame)" << endl;
+		break;
+	case 'v':
+	case 'V':
+		useSceneBvh = !useSceneBvh;
+		cout << "Scene BVH " << (useSceneBvh ? "on" : "off") << " (" << numBvhNodesVisited << " of "
+			<< sceneBvh.getNumNodes() << " nodes visited in the last frame)" << endl;
+		break;
+	case 'o':
+	case 'O':
+		useOcclusionCulling = !useOcclusionCulling;
+		cout << "Occlusion culling " << (useOcclusionCulling ? "on" : "off") << " (" << numMeshesOccluded << " meshes culled by "
+			<< numOccluderTriangles << " occluder triangles in the last frame)" << endl;
+		break;
+	case 'r':
+	case 'R':
+		useRenderQueue = !useRenderQueue;
+		cout << "Render queue " << (useRenderQueue ? "on" : "off") << " (" << numStateChanges << " state changes sent and "
+			<< numStateChangesSaved << " saved for " << renderQueue.size() << " draws in the last frame)" << endl;
+		break;
+	case 'b':
+	case 'B':
+		if (sceneReady) {
+			benchmarkCulling();
+		}
 		break;
 	case 033: // Escape Key
 		exit(EXIT_SUCCESS);
@@ -1267,15 +4073,19 @@ void specialKeys(int key, int x, int y) {
 
 	case GLUT_KEY_UP:
 		yTranslation += transformationStep;
+		userTransformDirty = true;
 		break;
 	case GLUT_KEY_DOWN:
 		yTranslation -= transformationStep;
+		userTransformDirty = true;
 		break;
 	case GLUT_KEY_LEFT:
 		xTranslation -= transformationStep;
+		userTransformDirty = true;
 		break;
 	case GLUT_KEY_RIGHT:
 		xTranslation += transformationStep;
+		userTransformDirty = true;
 		break;
 	default:
 		break;
@@ -1304,6 +4114,7 @@ void passiveMotion(int x, int y) {
 	if (useMouse) {
 		rotateY = (float)(x - centerX) * 0.5f;
 		rotateX = (float)(y - centerY) * 0.5f;
+		userTransformDirty = true;
 
 		// Generate a dislay event to force refreshing the window. 
 		glutPostRedisplay();
@@ -1314,6 +4125,29 @@ int main(int argc, char* argv[])
 {
 	glutInit(&argc, argv);
 
+	// glutInit() removes the options it uses. The rest are ours. 
+	for (int i = 1; i < argc; i++) {
+		string option = argv[i];
+		bool hasValue = (i + 1 < argc);
+
+		if (option == "--model" && hasValue) {
+			objectFileName = argv[++i];
+		}
+		else if (option == "--instances" && hasValue) {
+			instanceCount = (unsigned int)std::max(atoi(argv[++i]), 1);
+		}
+		else if (option == "--layout" && hasValue) {
+			string layout = argv[++i];
+			instanceLayout = (layout == "random") ? instanceLayoutRandom : instanceLayoutGrid;
+		}
+		else if (option == "--spacing" && hasValue) {
+			instanceSpacing = (float)atof(argv[++i]);
+		}
+		else {
+			cout << "Unknown option " << option << ". Options: --model <file> --instances <count> --layout grid|random --spacing <distance>" << endl;
+		}
+	}
+
 	// Initialize double buffer and depth buffer. 
 	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
 
@@ -1351,10 +4185,38 @@ int main(int argc, char* argv[])
 
 		glutMainLoop();
 
+		stopSceneLoading();
+
 		//Release the dynamically allocated memory blocks. 
 		free(vaoArray);
-		free(faceArray);
-		free(textureCoordArray);
+		free(indexCountArray);
+		free(baseVertexArray);
+		free(indexOffsetArray);
+		free(indexTypeArray);
+		free(vertexDecodeArray);
+		free(vertexBufferArray);
+		free(indexBufferArray);
+		free(meshLodArray);
+		free(meshletArray);
+		free(firstMeshletArray);
+		free(meshletCountArray);
+		free(meshBoundsArray);
+		free(surfaceMaterials);
+		// Delete every texture object when its last material releases it. An image that is still being loaded has 
+		// no texture object yet. 
+		for (unsigned int i = 0; i < numMaterials; i++) {
+			if (!materialTextureEntries[i]) {
+				continue;
+			}
+
+			GLuint texture = materialTextureEntries[i]->texture;
+			if (textureCache.release(*materialTextureEntries[i]) && texture > 0) {
+				glDeleteTextures(1, &texture);
+			}
+		}
 		free(textureObjectIDArray);
+		delete textureThreadPool;
+		delete occlusionThreadPool;
+		delete cachedScene;
 	}
 }
\ No newline at end of file
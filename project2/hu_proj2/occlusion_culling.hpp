@@ -0,0 +1,301 @@
+/*
+CPU occlusion culling with a small software depth buffer.
+
+A handful of large occluders are rasterized into a low-resolution depth buffer (256 x 128 by default), and then the
+bounding boxes of the meshes are tested against a hierarchical-Z (HiZ) pyramid built from it. A box is occluded if
+its nearest point is behind the farthest occluder depth of every HiZ texel it covers, and of a border of one pixel
+around them.
+
+addOccluder() transforms the triangles of an occluder to the screen. rasterize() splits the screen into horizontal
+bands and rasterizes all the triangles into every band on its own thread, four pixels at a time with SSE. Each
+pixel is written by one thread only, and the depth test keeps the nearest depth whatever the order of the
+triangles, so the result doesn't depend on the number of threads or on their timing. Then the HiZ levels are built:
+every texel keeps the farthest depth of the 2 x 2 texels below it.
+
+Depths are window depths in [0, 1], as the default glDepthRange() gives them; 1 is the far plane. Triangles with a
+vertex behind the near plane aren't clipped but skipped, and boxes that cross the near plane are never occluded,
+so both mistakes only ever keep a mesh that could have been culled. Nothing here calls OpenGL.
+*/
+
+#ifndef OCCLUSION_CULLING_HPP
+#define OCCLUSION_CULLING_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "frustum_culling.hpp"
+#include "thread_pool.hpp"
+
+class OcclusionBuffer {
+public:
+	// width must be a multiple of 4. The screen is split into numBands bands for rasterize().
+	OcclusionBuffer(int width = 256, int height = 128, int numBands = 8)
+		: width(width), height(height), numBands(std::max(1, std::min(numBands, height))) {
+		for (int w = width, h = height; w >= 1 && h >= 1; w /= 2, h /= 2) {
+			HizLevel level;
+			level.width = w;
+			level.height = h;
+			level.depth.assign((size_t)w * h, 1.0f);
+			levels.push_back(level);
+		}
+	}
+
+	int getWidth() const {
+		return width;
+	}
+
+	int getHeight() const {
+		return height;
+	}
+
+	// The depth buffer, width * height values, row 0 at the bottom of the screen.
+	const float *getDepth() const {
+		return levels[0].depth.data();
+	}
+
+	size_t getNumTriangles() const {
+		return triangles.size();
+	}
+
+	// Remove all the occluders and clear the depth buffer to the far plane.
+	void clear() {
+		triangles.clear();
+		std::fill(levels[0].depth.begin(), levels[0].depth.end(), 1.0f);
+	}
+
+	// Add the triangles of an occluder. positions has 3 floats per vertex, and mvp is a column-major 4 x 4
+	// model-view-projection matrix (the layout of glm).
+	void addOccluder(const float *positions, const unsigned int *indices, size_t indexCount, const float *mvp) {
+		for (size_t i = 0; i + 2 < indexCount; i += 3) {
+			ScreenTriangle triangle;
+			bool inFront = true;
+
+			for (int k = 0; k < 3 && inFront; k++) {
+				const float *p = &positions[3 * indices[i + k]];
+				float clip[4];
+
+				for (int r = 0; r < 4; r++) {
+					clip[r] = mvp[r] * p[0] + mvp[4 + r] * p[1] + mvp[8 + r] * p[2] + mvp[12 + r];
+				}
+
+				inFront = (clip[3] > nearW);
+				if (inFront) {
+					triangle.x[k] = (clip[0] / clip[3] * 0.5f + 0.5f) * width;
+					triangle.y[k] = (clip[1] / clip[3] * 0.5f + 0.5f) * height;
+					triangle.z[k] = clip[2] / clip[3] * 0.5f + 0.5f;
+				}
+			}
+
+			if (inFront) {
+				triangles.push_back(triangle);
+			}
+		}
+	}
+
+	// Rasterize the occluders and build the HiZ levels. With a pool, the bands are rasterized in parallel.
+	void rasterize(ThreadPool *pool) {
+		if (pool && numBands > 1) {
+			pool->parallelFor((size_t)numBands, [this](size_t band) { rasterizeBand((int)band); });
+		}
+		else {
+			for (int band = 0; band < numBands; band++) {
+				rasterizeBand(band);
+			}
+		}
+
+		buildHiz();
+	}
+
+	// True if the box is hidden behind the occluders. viewProj is the column-major view-projection matrix the box is
+	// seen with; the box is in world space.
+	bool isBoxOccluded(const BoundingBox& box, const float *viewProj) const {
+		float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f, minDepth = 1.0f;
+
+		for (int c = 0; c < 8; c++) {
+			float p[3] = { (c & 1) ? box.max[0] : box.min[0], (c & 2) ? box.max[1] : box.min[1], (c & 4) ? box.max[2] : box.min[2] };
+			float clip[4];
+
+			for (int r = 0; r < 4; r++) {
+				clip[r] = viewProj[r] * p[0] + viewProj[4 + r] * p[1] + viewProj[8 + r] * p[2] + viewProj[12 + r];
+			}
+
+			// A box that crosses the near plane is never occluded.
+			if (clip[3] <= nearW) {
+				return false;
+			}
+
+			float x = (clip[0] / clip[3] * 0.5f + 0.5f) * width;
+			float y = (clip[1] / clip[3] * 0.5f + 0.5f) * height;
+			minX = std::min(minX, x);
+			maxX = std::max(maxX, x);
+			minY = std::min(minY, y);
+			maxY = std::max(maxY, y);
+			minDepth = std::min(minDepth, clip[2] / clip[3] * 0.5f + 0.5f);
+		}
+
+		// Every pixel the box touches is tested, even if the box doesn't cover its center, and one more pixel on every
+		// side. An occluder covers a pixel only if it covers its center, so a box seen just past the edge of an
+		// occluder can touch a pixel the occluder was rasterized into without being behind it.
+		int x0 = std::max((int)std::floor(minX) - 1, 0), x1 = std::min((int)std::floor(maxX) + 1, width - 1);
+		int y0 = std::max((int)std::floor(minY) - 1, 0), y1 = std::min((int)std::floor(maxY) + 1, height - 1);
+
+		if (x0 > x1 || y0 > y1 || minDepth <= 0.0f) {
+			return false;
+		}
+
+		// Use the finest level where the box covers at most about 8 x 8 texels. Coarser levels would be cheaper to
+		// test, but their texels reach further outside the box, so fewer boxes would be occluded.
+		size_t level = 0;
+		while (level + 1 < levels.size() && std::max(x1 - x0, y1 - y0) >= 8) {
+			x0 /= 2;
+			x1 /= 2;
+			y0 /= 2;
+			y1 /= 2;
+			level++;
+		}
+
+		const HizLevel& hiz = levels[level];
+		for (int y = y0; y <= y1; y++) {
+			for (int x = x0; x <= x1; x++) {
+				if (hiz.depth[(size_t)y * hiz.width + x] >= minDepth) {
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+private:
+	struct ScreenTriangle {
+		float x[3]; // in pixels
+		float y[3];
+		float z[3]; // window depth
+	};
+
+	struct HizLevel {
+		int width;
+		int height;
+		std::vector<float> depth;
+	};
+
+	// Triangles with a vertex this close to the camera plane are skipped; see the comment at the top.
+	static constexpr float nearW = 1e-5f;
+
+	void rasterizeBand(int band) {
+		int bandY0 = band * height / numBands;
+		int bandY1 = (band + 1) * height / numBands;
+
+		for (const ScreenTriangle& t : triangles) {
+			rasterizeTriangle(t, bandY0, bandY1);
+		}
+	}
+
+	// Rasterize one triangle into the rows [bandY0, bandY1). A pixel is covered if its center is inside the triangle.
+	void rasterizeTriangle(const ScreenTriangle& t, int bandY0, int bandY1) {
+		float area = (t.x[1] - t.x[0]) * (t.y[2] - t.y[0]) - (t.x[2] - t.x[0]) * (t.y[1] - t.y[0]);
+		if (std::fabs(area) < 1e-8f) {
+			return;
+		}
+
+		// Both windings are rasterized: the edge functions are flipped so the inside is positive.
+		float sign = (area > 0.0f) ? 1.0f : -1.0f;
+		float edgeA[3], edgeB[3], edgeC[3];
+		for (int e = 0; e < 3; e++) {
+			int i = e, j = (e + 1) % 3;
+			edgeA[e] = sign * (t.y[i] - t.y[j]);
+			edgeB[e] = sign * (t.x[j] - t.x[i]);
+			edgeC[e] = sign * (t.x[i] * t.y[j] - t.x[j] * t.y[i]);
+		}
+
+		// The depth is interpolated linearly on the screen: z = zA * x + zB * y + zC.
+		float invArea = 1.0f / area;
+		float zA = ((t.z[1] - t.z[0]) * (t.y[2] - t.y[0]) - (t.z[2] - t.z[0]) * (t.y[1] - t.y[0])) * invArea;
+		float zB = ((t.z[2] - t.z[0]) * (t.x[1] - t.x[0]) - (t.z[1] - t.z[0]) * (t.x[2] - t.x[0])) * invArea;
+		float zC = t.z[0] - zA * t.x[0] - zB * t.y[0];
+
+		// The pixels whose centers can be inside, with the first column rounded down to a multiple of 4.
+		int x0 = std::max((int)std::floor(std::min(t.x[0], std::min(t.x[1], t.x[2])) - 0.5f), 0) & ~3;
+		int x1 = std::min((int)std::ceil(std::max(t.x[0], std::max(t.x[1], t.x[2])) - 0.5f), width - 1);
+		int y0 = std::max((int)std::floor(std::min(t.y[0], std::min(t.y[1], t.y[2])) - 0.5f), bandY0);
+		int y1 = std::min((int)std::ceil(std::max(t.y[0], std::max(t.y[1], t.y[2])) - 0.5f), bandY1 - 1);
+
+		float *depth = levels[0].depth.data();
+
+		for (int y = y0; y <= y1; y++) {
+			float py = y + 0.5f;
+			float *row = &depth[(size_t)y * width];
+
+#ifdef FRUSTUM_CULLING_SSE
+			__m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+			__m128 a0 = _mm_set1_ps(edgeA[0]), a1 = _mm_set1_ps(edgeA[1]), a2 = _mm_set1_ps(edgeA[2]);
+			__m128 rowE0 = _mm_set1_ps(edgeB[0] * py + edgeC[0]);
+			__m128 rowE1 = _mm_set1_ps(edgeB[1] * py + edgeC[1]);
+			__m128 rowE2 = _mm_set1_ps(edgeB[2] * py + edgeC[2]);
+			__m128 za = _mm_set1_ps(zA), rowZ = _mm_set1_ps(zB * py + zC);
+			__m128 zero = _mm_setzero_ps();
+
+			for (int x = x0; x <= x1; x += 4) {
+				__m128 px = _mm_add_ps(_mm_set1_ps((float)x), offsets);
+				__m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), rowE0);
+				__m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), rowE1);
+				__m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), rowE2);
+				__m128 inside = _mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_and_ps(_mm_cmpge_ps(e1, zero), _mm_cmpge_ps(e2, zero)));
+
+				if (_mm_movemask_ps(inside) == 0) {
+					continue;
+				}
+
+				__m128 z = _mm_add_ps(_mm_mul_ps(za, px), rowZ);
+				__m128 old = _mm_loadu_ps(&row[x]);
+				__m128 nearest = _mm_min_ps(old, z);
+				_mm_storeu_ps(&row[x], _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+			}
+#else
+			for (int x = x0; x <= x1; x++) {
+				float px = x + 0.5f;
+
+				if (edgeA[0] * px + edgeB[0] * py + edgeC[0] >= 0.0f && edgeA[1] * px + edgeB[1] * py + edgeC[1] >= 0.0f &&
+					edgeA[2] * px + edgeB[2] * py + edgeC[2] >= 0.0f) {
+					row[x] = std::min(row[x], zA * px + zB * py + zC);
+				}
+			}
+#endif
+		}
+	}
+
+	// Every texel of a level keeps the farthest depth of the texels it covers in the level below. With an odd size,
+	// the last row or column of the level below is folded into the last texel.
+	void buildHiz() {
+		for (size_t l = 1; l < levels.size(); l++) {
+			const HizLevel& below = levels[l - 1];
+			HizLevel& level = levels[l];
+
+			for (int y = 0; y < level.height; y++) {
+				int sy1 = (y == level.height - 1) ? below.height - 1 : 2 * y + 1;
+
+				for (int x = 0; x < level.width; x++) {
+					int sx1 = (x == level.width - 1) ? below.width - 1 : 2 * x + 1;
+					float farthest = 0.0f;
+
+					for (int sy = 2 * y; sy <= sy1; sy++) {
+						for (int sx = 2 * x; sx <= sx1; sx++) {
+							farthest = std::max(farthest, below.depth[(size_t)sy * below.width + sx]);
+						}
+					}
+
+					level.depth[(size_t)y * level.width + x] = farthest;
+				}
+			}
+		}
+	}
+
+	int width;
+	int height;
+	int numBands;
+	std::vector<ScreenTriangle> triangles;
+	std::vector<HizLevel> levels; // level 0 is the depth buffer
+};
+
+#endif
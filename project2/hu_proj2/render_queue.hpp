@@ -0,0 +1,115 @@
+/*
+A render queue that sorts the draws of a frame by the state they need.
+
+While the scene is traversed, every draw is pushed as a packet: a 64-bit sort key and the index of the draw in the
+caller's own array. The key packs, from the most significant bits down, the shader, the texture, the material, the
+mesh (its VAO, or its vertex decode uniforms with shared buffers) and the depth:
+
+	| shader: 4 | texture: 12 | material: 12 | mesh: 12 | depth: 24 |
+
+so sorting the keys groups the draws that share the most expensive state, and the draws with the same state are
+drawn front to back. A value too large for its field is clamped. Packets with a clamped value may not be grouped
+as well, but nothing else changes: the caller compares the real state of each draw with the state already bound.
+
+sort() is an LSD radix sort, one pass per byte of the key. A pass where every key has the same byte is skipped, so a
+scene with one shader and a few materials mostly costs the depth passes. The sort is stable: packets with the same
+key keep the order they were pushed in.
+*/
+
+#ifndef RENDER_QUEUE_HPP
+#define RENDER_QUEUE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#include <stdint.h>
+
+struct RenderPacket {
+	uint64_t key;
+	unsigned int item; // the index of the draw in the caller's array
+};
+
+class RenderQueue {
+public:
+	// Pack the state of a draw into a sort key. depth is the window depth in [0, 1], 0 at the near plane.
+	static uint64_t makeKey(unsigned int shader, unsigned int texture, unsigned int material, unsigned int mesh, float depth) {
+		const float maxDepth = (float)((1u << depthBits) - 1);
+		uint64_t quantizedDepth = (uint64_t)(std::min(std::max(depth, 0.0f), 1.0f) * maxDepth);
+
+		return (clampField(shader, shaderBits) << (textureBits + materialBits + meshBits + depthBits)) |
+			(clampField(texture, textureBits) << (materialBits + meshBits + depthBits)) |
+			(clampField(material, materialBits) << (meshBits + depthBits)) |
+			(clampField(mesh, meshBits) << depthBits) |
+			quantizedDepth;
+	}
+
+	void clear() {
+		packets.clear();
+	}
+
+	void push(uint64_t key, unsigned int item) {
+		RenderPacket packet = { key, item };
+		packets.push_back(packet);
+	}
+
+	// Sort the packets by their keys. Returns the number of radix passes that weren't skipped.
+	unsigned int sort() {
+		unsigned int numPasses = 0;
+
+		scratch.resize(packets.size());
+
+		for (int shift = 0; shift < 64; shift += 8) {
+			size_t counts[256] = { 0 };
+
+			for (const RenderPacket& packet : packets) {
+				counts[(packet.key >> shift) & 0xff]++;
+			}
+
+			// Every key has the same byte here, so this pass wouldn't move anything.
+			if (packets.empty() || counts[(packets[0].key >> shift) & 0xff] == packets.size()) {
+				continue;
+			}
+
+			size_t offset = 0;
+			for (int b = 0; b < 256; b++) {
+				size_t count = counts[b];
+				counts[b] = offset;
+				offset += count;
+			}
+
+			for (const RenderPacket& packet : packets) {
+				scratch[counts[(packet.key >> shift) & 0xff]++] = packet;
+			}
+
+			packets.swap(scratch);
+			numPasses++;
+		}
+
+		return numPasses;
+	}
+
+	size_t size() const {
+		return packets.size();
+	}
+
+	const std::vector<RenderPacket>& getPackets() const {
+		return packets;
+	}
+
+private:
+	static const int shaderBits = 4;
+	static const int textureBits = 12;
+	static const int materialBits = 12;
+	static const int meshBits = 12;
+	static const int depthBits = 24;
+
+	static uint64_t clampField(unsigned int value, int bits) {
+		return std::min((uint64_t)value, ((uint64_t)1 << bits) - 1);
+	}
+
+	std::vector<RenderPacket> packets;
+	std::vector<RenderPacket> scratch;
+};
+
+#endif
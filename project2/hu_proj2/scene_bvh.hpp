@@ -0,0 +1,360 @@
+/*
+A bounding volume hierarchy over the bounding boxes of the mesh instances of a scene, for view-frustum culling.
+
+build() splits the items top-down with the surface area heuristic (SAH): the centroids of the boxes of a node are
+sorted into bins along each axis, and the node is split at the bin boundary with the smallest
+area(left) * count(left) + area(right) * count(right). The cost of the split, in box tests, is
+
+	traversalCost + (area(left) * count(left) + area(right) * count(right)) / area(node)
+
+since a child is reached about as often as its area is a part of the area of the node. A node with at most
+maxLeafItems items becomes a leaf when this isn't cheaper than testing its count(node) items one by one; a larger
+node is always split if it can be. The items are partitioned in place, so the items of every node, not only of
+the leaves, are one range of getItemOrder(), and the two children of a node are stored next to each other after it.
+
+When the boxes of some items change, setItemBounds() marks their leaves, and refit() recomputes the boxes of the
+marked nodes and their ancestors in one backward pass over the nodes. The tree isn't rebuilt, so it gets looser
+if the items move far, but culling stays correct.
+
+cull() walks the tree from the root. A node outside the frustum is skipped with its whole subtree, and all the
+items of a node inside the frustum are visible without testing anything below it.
+*/
+
+#ifndef SCENE_BVH_HPP
+#define SCENE_BVH_HPP
+
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+#include "frustum_culling.hpp"
+
+// The work done by one cull().
+struct SceneBvhCullStats {
+	unsigned int nodesVisited;
+	unsigned int itemsTested; // the items tested one by one, in leaves that cross the frustum
+	unsigned int itemsVisible;
+};
+
+class SceneBvh {
+public:
+	SceneBvh() : anyDirty(false) {}
+
+	// Build the tree over the boxes of the items. Item i is reported to cull() as i.
+	void build(const std::vector<BoundingBox>& bounds) {
+		itemBounds = bounds;
+		itemOrder.resize(bounds.size());
+		itemLeaf.resize(bounds.size());
+		nodes.clear();
+		anyDirty = false;
+
+		for (unsigned int i = 0; i < (unsigned int)bounds.size(); i++) {
+			itemOrder[i] = i;
+		}
+
+		if (bounds.empty()) {
+			return;
+		}
+
+		Node root;
+		root.firstItem = 0;
+		root.itemCount = (unsigned int)bounds.size();
+		root.leftChild = 0;
+		root.parent = 0;
+		nodes.push_back(root);
+
+		// Split the nodes in the order they were created, so the children always come after their parent.
+		for (size_t n = 0; n < nodes.size(); n++) {
+			splitNode((unsigned int)n);
+		}
+
+		nodeDirty.assign(nodes.size(), 0);
+	}
+
+	// Change the box of an item. The boxes of the tree are updated by the next refit().
+	void setItemBounds(unsigned int item, const BoundingBox& bounds) {
+		itemBounds[item] = bounds;
+		nodeDirty[itemLeaf[item]] = 1;
+		anyDirty = true;
+	}
+
+	// Recompute the boxes of the nodes whose items have changed since the last refit(), and of their ancestors.
+	// Returns the number of nodes recomputed.
+	unsigned int refit() {
+		if (!anyDirty) {
+			return 0;
+		}
+
+		unsigned int numRefitted = 0;
+
+		// The children of a node come after it, so a backward pass sees every child before its parent.
+		for (size_t n = nodes.size(); n > 0; n--) {
+			Node& node = nodes[n - 1];
+
+			if (!nodeDirty[n - 1]) {
+				continue;
+			}
+
+			if (node.leftChild == 0) {
+				node.bounds = computeItemBounds(node.firstItem, node.itemCount);
+			}
+			else {
+				node.bounds = mergeBounds(nodes[node.leftChild].bounds, nodes[node.leftChild + 1].bounds);
+			}
+
+			nodeDirty[n - 1] = 0;
+			if (n - 1 > 0) {
+				nodeDirty[node.parent] = 1;
+			}
+			numRefitted++;
+		}
+
+		anyDirty = false;
+
+		return numRefitted;
+	}
+
+	// Call visit(item) for every item whose box isn't outside the frustum. The items are reported in tree order.
+	template <typename Visit>
+	SceneBvhCullStats cull(const FrustumPlanes& frustum, Visit visit) {
+		SceneBvhCullStats stats = { 0, 0, 0 };
+
+		if (nodes.empty()) {
+			return stats;
+		}
+
+		stack.clear();
+		stack.push_back(0);
+
+		while (!stack.empty()) {
+			const Node& node = nodes[stack.back()];
+			stack.pop_back();
+			stats.nodesVisited++;
+
+			if (isBoxOutsideFrustum(node.bounds, frustum)) {
+				continue;
+			}
+
+			if (isBoxInsideFrustum(node.bounds, frustum)) {
+				for (unsigned int i = 0; i < node.itemCount; i++) {
+					visit(itemOrder[node.firstItem + i]);
+				}
+				stats.itemsVisible += node.itemCount;
+				continue;
+			}
+
+			if (node.leftChild == 0) {
+				for (unsigned int i = 0; i < node.itemCount; i++) {
+					unsigned int item = itemOrder[node.firstItem + i];
+					stats.itemsTested++;
+
+					if (!isBoxOutsideFrustum(itemBounds[item], frustum)) {
+						visit(item);
+						stats.itemsVisible++;
+					}
+				}
+				continue;
+			}
+
+			// The left child is visited first.
+			stack.push_back(node.leftChild + 1);
+			stack.push_back(node.leftChild);
+		}
+
+		return stats;
+	}
+
+	size_t getNumNodes() const {
+		return nodes.size();
+	}
+
+	size_t getNumItems() const {
+		return itemOrder.size();
+	}
+
+	const std::vector<unsigned int>& getItemOrder() const {
+		return itemOrder;
+	}
+
+private:
+	struct Node {
+		BoundingBox bounds;
+		unsigned int firstItem; // the items of the node are itemOrder[firstItem, firstItem + itemCount)
+		unsigned int itemCount;
+		unsigned int leftChild; // 0 for a leaf; the right child is leftChild + 1
+		unsigned int parent;
+	};
+
+	static const int numBins = 16;
+
+	// A node with at most this many items isn't split when testing its items is cheaper than a split.
+	static const unsigned int maxLeafItems = 8;
+
+	// The cost of splitting a node, relative to testing the box of one item: whenever the node crosses the frustum,
+	// the boxes of both its children are tested.
+	static constexpr float traversalCost = 2.0f;
+
+	static float getHalfArea(const BoundingBox& box) {
+		float dx = box.max[0] - box.min[0], dy = box.max[1] - box.min[1], dz = box.max[2] - box.min[2];
+		return dx * dy + dy * dz + dz * dx;
+	}
+
+	static BoundingBox mergeBounds(const BoundingBox& a, const BoundingBox& b) {
+		BoundingBox result;
+
+		for (int k = 0; k < 3; k++) {
+			result.min[k] = std::min(a.min[k], b.min[k]);
+			result.max[k] = std::max(a.max[k], b.max[k]);
+		}
+
+		return result;
+	}
+
+	static BoundingBox getEmptyBounds() {
+		BoundingBox box = { { FLT_MAX, FLT_MAX, FLT_MAX }, { -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+		return box;
+	}
+
+	BoundingBox computeItemBounds(unsigned int firstItem, unsigned int itemCount) const {
+		BoundingBox bounds = getEmptyBounds();
+
+		for (unsigned int i = 0; i < itemCount; i++) {
+			bounds = mergeBounds(bounds, itemBounds[itemOrder[firstItem + i]]);
+		}
+
+		return bounds;
+	}
+
+	float getCentroid(unsigned int item, int axis) const {
+		return 0.5f * (itemBounds[item].min[axis] + itemBounds[item].max[axis]);
+	}
+
+	// Compute the box of a node, and split it into two children if the SAH finds a split cheaper than a leaf.
+	void splitNode(unsigned int nodeIndex) {
+		unsigned int firstItem = nodes[nodeIndex].firstItem;
+		unsigned int itemCount = nodes[nodeIndex].itemCount;
+
+		nodes[nodeIndex].bounds = computeItemBounds(firstItem, itemCount);
+
+		if (itemCount <= 1) {
+			makeLeaf(nodeIndex);
+			return;
+		}
+
+		BoundingBox centroidBounds = getEmptyBounds();
+		for (unsigned int i = 0; i < itemCount; i++) {
+			unsigned int item = itemOrder[firstItem + i];
+
+			for (int k = 0; k < 3; k++) {
+				float centroid = getCentroid(item, k);
+				centroidBounds.min[k] = std::min(centroidBounds.min[k], centroid);
+				centroidBounds.max[k] = std::max(centroidBounds.max[k], centroid);
+			}
+		}
+
+		// Find the cheapest bin boundary on every axis.
+		float bestCost = FLT_MAX;
+		int bestAxis = -1, bestSplit = 0;
+
+		for (int axis = 0; axis < 3; axis++) {
+			float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+			if (extent <= 0.0f) {
+				continue;
+			}
+
+			BoundingBox binBounds[numBins];
+			unsigned int binCounts[numBins] = { 0 };
+			for (int b = 0; b < numBins; b++) {
+				binBounds[b] = getEmptyBounds();
+			}
+
+			for (unsigned int i = 0; i < itemCount; i++) {
+				unsigned int item = itemOrder[firstItem + i];
+				int b = getBin(getCentroid(item, axis), centroidBounds.min[axis], extent);
+				binBounds[b] = mergeBounds(binBounds[b], itemBounds[item]);
+				binCounts[b]++;
+			}
+
+			// Sweep from the right to get the cost of every right side, then from the left.
+			float rightCosts[numBins];
+			BoundingBox rightBounds = getEmptyBounds();
+			unsigned int rightCount = 0;
+			for (int b = numBins - 1; b > 0; b--) {
+				rightBounds = mergeBounds(rightBounds, binBounds[b]);
+				rightCount += binCounts[b];
+				rightCosts[b] = rightCount ? getHalfArea(rightBounds) * rightCount : 0.0f;
+			}
+
+			BoundingBox leftBounds = getEmptyBounds();
+			unsigned int leftCount = 0;
+			for (int b = 0; b < numBins - 1; b++) {
+				leftBounds = mergeBounds(leftBounds, binBounds[b]);
+				leftCount += binCounts[b];
+
+				if (leftCount == 0 || leftCount == itemCount) {
+					continue;
+				}
+
+				float cost = getHalfArea(leftBounds) * leftCount + rightCosts[b + 1];
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = b + 1;
+				}
+			}
+		}
+
+		// bestCost is the area-weighted item count of the children. A node without area (all the boxes are the
+		// same point) gives every split the weight of all its items.
+		float nodeArea = getHalfArea(nodes[nodeIndex].bounds);
+		float splitCost = traversalCost + ((nodeArea > 0.0f) ? bestCost / nodeArea : (float)itemCount);
+		float leafCost = (float)itemCount;
+		if (bestAxis < 0 || (itemCount <= maxLeafItems && splitCost >= leafCost)) {
+			makeLeaf(nodeIndex);
+			return;
+		}
+
+		// Partition the items of the node: the bins before bestSplit go to the left child.
+		float extent = centroidBounds.max[bestAxis] - centroidBounds.min[bestAxis];
+		unsigned int *begin = &itemOrder[firstItem];
+		unsigned int *middle = std::partition(begin, begin + itemCount, [&](unsigned int item) {
+			return getBin(getCentroid(item, bestAxis), centroidBounds.min[bestAxis], extent) < bestSplit;
+		});
+		unsigned int leftCount = (unsigned int)(middle - begin);
+
+		Node left, right;
+		left.firstItem = firstItem;
+		left.itemCount = leftCount;
+		right.firstItem = firstItem + leftCount;
+		right.itemCount = itemCount - leftCount;
+		left.leftChild = right.leftChild = 0;
+		left.parent = right.parent = nodeIndex;
+
+		nodes[nodeIndex].leftChild = (unsigned int)nodes.size();
+		nodes.push_back(left);
+		nodes.push_back(right);
+	}
+
+	void makeLeaf(unsigned int nodeIndex) {
+		const Node& node = nodes[nodeIndex];
+
+		for (unsigned int i = 0; i < node.itemCount; i++) {
+			itemLeaf[itemOrder[node.firstItem + i]] = nodeIndex;
+		}
+	}
+
+	static int getBin(float centroid, float minValue, float extent) {
+		int b = (int)((centroid - minValue) / extent * numBins);
+		return std::min(std::max(b, 0), numBins - 1);
+	}
+
+	std::vector<Node> nodes;
+	std::vector<BoundingBox> itemBounds;
+	std::vector<unsigned int> itemOrder;
+	std::vector<unsigned int> itemLeaf; // the leaf of every item
+	std::vector<unsigned char> nodeDirty;
+	std::vector<unsigned int> stack;
+	bool anyDirty;
+};
+
+#endif
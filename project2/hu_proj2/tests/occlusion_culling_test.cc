@@ -0,0 +1,143 @@
+/*
+Tests of the software occlusion buffer in occlusion_culling.hpp.
+
+Nothing here needs OpenGL, so the test builds on its own: run "make test" in this directory. It checks that the
+depth buffer doesn't depend on the number of bands or threads, that a box behind a full-screen occluder is culled
+while one in front of it isn't, and that a box crossing the near plane is never culled.
+
+project1 keeps its own copy of the header, so the Makefile builds this test once against each copy, picked with -I.
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "occlusion_culling.hpp"
+
+static int numFailures = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			numFailures++; \
+		} \
+	} while (0)
+
+//-----------------------------------------------------------------
+// A column-major perspective projection looking down -z, as glm::perspective() builds it.
+static void makePerspective(float fovY, float aspect, float zNear, float zFar, float *matrix) {
+	float f = 1.0f / std::tan(fovY * 0.5f);
+
+	for (int i = 0; i < 16; i++) {
+		matrix[i] = 0.0f;
+	}
+	matrix[0] = f / aspect;
+	matrix[5] = f;
+	matrix[10] = (zFar + zNear) / (zNear - zFar);
+	matrix[11] = -1.0f;
+	matrix[14] = 2.0f * zFar * zNear / (zNear - zFar);
+}
+
+// A quad in the plane z, large enough to cover the whole screen from the origin.
+static void addFullScreenQuad(OcclusionBuffer& buffer, float z, const float *viewProj) {
+	float positions[] = { -100.0f, -100.0f, z, 100.0f, -100.0f, z, 100.0f, 100.0f, z, -100.0f, 100.0f, z };
+	unsigned int indices[] = { 0, 1, 2, 0, 2, 3 };
+
+	buffer.addOccluder(positions, indices, 6, viewProj);
+}
+
+static BoundingBox makeBox(float x0, float y0, float z0, float x1, float y1, float z1) {
+	BoundingBox box = { { x0, y0, z0 }, { x1, y1, z1 } };
+	return box;
+}
+
+//-----------------------------------------------------------------
+// The same occluders give a byte-identical depth buffer with one band on this thread and with many bands on a pool.
+static void testDepthIndependentOfThreads(const float *viewProj) {
+	std::vector<float> positions;
+	std::vector<unsigned int> indices;
+	unsigned int seed = 12345;
+
+	// Overlapping triangles at many depths, so the order of the depth tests matters if anything does.
+	for (unsigned int t = 0; t < 2000; t++) {
+		for (int k = 0; k < 3; k++) {
+			float p[3];
+
+			for (int c = 0; c < 3; c++) {
+				seed = seed * 1664525u + 1013904223u;
+				p[c] = (float)(seed >> 8) / (float)(1u << 24);
+			}
+
+			positions.push_back(p[0] * 8.0f - 4.0f);
+			positions.push_back(p[1] * 6.0f - 3.0f);
+			positions.push_back(-2.0f - p[2] * 20.0f);
+			indices.push_back(3 * t + k);
+		}
+	}
+
+	OcclusionBuffer serial(256, 128, 1);
+	OcclusionBuffer parallel(256, 128, 16);
+	ThreadPool pool(4);
+
+	serial.addOccluder(positions.data(), indices.data(), indices.size(), viewProj);
+	parallel.addOccluder(positions.data(), indices.data(), indices.size(), viewProj);
+	serial.rasterize(NULL);
+	parallel.rasterize(&pool);
+
+	CHECK(serial.getNumTriangles() == 2000);
+	CHECK(memcmp(serial.getDepth(), parallel.getDepth(), sizeof(float) * 256 * 128) == 0);
+
+	// Something was drawn, or the comparison above proves nothing.
+	bool anyWritten = false;
+	for (int i = 0; i < 256 * 128; i++) {
+		anyWritten = anyWritten || (serial.getDepth()[i] < 1.0f);
+	}
+	CHECK(anyWritten);
+}
+
+// A box behind a full-screen quad is occluded; one between the camera and the quad isn't.
+static void testBoxBehindAndInFront(const float *viewProj) {
+	OcclusionBuffer buffer;
+	ThreadPool pool(4);
+
+	addFullScreenQuad(buffer, -10.0f, viewProj);
+	buffer.rasterize(&pool);
+
+	CHECK(buffer.isBoxOccluded(makeBox(-1.0f, -1.0f, -14.0f, 1.0f, 1.0f, -12.0f), viewProj));
+	CHECK(buffer.isBoxOccluded(makeBox(-50.0f, -50.0f, -60.0f, 50.0f, 50.0f, -40.0f), viewProj));
+	CHECK(!buffer.isBoxOccluded(makeBox(-1.0f, -1.0f, -6.0f, 1.0f, 1.0f, -4.0f), viewProj));
+
+	// A box that reaches in front of the quad is visible, even if most of it is behind.
+	CHECK(!buffer.isBoxOccluded(makeBox(-1.0f, -1.0f, -14.0f, 1.0f, 1.0f, -9.0f), viewProj));
+}
+
+// A box crossing the near plane is never occluded, even if all of it in front of the camera is behind the quad.
+static void testBoxCrossingNearPlane(const float *viewProj) {
+	OcclusionBuffer buffer;
+
+	addFullScreenQuad(buffer, -10.0f, viewProj);
+	buffer.rasterize(NULL);
+
+	CHECK(!buffer.isBoxOccluded(makeBox(-1.0f, -1.0f, -14.0f, 1.0f, 1.0f, 1.0f), viewProj));
+	CHECK(!buffer.isBoxOccluded(makeBox(-1.0f, -1.0f, -14.0f, 1.0f, 1.0f, -0.05f), viewProj));
+	CHECK(!buffer.isBoxOccluded(makeBox(5.0f, 5.0f, -0.5f, 6.0f, 6.0f, 0.5f), viewProj));
+}
+
+int main() {
+	float viewProj[16];
+	makePerspective(1.0f, 2.0f, 0.1f, 100.0f, viewProj);
+
+	testDepthIndependentOfThreads(viewProj);
+	testBoxBehindAndInFront(viewProj);
+	testBoxCrossingNearPlane(viewProj);
+
+	if (numFailures > 0) {
+		printf("%d checks failed.\n", numFailures);
+		return 1;
+	}
+
+	printf("All occlusion culling tests passed.\n");
+	return 0;
+}
@@ -0,0 +1,123 @@
+/*
+A cache of texture objects, keyed by the resolved path of the image file and the load flags.
+
+Materials that use the same image with the same flags share one texture object. acquire() returns the entry of
+an image and adds a reference to it; on a miss the entry is new and its texture is 0, and the caller loads the
+image and stores the texture object in it. release() takes the entry back and removes a reference, and when the
+last reference is gone the entry is removed and the caller deletes the texture object. The entry knows its own
+key, so a release is one hash lookup, and entries whose images couldn't be loaded (texture 0) aren't confused.
+
+The cache counts the hits and misses, and the bytes of texture memory saved by the hits: every hit saves the
+size of the texture of its entry. The cache doesn't call any OpenGL function.
+*/
+
+#ifndef TEXTURE_CACHE_HPP
+#define TEXTURE_CACHE_HPP
+
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+
+struct TextureCacheEntry {
+	unsigned int texture; // 0 until the image is loaded, or if it can't be loaded
+	size_t size; // the size of the texture object in bytes, with all its mipmaps
+	unsigned int refCount;
+	unsigned int hits;
+	std::string key; // the key of the entry in the cache
+};
+
+class TextureCache {
+public:
+	TextureCache() : numHits(0), numMisses(0) {}
+
+	// Return the entry of an image and add a reference to it. hit is false if the entry was just created.
+	// The entry stays at the same address until it's removed.
+	TextureCacheEntry& acquire(const std::string& path, unsigned int flags, bool& hit) {
+		std::string key = resolvePath(path) + "|" + std::to_string(flags);
+		auto found = entries.find(key);
+
+		hit = (found != entries.end());
+
+		if (hit) {
+			numHits++;
+			found->second.hits++;
+			found->second.refCount++;
+			return found->second;
+		}
+
+		numMisses++;
+
+		TextureCacheEntry& entry = entries[key];
+		entry.texture = 0;
+		entry.size = 0;
+		entry.refCount = 1;
+		entry.hits = 0;
+		entry.key = key;
+
+		return entry;
+	}
+
+	// Remove a reference to an entry returned by acquire(). Returns true if it was the last reference; then the
+	// entry is removed, so the caller must read its texture first, and the texture object should be deleted.
+	bool release(TextureCacheEntry& entry) {
+		if (--entry.refCount > 0) {
+			return false;
+		}
+
+		// Copy the key: it's destroyed with the entry.
+		std::string key = entry.key;
+		entries.erase(key);
+		return true;
+	}
+
+	size_t size() const {
+		return entries.size();
+	}
+
+	size_t getBytesSaved() const {
+		size_t bytes = 0;
+
+		for (const auto& entry : entries) {
+			bytes += entry.second.size * entry.second.hits;
+		}
+
+		return bytes;
+	}
+
+	void printStatistics(std::ostream& out) const {
+		out << "Texture cache: " << entries.size() << " textures, " << numHits << " hits, " << numMisses << " misses, "
+			<< getBytesSaved() << " bytes saved." << std::endl;
+	}
+
+	// Use the same key for every spelling of a path: forward slashes, and no "./" components.
+	// Paths on Windows are case insensitive.
+	static std::string resolvePath(const std::string& path) {
+		std::string resolved;
+		resolved.reserve(path.size());
+
+		for (size_t i = 0; i < path.size(); i++) {
+			char c = (path[i] == '\\') ? '/' : path[i];
+#ifdef _WIN32
+			c = (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+#endif
+			resolved += c;
+		}
+
+		for (size_t i = resolved.find("/./"); i != std::string::npos; i = resolved.find("/./")) {
+			resolved.erase(i, 2);
+		}
+		while (resolved.compare(0, 2, "./") == 0) {
+			resolved.erase(0, 2);
+		}
+
+		return resolved;
+	}
+
+private:
+	std::unordered_map<std::string, TextureCacheEntry> entries;
+	unsigned int numHits;
+	unsigned int numMisses;
+};
+
+#endif
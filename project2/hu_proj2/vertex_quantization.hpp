@@ -0,0 +1,92 @@
+/*
+Helper functions for the quantized vertex format.
+
+Positions and texture coordinates are stored as 16-bit unsigned normalized integers relative to the
+bounding box of the mesh: value = offset + (q / 65535) * scale. The offset and scale of each mesh
+are passed to the vertex shader, which converts the values back.
+
+Normals are stored with the octahedral encoding: the unit sphere is projected onto an octahedron,
+which is unfolded into a square, so a normal takes two 16-bit signed normalized integers.
+*/
+
+#ifndef VERTEX_QUANTIZATION_HPP
+#define VERTEX_QUANTIZATION_HPP
+
+#include <cmath>
+#include <cstddef>
+
+#include <stdint.h>
+
+//-----------------------------------------------------------------------------------
+// Find the offset (minimum) and scale (maximum - minimum) of numComponents consecutive floats
+// in count elements that are stride floats apart.
+inline void computeQuantizationRange(const float *values, size_t count, size_t stride, size_t numComponents,
+	float *offset, float *scale) {
+	for (size_t k = 0; k < numComponents; k++) {
+		float minValue = 0.0f, maxValue = 0.0f;
+
+		for (size_t i = 0; i < count; i++) {
+			float value = values[i * stride + k];
+
+			if (i == 0 || value < minValue) {
+				minValue = value;
+			}
+			if (i == 0 || value > maxValue) {
+				maxValue = value;
+			}
+		}
+
+		offset[k] = minValue;
+		scale[k] = maxValue - minValue;
+	}
+}
+
+//-----------------------------------------------------------------
+// Quantize a value in [offset, offset + scale] to a 16-bit unsigned normalized integer.
+inline uint16_t quantizeUnorm16(float value, float offset, float scale) {
+	if (scale <= 0.0f) {
+		return 0;
+	}
+
+	float normalized = (value - offset) / scale;
+	normalized = normalized < 0.0f ? 0.0f : (normalized > 1.0f ? 1.0f : normalized);
+
+	return (uint16_t)(normalized * 65535.0f + 0.5f);
+}
+
+//-----------------------------------------------------------------
+// Quantize a value in [-1, 1] to a 16-bit signed normalized integer.
+inline int16_t quantizeSnorm16(float value) {
+	value = value < -1.0f ? -1.0f : (value > 1.0f ? 1.0f : value);
+
+	return (int16_t)(value >= 0.0f ? value * 32767.0f + 0.5f : value * 32767.0f - 0.5f);
+}
+
+//-----------------------------------------------------------------
+// Encode a normal with the octahedral encoding. The normal doesn't need to be normalized.
+// A zero vector is encoded as (0, 0), which decodes to (0, 0, 1).
+inline void encodeOctahedralNormal(const float *normal, int16_t *encoded) {
+	float length = std::fabs(normal[0]) + std::fabs(normal[1]) + std::fabs(normal[2]);
+
+	if (length <= 0.0f) {
+		encoded[0] = encoded[1] = 0;
+		return;
+	}
+
+	// Project onto the octahedron |x| + |y| + |z| = 1.
+	float x = normal[0] / length;
+	float y = normal[1] / length;
+
+	// Fold the lower half of the octahedron over the upper half.
+	if (normal[2] < 0.0f) {
+		float foldedX = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float foldedY = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = foldedX;
+		y = foldedY;
+	}
+
+	encoded[0] = quantizeSnorm16(x);
+	encoded[1] = quantizeSnorm16(y);
+}
+
+#endif
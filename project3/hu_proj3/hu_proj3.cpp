@@ -26,6 +26,16 @@
 #include <unordered_map>
 #include <chrono>
 #include <thread>
+#include <atomic>
+#include <exception>
+
+#include "obj_parser.hpp"
+#include "vertex_quantization.hpp"
+#include "mesh_optimizer.hpp"
+#include "vertex_dedup.hpp"
+#include "mesh_simplifier.hpp"
+#include "meshlet_builder.hpp"
+#include "texture_container.hpp"
 
 const int WIDTH = 800;
 const int HEIGHT = 600;
@@ -34,6 +44,48 @@ const int HEIGHT = 600;
 const std::string MODEL_PATH = "../models/pyramid.obj";
 const std::string TEXTURE_PATH = "../textures/chalet.jpg";
 
+// Parse OBJ files with ParallelObjParser instead of tinyobj::LoadObj().
+const bool useParallelObjParser = true;
+
+// Remove duplicate vertices on all the loader threads when a model has at least this many indices.
+const bool useParallelVertexDedup = true;
+const size_t parallelVertexDedupMinIndices = 1 << 20;
+
+// Reorder the triangles and vertices of the model for the vertex cache, overdraw, and vertex fetch.
+const bool optimizeModelMesh = true;
+
+// Store the vertices in the 12-byte QuantizedVertex format instead of the 32-byte Vertex format.
+const bool useQuantizedVertices = true;
+
+// Build up to maxLodLevels simplified levels of the model. A level is picked every frame from the size of
+// the model on the screen. The LOD selection (L), bias ([ and ]), and hysteresis (, and .) can be changed at run time.
+const bool buildModelLods = true;
+const float lodPixelThreshold = 1.0f;
+
+// Split every LOD level of the model into meshlets, and draw only the meshlets that are inside the view frustum
+// and not facing away from the camera. Cluster culling (C) can be turned on and off at run time.
+const bool buildModelMeshlets = true;
+
+// Load the model on a background thread while the window already draws frames, then copy it to the
+// vertex and index buffers in slices of at most uploadBudgetPerFrame bytes per frame.
+const bool useBackgroundLoading = true;
+const VkDeviceSize uploadBudgetPerFrame = 4 * 1024 * 1024;
+
+// Load the texture from a BC1/BC3/BC7 texture container with all its mipmaps, when the device supports BC textures.
+// The container is memory-mapped and its levels are copied to the image as they are. A missing or out-of-date
+// container is created from the texture image the first time. See texture_container.hpp.
+const bool useCompressedTextures = true;
+
+// Draw instanceCount copies of the model with one instanced draw per index range. Every copy gets its own model
+// matrix from the instance buffer, which is bound with the instance input rate next to the vertex buffer. The copies
+// are placed in a square grid, or scattered randomly with random rotations, instanceSpacing apart.
+// These are set on the command line: --instances <count> --layout grid|random --spacing <distance>
+enum InstanceLayout { instanceLayoutGrid, instanceLayoutRandom };
+
+uint32_t instanceCount = 1;
+InstanceLayout instanceLayout = instanceLayoutGrid;
+float instanceSpacing = 2.5f;
+
 const std::vector<const char*> validationLayers = {
 	"VK_LAYER_LUNARG_standard_validation"
 };
@@ -120,24 +172,181 @@ struct Vertex {
 	}
 };
 
-namespace std {
-	template<> struct hash<Vertex> {
-		size_t operator()(Vertex const& vertex) const {
-			return ((hash<glm::vec3>()(vertex.pos) ^ (hash<glm::vec3>()(vertex.color) << 1)) >> 1) ^ (hash<glm::vec2>()(vertex.texCoord) << 1);
+// The quantized vertex format. The position and texture coordinates are 16-bit unsigned normalized
+// values relative to the bounding box of the model, which the vertex shader converts back with the
+// offsets and scales in the UniformBufferObject. The color of Vertex is always white, so it is left out.
+struct QuantizedVertex {
+	uint16_t pos[4]; // The 4th value is padding, so that texCoord is 4-byte aligned.
+	uint16_t texCoord[2];
+
+	static VkVertexInputBindingDescription getBindingDescription() {
+		VkVertexInputBindingDescription bindingDescription = {};
+		bindingDescription.binding = 0;
+		bindingDescription.stride = sizeof(QuantizedVertex);
+		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+		return bindingDescription;
+	}
+
+	static std::array<VkVertexInputAttributeDescription, 2> getAttributeDescriptions() {
+		std::array<VkVertexInputAttributeDescription, 2> attributeDescriptions = {};
+
+		attributeDescriptions[0].binding = 0;
+		attributeDescriptions[0].location = 0;
+		attributeDescriptions[0].format = VK_FORMAT_R16G16B16A16_UNORM;
+		attributeDescriptions[0].offset = offsetof(QuantizedVertex, pos);
+
+		attributeDescriptions[1].binding = 0;
+		attributeDescriptions[1].location = 2;
+		attributeDescriptions[1].format = VK_FORMAT_R16G16_UNORM;
+		attributeDescriptions[1].offset = offsetof(QuantizedVertex, texCoord);
+
+		return attributeDescriptions;
+	}
+};
+
+// The per-instance data of a copy of the model. The shader applies the instance matrix on top of the model matrix
+// of the UniformBufferObject. The shader doesn't light the model, so no normal matrix is needed.
+struct InstanceData {
+	glm::mat4 model;
+
+	static VkVertexInputBindingDescription getBindingDescription() {
+		VkVertexInputBindingDescription bindingDescription = {};
+		bindingDescription.binding = 1;
+		bindingDescription.stride = sizeof(InstanceData);
+		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+		return bindingDescription;
+	}
+
+	// A mat4 takes 4 locations, one per column.
+	static std::array<VkVertexInputAttributeDescription, 4> getAttributeDescriptions() {
+		std::array<VkVertexInputAttributeDescription, 4> attributeDescriptions = {};
+
+		for (uint32_t i = 0; i < 4; i++) {
+			attributeDescriptions[i].binding = 1;
+			attributeDescriptions[i].location = 3 + i;
+			attributeDescriptions[i].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+			attributeDescriptions[i].offset = static_cast<uint32_t>(offsetof(InstanceData, model) + sizeof(glm::vec4) * i);
 		}
+
+		return attributeDescriptions;
+	}
+};
+
+// Hash the position, color, and texture coordinates of a vertex, for VertexDedupTable.
+inline uint64_t hashVertex(const Vertex& vertex) {
+	const float values[] = {
+		vertex.pos.x, vertex.pos.y, vertex.pos.z,
+		vertex.color.r, vertex.color.g, vertex.color.b,
+		vertex.texCoord.x, vertex.texCoord.y
 	};
+
+	return hashFloats(values, 8);
 }
 
+// A range of the index buffer, drawn with one vkCmdDrawIndexed().
+struct IndexRange {
+	uint32_t firstIndex;
+	uint32_t indexCount;
+
+	bool operator==(const IndexRange& other) const {
+		return firstIndex == other.firstIndex && indexCount == other.indexCount;
+	}
+};
+
 struct UniformBufferObject {
 	glm::mat4 model;
 	glm::mat4 view;
 	glm::mat4 proj;
 	//glm::vec3 lightPos;
+
+	// Decoding of the quantized vertices: position = positionOffset + inPosition * positionScale, and
+	// texCoord = texCoordOffsetScale.xy + inTexCoord * texCoordOffsetScale.zw. For Vertex, the offsets are 0 and the scales are 1.
+	glm::vec4 positionOffset;
+	glm::vec4 positionScale;
+	glm::vec4 texCoordOffsetScale;
 };
 
+// The thread pool shared by the loaders.
+ThreadPool& getLoaderThreadPool() {
+	static ThreadPool threadPool;
+
+	return threadPool;
+}
+
+// Load the geometry of an OBJ file. The faces of all the shapes are returned in one index list.
+void loadObjGeometry(const std::string& filename, bool parallel, tinyobj::attrib_t& attrib, std::vector<tinyobj::index_t>& indices) {
+	std::string err;
+
+	if (parallel) {
+		if (!ParallelObjParser::loadObj(filename, attrib, indices, err, getLoaderThreadPool())) {
+			throw std::runtime_error(err);
+		}
+		return;
+	}
+
+	std::vector<tinyobj::shape_t> shapes;
+	std::vector<tinyobj::material_t> materials;
+
+	if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, filename.c_str())) {
+		throw std::runtime_error(err);
+	}
+
+	indices.clear();
+	for (const auto& shape : shapes) {
+		indices.insert(indices.end(), shape.mesh.indices.begin(), shape.mesh.indices.end());
+	}
+}
+
+// Compare the load times of tinyobj::LoadObj() and ParallelObjParser on the same file,
+// and check that both of them return the same geometry.
+void benchmarkObjParsers(const std::string& filename) {
+	const int numRuns = 5;
+	double bestTimes[2] = { 0.0, 0.0 };
+	tinyobj::attrib_t attribs[2];
+	std::vector<tinyobj::index_t> indices[2];
+
+	for (int parser = 0; parser < 2; parser++) {
+		for (int run = 0; run < numRuns; run++) {
+			auto startTime = std::chrono::high_resolution_clock::now();
+
+			loadObjGeometry(filename, parser == 1, attribs[parser], indices[parser]);
+
+			auto endTime = std::chrono::high_resolution_clock::now();
+			double time = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+
+			if (run == 0 || time < bestTimes[parser]) {
+				bestTimes[parser] = time;
+			}
+		}
+	}
+
+	std::cout << filename << ": " << attribs[0].vertices.size() / 3 << " positions, "
+		<< attribs[0].normals.size() / 3 << " normals, " << attribs[0].texcoords.size() / 2 << " texture coordinates, "
+		<< indices[0].size() / 3 << " triangles" << std::endl;
+	std::cout << "tinyobj::LoadObj:  " << bestTimes[0] << " ms (best of " << numRuns << ")" << std::endl;
+	std::cout << "ParallelObjParser: " << bestTimes[1] << " ms (best of " << numRuns << ", "
+		<< getLoaderThreadPool().size() << " threads)" << std::endl;
+	std::cout << "Speedup: " << bestTimes[0] / bestTimes[1] << "x" << std::endl;
+
+	bool same = attribs[0].vertices == attribs[1].vertices && attribs[0].normals == attribs[1].normals &&
+		attribs[0].texcoords == attribs[1].texcoords && indices[0].size() == indices[1].size();
+
+	for (size_t i = 0; same && i < indices[0].size(); i++) {
+		same = indices[0][i].vertex_index == indices[1][i].vertex_index &&
+			indices[0][i].normal_index == indices[1][i].normal_index &&
+			indices[0][i].texcoord_index == indices[1][i].texcoord_index;
+	}
+
+	std::cout << (same ? "Both parsers returned the same geometry." : "The parsers returned different geometry!") << std::endl;
+}
+
 class HelloTriangleApplication {
 public:
 	void run() {
+		startTime = std::chrono::high_resolution_clock::now();
+
 		initWindow();
 		initVulkan();
 		mainLoop();
@@ -145,6 +354,8 @@ public:
 	}
 
 private:
+	std::chrono::high_resolution_clock::time_point startTime;
+
 	GLFWwindow* window;
 
 	VkInstance instance;
@@ -179,17 +390,91 @@ private:
 	VkDeviceMemory textureImageMemory;
 	VkImageView textureImageView;
 	VkSampler textureSampler;
+	VkFormat textureFormat = VK_FORMAT_R8G8B8A8_UNORM;
+	uint32_t textureMipLevels = 1;
+	bool textureCompressionSupported = false;
+
+	// True if one vkCmdDrawIndexedIndirect() can draw more than one command, and the largest count it can draw.
+	bool multiDrawIndirectSupported = false;
+	uint32_t maxDrawIndirectCount = 1;
 
 	std::vector<Vertex> vertices;
 	std::vector<uint32_t> indices;
-	VkBuffer vertexBuffer;
-	VkDeviceMemory vertexBufferMemory;
-	VkBuffer indexBuffer;
-	VkDeviceMemory indexBufferMemory;
+
+	// The vertices in the quantized format, when useQuantizedVertices is true, and the offsets and scales to decode them.
+	std::vector<QuantizedVertex> quantizedVertices;
+	glm::vec4 positionOffset = glm::vec4(0.0f);
+	glm::vec4 positionScale = glm::vec4(1.0f);
+	glm::vec4 texCoordOffsetScale = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
+
+	// 16-bit indices are used when the model has fewer than 65536 vertices.
+	VkIndexType indexType = VK_INDEX_TYPE_UINT32;
+	std::vector<uint16_t> shortIndices;
+
+	VkBuffer vertexBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory vertexBufferMemory = VK_NULL_HANDLE;
+	VkBuffer indexBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory indexBufferMemory = VK_NULL_HANDLE;
+
+	// The number of indices that are in the index buffer and can be drawn. It is a multiple of 3.
+	uint32_t residentIndexCount = 0;
+
+	// The LOD levels of the model. indices holds the indices of all the levels, coarsest level first.
+	MeshLodChain modelLods = {};
+	bool useLods = true;
+	float lodBias = 0.0f;
+	float lodHysteresis = 0.1f;
+	unsigned int lodLevel = 0;
+
+	// The meshlets of all the LOD levels, sorted by their first index.
+	std::vector<Meshlet> meshlets;
+	bool useClusterCulling = true;
+
+	// The model-view-projection matrix and the camera position in model space of the last frame, used to cull the meshlets.
+	bool hasCullingMatrices = false;
+	glm::mat4 cullingMatrix;
+	glm::vec4 cullingCameraPosition;
+	uint32_t numClustersTested = 0;
+	uint32_t numClustersCulled = 0;
+
+	// The ranges of indices to draw in this frame, computed by updateModelLod().
+	std::vector<IndexRange> drawRanges;
+
+	// The command buffers don't draw drawRanges themselves. They draw maxIndirectDraws commands from the indirect
+	// buffer of their swapchain image, and drawFrame() writes drawRanges to that buffer before the image is
+	// submitted; the commands after the last range draw no indices. So the command buffers are recorded again only
+	// when the swapchain or the model buffers change, not when the LOD level or the visible meshlets change.
+	// frameFences[i] is signaled when the last submission of image i is done, so its indirect buffer can be written.
+	uint32_t maxIndirectDraws = 1;
+	std::vector<VkBuffer> indirectBuffers;
+	std::vector<VkDeviceMemory> indirectBuffersMemory;
+	std::vector<VkDrawIndexedIndirectCommand*> indirectCommands;
+	std::vector<uint32_t> indirectDrawCounts; // the number of non-empty commands in each indirect buffer
+	std::vector<VkFence> frameFences;
+
+	// Background loading: loadModel() runs on modelLoaderThread. The other threads don't touch the model data
+	// until modelLoaded is true and the thread is joined.
+	std::thread modelLoaderThread;
+	std::atomic<bool> modelLoaded{ false };
+	std::exception_ptr modelLoaderError;
+	bool modelBuffersCreated = false;
+	bool firstFrameDrawn = false;
+
+	// A persistently mapped staging buffer, reused for the slice of every frame.
+	VkBuffer streamingBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory streamingBufferMemory = VK_NULL_HANDLE;
+	void* streamingBufferData = nullptr;
+	VkDeviceSize uploadedVertexBytes = 0;
+	VkDeviceSize uploadedIndexBytes = 0;
 
 	VkBuffer uniformBuffer;
 	VkDeviceMemory uniformBufferMemory;
 
+	// The matrices of the copies of the model. See instanceCount.
+	std::vector<InstanceData> instances;
+	VkBuffer instanceBuffer;
+	VkDeviceMemory instanceBufferMemory;
+
 	VkDescriptorPool descriptorPool;
 	VkDescriptorSet descriptorSet;
 
@@ -207,6 +492,7 @@ private:
 
 		glfwSetWindowUserPointer(window, this);
 		glfwSetWindowSizeCallback(window, HelloTriangleApplication::onWindowResized);
+		glfwSetKeyCallback(window, HelloTriangleApplication::onKey);
 	}
 
 	void initVulkan() {
@@ -226,12 +512,19 @@ private:
 		createTextureImage();
 		createTextureImageView();
 		createTextureSampler();
-		loadModel();
-		createVertexBuffer();
-		createIndexBuffer();
+		if (useBackgroundLoading) {
+			startModelLoading();
+		}
+		else {
+			loadModel();
+			createVertexBuffer();
+			createIndexBuffer();
+		}
 		createUniformBuffer();
+		createInstanceBuffer();
 		createDescriptorPool();
 		createDescriptorSet();
+		createFrameResources();
 		createCommandBuffers();
 		createSemaphores();
 	}
@@ -240,8 +533,17 @@ private:
 		while (!glfwWindowShouldClose(window)) {
 			glfwPollEvents();
 
+			if (useBackgroundLoading) {
+				streamModel();
+			}
+
 			updateUniformBuffer();
 			drawFrame();
+
+			if (!firstFrameDrawn && residentIndexCount > 0) {
+				firstFrameDrawn = true;
+				std::cout << "First frame with the model drawn after " << getTimeSinceStart() << " ms." << std::endl;
+			}
 		}
 
 		vkDeviceWaitIdle(device);
@@ -270,6 +572,10 @@ private:
 	}
 
 	void cleanup() {
+		if (modelLoaderThread.joinable()) {
+			modelLoaderThread.join();
+		}
+
 		cleanupSwapChain();
 
 		vkDestroySampler(device, textureSampler, nullptr);
@@ -284,12 +590,18 @@ private:
 		vkDestroyBuffer(device, uniformBuffer, nullptr);
 		vkFreeMemory(device, uniformBufferMemory, nullptr);
 
+		vkDestroyBuffer(device, instanceBuffer, nullptr);
+		vkFreeMemory(device, instanceBufferMemory, nullptr);
+
 		vkDestroyBuffer(device, indexBuffer, nullptr);
 		vkFreeMemory(device, indexBufferMemory, nullptr);
 
 		vkDestroyBuffer(device, vertexBuffer, nullptr);
 		vkFreeMemory(device, vertexBufferMemory, nullptr);
 
+		destroyStreamingBuffer();
+		destroyFrameResources();
+
 		vkDestroySemaphore(device, renderFinishedSemaphore, nullptr);
 		vkDestroySemaphore(device, imageAvailableSemaphore, nullptr);
 
@@ -312,6 +624,42 @@ private:
 		app->recreateSwapChain();
 	}
 
+	static void onKey(GLFWwindow* window, int key, int scancode, int action, int mods) {
+		if (action != GLFW_PRESS && action != GLFW_REPEAT) return;
+
+		HelloTriangleApplication* app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
+
+		switch (key) {
+		case GLFW_KEY_L:
+			app->useLods = !app->useLods;
+			std::cout << "LOD selection " << (app->useLods ? "on" : "off") << std::endl;
+			break;
+		case GLFW_KEY_LEFT_BRACKET:
+			app->lodBias -= 0.5f;
+			std::cout << "LOD bias " << app->lodBias << std::endl;
+			break;
+		case GLFW_KEY_RIGHT_BRACKET:
+			app->lodBias += 0.5f;
+			std::cout << "LOD bias " << app->lodBias << std::endl;
+			break;
+		case GLFW_KEY_COMMA:
+			app->lodHysteresis = std::max(app->lodHysteresis - 0.05f, 0.0f);
+			std::cout << "LOD hysteresis " << app->lodHysteresis << std::endl;
+			break;
+		case GLFW_KEY_PERIOD:
+			app->lodHysteresis = std::min(app->lodHysteresis + 0.05f, 0.9f);
+			std::cout << "LOD hysteresis " << app->lodHysteresis << std::endl;
+			break;
+		case GLFW_KEY_C:
+			app->useClusterCulling = !app->useClusterCulling;
+			std::cout << "Cluster culling " << (app->useClusterCulling ? "on" : "off") << " (" << app->numClustersCulled << " of "
+				<< app->numClustersTested << " meshlets culled in the last frame)" << std::endl;
+			break;
+		default:
+			break;
+		}
+	}
+
 	void recreateSwapChain() {
 		vkDeviceWaitIdle(device);
 
@@ -323,6 +671,7 @@ private:
 		createGraphicsPipeline();
 		createDepthResources();
 		createFramebuffers();
+		createFrameResources();
 		createCommandBuffers();
 	}
 
@@ -418,8 +767,19 @@ private:
 			queueCreateInfos.push_back(queueCreateInfo);
 		}
 
+		VkPhysicalDeviceFeatures supportedFeatures;
+		vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+		textureCompressionSupported = (supportedFeatures.textureCompressionBC == VK_TRUE);
+
+		VkPhysicalDeviceProperties deviceProperties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+		multiDrawIndirectSupported = (supportedFeatures.multiDrawIndirect == VK_TRUE);
+		maxDrawIndirectCount = multiDrawIndirectSupported ? deviceProperties.limits.maxDrawIndirectCount : 1;
+
 		VkPhysicalDeviceFeatures deviceFeatures = {};
 		deviceFeatures.samplerAnisotropy = VK_TRUE;
+		deviceFeatures.textureCompressionBC = supportedFeatures.textureCompressionBC;
+		deviceFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
 
 		VkDeviceCreateInfo createInfo = {};
 		createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -504,7 +864,7 @@ private:
 		swapChainImageViews.resize(swapChainImages.size());
 
 		for (uint32_t i = 0; i < swapChainImages.size(); i++) {
-			swapChainImageViews[i] = createImageView(swapChainImages[i], swapChainImageFormat, VK_IMAGE_ASPECT_COLOR_BIT);
+			swapChainImageViews[i] = createImageView(swapChainImages[i], swapChainImageFormat, VK_IMAGE_ASPECT_COLOR_BIT, 1);
 		}
 	}
 
@@ -616,12 +976,28 @@ private:
 		VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
 		vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
 
-		auto bindingDescription = Vertex::getBindingDescription();
-		auto attributeDescriptions = Vertex::getAttributeDescriptions();
+		// Binding 0 is the vertex buffer, and binding 1 is the instance buffer.
+		std::array<VkVertexInputBindingDescription, 2> bindingDescriptions;
+		std::vector<VkVertexInputAttributeDescription> attributeDescriptions;
 
-		vertexInputInfo.vertexBindingDescriptionCount = 1;
+		if (useQuantizedVertices) {
+			auto quantizedAttributeDescriptions = QuantizedVertex::getAttributeDescriptions();
+			bindingDescriptions[0] = QuantizedVertex::getBindingDescription();
+			attributeDescriptions.assign(quantizedAttributeDescriptions.begin(), quantizedAttributeDescriptions.end());
+		}
+		else {
+			auto vertexAttributeDescriptions = Vertex::getAttributeDescriptions();
+			bindingDescriptions[0] = Vertex::getBindingDescription();
+			attributeDescriptions.assign(vertexAttributeDescriptions.begin(), vertexAttributeDescriptions.end());
+		}
+
+		auto instanceAttributeDescriptions = InstanceData::getAttributeDescriptions();
+		bindingDescriptions[1] = InstanceData::getBindingDescription();
+		attributeDescriptions.insert(attributeDescriptions.end(), instanceAttributeDescriptions.begin(), instanceAttributeDescriptions.end());
+
+		vertexInputInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(bindingDescriptions.size());
 		vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
-		vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+		vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions.data();
 		vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
 
 		VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
@@ -758,10 +1134,10 @@ private:
 	void createDepthResources() {
 		VkFormat depthFormat = findDepthFormat();
 
-		createImage(swapChainExtent.width, swapChainExtent.height, depthFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depthImage, depthImageMemory);
-		depthImageView = createImageView(depthImage, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT);
+		createImage(swapChainExtent.width, swapChainExtent.height, 1, depthFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depthImage, depthImageMemory);
+		depthImageView = createImageView(depthImage, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT, 1);
 
-		transitionImageLayout(depthImage, depthFormat, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+		transitionImageLayout(depthImage, depthFormat, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, 1);
 	}
 
 	VkFormat findSupportedFormat(const std::vector<VkFormat>& candidates, VkImageTiling tiling, VkFormatFeatureFlags features) {
@@ -792,38 +1168,283 @@ private:
 		return format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT;
 	}
 
+	// Create the texture image from the texture container of TEXTURE_PATH, with all its mipmaps. If the container
+	// is missing or out of date, the image is compressed and the container is saved. Returns false if the texture
+	// image can't be loaded, or if the format of the container isn't supported.
+	bool createCompressedTextureImage() {
+		MappedFile source;
+		if (!source.open(TEXTURE_PATH.c_str())) {
+			return false;
+		}
+
+		std::string containerPath = TEXTURE_PATH + textureContainerExtension;
+		MappedFile containerFile;
+		std::vector<unsigned char> containerBytes;
+		const TextureContainerHeader* container = nullptr;
+
+		if (containerFile.open(containerPath.c_str())) {
+			container = readTextureContainer(containerFile.getData(), containerFile.getSize(), source.getData(), source.getSize());
+		}
+
+		if (!container) {
+			int texWidth, texHeight, texChannels;
+			stbi_uc* pixels = stbi_load(TEXTURE_PATH.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
+
+			if (!pixels) {
+				return false;
+			}
+
+			DecodedTexture image;
+			buildMipChain(pixels, static_cast<unsigned int>(texWidth), static_cast<unsigned int>(texHeight), image);
+			stbi_image_free(pixels);
+
+			buildTextureContainer(image, source.getData(), source.getSize(), containerBytes);
+			container = reinterpret_cast<const TextureContainerHeader*>(containerBytes.data());
+
+			if (!saveTextureContainer(containerPath.c_str(), containerBytes)) {
+				std::cout << "Couldn't save the texture container " << containerPath << std::endl;
+			}
+		}
+
+		VkFormat format = VK_FORMAT_BC1_RGB_UNORM_BLOCK;
+		if (container->format == textureFormatBC3) {
+			format = VK_FORMAT_BC3_UNORM_BLOCK;
+		}
+		else if (container->format == textureFormatBC7) {
+			format = VK_FORMAT_BC7_UNORM_BLOCK;
+		}
+
+		VkFormatProperties formatProperties;
+		vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProperties);
+		if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)) {
+			return false;
+		}
+
+		// The levels are stored one after another, so they are copied to the staging buffer in one piece.
+		const TextureContainerLevel* levels = getTextureContainerLevels(container);
+		const TextureContainerLevel& lastLevel = levels[container->numLevels - 1];
+		VkDeviceSize imageSize = lastLevel.offset + lastLevel.size - levels[0].offset;
+
+		VkBuffer stagingBuffer;
+		VkDeviceMemory stagingBufferMemory;
+		createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+
+		void* data;
+		vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
+		memcpy(data, reinterpret_cast<const unsigned char*>(container) + levels[0].offset, static_cast<size_t>(imageSize));
+		vkUnmapMemory(device, stagingBufferMemory);
+
+		std::vector<VkBufferImageCopy> regions(container->numLevels);
+		for (uint32_t i = 0; i < container->numLevels; i++) {
+			VkBufferImageCopy& region = regions[i];
+			region = {};
+			region.bufferOffset = levels[i].offset - levels[0].offset;
+			region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			region.imageSubresource.mipLevel = i;
+			region.imageSubresource.baseArrayLayer = 0;
+			region.imageSubresource.layerCount = 1;
+			region.imageOffset = { 0, 0, 0 };
+			region.imageExtent = { levels[i].width, levels[i].height, 1 };
+		}
+
+		textureFormat = format;
+		textureMipLevels = container->numLevels;
+
+		createImage(container->width, container->height, textureMipLevels, textureFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
+
+		transitionImageLayout(textureImage, textureFormat, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, textureMipLevels);
+
+		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+		vkCmdCopyBufferToImage(commandBuffer, stagingBuffer, textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, static_cast<uint32_t>(regions.size()), regions.data());
+		endSingleTimeCommands(commandBuffer);
+
+		transitionImageLayout(textureImage, textureFormat, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, textureMipLevels);
+
+		vkDestroyBuffer(device, stagingBuffer, nullptr);
+		vkFreeMemory(device, stagingBufferMemory, nullptr);
+
+		std::cout << "Texture: " << container->width << " x " << container->height << ", BC" << container->format << ", "
+			<< textureMipLevels << " levels, " << imageSize << " bytes" << std::endl;
+
+		return true;
+	}
+
 	void createTextureImage() {
+		if (useCompressedTextures && textureCompressionSupported && createCompressedTextureImage()) {
+			return;
+		}
+
+		textureFormat = VK_FORMAT_R8G8B8A8_UNORM;
+
 		int texWidth, texHeight, texChannels;
 		stbi_uc* pixels = stbi_load(TEXTURE_PATH.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
-		VkDeviceSize imageSize = texWidth * texHeight * 4;
 
 		if (!pixels) {
 			throw std::runtime_error("failed to load texture image!");
 		}
 
+		// The full mip chain, down to 1 x 1.
+		textureMipLevels = 1;
+		for (uint32_t size = static_cast<uint32_t>(std::max(texWidth, texHeight)); size > 1; size /= 2) {
+			textureMipLevels++;
+		}
+
+		// The mipmaps are blitted from level 0 on the GPU when the format can be the source and destination of a
+		// linear blit. Otherwise they are built on the CPU and copied with level 0.
+		VkFormatProperties formatProperties;
+		vkGetPhysicalDeviceFormatProperties(physicalDevice, textureFormat, &formatProperties);
+		bool blitMipmaps = (formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT) &&
+			(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_SRC_BIT) &&
+			(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_DST_BIT);
+
+		DecodedTexture image;
+		if (blitMipmaps) {
+			image.numLevels = 1;
+			image.width[0] = static_cast<unsigned int>(texWidth);
+			image.height[0] = static_cast<unsigned int>(texHeight);
+			image.offset[0] = 0;
+			image.pixels.assign(pixels, pixels + static_cast<size_t>(texWidth) * texHeight * 4);
+		}
+		else {
+			buildMipChain(pixels, static_cast<unsigned int>(texWidth), static_cast<unsigned int>(texHeight), image);
+			textureMipLevels = image.numLevels;
+		}
+
+		stbi_image_free(pixels);
+
+		VkDeviceSize imageSize = image.pixels.size();
+
 		VkBuffer stagingBuffer;
 		VkDeviceMemory stagingBufferMemory;
 		createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
 
 		void* data;
 		vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
-		memcpy(data, pixels, static_cast<size_t>(imageSize));
+		memcpy(data, image.pixels.data(), static_cast<size_t>(imageSize));
 		vkUnmapMemory(device, stagingBufferMemory);
 
-		stbi_image_free(pixels);
+		createImage(texWidth, texHeight, textureMipLevels, textureFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
+
+		transitionImageLayout(textureImage, textureFormat, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, textureMipLevels);
+
+		std::vector<VkBufferImageCopy> regions(image.numLevels);
+		for (uint32_t i = 0; i < image.numLevels; i++) {
+			VkBufferImageCopy& region = regions[i];
+			region = {};
+			region.bufferOffset = image.offset[i];
+			region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			region.imageSubresource.mipLevel = i;
+			region.imageSubresource.baseArrayLayer = 0;
+			region.imageSubresource.layerCount = 1;
+			region.imageOffset = { 0, 0, 0 };
+			region.imageExtent = { image.width[i], image.height[i], 1 };
+		}
 
-		createImage(texWidth, texHeight, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
+		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+		vkCmdCopyBufferToImage(commandBuffer, stagingBuffer, textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, static_cast<uint32_t>(regions.size()), regions.data());
+		endSingleTimeCommands(commandBuffer);
 
-		transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-		copyBufferToImage(stagingBuffer, textureImage, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight));
-		transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+		if (blitMipmaps) {
+			generateMipmaps(textureImage, texWidth, texHeight, textureMipLevels);
+		}
+		else {
+			transitionImageLayout(textureImage, textureFormat, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, textureMipLevels);
+		}
 
 		vkDestroyBuffer(device, stagingBuffer, nullptr);
 		vkFreeMemory(device, stagingBufferMemory, nullptr);
 	}
 
+	// Fill the mip levels 1 to mipLevels - 1 of an image by blitting every level from the level above it, and leave
+	// every level in the shader read-only layout. All the levels must be in the transfer destination layout, and
+	// level 0 must hold the image.
+	void generateMipmaps(VkImage image, int32_t width, int32_t height, uint32_t mipLevels) {
+		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+		VkImageMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.image = image;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		barrier.subresourceRange.baseArrayLayer = 0;
+		barrier.subresourceRange.layerCount = 1;
+		barrier.subresourceRange.levelCount = 1;
+
+		int32_t mipWidth = width;
+		int32_t mipHeight = height;
+
+		for (uint32_t i = 1; i < mipLevels; i++) {
+			// Level i - 1 has been written; it's the source of this blit.
+			barrier.subresourceRange.baseMipLevel = i - 1;
+			barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+			barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+			barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+			vkCmdPipelineBarrier(commandBuffer,
+				VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+				0, nullptr,
+				0, nullptr,
+				1, &barrier);
+
+			int32_t nextWidth = std::max(mipWidth / 2, 1);
+			int32_t nextHeight = std::max(mipHeight / 2, 1);
+
+			VkImageBlit blit = {};
+			blit.srcOffsets[0] = { 0, 0, 0 };
+			blit.srcOffsets[1] = { mipWidth, mipHeight, 1 };
+			blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			blit.srcSubresource.mipLevel = i - 1;
+			blit.srcSubresource.baseArrayLayer = 0;
+			blit.srcSubresource.layerCount = 1;
+			blit.dstOffsets[0] = { 0, 0, 0 };
+			blit.dstOffsets[1] = { nextWidth, nextHeight, 1 };
+			blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			blit.dstSubresource.mipLevel = i;
+			blit.dstSubresource.baseArrayLayer = 0;
+			blit.dstSubresource.layerCount = 1;
+
+			vkCmdBlitImage(commandBuffer,
+				image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				1, &blit,
+				VK_FILTER_LINEAR);
+
+			// Level i - 1 is done.
+			barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+			barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+			barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+			vkCmdPipelineBarrier(commandBuffer,
+				VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+				0, nullptr,
+				0, nullptr,
+				1, &barrier);
+
+			mipWidth = nextWidth;
+			mipHeight = nextHeight;
+		}
+
+		// The last level was only written.
+		barrier.subresourceRange.baseMipLevel = mipLevels - 1;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+		vkCmdPipelineBarrier(commandBuffer,
+			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+			0, nullptr,
+			0, nullptr,
+			1, &barrier);
+
+		endSingleTimeCommands(commandBuffer);
+	}
+
 	void createTextureImageView() {
-		textureImageView = createImageView(textureImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_ASPECT_COLOR_BIT);
+		textureImageView = createImageView(textureImage, textureFormat, VK_IMAGE_ASPECT_COLOR_BIT, textureMipLevels);
 	}
 
 	void createTextureSampler() {
@@ -841,13 +1462,16 @@ private:
 		samplerInfo.compareEnable = VK_FALSE;
 		samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
 		samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+		samplerInfo.minLod = 0.0f;
+		samplerInfo.maxLod = static_cast<float>(textureMipLevels);
+		samplerInfo.mipLodBias = 0.0f;
 
 		if (vkCreateSampler(device, &samplerInfo, nullptr, &textureSampler) != VK_SUCCESS) {
 			throw std::runtime_error("failed to create texture sampler!");
 		}
 	}
 
-	VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags) {
+	VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, uint32_t mipLevels) {
 		VkImageViewCreateInfo viewInfo = {};
 		viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
 		viewInfo.image = image;
@@ -855,7 +1479,7 @@ private:
 		viewInfo.format = format;
 		viewInfo.subresourceRange.aspectMask = aspectFlags;
 		viewInfo.subresourceRange.baseMipLevel = 0;
-		viewInfo.subresourceRange.levelCount = 1;
+		viewInfo.subresourceRange.levelCount = mipLevels;
 		viewInfo.subresourceRange.baseArrayLayer = 0;
 		viewInfo.subresourceRange.layerCount = 1;
 
@@ -867,14 +1491,14 @@ private:
 		return imageView;
 	}
 
-	void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory) {
+	void createImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory) {
 		VkImageCreateInfo imageInfo = {};
 		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 		imageInfo.imageType = VK_IMAGE_TYPE_2D;
 		imageInfo.extent.width = width;
 		imageInfo.extent.height = height;
 		imageInfo.extent.depth = 1;
-		imageInfo.mipLevels = 1;
+		imageInfo.mipLevels = mipLevels;
 		imageInfo.arrayLayers = 1;
 		imageInfo.format = format;
 		imageInfo.tiling = tiling;
@@ -902,7 +1526,7 @@ private:
 		vkBindImageMemory(device, image, imageMemory, 0);
 	}
 
-	void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout) {
+	void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mipLevels) {
 		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
 
 		VkImageMemoryBarrier barrier = {};
@@ -925,7 +1549,7 @@ private:
 		}
 
 		barrier.subresourceRange.baseMipLevel = 0;
-		barrier.subresourceRange.levelCount = 1;
+		barrier.subresourceRange.levelCount = mipLevels;
 		barrier.subresourceRange.baseArrayLayer = 0;
 		barrier.subresourceRange.layerCount = 1;
 
@@ -969,94 +1593,424 @@ private:
 		endSingleTimeCommands(commandBuffer);
 	}
 
-	void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height) {
-		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+	void loadModel() {
+		tinyobj::attrib_t attrib;
+		std::vector<tinyobj::index_t> objIndices;
 
-		VkBufferImageCopy region = {};
-		region.bufferOffset = 0;
-		region.bufferRowLength = 0;
-		region.bufferImageHeight = 0;
-		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		region.imageSubresource.mipLevel = 0;
-		region.imageSubresource.baseArrayLayer = 0;
-		region.imageSubresource.layerCount = 1;
-		region.imageOffset = { 0, 0, 0 };
-		region.imageExtent = {
-			width,
-			height,
-			1
+		loadObjGeometry(MODEL_PATH, useParallelObjParser, attrib, objIndices);
+
+		auto makeVertex = [&attrib](const tinyobj::index_t& index) {
+			Vertex vertex = {};
+
+			vertex.pos = {
+				attrib.vertices[3 * index.vertex_index + 0],
+				attrib.vertices[3 * index.vertex_index + 1],
+				attrib.vertices[3 * index.vertex_index + 2]
+			};
+
+			/*vertex.texCoord = {
+			attrib.texcoords[2 * index.texcoord_index + 0],
+			1.0f - attrib.texcoords[2 * index.texcoord_index + 1]
+			};*/
+
+			if (attrib.texcoords.size() == 0) {
+				if (index.normal_index % 2 == 0) {
+					vertex.texCoord = {
+						0.5f,
+						0.5f
+					};
+				}
+				else
+				{
+					vertex.texCoord = {
+						1.0f,
+						0.0f
+					};
+
+				}
+
+			}
+			else {
+				vertex.texCoord = {
+					attrib.texcoords[2 * index.texcoord_index + 0],
+					1.0f - attrib.texcoords[2 * index.texcoord_index + 1]
+				};
+			}
+
+			vertex.color = { 1.0f, 1.0f, 1.0f };
+
+			return vertex;
 		};
 
-		vkCmdCopyBufferToImage(commandBuffer, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+		if (useParallelVertexDedup && objIndices.size() >= parallelVertexDedupMinIndices) {
+			// Build one vertex per index, then remove the duplicates on all the loader threads.
+			std::vector<Vertex> indexedVertices(objIndices.size());
+			std::vector<uint64_t> hashes(objIndices.size());
+			ThreadPool& threadPool = getLoaderThreadPool();
+			size_t blockSize = (objIndices.size() + threadPool.size() - 1) / threadPool.size();
 
-		endSingleTimeCommands(commandBuffer);
+			threadPool.parallelFor(threadPool.size(), [&](size_t block) {
+				size_t begin = std::min(block * blockSize, objIndices.size());
+				size_t end = std::min(begin + blockSize, objIndices.size());
+
+				for (size_t i = begin; i < end; i++) {
+					indexedVertices[i] = makeVertex(objIndices[i]);
+					hashes[i] = hashVertex(indexedVertices[i]);
+				}
+			});
+
+			deduplicateVerticesParallel(indexedVertices, hashes, vertices, indices, threadPool);
+		}
+		else {
+			VertexDedupTable uniqueVertices(objIndices.size() / 4);
+
+			indices.reserve(indices.size() + objIndices.size());
+
+			for (const auto& index : objIndices) {
+				Vertex vertex = makeVertex(index);
+				uint32_t newIndex = static_cast<uint32_t>(vertices.size());
+
+				uint32_t vertexIndex = uniqueVertices.findOrInsert(hashVertex(vertex), newIndex, [this, &vertex](uint32_t i) {
+					return vertices[i] == vertex;
+				});
+
+				if (vertexIndex == newIndex) {
+					vertices.push_back(vertex);
+				}
+
+				indices.push_back(vertexIndex);
+			}
+		}
+
+		if (optimizeModelMesh && !indices.empty()) {
+			optimizeMesh();
+		}
+
+		buildLods();
+		createMeshlets();
+
+		if (useQuantizedVertices) {
+			quantizeVertices();
+		}
 	}
 
-	void loadModel() {
-		tinyobj::attrib_t attrib;
-		std::vector<tinyobj::shape_t> shapes;
-		std::vector<tinyobj::material_t> materials;
-		std::string err;
+	// Convert vertices into quantizedVertices, relative to the bounding box of the positions and texture coordinates.
+	void quantizeVertices() {
+		if (vertices.empty()) {
+			return;
+		}
 
-		if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, MODEL_PATH.c_str())) {
-			throw std::runtime_error(err);
+		const size_t stride = sizeof(Vertex) / sizeof(float);
+		computeQuantizationRange(&vertices[0].pos.x, vertices.size(), stride, 3, &positionOffset.x, &positionScale.x);
+
+		float texCoordOffset[2], texCoordScale[2];
+		computeQuantizationRange(&vertices[0].texCoord.x, vertices.size(), stride, 2, texCoordOffset, texCoordScale);
+		texCoordOffsetScale = glm::vec4(texCoordOffset[0], texCoordOffset[1], texCoordScale[0], texCoordScale[1]);
+
+		quantizedVertices.resize(vertices.size());
+		for (size_t i = 0; i < vertices.size(); i++) {
+			QuantizedVertex& quantizedVertex = quantizedVertices[i];
+
+			for (int k = 0; k < 3; k++) {
+				quantizedVertex.pos[k] = quantizeUnorm16(vertices[i].pos[k], positionOffset[k], positionScale[k]);
+			}
+			quantizedVertex.pos[3] = 0;
+
+			for (int k = 0; k < 2; k++) {
+				quantizedVertex.texCoord[k] = quantizeUnorm16(vertices[i].texCoord[k], texCoordOffsetScale[k], texCoordOffsetScale[k + 2]);
+			}
 		}
 
-		std::unordered_map<Vertex, uint32_t> uniqueVertices = {};
+		std::cout << "Vertex data quantized from " << sizeof(Vertex) * vertices.size() << " to "
+			<< sizeof(QuantizedVertex) * quantizedVertices.size() << " bytes." << std::endl;
+	}
 
-		for (const auto& shape : shapes) {
-			for (const auto& index : shape.mesh.indices) {
-				Vertex vertex = {};
+	// Replace indices with the indices of all the LOD levels of the model, coarsest level first.
+	// The vertices are shared by all the levels, so they must not be reordered after this.
+	void buildLods() {
+		modelLods.numLevels = 1;
+		modelLods.firstIndex[0] = 0;
+		modelLods.indexCount[0] = static_cast<unsigned int>(indices.size());
+		modelLods.error[0] = 0.0f;
 
-				vertex.pos = {
-					attrib.vertices[3 * index.vertex_index + 0],
-					attrib.vertices[3 * index.vertex_index + 1],
-					attrib.vertices[3 * index.vertex_index + 2]
-				};
+		if (!buildModelLods || vertices.empty() || indices.empty()) {
+			return;
+		}
 
-				/*vertex.texCoord = {
-				attrib.texcoords[2 * index.texcoord_index + 0],
-				1.0f - attrib.texcoords[2 * index.texcoord_index + 1]
-				};*/
-
-				if (attrib.texcoords.size() == 0) {
-					if (index.normal_index % 2 == 0) {
-						vertex.texCoord = {
-							0.5f,
-							0.5f
-						};
-					}
-					else
-					{
-						vertex.texCoord = {
-							1.0f,
-							0.0f
-						};
+		auto startTime = std::chrono::high_resolution_clock::now();
 
-					}
+		std::vector<uint32_t> lodIndices;
+		buildLodChain(indices.data(), indices.size(), &vertices[0].pos.x, sizeof(Vertex) / sizeof(float), vertices.size(), modelLods, lodIndices);
 
+		// Level 0 is already optimized. The simplified levels keep the triangle order of level 0, which is
+		// close to the best order, but optimizing them again helps after many collapses.
+		for (unsigned int k = 1; optimizeModelMesh && k < modelLods.numLevels; k++) {
+			auto first = lodIndices.begin() + modelLods.firstIndex[k];
+			std::vector<uint32_t> level(first, first + modelLods.indexCount[k]);
+			level = optimizeVertexCache(level, vertices.size());
+			std::copy(level.begin(), level.end(), first);
+		}
+
+		indices.swap(lodIndices);
+
+		auto endTime = std::chrono::high_resolution_clock::now();
+		std::cout << MODEL_PATH << ": " << modelLods.numLevels << " LOD levels built in "
+			<< std::chrono::duration<double, std::milli>(endTime - startTime).count() << " ms:";
+		for (unsigned int k = 0; k < modelLods.numLevels; k++) {
+			std::cout << " " << modelLods.indexCount[k] / 3;
+		}
+		std::cout << " triangles" << std::endl;
+	}
+
+	// Split every LOD level into meshlets. The triangles of each level are reordered so that every meshlet
+	// is a continuous range of indices.
+	// This regroups the triangles that optimizeMesh() and buildLods() ordered. The meshlets win: they must stay
+	// compact to be culled well. buildMeshlets() grows them from seeds taken in the optimized order, so the overdraw
+	// order of optimizeMesh() is only kept from meshlet to meshlet. Inside a meshlet, the vertex cache order is
+	// whichever of the growing order and a new optimizeVertexCache() pass misses less.
+	void createMeshlets() {
+		meshlets.clear();
+
+		if (!buildModelMeshlets || vertices.empty() || modelLods.indexCount[0] / 3 < minMeshletTriangles) {
+			return;
+		}
+
+		auto startTime = std::chrono::high_resolution_clock::now();
+
+		// The coarsest level is stored first, so the meshlets end up sorted by their first index.
+		for (unsigned int k = modelLods.numLevels; k-- > 0; ) {
+			buildMeshlets(indices.data(), modelLods.firstIndex[k], modelLods.indexCount[k],
+				&vertices[0].pos.x, sizeof(Vertex) / sizeof(float), vertices.size(), meshlets);
+		}
+
+		if (optimizeModelMesh) {
+			optimizeMeshletVertexCache();
+		}
+
+		auto endTime = std::chrono::high_resolution_clock::now();
+		std::cout << MODEL_PATH << ": " << meshlets.size() << " meshlets built in "
+			<< std::chrono::duration<double, std::milli>(endTime - startTime).count() << " ms" << std::endl;
+	}
+
+	// Reorder the triangles inside every meshlet for the vertex cache. The vertices of a meshlet are numbered from 0
+	// for optimizeVertexCache(), so it only works on the at most maxMeshletVertices vertices of the meshlet.
+	// The order buildMeshlets() grew the meshlet in already adds the triangles that share the most vertices first,
+	// and it is often better than the new order, so the new order is only kept when it has fewer cache misses.
+	// The meshlet keeps its range of indices, so its bounds don't change.
+	void optimizeMeshletVertexCache() {
+		std::vector<uint32_t> globalToLocal(vertices.size(), ~0u);
+		std::vector<uint32_t> localToGlobal;
+		std::vector<uint32_t> localIndices;
+
+		for (const Meshlet& meshlet : meshlets) {
+			uint32_t* triangles = &indices[meshlet.firstIndex];
+			localToGlobal.clear();
+			localIndices.resize(meshlet.indexCount);
+
+			for (uint32_t i = 0; i < meshlet.indexCount; i++) {
+				if (globalToLocal[triangles[i]] == ~0u) {
+					globalToLocal[triangles[i]] = static_cast<uint32_t>(localToGlobal.size());
+					localToGlobal.push_back(triangles[i]);
 				}
-				else {
-					vertex.texCoord = {
-						attrib.texcoords[2 * index.texcoord_index + 0],
-						1.0f - attrib.texcoords[2 * index.texcoord_index + 1]
-					};
-				}
+				localIndices[i] = globalToLocal[triangles[i]];
+			}
 
-				vertex.color = { 1.0f, 1.0f, 1.0f };
+			std::vector<uint32_t> optimized = optimizeVertexCache(localIndices, localToGlobal.size());
 
-				if (uniqueVertices.count(vertex) == 0) {
-					uniqueVertices[vertex] = static_cast<uint32_t>(vertices.size());
-					vertices.push_back(vertex);
+			if (analyzeVertexCache(optimized, localToGlobal.size()).acmr < analyzeVertexCache(localIndices, localToGlobal.size()).acmr) {
+				for (uint32_t i = 0; i < meshlet.indexCount; i++) {
+					triangles[i] = localToGlobal[optimized[i]];
 				}
+			}
+
+			for (uint32_t v : localToGlobal) {
+				globalToLocal[v] = ~0u;
+			}
+		}
+	}
+
+	// The matrix of the copy of the model that is closest to the camera.
+	glm::mat4 getNearestInstanceMatrix(const glm::mat4& view) const {
+		glm::vec3 cameraPosition = glm::vec3(glm::inverse(view)[3]);
+		glm::mat4 nearest = glm::mat4(1.0f);
+		float nearestDistance = std::numeric_limits<float>::max();
+
+		for (const InstanceData& instance : instances) {
+			float distance = glm::length(glm::vec3(instance.model[3]) - cameraPosition);
+			if (distance < nearestDistance) {
+				nearestDistance = distance;
+				nearest = instance.model;
+			}
+		}
+
+		return nearest;
+	}
 
-				indices.push_back(uniqueVertices[vertex]);
+	// Pick the LOD level from the radius of the bounding sphere of the model on the screen. With instancing, the level
+	// is picked for the closest copy, so no copy gets too coarse a level.
+	unsigned int selectModelLod(const UniformBufferObject& ubo) const {
+		if (!useLods || modelLods.numLevels <= 1) {
+			return 0;
+		}
+
+		glm::mat4 model = (instanceCount > 1) ? getNearestInstanceMatrix(ubo.view) * ubo.model : ubo.model;
+		glm::mat4 modelView = ubo.view * model;
+		float scale = std::max(glm::length(glm::vec3(model[0])), std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+		float radius = modelLods.boundingRadius * scale;
+		float distance = glm::length(glm::vec3(modelView * glm::vec4(modelLods.boundingCenter[0], modelLods.boundingCenter[1], modelLods.boundingCenter[2], 1.0f)));
+
+		if (distance <= radius) {
+			return 0;
+		}
+
+		// proj[1][1] is -1 / tan(fovy / 2) because of the flipped Y axis.
+		float screenRadius = radius / distance * std::abs(ubo.proj[1][1]) * 0.5f * swapChainExtent.height;
+
+		return selectLodLevel(modelLods, screenRadius, lodLevel, lodPixelThreshold, lodBias, lodHysteresis);
+	}
+
+	// The range of indices to draw for lodLevel. While the model is streamed, a level that isn't completely in the
+	// index buffer is replaced by the closest coarser level that is, or by the resident part of the coarsest level.
+	void getLodDrawRange(uint32_t& firstIndex, uint32_t& indexCount) const {
+		// Nothing is drawn until the loader thread is done and the first indices are in the index buffer.
+		if (residentIndexCount == 0) {
+			firstIndex = indexCount = 0;
+			return;
+		}
+
+		for (unsigned int k = lodLevel; k < modelLods.numLevels; k++) {
+			if (modelLods.firstIndex[k] + modelLods.indexCount[k] <= residentIndexCount) {
+				firstIndex = modelLods.firstIndex[k];
+				indexCount = modelLods.indexCount[k];
+				return;
+			}
+		}
+
+		unsigned int coarsest = modelLods.numLevels - 1;
+		firstIndex = modelLods.firstIndex[coarsest];
+		indexCount = (residentIndexCount > firstIndex) ? std::min(residentIndexCount - firstIndex, modelLods.indexCount[coarsest]) : 0;
+	}
+
+	// Cull the meshlets of the index range [firstIndex, firstIndex + indexCount) with the matrices of the last frame, and
+	// append the ranges of the visible meshlets to ranges. Adjacent visible meshlets are merged into one range.
+	// Returns false if the range isn't covered by meshlets, e.g. a level that is still being copied to the index buffer.
+	bool cullClusters(uint32_t firstIndex, uint32_t indexCount, std::vector<IndexRange>& ranges) {
+		// The meshlets are culled for one model matrix, so not when the model is drawn many times.
+		if (!useClusterCulling || instanceCount > 1 || !hasCullingMatrices || meshlets.empty()) {
+			return false;
+		}
+
+		auto first = std::lower_bound(meshlets.begin(), meshlets.end(), firstIndex, [](const Meshlet& meshlet, uint32_t index) {
+			return meshlet.firstIndex < index;
+		});
+		auto last = first;
+		uint32_t coveredCount = 0;
+		while (last != meshlets.end() && last->firstIndex + last->indexCount <= firstIndex + indexCount) {
+			coveredCount += last->indexCount;
+			++last;
+		}
+
+		if (first == meshlets.end() || first->firstIndex != firstIndex || coveredCount != indexCount) {
+			return false;
+		}
+
+		float frustumPlanes[6][4];
+		extractFrustumPlanes(&cullingMatrix[0][0], frustumPlanes);
+
+		numClustersTested = numClustersCulled = 0;
+		for (auto meshlet = first; meshlet != last; ++meshlet) {
+			numClustersTested++;
+
+			if (isMeshletOutsideFrustum(*meshlet, frustumPlanes) || isMeshletBackFacing(*meshlet, &cullingCameraPosition.x)) {
+				numClustersCulled++;
+				continue;
+			}
+
+			if (!ranges.empty() && ranges.back().firstIndex + ranges.back().indexCount == meshlet->firstIndex) {
+				ranges.back().indexCount += meshlet->indexCount;
+			}
+			else {
+				ranges.push_back({ meshlet->firstIndex, meshlet->indexCount });
 			}
 		}
+
+		return true;
+	}
+
+	// The ranges of indices to draw: the range of the selected LOD level, or the ranges of its visible meshlets.
+	void getDrawRanges(std::vector<IndexRange>& ranges) {
+		ranges.clear();
+
+		uint32_t firstIndex, indexCount;
+		getLodDrawRange(firstIndex, indexCount);
+
+		if (indexCount > 0 && !cullClusters(firstIndex, indexCount, ranges)) {
+			ranges.push_back({ firstIndex, indexCount });
+		}
+	}
+
+	// Select the LOD level and cull the meshlets for this frame. drawFrame() writes the ranges to the indirect buffer.
+	void updateModelLod(const UniformBufferObject& ubo) {
+		if (residentIndexCount == 0) {
+			return;
+		}
+
+		lodLevel = selectModelLod(ubo);
+
+		// The meshlets are culled in model space.
+		hasCullingMatrices = true;
+		cullingMatrix = ubo.proj * ubo.view * ubo.model;
+		cullingCameraPosition = glm::inverse(ubo.view * ubo.model) * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+
+		getDrawRanges(drawRanges);
+	}
+
+	// Run the mesh optimization passes on vertices and indices, and print the vertex cache
+	// statistics before and after.
+	void optimizeMesh() {
+		auto startTime = std::chrono::high_resolution_clock::now();
+		VertexCacheStats statsBefore = analyzeVertexCache(indices, vertices.size());
+
+		std::vector<uint32_t> hardBoundaries;
+		indices = optimizeVertexCache(indices, vertices.size(), 16, &hardBoundaries);
+		optimizeOverdraw(indices, hardBoundaries, &vertices[0].pos.x, sizeof(Vertex) / sizeof(float), vertices.size());
+		optimizeVertexFetch(vertices, indices);
+
+		VertexCacheStats statsAfter = analyzeVertexCache(indices, vertices.size());
+		auto endTime = std::chrono::high_resolution_clock::now();
+
+		std::cout << MODEL_PATH << " optimized in " << std::chrono::duration<double, std::milli>(endTime - startTime).count() << " ms: "
+			<< "ACMR " << statsBefore.acmr << " -> " << statsAfter.acmr << ", "
+			<< "ATVR " << statsBefore.atvr << " -> " << statsAfter.atvr << std::endl;
+	}
+
+	const void* getVertexData() const {
+		return useQuantizedVertices ? static_cast<const void*>(quantizedVertices.data()) : static_cast<const void*>(vertices.data());
+	}
+
+	VkDeviceSize getVertexDataSize() const {
+		return useQuantizedVertices ? sizeof(QuantizedVertex) * quantizedVertices.size() : sizeof(Vertex) * vertices.size();
+	}
+
+	// Every index of a model with fewer than 65536 vertices fits in 16 bits.
+	void selectIndexType() {
+		if (vertices.size() < 65536) {
+			indexType = VK_INDEX_TYPE_UINT16;
+			shortIndices.assign(indices.begin(), indices.end());
+		}
+	}
+
+	const void* getIndexData() const {
+		return (indexType == VK_INDEX_TYPE_UINT16) ? static_cast<const void*>(shortIndices.data()) : static_cast<const void*>(indices.data());
+	}
+
+	VkDeviceSize getIndexDataSize() const {
+		return ((indexType == VK_INDEX_TYPE_UINT16) ? sizeof(uint16_t) : sizeof(uint32_t)) * indices.size();
 	}
 
 	void createVertexBuffer() {
-		VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
+		const void* vertexData = getVertexData();
+		VkDeviceSize bufferSize = getVertexDataSize();
 
 		VkBuffer stagingBuffer;
 		VkDeviceMemory stagingBufferMemory;
@@ -1064,7 +2018,7 @@ private:
 
 		void* data;
 		vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-		memcpy(data, vertices.data(), (size_t)bufferSize);
+		memcpy(data, vertexData, (size_t)bufferSize);
 		vkUnmapMemory(device, stagingBufferMemory);
 
 		createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory);
@@ -1076,7 +2030,10 @@ private:
 	}
 
 	void createIndexBuffer() {
-		VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
+		selectIndexType();
+
+		const void* indexData = getIndexData();
+		VkDeviceSize bufferSize = getIndexDataSize();
 
 		VkBuffer stagingBuffer;
 		VkDeviceMemory stagingBufferMemory;
@@ -1084,7 +2041,7 @@ private:
 
 		void* data;
 		vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-		memcpy(data, indices.data(), (size_t)bufferSize);
+		memcpy(data, indexData, (size_t)bufferSize);
 		vkUnmapMemory(device, stagingBufferMemory);
 
 		createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory);
@@ -1093,6 +2050,119 @@ private:
 
 		vkDestroyBuffer(device, stagingBuffer, nullptr);
 		vkFreeMemory(device, stagingBufferMemory, nullptr);
+
+		residentIndexCount = static_cast<uint32_t>(indices.size());
+	}
+
+	double getTimeSinceStart() const {
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+	}
+
+	// Run loadModel() on modelLoaderThread. An exception is rethrown by streamModel() on the main thread.
+	void startModelLoading() {
+		modelLoaderThread = std::thread([this]() {
+			try {
+				loadModel();
+			}
+			catch (...) {
+				modelLoaderError = std::current_exception();
+			}
+
+			modelLoaded = true;
+		});
+	}
+
+	// Called once per frame while the model is streamed. When the loader thread is done, the vertex and
+	// index buffers are created at their full size. Then every frame copies the next uploadBudgetPerFrame
+	// bytes through the streaming buffer: first all the vertices, then the indices. The command buffers are
+	// recorded again whenever more triangles can be drawn.
+	void streamModel() {
+		if (!modelBuffersCreated) {
+			if (!modelLoaded) {
+				return;
+			}
+
+			modelLoaderThread.join();
+			if (modelLoaderError) {
+				std::rethrow_exception(modelLoaderError);
+			}
+
+			if (indices.empty()) {
+				throw std::runtime_error("the model has no triangles!");
+			}
+
+			selectIndexType();
+
+			createBuffer(getVertexDataSize(), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory);
+			createBuffer(getIndexDataSize(), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory);
+
+			createBuffer(uploadBudgetPerFrame, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, streamingBuffer, streamingBufferMemory);
+			vkMapMemory(device, streamingBufferMemory, 0, uploadBudgetPerFrame, 0, &streamingBufferData);
+
+			modelBuffersCreated = true;
+
+			// The meshlets are known now, so the indirect buffers get room for all the ranges, and the command
+			// buffers are recorded again to draw the model. This happens once.
+			vkDeviceWaitIdle(device);
+			createFrameResources();
+			vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+			createCommandBuffers();
+		}
+
+		if (uploadedIndexBytes == getIndexDataSize()) {
+			return;
+		}
+
+		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+		VkDeviceSize streamingOffset = 0;
+
+		auto copySlice = [&](const void* source, VkDeviceSize sourceSize, VkDeviceSize& uploadedBytes, VkBuffer destination) {
+			VkDeviceSize size = std::min(sourceSize - uploadedBytes, uploadBudgetPerFrame - streamingOffset);
+			if (size == 0) {
+				return;
+			}
+
+			memcpy(static_cast<char*>(streamingBufferData) + streamingOffset, static_cast<const char*>(source) + uploadedBytes, (size_t)size);
+
+			VkBufferCopy copyRegion = {};
+			copyRegion.srcOffset = streamingOffset;
+			copyRegion.dstOffset = uploadedBytes;
+			copyRegion.size = size;
+			vkCmdCopyBuffer(commandBuffer, streamingBuffer, destination, 1, &copyRegion);
+
+			streamingOffset += size;
+			uploadedBytes += size;
+		};
+
+		copySlice(getVertexData(), getVertexDataSize(), uploadedVertexBytes, vertexBuffer);
+		copySlice(getIndexData(), getIndexDataSize(), uploadedIndexBytes, indexBuffer);
+
+		// This waits until the queue is idle, so the streaming buffer can be reused and the command buffers can be freed.
+		endSingleTimeCommands(commandBuffer);
+
+		VkDeviceSize indexSize = (indexType == VK_INDEX_TYPE_UINT16) ? sizeof(uint16_t) : sizeof(uint32_t);
+		uint32_t drawableIndexCount = static_cast<uint32_t>(uploadedIndexBytes / indexSize / 3 * 3);
+
+		// The next frame draws the new indices through the indirect buffer.
+		residentIndexCount = drawableIndexCount;
+
+		if (uploadedIndexBytes == getIndexDataSize()) {
+			destroyStreamingBuffer();
+			std::cout << "Model fully resident after " << getTimeSinceStart() << " ms." << std::endl;
+		}
+	}
+
+	void destroyStreamingBuffer() {
+		if (streamingBuffer == VK_NULL_HANDLE) {
+			return;
+		}
+
+		vkUnmapMemory(device, streamingBufferMemory);
+		vkDestroyBuffer(device, streamingBuffer, nullptr);
+		vkFreeMemory(device, streamingBufferMemory, nullptr);
+		streamingBuffer = VK_NULL_HANDLE;
+		streamingBufferMemory = VK_NULL_HANDLE;
+		streamingBufferData = nullptr;
 	}
 
 	void createUniformBuffer() {
@@ -1100,6 +2170,56 @@ private:
 		createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBuffer, uniformBufferMemory);
 	}
 
+	// Place the copies of the model and copy their matrices to the instance buffer. The random layout uses a fixed
+	// seed, so the copies are in the same places in every run.
+	void createInstanceBuffer() {
+		uint32_t columns = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(instanceCount))));
+		float extent = instanceSpacing * columns;
+		uint32_t seed = 1;
+
+		auto random = [&seed]() {
+			seed = seed * 1664525u + 1013904223u;
+			return static_cast<float>(seed >> 8) / 16777216.0f;
+		};
+
+		instances.resize(instanceCount);
+		for (uint32_t i = 0; i < instanceCount; i++) {
+			if (instanceLayout == instanceLayoutRandom) {
+				glm::vec3 position((random() - 0.5f) * extent, (random() - 0.5f) * extent, 0.0f);
+				instances[i].model = glm::rotate(glm::translate(glm::mat4(1.0f), position), random() * glm::radians(360.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+			}
+			else {
+				// The grid is centered at the origin, in the xy plane, because z is up.
+				glm::vec3 position((static_cast<float>(i % columns) - 0.5f * (columns - 1)) * instanceSpacing,
+					(static_cast<float>(i / columns) - 0.5f * (columns - 1)) * instanceSpacing, 0.0f);
+				instances[i].model = glm::translate(glm::mat4(1.0f), position);
+			}
+		}
+
+		VkDeviceSize bufferSize = sizeof(InstanceData) * instances.size();
+
+		VkBuffer stagingBuffer;
+		VkDeviceMemory stagingBufferMemory;
+		createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+
+		void* data;
+		vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
+		memcpy(data, instances.data(), (size_t)bufferSize);
+		vkUnmapMemory(device, stagingBufferMemory);
+
+		createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, instanceBuffer, instanceBufferMemory);
+
+		copyBuffer(stagingBuffer, instanceBuffer, bufferSize);
+
+		vkDestroyBuffer(device, stagingBuffer, nullptr);
+		vkFreeMemory(device, stagingBufferMemory, nullptr);
+
+		if (instanceCount > 1) {
+			std::cout << instanceCount << " instances in a " << (instanceLayout == instanceLayoutRandom ? "random" : "grid")
+				<< " layout, " << instanceSpacing << " apart." << std::endl;
+		}
+	}
+
 	void createDescriptorPool() {
 		std::array<VkDescriptorPoolSize, 2> poolSizes = {};
 		poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
@@ -1243,6 +2363,102 @@ private:
 		throw std::runtime_error("failed to find suitable memory type!");
 	}
 
+	// The largest number of ranges getDrawRanges() can return: one per meshlet of the LOD level with the most meshlets.
+	uint32_t getMaxDrawRanges() const {
+		uint32_t maxRanges = 1;
+
+		for (unsigned int k = 0; k < modelLods.numLevels; k++) {
+			uint32_t levelEnd = modelLods.firstIndex[k] + modelLods.indexCount[k];
+			uint32_t count = 0;
+
+			for (const Meshlet& meshlet : meshlets) {
+				if (meshlet.firstIndex >= modelLods.firstIndex[k] && meshlet.firstIndex < levelEnd) {
+					count++;
+				}
+			}
+
+			maxRanges = std::max(maxRanges, count);
+		}
+
+		return maxRanges;
+	}
+
+	// Create a fence and a host-visible indirect buffer of maxIndirectDraws commands for every swapchain image.
+	// The GPU must not use the old ones.
+	void createFrameResources() {
+		destroyFrameResources();
+
+		maxIndirectDraws = (vertexBuffer != VK_NULL_HANDLE) ? getMaxDrawRanges() : 1;
+		VkDeviceSize bufferSize = sizeof(VkDrawIndexedIndirectCommand) * maxIndirectDraws;
+
+		size_t numImages = swapChainImages.size();
+		indirectBuffers.resize(numImages);
+		indirectBuffersMemory.resize(numImages);
+		indirectCommands.resize(numImages);
+		indirectDrawCounts.assign(numImages, 0);
+		frameFences.resize(numImages);
+
+		for (size_t i = 0; i < numImages; i++) {
+			createBuffer(bufferSize, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, indirectBuffers[i], indirectBuffersMemory[i]);
+
+			void* data;
+			vkMapMemory(device, indirectBuffersMemory[i], 0, bufferSize, 0, &data);
+			indirectCommands[i] = static_cast<VkDrawIndexedIndirectCommand*>(data);
+			memset(data, 0, static_cast<size_t>(bufferSize));
+
+			// Signaled, so the first frame of the image doesn't wait.
+			VkFenceCreateInfo fenceInfo = {};
+			fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+			fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+			if (vkCreateFence(device, &fenceInfo, nullptr, &frameFences[i]) != VK_SUCCESS) {
+				throw std::runtime_error("failed to create fence!");
+			}
+		}
+	}
+
+	void destroyFrameResources() {
+		for (size_t i = 0; i < indirectBuffers.size(); i++) {
+			vkUnmapMemory(device, indirectBuffersMemory[i]);
+			vkDestroyBuffer(device, indirectBuffers[i], nullptr);
+			vkFreeMemory(device, indirectBuffersMemory[i], nullptr);
+			vkDestroyFence(device, frameFences[i], nullptr);
+		}
+
+		indirectBuffers.clear();
+		indirectBuffersMemory.clear();
+		indirectCommands.clear();
+		indirectDrawCounts.clear();
+		frameFences.clear();
+	}
+
+	// Write drawRanges to the indirect buffer of a swapchain image. Only the commands that were used before are cleared.
+	void writeIndirectDraws(uint32_t imageIndex) {
+		VkDrawIndexedIndirectCommand* commands = indirectCommands[imageIndex];
+		uint32_t count = static_cast<uint32_t>(std::min(drawRanges.size(), static_cast<size_t>(maxIndirectDraws)));
+
+		for (uint32_t d = 0; d < count; d++) {
+			commands[d].indexCount = drawRanges[d].indexCount;
+			commands[d].instanceCount = instanceCount;
+			commands[d].firstIndex = drawRanges[d].firstIndex;
+			commands[d].vertexOffset = 0;
+			commands[d].firstInstance = 0;
+		}
+
+		// More ranges than commands can't happen, but if it did, the last command would draw everything up to the
+		// end of the last range, including some culled meshlets.
+		if (drawRanges.size() > count && count > 0) {
+			const IndexRange& last = drawRanges.back();
+			commands[count - 1].indexCount = last.firstIndex + last.indexCount - commands[count - 1].firstIndex;
+		}
+
+		for (uint32_t d = count; d < indirectDrawCounts[imageIndex]; d++) {
+			commands[d] = {};
+		}
+
+		indirectDrawCounts[imageIndex] = count;
+	}
+
 	void createCommandBuffers() {
 		commandBuffers.resize(swapChainFramebuffers.size());
 
@@ -1279,17 +2495,28 @@ private:
 
 			vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 
-			vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+			// Only the visible meshlets of the selected LOD level are drawn. While the model is streamed, only indices
+			// that are in the index buffer are used. Both are decided per frame, in the indirect buffer.
+			if (vertexBuffer != VK_NULL_HANDLE) {
+				vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
 
-			VkBuffer vertexBuffers[] = { vertexBuffer };
-			VkDeviceSize offsets[] = { 0 };
-			vkCmdBindVertexBuffers(commandBuffers[i], 0, 1, vertexBuffers, offsets);
+				VkBuffer vertexBuffers[] = { vertexBuffer, instanceBuffer };
+				VkDeviceSize offsets[] = { 0, 0 };
+				vkCmdBindVertexBuffers(commandBuffers[i], 0, 2, vertexBuffers, offsets);
 
-			vkCmdBindIndexBuffer(commandBuffers[i], indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+				vkCmdBindIndexBuffer(commandBuffers[i], indexBuffer, 0, indexType);
 
-			vkCmdBindDescriptorSets(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+				vkCmdBindDescriptorSets(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
 
-			vkCmdDrawIndexed(commandBuffers[i], static_cast<uint32_t>(indices.size()), 1, 0, 0, 0);
+				if (maxIndirectDraws <= maxDrawIndirectCount) {
+					vkCmdDrawIndexedIndirect(commandBuffers[i], indirectBuffers[i], 0, maxIndirectDraws, sizeof(VkDrawIndexedIndirectCommand));
+				}
+				else {
+					for (uint32_t d = 0; d < maxIndirectDraws; d++) {
+						vkCmdDrawIndexedIndirect(commandBuffers[i], indirectBuffers[i], d * sizeof(VkDrawIndexedIndirectCommand), 1, sizeof(VkDrawIndexedIndirectCommand));
+					}
+				}
+			}
 
 			vkCmdEndRenderPass(commandBuffers[i]);
 
@@ -1352,10 +2579,19 @@ private:
 		ubo.proj = glm::perspective(glm::radians(45.0f), swapChainExtent.width / (float)swapChainExtent.height, 0.1f, 10.0f);
 		ubo.proj[1][1] *= -1;
 
+		// The decode parameters are written by the loader thread, so they are only read once the model is drawn.
+		if (residentIndexCount > 0) {
+			ubo.positionOffset = positionOffset;
+			ubo.positionScale = positionScale;
+			ubo.texCoordOffsetScale = texCoordOffsetScale;
+		}
+
 		void* data;
 		vkMapMemory(device, uniformBufferMemory, 0, sizeof(ubo), 0, &data);
 		memcpy(data, &ubo, sizeof(ubo));
 		vkUnmapMemory(device, uniformBufferMemory);
+
+		updateModelLod(ubo);
 	}
 
 
@@ -1371,6 +2607,11 @@ private:
 			throw std::runtime_error("failed to acquire swap chain image!");
 		}
 
+		// Wait until the last submission of this image is done, usually long ago, and write the ranges of this frame.
+		vkWaitForFences(device, 1, &frameFences[imageIndex], VK_TRUE, std::numeric_limits<uint64_t>::max());
+		vkResetFences(device, 1, &frameFences[imageIndex]);
+		writeIndirectDraws(imageIndex);
+
 		VkSubmitInfo submitInfo = {};
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
@@ -1387,7 +2628,7 @@ private:
 		submitInfo.signalSemaphoreCount = 1;
 		submitInfo.pSignalSemaphores = signalSemaphores;
 
-		if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+		if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, frameFences[imageIndex]) != VK_SUCCESS) {
 			throw std::runtime_error("failed to submit draw command buffer!");
 		}
 
@@ -1637,10 +2878,34 @@ private:
 	}
 };
 
-int main() {
+int main(int argc, char* argv[]) {
 	HelloTriangleApplication app;
 
 	try {
+		// hu_proj3 --benchmark-obj [file.obj] times the OBJ parsers instead of running the viewer.
+		if (argc > 1 && strcmp(argv[1], "--benchmark-obj") == 0) {
+			benchmarkObjParsers(argc > 2 ? argv[2] : "../models/chalet.obj");
+			return EXIT_SUCCESS;
+		}
+
+		// hu_proj3 --instances <count> --layout grid|random --spacing <distance> draws many copies of the model.
+		for (int i = 1; i < argc; i++) {
+			bool hasValue = (i + 1 < argc);
+
+			if (strcmp(argv[i], "--instances") == 0 && hasValue) {
+				instanceCount = static_cast<uint32_t>(std::max(atoi(argv[++i]), 1));
+			}
+			else if (strcmp(argv[i], "--layout") == 0 && hasValue) {
+				instanceLayout = (strcmp(argv[++i], "random") == 0) ? instanceLayoutRandom : instanceLayoutGrid;
+			}
+			else if (strcmp(argv[i], "--spacing") == 0 && hasValue) {
+				instanceSpacing = static_cast<float>(atof(argv[++i]));
+			}
+			else {
+				throw std::runtime_error(std::string("unknown option ") + argv[i]);
+			}
+		}
+
 		app.run();
 	}
 	catch (const std::runtime_error& e) {
@@ -0,0 +1,122 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A read-only memory mapping of a whole file.
+class MappedFile {
+public:
+	MappedFile() : data(NULL), size(0) {
+#ifdef _WIN32
+		fileHandle = INVALID_HANDLE_VALUE;
+		mappingHandle = NULL;
+#endif
+	}
+
+	~MappedFile() {
+		close();
+	}
+
+	bool open(const char *filename) {
+		close();
+
+#ifdef _WIN32
+		fileHandle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (fileHandle == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0) {
+			close();
+			return false;
+		}
+		size = (size_t)fileSize.QuadPart;
+
+		mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mappingHandle == NULL) {
+			close();
+			return false;
+		}
+
+		data = (const unsigned char *)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+#else
+		int fd = ::open(filename, O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+
+		struct stat fileStat;
+		if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+			::close(fd);
+			return false;
+		}
+		size = (size_t)fileStat.st_size;
+
+		void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd); // The mapping stays valid after the file descriptor is closed.
+		data = (mapping == MAP_FAILED) ? NULL : (const unsigned char *)mapping;
+#endif
+
+		if (data == NULL) {
+			close();
+			return false;
+		}
+
+		return true;
+	}
+
+	void close() {
+#ifdef _WIN32
+		if (data) {
+			UnmapViewOfFile(data);
+		}
+		if (mappingHandle) {
+			CloseHandle(mappingHandle);
+			mappingHandle = NULL;
+		}
+		if (fileHandle != INVALID_HANDLE_VALUE) {
+			CloseHandle(fileHandle);
+			fileHandle = INVALID_HANDLE_VALUE;
+		}
+#else
+		if (data) {
+			munmap((void *)data, size);
+		}
+#endif
+		data = NULL;
+		size = 0;
+	}
+
+	bool isOpen() const { return data != NULL; }
+	const unsigned char *getData() const { return data; }
+	size_t getSize() const { return size; }
+
+private:
+	// A mapping can't be copied.
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const unsigned char *data;
+	size_t size;
+
+#ifdef _WIN32
+	HANDLE fileHandle;
+	HANDLE mappingHandle;
+#endif
+};
+
+#endif
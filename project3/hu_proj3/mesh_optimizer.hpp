@@ -0,0 +1,325 @@
+#ifndef MESH_OPTIMIZER_HPP
+#define MESH_OPTIMIZER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Reordering of indexed triangle lists for the GPU, used by loadModel().
+//
+// 1. optimizeVertexCache() reorders the triangles so that vertices are reused while they are still in the
+//    post-transform vertex cache (Tipsify, Sander et al. 2007). It also returns the points where the
+//    order had to jump to an unrelated part of the mesh.
+// 2. optimizeOverdraw() splits the triangles into clusters at those points and sorts the clusters so that
+//    the ones facing away from the center of the mesh are drawn first. They are more likely to occlude the
+//    others, which reduces overdraw. The triangles inside a cluster keep their order, so the vertex cache
+//    efficiency is mostly kept.
+// 3. optimizeVertexFetch() reorders the vertices in the order they are first used, so that the vertex
+//    fetches are mostly sequential.
+
+struct VertexCacheStats {
+	float acmr; // average cache miss ratio: transformed vertices per triangle, between 0.5 and 3
+	float atvr; // average transformed vertex ratio: transformed vertices per vertex, 1 is the best
+};
+
+// Simulate a FIFO post-transform vertex cache with cacheSize entries.
+inline VertexCacheStats analyzeVertexCache(const std::vector<uint32_t>& indices, size_t vertexCount, unsigned int cacheSize = 16) {
+	std::vector<unsigned int> cacheTimestamps(vertexCount, 0);
+	unsigned int timestamp = cacheSize + 1;
+	size_t misses = 0;
+
+	for (uint32_t index : indices) {
+		if (timestamp - cacheTimestamps[index] > cacheSize) {
+			cacheTimestamps[index] = timestamp++;
+			misses++;
+		}
+	}
+
+	VertexCacheStats stats = {};
+	size_t triangleCount = indices.size() / 3;
+	stats.acmr = triangleCount ? static_cast<float>(misses) / triangleCount : 0.0f;
+	stats.atvr = vertexCount ? static_cast<float>(misses) / vertexCount : 0.0f;
+
+	return stats;
+}
+
+// Reorder the triangles for the post-transform vertex cache with Tipsify.
+// If hardBoundaries isn't null, it receives the first triangle of every run of triangles that starts
+// after a dead end, i.e. with no vertex left in the cache.
+inline std::vector<uint32_t> optimizeVertexCache(const std::vector<uint32_t>& indices, size_t vertexCount,
+	unsigned int cacheSize = 16, std::vector<uint32_t>* hardBoundaries = nullptr) {
+	const size_t triangleCount = indices.size() / 3;
+
+	// Triangles using each vertex, in compressed rows: the triangles of vertex v are
+	// adjacentTriangles[adjacencyOffsets[v]] to adjacentTriangles[adjacencyOffsets[v + 1] - 1].
+	std::vector<uint32_t> liveTriangles(vertexCount, 0);
+	for (uint32_t index : indices) {
+		liveTriangles[index]++;
+	}
+
+	std::vector<uint32_t> adjacencyOffsets(vertexCount + 1, 0);
+	for (size_t v = 0; v < vertexCount; v++) {
+		adjacencyOffsets[v + 1] = adjacencyOffsets[v] + liveTriangles[v];
+	}
+
+	std::vector<uint32_t> adjacentTriangles(indices.size());
+	std::vector<uint32_t> fillOffsets(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+	for (size_t t = 0; t < triangleCount; t++) {
+		for (size_t k = 0; k < 3; k++) {
+			adjacentTriangles[fillOffsets[indices[3 * t + k]]++] = static_cast<uint32_t>(t);
+		}
+	}
+
+	std::vector<unsigned int> cacheTimestamps(vertexCount, 0);
+	unsigned int timestamp = cacheSize + 1;
+
+	std::vector<bool> emitted(triangleCount, false);
+	std::vector<uint32_t> deadEndStack;
+	std::vector<uint32_t> candidates;
+	std::vector<uint32_t> result;
+	result.reserve(indices.size());
+
+	if (hardBoundaries) {
+		hardBoundaries->clear();
+	}
+
+	size_t cursor = 0;
+	int64_t fanningVertex = vertexCount > 0 ? 0 : -1;
+	bool deadEnd = true;
+
+	while (fanningVertex >= 0) {
+		if (deadEnd && hardBoundaries) {
+			hardBoundaries->push_back(static_cast<uint32_t>(result.size() / 3));
+		}
+
+		// Emit all the remaining triangles around the fanning vertex.
+		candidates.clear();
+		for (uint32_t a = adjacencyOffsets[fanningVertex]; a < adjacencyOffsets[fanningVertex + 1]; a++) {
+			uint32_t t = adjacentTriangles[a];
+			if (emitted[t]) {
+				continue;
+			}
+
+			for (size_t k = 0; k < 3; k++) {
+				uint32_t v = indices[3 * t + k];
+
+				result.push_back(v);
+				deadEndStack.push_back(v);
+				candidates.push_back(v);
+				liveTriangles[v]--;
+
+				if (timestamp - cacheTimestamps[v] > cacheSize) {
+					cacheTimestamps[v] = timestamp++;
+				}
+			}
+
+			emitted[t] = true;
+		}
+
+		// The next fanning vertex is the candidate that will still be in the cache after all of
+		// its remaining triangles are emitted, and that has been in the cache the longest.
+		int64_t nextVertex = -1;
+		int bestPriority = -1;
+		for (uint32_t v : candidates) {
+			if (liveTriangles[v] > 0) {
+				int priority = 0;
+				if (timestamp - cacheTimestamps[v] + 2 * liveTriangles[v] <= cacheSize) {
+					priority = static_cast<int>(timestamp - cacheTimestamps[v]);
+				}
+
+				if (priority > bestPriority) {
+					bestPriority = priority;
+					nextVertex = v;
+				}
+			}
+		}
+
+		deadEnd = false;
+		if (nextVertex < 0) {
+			// Dead end: try the most recently used vertices first, then any vertex with triangles left.
+			while (!deadEndStack.empty() && nextVertex < 0) {
+				uint32_t v = deadEndStack.back();
+				deadEndStack.pop_back();
+				if (liveTriangles[v] > 0) {
+					nextVertex = v;
+				}
+			}
+
+			while (nextVertex < 0 && cursor < vertexCount) {
+				if (liveTriangles[cursor] > 0) {
+					nextVertex = static_cast<int64_t>(cursor);
+					deadEnd = true;
+				}
+				cursor++;
+			}
+		}
+
+		fanningVertex = nextVertex;
+	}
+
+	return result;
+}
+
+// Split the triangles into clusters and sort the clusters to reduce overdraw.
+// hardBoundaries are the cluster starts returned by optimizeVertexCache(). Each of those clusters is split
+// further wherever the part before the split has an ACMR within threshold (e.g. 1.05) of the whole cluster,
+// so the reordering doesn't cost much vertex cache efficiency.
+// positions[v * positionStride] to positions[v * positionStride + 2] is the position of vertex v.
+inline void optimizeOverdraw(std::vector<uint32_t>& indices, const std::vector<uint32_t>& hardBoundaries,
+	const float* positions, size_t positionStride, size_t vertexCount, float threshold = 1.05f, unsigned int cacheSize = 16) {
+	const size_t triangleCount = indices.size() / 3;
+	if (triangleCount == 0) {
+		return;
+	}
+
+	std::vector<unsigned int> cacheTimestamps(vertexCount, 0);
+	unsigned int timestamp = cacheSize + 1;
+
+	auto countMisses = [&](size_t t) {
+		unsigned int misses = 0;
+		for (size_t k = 0; k < 3; k++) {
+			uint32_t v = indices[3 * t + k];
+			if (timestamp - cacheTimestamps[v] > cacheSize) {
+				cacheTimestamps[v] = timestamp++;
+				misses++;
+			}
+		}
+		return misses;
+	};
+
+	// Starting a new cluster is like flushing the cache.
+	auto flushCache = [&]() {
+		timestamp += cacheSize + 1;
+	};
+
+	std::vector<uint32_t> hardStarts(hardBoundaries);
+	if (hardStarts.empty() || hardStarts[0] != 0) {
+		hardStarts.insert(hardStarts.begin(), 0);
+	}
+	hardStarts.push_back(static_cast<uint32_t>(triangleCount));
+
+	std::vector<uint32_t> clusterStarts;
+	for (size_t c = 0; c + 1 < hardStarts.size(); c++) {
+		size_t begin = hardStarts[c], end = hardStarts[c + 1];
+		if (begin >= end) {
+			continue;
+		}
+
+		flushCache();
+		unsigned int clusterMisses = 0;
+		for (size_t t = begin; t < end; t++) {
+			clusterMisses += countMisses(t);
+		}
+		float clusterThreshold = threshold * clusterMisses / (end - begin);
+
+		flushCache();
+		clusterStarts.push_back(static_cast<uint32_t>(begin));
+		size_t softBegin = begin;
+		unsigned int softMisses = 0;
+		for (size_t t = begin; t < end; t++) {
+			softMisses += countMisses(t);
+
+			if (t + 1 < end && static_cast<float>(softMisses) / (t + 1 - softBegin) <= clusterThreshold) {
+				clusterStarts.push_back(static_cast<uint32_t>(t + 1));
+				softBegin = t + 1;
+				softMisses = 0;
+				flushCache();
+			}
+		}
+	}
+	clusterStarts.push_back(static_cast<uint32_t>(triangleCount));
+
+	const size_t clusterCount = clusterStarts.size() - 1;
+
+	// Area-weighted centroid and normal of every cluster, and the centroid of the whole mesh.
+	std::vector<float> clusterData(clusterCount * 6, 0.0f);
+	float meshCentroid[3] = { 0.0f, 0.0f, 0.0f };
+	float meshArea = 0.0f;
+
+	for (size_t c = 0; c < clusterCount; c++) {
+		float* centroid = &clusterData[c * 6];
+		float* normal = &clusterData[c * 6 + 3];
+		float clusterArea = 0.0f;
+
+		for (size_t t = clusterStarts[c]; t < clusterStarts[c + 1]; t++) {
+			const float* p0 = positions + indices[3 * t + 0] * positionStride;
+			const float* p1 = positions + indices[3 * t + 1] * positionStride;
+			const float* p2 = positions + indices[3 * t + 2] * positionStride;
+
+			float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+			float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+			float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+			float area = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+			for (size_t k = 0; k < 3; k++) {
+				centroid[k] += (p0[k] + p1[k] + p2[k]) / 3.0f * area;
+				normal[k] += n[k];
+				meshCentroid[k] += (p0[k] + p1[k] + p2[k]) / 3.0f * area;
+			}
+			clusterArea += area;
+		}
+
+		for (size_t k = 0; k < 3; k++) {
+			centroid[k] = clusterArea > 0.0f ? centroid[k] / clusterArea : 0.0f;
+		}
+		meshArea += clusterArea;
+	}
+
+	for (size_t k = 0; k < 3; k++) {
+		meshCentroid[k] = meshArea > 0.0f ? meshCentroid[k] / meshArea : 0.0f;
+	}
+
+	// Clusters that face away from the center of the mesh are drawn first.
+	std::vector<float> sortKeys(clusterCount);
+	for (size_t c = 0; c < clusterCount; c++) {
+		const float* centroid = &clusterData[c * 6];
+		const float* normal = &clusterData[c * 6 + 3];
+		float length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+
+		sortKeys[c] = 0.0f;
+		if (length > 0.0f) {
+			for (size_t k = 0; k < 3; k++) {
+				sortKeys[c] += (centroid[k] - meshCentroid[k]) * normal[k] / length;
+			}
+		}
+	}
+
+	std::vector<uint32_t> clusterOrder(clusterCount);
+	for (size_t c = 0; c < clusterCount; c++) {
+		clusterOrder[c] = static_cast<uint32_t>(c);
+	}
+	std::stable_sort(clusterOrder.begin(), clusterOrder.end(), [&sortKeys](uint32_t a, uint32_t b) {
+		return sortKeys[a] > sortKeys[b];
+	});
+
+	std::vector<uint32_t> result;
+	result.reserve(indices.size());
+	for (uint32_t c : clusterOrder) {
+		result.insert(result.end(), indices.begin() + 3 * clusterStarts[c], indices.begin() + 3 * clusterStarts[c + 1]);
+	}
+
+	indices.swap(result);
+}
+
+// Reorder the vertices in the order the indices first use them and update the indices.
+// Vertices that no index uses are removed.
+template <typename V>
+void optimizeVertexFetch(std::vector<V>& vertices, std::vector<uint32_t>& indices) {
+	const uint32_t unused = 0xFFFFFFFFu;
+	std::vector<uint32_t> remap(vertices.size(), unused);
+	std::vector<V> result;
+	result.reserve(vertices.size());
+
+	for (uint32_t& index : indices) {
+		if (remap[index] == unused) {
+			remap[index] = static_cast<uint32_t>(result.size());
+			result.push_back(vertices[index]);
+		}
+		index = remap[index];
+	}
+
+	vertices.swap(result);
+}
+
+#endif
@@ -0,0 +1,479 @@
+/*
+Quadric error mesh simplification and LOD selection.
+
+simplifyMesh() reduces the number of triangles of an indexed triangle mesh by collapsing edges, using the
+quadric error metric of Garland and Heckbert ("Surface Simplification Using Quadric Error Metrics", 1997).
+A collapse moves a vertex onto one of its neighbors, so the vertices themselves are never changed. Every
+simplified level is only a new index list into the original vertex array, and all the levels of a mesh can
+share one vertex buffer.
+
+Vertices on a texture or normal seam (several vertices with the same position) never move, and vertices on
+an open border only move along the border, so the seams and the outline of the mesh are kept.
+
+buildLodChain() creates up to maxLodLevels levels, each with about half the triangles of the previous one.
+The index lists of all the levels are stored in one array, coarsest level first, so a renderer that uploads
+the array front to back can draw a coarse version of the mesh early.
+
+selectLodLevel() picks a level from the projected size of the mesh on the screen.
+*/
+
+#ifndef MESH_SIMPLIFIER_HPP
+#define MESH_SIMPLIFIER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#include <stdint.h>
+
+// The maximum number of LOD levels of a mesh, including the original mesh (level 0).
+const unsigned int maxLodLevels = 5;
+
+// Meshes with fewer triangles than this only have level 0.
+const unsigned int minLodTriangles = 1024;
+
+// The LOD levels of one mesh. The indices of all the levels are stored in one array; level k uses
+// indexCount[k] indices starting at firstIndex[k]. Level 0 is the original mesh.
+struct MeshLodChain {
+	unsigned int numLevels;
+	unsigned int firstIndex[maxLodLevels];
+	unsigned int indexCount[maxLodLevels];
+	float error[maxLodLevels]; // the largest distance from the original surface, relative to boundingRadius
+	float boundingCenter[3];
+	float boundingRadius;
+};
+
+//-----------------------------------------------------------------
+// A symmetric 4x4 matrix: the sum of the squared distances to a set of planes.
+struct SimplifierQuadric {
+	double a00, a01, a02, a03, a11, a12, a13, a22, a23, a33;
+
+	void clear() {
+		a00 = a01 = a02 = a03 = a11 = a12 = a13 = a22 = a23 = a33 = 0.0;
+	}
+
+	// Add the plane nx * x + ny * y + nz * z + d = 0 with the given weight.
+	void addPlane(double nx, double ny, double nz, double d, double weight) {
+		a00 += weight * nx * nx; a01 += weight * nx * ny; a02 += weight * nx * nz; a03 += weight * nx * d;
+		a11 += weight * ny * ny; a12 += weight * ny * nz; a13 += weight * ny * d;
+		a22 += weight * nz * nz; a23 += weight * nz * d;
+		a33 += weight * d * d;
+	}
+
+	void add(const SimplifierQuadric& q) {
+		a00 += q.a00; a01 += q.a01; a02 += q.a02; a03 += q.a03;
+		a11 += q.a11; a12 += q.a12; a13 += q.a13;
+		a22 += q.a22; a23 += q.a23;
+		a33 += q.a33;
+	}
+
+	double evaluate(const float *p) const {
+		double x = p[0], y = p[1], z = p[2];
+
+		double result = a00 * x * x + 2.0 * a01 * x * y + 2.0 * a02 * x * z + 2.0 * a03 * x +
+			a11 * y * y + 2.0 * a12 * y * z + 2.0 * a13 * y +
+			a22 * z * z + 2.0 * a23 * z +
+			a33;
+
+		return result > 0.0 ? result : 0.0;
+	}
+};
+
+//-----------------------------------------------------------------
+// Compute a bounding sphere of the vertices: the center of the bounding box and the largest distance from it.
+inline void computeBoundingSphere(const float *positions, size_t positionStride, size_t vertexCount, float *center, float *radius) {
+	float minValue[3] = { 0.0f, 0.0f, 0.0f }, maxValue[3] = { 0.0f, 0.0f, 0.0f };
+
+	for (size_t i = 0; i < vertexCount; i++) {
+		for (int k = 0; k < 3; k++) {
+			float value = positions[i * positionStride + k];
+			minValue[k] = (i == 0 || value < minValue[k]) ? value : minValue[k];
+			maxValue[k] = (i == 0 || value > maxValue[k]) ? value : maxValue[k];
+		}
+	}
+
+	float maxDistance2 = 0.0f;
+	for (int k = 0; k < 3; k++) {
+		center[k] = 0.5f * (minValue[k] + maxValue[k]);
+	}
+	for (size_t i = 0; i < vertexCount; i++) {
+		const float *p = &positions[i * positionStride];
+		float dx = p[0] - center[0], dy = p[1] - center[1], dz = p[2] - center[2];
+		maxDistance2 = std::max(maxDistance2, dx * dx + dy * dy + dz * dz);
+	}
+
+	*radius = std::sqrt(maxDistance2);
+}
+
+//-----------------------------------------------------------------
+// Simplify a triangle list until at most targetIndexCount indices are left, or until the error of every
+// remaining collapse is larger than maxError. positions has positionStride floats per vertex.
+// The errors are distances from the original surface, relative to the radius of the bounding sphere.
+// The simplified indices are written to destination, which must have room for indexCount indices.
+// Returns the number of indices written. If resultError isn't NULL, it receives the largest error.
+inline size_t simplifyMesh(unsigned int *destination, const unsigned int *indices, size_t indexCount,
+	const float *positions, size_t positionStride, size_t vertexCount, size_t targetIndexCount, float maxError,
+	float *resultError) {
+	// Work in a normalized copy of the positions, so that the errors are relative to the size of the mesh.
+	float center[3], radius;
+	computeBoundingSphere(positions, positionStride, vertexCount, center, &radius);
+	float invRadius = radius > 0.0f ? 1.0f / radius : 0.0f;
+
+	std::vector<float> points(3 * vertexCount);
+	for (size_t i = 0; i < vertexCount; i++) {
+		for (int k = 0; k < 3; k++) {
+			points[3 * i + k] = (positions[i * positionStride + k] - center[k]) * invRadius;
+		}
+	}
+
+	// Vertices with the same position (the copies of a vertex on a seam) share one position id.
+	std::vector<unsigned int> order(vertexCount), positionId(vertexCount), wedgeSize(vertexCount, 0);
+	for (size_t i = 0; i < vertexCount; i++) {
+		order[i] = (unsigned int)i;
+	}
+	std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) {
+		const float *pa = &points[3 * a], *pb = &points[3 * b];
+		if (pa[0] != pb[0]) return pa[0] < pb[0];
+		if (pa[1] != pb[1]) return pa[1] < pb[1];
+		if (pa[2] != pb[2]) return pa[2] < pb[2];
+		return a < b;
+	});
+	for (size_t i = 0; i < vertexCount; i++) {
+		unsigned int v = order[i];
+		bool samePosition = i > 0 && points[3 * v] == points[3 * order[i - 1]] &&
+			points[3 * v + 1] == points[3 * order[i - 1] + 1] && points[3 * v + 2] == points[3 * order[i - 1] + 2];
+		positionId[v] = samePosition ? positionId[order[i - 1]] : v;
+		wedgeSize[positionId[v]]++;
+	}
+
+	// Find the border edges: the half edges without an opposite half edge, in position space.
+	std::vector<uint64_t> halfEdges;
+	halfEdges.reserve(indexCount);
+	for (size_t i = 0; i + 2 < indexCount; i += 3) {
+		for (int e = 0; e < 3; e++) {
+			unsigned int a = positionId[indices[i + e]], b = positionId[indices[i + (e + 1) % 3]];
+			if (a != b) {
+				halfEdges.push_back(((uint64_t)a << 32) | b);
+			}
+		}
+	}
+	std::sort(halfEdges.begin(), halfEdges.end());
+
+	// A vertex is movable if it has one position and is either inside the mesh or on a simple border.
+	// A border vertex may only move onto its neighbors along the border.
+	const unsigned int noVertex = ~0u;
+	std::vector<unsigned char> movable(vertexCount, 1);
+	std::vector<unsigned int> borderNext(vertexCount, noVertex), borderPrevious(vertexCount, noVertex);
+
+	for (size_t i = 0; i < vertexCount; i++) {
+		if (wedgeSize[positionId[i]] > 1) {
+			movable[i] = 0;
+		}
+	}
+
+	for (size_t i = 0; i < halfEdges.size(); i++) {
+		unsigned int a = (unsigned int)(halfEdges[i] >> 32), b = (unsigned int)halfEdges[i];
+		if (std::binary_search(halfEdges.begin(), halfEdges.end(), ((uint64_t)b << 32) | a)) {
+			continue;
+		}
+
+		if (borderNext[a] != noVertex || borderPrevious[b] != noVertex) {
+			// More than one border passes through the vertex.
+			movable[a] = 0;
+			movable[b] = 0;
+		}
+		borderNext[a] = b;
+		borderPrevious[b] = a;
+	}
+
+	// Every vertex starts with the planes of its triangles, weighted by their areas. Border edges also add a
+	// plane perpendicular to the triangle, which keeps the border from moving inwards.
+	std::vector<SimplifierQuadric> quadrics(vertexCount);
+	for (size_t i = 0; i < vertexCount; i++) {
+		quadrics[i].clear();
+	}
+
+	for (size_t i = 0; i + 2 < indexCount; i += 3) {
+		const float *p0 = &points[3 * indices[i]], *p1 = &points[3 * indices[i + 1]], *p2 = &points[3 * indices[i + 2]];
+
+		double e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+		double e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+		double n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+		double length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+		if (length <= 0.0) {
+			continue;
+		}
+
+		n[0] /= length; n[1] /= length; n[2] /= length;
+		double d = -(n[0] * p0[0] + n[1] * p0[1] + n[2] * p0[2]);
+
+		SimplifierQuadric q;
+		q.clear();
+		q.addPlane(n[0], n[1], n[2], d, 0.5 * length);
+
+		for (int e = 0; e < 3; e++) {
+			unsigned int a = indices[i + e], b = indices[i + (e + 1) % 3];
+			quadrics[positionId[a]].add(q);
+
+			if (borderNext[positionId[a]] != positionId[b]) {
+				continue;
+			}
+
+			const float *pa = &points[3 * a], *pb = &points[3 * b];
+			double edge[3] = { pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2] };
+			double m[3] = { edge[1] * n[2] - edge[2] * n[1], edge[2] * n[0] - edge[0] * n[2], edge[0] * n[1] - edge[1] * n[0] };
+			double mLength = std::sqrt(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+
+			if (mLength > 0.0) {
+				SimplifierQuadric borderQuadric;
+				borderQuadric.clear();
+				borderQuadric.addPlane(m[0] / mLength, m[1] / mLength, m[2] / mLength,
+					-(m[0] * pa[0] + m[1] * pa[1] + m[2] * pa[2]) / mLength, 10.0 * mLength);
+				quadrics[positionId[a]].add(borderQuadric);
+				quadrics[positionId[b]].add(borderQuadric);
+			}
+		}
+	}
+
+	std::vector<unsigned int> result(indices, indices + indexCount);
+	float largestError = 0.0f;
+
+	struct Collapse {
+		unsigned int from, to;
+		float error;
+	};
+	std::vector<Collapse> collapses;
+	std::vector<unsigned int> collapseTarget(vertexCount);
+	std::vector<unsigned char> locked(vertexCount);
+	std::vector<unsigned int> triangleOffsets(vertexCount + 1), vertexTriangles;
+
+	// Every pass collapses the cheapest independent edges, then removes the degenerate triangles.
+	while (result.size() > targetIndexCount) {
+		collapses.clear();
+
+		for (size_t i = 0; i + 2 < result.size(); i += 3) {
+			for (int e = 0; e < 3; e++) {
+				unsigned int a = result[i + e], b = result[i + (e + 1) % 3];
+				unsigned int pa = positionId[a], pb = positionId[b];
+
+				// Each edge is seen from both of its triangles; only one of them adds it.
+				bool interiorEdge = borderNext[pa] != pb && borderNext[pb] != pa;
+				if (interiorEdge && a > b) {
+					continue;
+				}
+
+				Collapse best = { noVertex, noVertex, 0.0f };
+				for (int direction = 0; direction < 2; direction++) {
+					unsigned int from = direction ? b : a, to = direction ? a : b;
+					unsigned int pFrom = positionId[from], pTo = positionId[to];
+
+					if (!movable[from]) {
+						continue;
+					}
+					if (borderNext[pFrom] != noVertex && borderNext[pFrom] != pTo && borderPrevious[pFrom] != pTo) {
+						continue;
+					}
+
+					SimplifierQuadric q = quadrics[pFrom];
+					q.add(quadrics[pTo]);
+					float error = (float)std::sqrt(q.evaluate(&points[3 * to]));
+
+					if (best.from == noVertex || error < best.error) {
+						best.from = from;
+						best.to = to;
+						best.error = error;
+					}
+				}
+
+				if (best.from != noVertex && best.error <= maxError) {
+					collapses.push_back(best);
+				}
+			}
+		}
+
+		if (collapses.empty()) {
+			break;
+		}
+
+		std::stable_sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) {
+			return a.error < b.error;
+		});
+
+		// The triangles around every vertex, used to check for flipped triangles.
+		std::fill(triangleOffsets.begin(), triangleOffsets.end(), 0);
+		for (size_t i = 0; i < result.size(); i++) {
+			triangleOffsets[result[i] + 1]++;
+		}
+		for (size_t i = 0; i < vertexCount; i++) {
+			triangleOffsets[i + 1] += triangleOffsets[i];
+		}
+		vertexTriangles.resize(result.size());
+		{
+			std::vector<unsigned int> fill(triangleOffsets.begin(), triangleOffsets.end() - 1);
+			for (size_t i = 0; i < result.size(); i++) {
+				vertexTriangles[fill[result[i]]++] = (unsigned int)(i / 3);
+			}
+		}
+
+		for (size_t i = 0; i < vertexCount; i++) {
+			collapseTarget[i] = (unsigned int)i;
+		}
+		std::fill(locked.begin(), locked.end(), 0);
+
+		size_t removedIndices = 0;
+		size_t numCollapsed = 0;
+
+		for (size_t c = 0; c < collapses.size() && result.size() - removedIndices > targetIndexCount; c++) {
+			unsigned int from = collapses[c].from, to = collapses[c].to;
+
+			if (locked[from] || locked[to]) {
+				continue;
+			}
+
+			// Moving the vertex must not flip any of its remaining triangles.
+			bool flipped = false;
+			size_t degenerateTriangles = 0;
+			const float *target = &points[3 * to];
+
+			for (unsigned int t = triangleOffsets[from]; t < triangleOffsets[from + 1] && !flipped; t++) {
+				const unsigned int *triangle = &result[3 * vertexTriangles[t]];
+
+				if (triangle[0] == to || triangle[1] == to || triangle[2] == to) {
+					degenerateTriangles++;
+					continue;
+				}
+
+				const float *p[3], *q[3];
+				for (int k = 0; k < 3; k++) {
+					p[k] = &points[3 * triangle[k]];
+					q[k] = (triangle[k] == from) ? target : p[k];
+				}
+
+				float before[3], after[3];
+				float a1[3] = { p[1][0] - p[0][0], p[1][1] - p[0][1], p[1][2] - p[0][2] };
+				float a2[3] = { p[2][0] - p[0][0], p[2][1] - p[0][1], p[2][2] - p[0][2] };
+				float b1[3] = { q[1][0] - q[0][0], q[1][1] - q[0][1], q[1][2] - q[0][2] };
+				float b2[3] = { q[2][0] - q[0][0], q[2][1] - q[0][1], q[2][2] - q[0][2] };
+				before[0] = a1[1] * a2[2] - a1[2] * a2[1]; before[1] = a1[2] * a2[0] - a1[0] * a2[2]; before[2] = a1[0] * a2[1] - a1[1] * a2[0];
+				after[0] = b1[1] * b2[2] - b1[2] * b2[1]; after[1] = b1[2] * b2[0] - b1[0] * b2[2]; after[2] = b1[0] * b2[1] - b1[1] * b2[0];
+
+				float dot = before[0] * after[0] + before[1] * after[1] + before[2] * after[2];
+				float lengths = std::sqrt((before[0] * before[0] + before[1] * before[1] + before[2] * before[2]) *
+					(after[0] * after[0] + after[1] * after[1] + after[2] * after[2]));
+
+				// Reject the collapse if the triangle turns by more than about 75 degrees.
+				flipped = dot <= 0.25f * lengths;
+			}
+
+			if (flipped) {
+				continue;
+			}
+
+			collapseTarget[from] = to;
+			quadrics[positionId[to]].add(quadrics[positionId[from]]);
+			largestError = std::max(largestError, collapses[c].error);
+			removedIndices += 3 * degenerateTriangles;
+			numCollapsed++;
+
+			// The neighbors of a moved vertex don't move in the same pass, so the flip checks stay valid.
+			for (unsigned int t = triangleOffsets[from]; t < triangleOffsets[from + 1]; t++) {
+				const unsigned int *triangle = &result[3 * vertexTriangles[t]];
+				locked[triangle[0]] = locked[triangle[1]] = locked[triangle[2]] = 1;
+			}
+		}
+
+		if (numCollapsed == 0) {
+			break;
+		}
+
+		size_t writeIndex = 0;
+		for (size_t i = 0; i + 2 < result.size(); i += 3) {
+			unsigned int a = collapseTarget[result[i]], b = collapseTarget[result[i + 1]], c = collapseTarget[result[i + 2]];
+
+			if (a != b && b != c && c != a) {
+				result[writeIndex++] = a;
+				result[writeIndex++] = b;
+				result[writeIndex++] = c;
+			}
+		}
+		result.resize(writeIndex);
+	}
+
+	std::copy(result.begin(), result.end(), destination);
+
+	if (resultError) {
+		*resultError = largestError;
+	}
+
+	return result.size();
+}
+
+//-----------------------------------------------------------------
+// Build the LOD levels of a mesh. Level 0 is the original mesh, and every next level has about half the
+// triangles of the previous one. The chain stops early if a level can't remove at least a quarter of the
+// triangles of the previous level. lodIndices receives the indices of all the levels, coarsest level first.
+inline void buildLodChain(const unsigned int *indices, size_t indexCount, const float *positions, size_t positionStride,
+	size_t vertexCount, MeshLodChain& chain, std::vector<unsigned int>& lodIndices) {
+	computeBoundingSphere(positions, positionStride, vertexCount, chain.boundingCenter, &chain.boundingRadius);
+
+	std::vector<std::vector<unsigned int> > levels(1, std::vector<unsigned int>(indices, indices + indexCount));
+	std::vector<float> errors(1, 0.0f);
+
+	if (indexCount / 3 >= minLodTriangles) {
+		std::vector<unsigned int> simplified(indexCount);
+
+		// Every level is simplified from the previous one, which is much faster than starting from the original
+		// mesh every time. The error of a level is the sum of the errors of the steps, an upper bound of its
+		// distance from the original surface.
+		while (levels.size() < maxLodLevels) {
+			const std::vector<unsigned int>& previous = levels.back();
+			size_t targetCount = previous.size() / 6 * 3;
+			float error = 0.0f;
+
+			size_t count = simplifyMesh(simplified.data(), previous.data(), previous.size(), positions, positionStride,
+				vertexCount, targetCount, 1.0f, &error);
+
+			if (count == 0 || count * 4 > previous.size() * 3) {
+				break;
+			}
+
+			errors.push_back(errors.back() + error);
+			levels.push_back(std::vector<unsigned int>(simplified.begin(), simplified.begin() + count));
+		}
+	}
+
+	chain.numLevels = (unsigned int)levels.size();
+	lodIndices.clear();
+
+	for (size_t k = chain.numLevels; k-- > 0;) {
+		chain.firstIndex[k] = (unsigned int)lodIndices.size();
+		chain.indexCount[k] = (unsigned int)levels[k].size();
+		chain.error[k] = errors[k];
+		lodIndices.insert(lodIndices.end(), levels[k].begin(), levels[k].end());
+	}
+}
+
+//-----------------------------------------------------------------
+// Pick the coarsest level whose error, projected to the screen, is at most pixelThreshold * 2^bias pixels.
+// screenRadius is the radius of the bounding sphere on the screen, in pixels. A positive bias selects coarser
+// levels. To keep a mesh from switching back and forth at a threshold, a level coarser than previousLevel must
+// pass (1 - hysteresis) * threshold, while previousLevel and the finer levels pass up to (1 + hysteresis) * threshold.
+inline unsigned int selectLodLevel(const MeshLodChain& chain, float screenRadius, unsigned int previousLevel,
+	float pixelThreshold, float bias, float hysteresis) {
+	float threshold = pixelThreshold * std::pow(2.0f, bias);
+	unsigned int level = 0;
+
+	for (unsigned int k = 1; k < chain.numLevels; k++) {
+		float margin = (k > previousLevel) ? 1.0f - hysteresis : 1.0f + hysteresis;
+
+		if (chain.error[k] * screenRadius <= threshold * margin) {
+			level = k;
+		}
+	}
+
+	return level;
+}
+
+#endif
@@ -0,0 +1,464 @@
+#ifndef OBJ_PARSER_HPP
+#define OBJ_PARSER_HPP
+
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "thread_pool.hpp"
+
+// Parallel OBJ parser.
+// The file is memory-mapped and split at line boundaries into chunks. Each chunk is parsed
+// on the thread pool into its own position, normal, texture coordinate, and index arrays.
+// The chunks are then merged, in file order, into one tinyobj::attrib_t and one list of
+// tinyobj::index_t, so the result can be used exactly like the output of tinyobj::LoadObj().
+//
+// Only the geometry is read: v, vt, vn, and f. Faces with more than 3 vertices are
+// triangulated as a fan, like tinyobj does. Groups, objects, and materials are ignored,
+// and all the faces end up in one index list.
+class ParallelObjParser {
+public:
+	static bool loadObj(const std::string& filename, tinyobj::attrib_t& attrib, std::vector<tinyobj::index_t>& indices,
+		std::string& err, ThreadPool& threadPool) {
+		MappedFile file;
+
+		if (!file.open(filename.c_str())) {
+			err = "failed to open " + filename;
+			return false;
+		}
+
+		const char* begin = reinterpret_cast<const char*>(file.getData());
+		const char* end = begin + file.getSize();
+
+		// Split the file into a few chunks per thread, so that uneven chunks still keep every thread busy.
+		// Chunks smaller than minChunkSize are not worth a task.
+		const size_t minChunkSize = 256 * 1024;
+		size_t numChunks = std::min(threadPool.size() * 4, file.getSize() / minChunkSize + 1);
+
+		std::vector<Chunk> chunks(numChunks);
+		const char* chunkBegin = begin;
+		for (size_t i = 0; i < numChunks; i++) {
+			const char* chunkEnd = (i + 1 == numChunks) ? end : begin + file.getSize() / numChunks * (i + 1);
+
+			// Move the chunk boundary to the start of the next line.
+			if (chunkEnd < chunkBegin) {
+				chunkEnd = chunkBegin;
+			}
+			while (chunkEnd < end && chunkEnd[-1] != '\n') {
+				chunkEnd++;
+			}
+
+			chunks[i].begin = chunkBegin;
+			chunks[i].end = chunkEnd;
+			chunkBegin = chunkEnd;
+		}
+
+		threadPool.parallelFor(numChunks, [&chunks](size_t i) {
+			parseChunk(chunks[i]);
+		});
+
+		// Every chunk's arrays start where the previous chunk's arrays end.
+		size_t numVertices = 0, numNormals = 0, numTexcoords = 0, numIndices = 0;
+		for (auto& chunk : chunks) {
+			if (!chunk.error.empty()) {
+				err = filename + ": " + chunk.error;
+				return false;
+			}
+
+			chunk.vertexBase = numVertices;
+			chunk.normalBase = numNormals;
+			chunk.texcoordBase = numTexcoords;
+			chunk.indexBase = numIndices;
+
+			numVertices += chunk.vertices.size() / 3;
+			numNormals += chunk.normals.size() / 3;
+			numTexcoords += chunk.texcoords.size() / 2;
+			numIndices += chunk.indices.size();
+		}
+
+		attrib.vertices.resize(numVertices * 3);
+		attrib.normals.resize(numNormals * 3);
+		attrib.texcoords.resize(numTexcoords * 2);
+		indices.resize(numIndices);
+
+		// Resolve the negative (relative) indices, check the ranges, and copy every chunk into place.
+		threadPool.parallelFor(numChunks, [&](size_t i) {
+			Chunk& chunk = chunks[i];
+
+			// A relative index that reaches back before the first element is out of range. For normals and
+			// texture coordinates it's checked here, since -1 means "none" once the indices are resolved.
+			for (size_t position : chunk.relativeVertexIndices) {
+				chunk.indices[position].vertex_index += static_cast<int>(chunk.vertexBase);
+			}
+			for (size_t position : chunk.relativeNormalIndices) {
+				chunk.indices[position].normal_index += static_cast<int>(chunk.normalBase);
+				if (chunk.indices[position].normal_index < 0) {
+					chunk.error = "face index out of range";
+				}
+			}
+			for (size_t position : chunk.relativeTexcoordIndices) {
+				chunk.indices[position].texcoord_index += static_cast<int>(chunk.texcoordBase);
+				if (chunk.indices[position].texcoord_index < 0) {
+					chunk.error = "face index out of range";
+				}
+			}
+
+			for (const auto& index : chunk.indices) {
+				if (index.vertex_index < 0 || static_cast<size_t>(index.vertex_index) >= numVertices ||
+					index.normal_index >= static_cast<int>(numNormals) ||
+					index.texcoord_index >= static_cast<int>(numTexcoords)) {
+					chunk.error = "face index out of range";
+					break;
+				}
+			}
+
+			copyArray(chunk.vertices, attrib.vertices, chunk.vertexBase * 3);
+			copyArray(chunk.normals, attrib.normals, chunk.normalBase * 3);
+			copyArray(chunk.texcoords, attrib.texcoords, chunk.texcoordBase * 2);
+			copyArray(chunk.indices, indices, chunk.indexBase);
+		});
+
+		for (const auto& chunk : chunks) {
+			if (!chunk.error.empty()) {
+				err = filename + ": " + chunk.error;
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+private:
+	struct Chunk {
+		const char* begin = nullptr;
+		const char* end = nullptr;
+
+		std::vector<float> vertices;
+		std::vector<float> normals;
+		std::vector<float> texcoords;
+		std::vector<tinyobj::index_t> indices;
+
+		// Positions in indices of negative OBJ indices. They are stored relative to the start of
+		// this chunk until the number of elements in the previous chunks is known.
+		std::vector<size_t> relativeVertexIndices;
+		std::vector<size_t> relativeNormalIndices;
+		std::vector<size_t> relativeTexcoordIndices;
+
+		size_t vertexBase = 0;
+		size_t normalBase = 0;
+		size_t texcoordBase = 0;
+		size_t indexBase = 0;
+
+		std::string error;
+	};
+
+	template <typename T>
+	static void copyArray(const std::vector<T>& source, std::vector<T>& destination, size_t offset) {
+		if (!source.empty()) {
+			memcpy(destination.data() + offset, source.data(), source.size() * sizeof(T));
+		}
+	}
+
+	static bool isSpace(char c) {
+		return c == ' ' || c == '\t' || c == '\r';
+	}
+
+	static bool isDigit(char c) {
+		return c >= '0' && c <= '9';
+	}
+
+	static const char* skipSpaces(const char* p, const char* end) {
+		while (p < end && isSpace(*p)) {
+			p++;
+		}
+		return p;
+	}
+
+	static const char* skipLine(const char* p, const char* end) {
+		while (p < end && *p != '\n') {
+			p++;
+		}
+		return p < end ? p + 1 : end;
+	}
+
+	// Parse a decimal floating point number such as -1.25e-3. Returns nullptr if there is no number.
+	static const char* parseFloat(const char* p, const char* end, float& value) {
+		p = skipSpaces(p, end);
+
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+')) {
+			negative = (*p == '-');
+			p++;
+		}
+
+		double mantissa = 0.0;
+		int exponent = 0;
+		bool hasDigits = false;
+
+		while (p < end && isDigit(*p)) {
+			mantissa = mantissa * 10.0 + (*p - '0');
+			hasDigits = true;
+			p++;
+		}
+
+		if (p < end && *p == '.') {
+			p++;
+			while (p < end && isDigit(*p)) {
+				mantissa = mantissa * 10.0 + (*p - '0');
+				exponent--;
+				hasDigits = true;
+				p++;
+			}
+		}
+
+		if (!hasDigits) {
+			return nullptr;
+		}
+
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			p++;
+			bool negativeExponent = false;
+			if (p < end && (*p == '-' || *p == '+')) {
+				negativeExponent = (*p == '-');
+				p++;
+			}
+
+			int e = 0;
+			while (p < end && isDigit(*p)) {
+				if (e < 10000) {
+					e = e * 10 + (*p - '0');
+				}
+				p++;
+			}
+			exponent += negativeExponent ? -e : e;
+		}
+
+		// Powers of ten up to 10^22 are exact in double precision.
+		static const double powersOf10[] = {
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+		};
+
+		double result;
+		if (exponent < 0 && exponent >= -22) {
+			result = mantissa / powersOf10[-exponent];
+		}
+		else if (exponent >= 0 && exponent <= 22) {
+			result = mantissa * powersOf10[exponent];
+		}
+		else {
+			result = mantissa * std::pow(10.0, exponent);
+		}
+
+		value = static_cast<float>(negative ? -result : result);
+
+		return p;
+	}
+
+	static const char* parseInt(const char* p, const char* end, int& value) {
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+')) {
+			negative = (*p == '-');
+			p++;
+		}
+
+		if (p >= end || !isDigit(*p)) {
+			return nullptr;
+		}
+
+		int result = 0;
+		while (p < end && isDigit(*p)) {
+			result = result * 10 + (*p - '0');
+			p++;
+		}
+
+		value = negative ? -result : result;
+
+		return p;
+	}
+
+	// Convert a 1-based OBJ index to a 0-based index. Negative OBJ indices count back from the last
+	// element read so far. Those are stored relative to the chunk and recorded in relativeIndices.
+	static bool resolveIndex(int objIndex, size_t numElementsInChunk, size_t position,
+		int& index, std::vector<size_t>& relativeIndices) {
+		if (objIndex > 0) {
+			index = objIndex - 1;
+		}
+		else if (objIndex < 0) {
+			index = static_cast<int>(numElementsInChunk) + objIndex;
+			relativeIndices.push_back(position);
+		}
+		else {
+			return false;
+		}
+
+		return true;
+	}
+
+	// Parse one face vertex: v, v/vt, v//vn, or v/vt/vn.
+	static const char* parseFaceVertex(const char* p, const char* end, Chunk& chunk, size_t position,
+		tinyobj::index_t& index) {
+		int objIndex = 0;
+
+		index.vertex_index = -1;
+		index.normal_index = -1;
+		index.texcoord_index = -1;
+
+		p = parseInt(p, end, objIndex);
+		if (!p || !resolveIndex(objIndex, chunk.vertices.size() / 3, position, index.vertex_index, chunk.relativeVertexIndices)) {
+			return nullptr;
+		}
+
+		if (p < end && *p == '/') {
+			p++;
+
+			if (p < end && *p != '/') {
+				p = parseInt(p, end, objIndex);
+				if (!p || !resolveIndex(objIndex, chunk.texcoords.size() / 2, position, index.texcoord_index, chunk.relativeTexcoordIndices)) {
+					return nullptr;
+				}
+			}
+
+			if (p < end && *p == '/') {
+				p++;
+
+				p = parseInt(p, end, objIndex);
+				if (!p || !resolveIndex(objIndex, chunk.normals.size() / 3, position, index.normal_index, chunk.relativeNormalIndices)) {
+					return nullptr;
+				}
+			}
+		}
+
+		return p;
+	}
+
+	static void parseChunk(Chunk& chunk) {
+		const char* p = chunk.begin;
+		const char* end = chunk.end;
+
+		// Guess the array sizes from the chunk size, to avoid most reallocations.
+		size_t sizeGuess = static_cast<size_t>(end - p) / 32;
+		chunk.vertices.reserve(sizeGuess);
+		chunk.indices.reserve(sizeGuess);
+
+		std::vector<tinyobj::index_t> polygon;
+
+		while (p < end) {
+			p = skipSpaces(p, end);
+
+			if (p + 1 < end && p[0] == 'v' && isSpace(p[1])) {
+				float x = 0.0f, y = 0.0f, z = 0.0f;
+				const char* q = parseFloat(p + 2, end, x);
+				q = q ? parseFloat(q, end, y) : nullptr;
+				q = q ? parseFloat(q, end, z) : nullptr;
+				if (!q) {
+					chunk.error = "invalid vertex position";
+					return;
+				}
+
+				chunk.vertices.push_back(x);
+				chunk.vertices.push_back(y);
+				chunk.vertices.push_back(z);
+			}
+			else if (p + 2 < end && p[0] == 'v' && p[1] == 'n' && isSpace(p[2])) {
+				float x = 0.0f, y = 0.0f, z = 0.0f;
+				const char* q = parseFloat(p + 3, end, x);
+				q = q ? parseFloat(q, end, y) : nullptr;
+				q = q ? parseFloat(q, end, z) : nullptr;
+				if (!q) {
+					chunk.error = "invalid vertex normal";
+					return;
+				}
+
+				chunk.normals.push_back(x);
+				chunk.normals.push_back(y);
+				chunk.normals.push_back(z);
+			}
+			else if (p + 2 < end && p[0] == 'v' && p[1] == 't' && isSpace(p[2])) {
+				float u = 0.0f, v = 0.0f;
+				const char* q = parseFloat(p + 3, end, u);
+				if (!q) {
+					chunk.error = "invalid texture coordinate";
+					return;
+				}
+				// The second texture coordinate is optional.
+				parseFloat(q, end, v);
+
+				chunk.texcoords.push_back(u);
+				chunk.texcoords.push_back(v);
+			}
+			else if (p + 1 < end && p[0] == 'f' && isSpace(p[1])) {
+				polygon.clear();
+				const char* q = skipSpaces(p + 2, end);
+
+				// The face ends at the end of the line or at a comment.
+				while (q < end && *q != '\n' && *q != '#') {
+					tinyobj::index_t index;
+					q = parseFaceVertex(q, end, chunk, chunk.indices.size() + polygon.size(), index);
+					if (!q) {
+						chunk.error = "invalid face";
+						return;
+					}
+
+					polygon.push_back(index);
+					q = skipSpaces(q, end);
+				}
+
+				if (polygon.size() < 3) {
+					chunk.error = "face with less than 3 vertices";
+					return;
+				}
+
+				// The positions recorded in the relative index lists assume the polygon is copied to the
+				// index list as it is. Fix them when the polygon is split into a triangle fan.
+				if (polygon.size() > 3) {
+					remapRelativeIndices(chunk, chunk.indices.size(), polygon.size());
+				}
+
+				for (size_t k = 1; k + 1 < polygon.size(); k++) {
+					chunk.indices.push_back(polygon[0]);
+					chunk.indices.push_back(polygon[k]);
+					chunk.indices.push_back(polygon[k + 1]);
+				}
+			}
+
+			p = skipLine(p, end);
+		}
+	}
+
+	// A polygon with n vertices that starts at firstPosition in the index list becomes a triangle fan:
+	// polygon vertex 0 appears in every triangle, and vertex k (1 <= k < n) appears in triangles k - 1 and k.
+	static void remapRelativeIndices(Chunk& chunk, size_t firstPosition, size_t numPolygonVertices) {
+		std::vector<size_t>* lists[] = {
+			&chunk.relativeVertexIndices, &chunk.relativeNormalIndices, &chunk.relativeTexcoordIndices
+		};
+
+		for (std::vector<size_t>* list : lists) {
+			std::vector<size_t> polygonPositions;
+			while (!list->empty() && list->back() >= firstPosition) {
+				polygonPositions.push_back(list->back() - firstPosition);
+				list->pop_back();
+			}
+
+			for (size_t k : polygonPositions) {
+				for (size_t triangle = 0; triangle + 2 < numPolygonVertices; triangle++) {
+					size_t base = firstPosition + triangle * 3;
+
+					if (k == 0) {
+						list->push_back(base);
+					}
+					else if (k == triangle + 1) {
+						list->push_back(base + 1);
+					}
+					else if (k == triangle + 2) {
+						list->push_back(base + 2);
+					}
+				}
+			}
+		}
+	}
+};
+
+#endif
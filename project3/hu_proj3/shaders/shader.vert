@@ -5,11 +5,17 @@ layout(binding = 0) uniform UniformBufferObject {
     mat4 model;
     mat4 view;
     mat4 proj;
+    // Quantized vertices are relative to the bounding box of the model.
+    // For 32-bit float vertices, the offsets are 0 and the scales are 1.
+    vec4 positionOffset;
+    vec4 positionScale;
+    vec4 texCoordOffsetScale;
 } ubo;
 
 layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inColor;
 layout(location = 2) in vec2 inTexCoord;
+// The model matrix of the instance, from the instance buffer. It places the copy of the model in the scene.
+layout(location = 3) in mat4 inInstanceModel;
 
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec2 fragTexCoord;
@@ -19,7 +25,9 @@ out gl_PerVertex {
 };
 
 void main() {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
-    fragColor = inColor;
-    fragTexCoord = inTexCoord;
+    vec3 position = ubo.positionOffset.xyz + inPosition * ubo.positionScale.xyz;
+    gl_Position = ubo.proj * ubo.view * inInstanceModel * ubo.model * vec4(position, 1.0);
+    // The vertex color was always white, so it is no longer a vertex attribute.
+    fragColor = vec3(1.0);
+    fragTexCoord = ubo.texCoordOffsetScale.xy + inTexCoord * ubo.texCoordOffsetScale.zw;
 }
\ No newline at end of file
@@ -0,0 +1,110 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// A fixed-size pool of worker threads used by the loaders.
+// Tasks are run in the order they are enqueued.
+class ThreadPool {
+public:
+	// numThreads == 0 uses one thread per hardware thread.
+	explicit ThreadPool(unsigned int numThreads = 0) : stopping(false) {
+		if (numThreads == 0) {
+			numThreads = std::max(1u, std::thread::hardware_concurrency());
+		}
+
+		for (unsigned int i = 0; i < numThreads; i++) {
+			workers.emplace_back([this] { workerLoop(); });
+		}
+	}
+
+	~ThreadPool() {
+		{
+			std::unique_lock<std::mutex> lock(queueMutex);
+			stopping = true;
+		}
+		queueCondition.notify_all();
+
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	size_t size() const {
+		return workers.size();
+	}
+
+	template <typename F>
+	std::future<void> enqueue(F task) {
+		auto packagedTask = std::make_shared<std::packaged_task<void()>>(std::move(task));
+		std::future<void> result = packagedTask->get_future();
+
+		{
+			std::unique_lock<std::mutex> lock(queueMutex);
+			tasks.push([packagedTask] { (*packagedTask)(); });
+		}
+		queueCondition.notify_one();
+
+		return result;
+	}
+
+	// Run task(i) for every i in [0, count) on the pool and wait until all of them are done.
+	// The first exception thrown by a task is rethrown here, after all the tasks have finished.
+	// Don't call this from a task running on the same pool.
+	template <typename F>
+	void parallelFor(size_t count, F task) {
+		std::vector<std::future<void>> results;
+		results.reserve(count);
+
+		for (size_t i = 0; i < count; i++) {
+			results.push_back(enqueue([&task, i] { task(i); }));
+		}
+
+		for (auto& result : results) {
+			result.wait();
+		}
+
+		for (auto& result : results) {
+			result.get();
+		}
+	}
+
+private:
+	void workerLoop() {
+		for (;;) {
+			std::function<void()> task;
+
+			{
+				std::unique_lock<std::mutex> lock(queueMutex);
+				queueCondition.wait(lock, [this] { return stopping || !tasks.empty(); });
+
+				if (stopping && tasks.empty()) {
+					return;
+				}
+
+				task = std::move(tasks.front());
+				tasks.pop();
+			}
+
+			task();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()>> tasks;
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	bool stopping;
+};
+
+#endif
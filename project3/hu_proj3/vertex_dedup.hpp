@@ -0,0 +1,214 @@
+#ifndef VERTEX_DEDUP_HPP
+#define VERTEX_DEDUP_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+// Hash an array of floats, e.g. the members of a vertex.
+// -0.0f and 0.0f compare equal, so they also hash to the same value.
+inline uint64_t hashFloats(const float* values, size_t count) {
+	const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+	const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+
+	uint64_t hash = prime1 ^ (count * prime2);
+
+	for (size_t i = 0; i < count; i++) {
+		float value = (values[i] == 0.0f) ? 0.0f : values[i];
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+
+		hash ^= bits * prime2;
+		hash = (hash << 31) | (hash >> 33);
+		hash *= prime1;
+	}
+
+	// Final mix, so that every input bit affects every output bit.
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+// An open-addressing hash table used to find duplicate vertices.
+// The table doesn't store the vertices, only their ids (usually the position of the vertex in the
+// caller's vertex array) and the low 32 bits of their hashes. The ids and hashes are kept in one
+// flat array, and collisions are resolved with linear probing.
+class VertexDedupTable {
+public:
+	explicit VertexDedupTable(size_t expectedCount = 0) : count(0) {
+		rehash(expectedCount);
+	}
+
+	// Look for a vertex with the given hash for which equal(id) is true and return its id.
+	// If there is none, insert newId and return it. The table is only probed once.
+	template <typename Equal>
+	uint32_t findOrInsert(uint64_t hash, uint32_t newId, Equal equal) {
+		// Keep the load factor at or below 1/2.
+		if ((count + 1) * 2 > slots.size()) {
+			rehash(count + 1);
+		}
+
+		uint32_t shortHash = static_cast<uint32_t>(hash);
+		size_t mask = slots.size() - 1;
+
+		for (size_t i = shortHash & mask;; i = (i + 1) & mask) {
+			Slot& slot = slots[i];
+
+			if (slot.id == emptyId) {
+				slot.id = newId;
+				slot.hash = shortHash;
+				count++;
+				return newId;
+			}
+
+			if (slot.hash == shortHash && equal(slot.id)) {
+				return slot.id;
+			}
+		}
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+private:
+	struct Slot {
+		uint32_t id;
+		uint32_t hash;
+	};
+
+	static const uint32_t emptyId = 0xFFFFFFFFu;
+
+	void rehash(size_t minCount) {
+		size_t capacity = 16;
+		while (capacity < minCount * 2) {
+			capacity *= 2;
+		}
+
+		std::vector<Slot> oldSlots(capacity, Slot{ emptyId, 0 });
+		oldSlots.swap(slots);
+
+		size_t mask = slots.size() - 1;
+		for (const Slot& slot : oldSlots) {
+			if (slot.id != emptyId) {
+				size_t i = slot.hash & mask;
+				while (slots[i].id != emptyId) {
+					i = (i + 1) & mask;
+				}
+				slots[i] = slot;
+			}
+		}
+	}
+
+	std::vector<Slot> slots;
+	size_t count;
+};
+
+// Remove duplicate vertices from indexedVertices (one vertex per index), using all the threads of threadPool.
+// hashes[i] must be the hash of indexedVertices[i]. The output is the same as with a sequential loop:
+// unique vertices are stored in the order they first appear, and indices[i] is the new index of
+// indexedVertices[i].
+//
+// The vertices are split into shards by the high bits of their hashes, so that all the copies of a vertex
+// are in the same shard and every shard can be deduplicated by its own thread. Each shard records the first
+// position of every vertex, and the unique vertices are numbered afterwards in position order.
+template <typename V>
+void deduplicateVerticesParallel(const std::vector<V>& indexedVertices, const std::vector<uint64_t>& hashes,
+	std::vector<V>& vertices, std::vector<uint32_t>& indices, ThreadPool& threadPool) {
+	const size_t numIndices = indexedVertices.size();
+	const unsigned int shardBits = 6;
+	const size_t numShards = size_t(1) << shardBits;
+	const size_t numBlocks = threadPool.size() * 4;
+	const size_t blockSize = (numIndices + numBlocks - 1) / numBlocks;
+
+	// Sort the positions of every block into shards. Each list is in increasing position order.
+	std::vector<std::vector<uint32_t>> blockShards(numBlocks * numShards);
+
+	threadPool.parallelFor(numBlocks, [&](size_t block) {
+		size_t begin = std::min(block * blockSize, numIndices);
+		size_t end = std::min(begin + blockSize, numIndices);
+
+		for (size_t i = begin; i < end; i++) {
+			blockShards[block * numShards + (hashes[i] >> (64 - shardBits))].push_back(static_cast<uint32_t>(i));
+		}
+	});
+
+	// For every position, find the first position with the same vertex.
+	std::vector<uint32_t> firstPositions(numIndices);
+
+	threadPool.parallelFor(numShards, [&](size_t shard) {
+		size_t shardSize = 0;
+		for (size_t block = 0; block < numBlocks; block++) {
+			shardSize += blockShards[block * numShards + shard].size();
+		}
+
+		VertexDedupTable table(shardSize);
+
+		for (size_t block = 0; block < numBlocks; block++) {
+			for (uint32_t i : blockShards[block * numShards + shard]) {
+				firstPositions[i] = table.findOrInsert(hashes[i], i, [&](uint32_t j) {
+					return indexedVertices[j] == indexedVertices[i];
+				});
+			}
+		}
+	});
+
+	// Count the unique vertices in every block, then number them in position order.
+	std::vector<size_t> blockOffsets(numBlocks + 1, 0);
+
+	threadPool.parallelFor(numBlocks, [&](size_t block) {
+		size_t begin = std::min(block * blockSize, numIndices);
+		size_t end = std::min(begin + blockSize, numIndices);
+
+		for (size_t i = begin; i < end; i++) {
+			if (firstPositions[i] == i) {
+				blockOffsets[block + 1]++;
+			}
+		}
+	});
+
+	for (size_t block = 0; block < numBlocks; block++) {
+		blockOffsets[block + 1] += blockOffsets[block];
+	}
+
+	size_t firstVertex = vertices.size();
+	vertices.resize(firstVertex + blockOffsets[numBlocks]);
+
+	size_t firstIndex = indices.size();
+	indices.resize(firstIndex + numIndices);
+
+	// The new index of every unique vertex is stored at its own position first ...
+	threadPool.parallelFor(numBlocks, [&](size_t block) {
+		size_t begin = std::min(block * blockSize, numIndices);
+		size_t end = std::min(begin + blockSize, numIndices);
+		size_t vertexIndex = firstVertex + blockOffsets[block];
+
+		for (size_t i = begin; i < end; i++) {
+			if (firstPositions[i] == i) {
+				vertices[vertexIndex] = indexedVertices[i];
+				indices[firstIndex + i] = static_cast<uint32_t>(vertexIndex);
+				vertexIndex++;
+			}
+		}
+	});
+
+	// ... and then copied to the positions of the duplicates.
+	threadPool.parallelFor(numBlocks, [&](size_t block) {
+		size_t begin = std::min(block * blockSize, numIndices);
+		size_t end = std::min(begin + blockSize, numIndices);
+
+		for (size_t i = begin; i < end; i++) {
+			if (firstPositions[i] != i) {
+				indices[firstIndex + i] = indices[firstIndex + firstPositions[i]];
+			}
+		}
+	});
+}
+
+#endif